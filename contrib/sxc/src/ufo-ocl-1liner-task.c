@@ -31,6 +31,7 @@
 
 
 #include "ufo-ocl-1liner-task.h"
+#include "common/ufo-kernel-cache.h"
 
 /*
 #define IN_LOG printf("=> %s : %s.%d\n", __func__, __FILE__, __LINE__);
@@ -116,10 +117,11 @@ ufo_ocl_1liner_task_setup (UfoTask *task,
   }
 
   /* Copiling the kernel now : */
-  priv->kernel = ufo_resources_get_kernel_from_source(resources,
-                                                      kernel_src,
-                                                      "ocl_1liner",
-                                                      error);
+  priv->kernel = ufo_kernel_cache_get_kernel_from_source(resources,
+                                                          kernel_src,
+                                                          "ocl_1liner",
+                                                          NULL,
+                                                          error);
   /* Done compiling sources into a kernel, if existing retain it */
   if (priv->kernel != NULL)
     UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
@@ -24,6 +24,7 @@
 
 #include "ufo-stat-monitor-task.h"
 #include "ufo-sxc-common.h"
+#include "common/ufo-kernel-cache.h"
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
@@ -99,18 +100,18 @@ ufo_stat_monitor_task_setup (UfoTask *task,
   // Loading the OpenCL kernel :
   // Error : kernel compilation is buggy is one device has fp64 and another has not !
   if ( priv->node_has_fp64 ) {
-    priv->kernel = ufo_resources_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f64", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f64", NULL, error);
     if (priv->kernel != NULL)
       UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
-    priv->kernel_final = ufo_resources_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f64_fin", error);
+    priv->kernel_final = ufo_kernel_cache_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f64_fin", NULL, error);
     if (priv->kernel_final != NULL)
       UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel_final));
   }
   else {
-    priv->kernel = ufo_resources_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f32", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f32", NULL, error);
     if (priv->kernel != NULL)
       UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
-    priv->kernel_final = ufo_resources_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f32_fin", error);
+    priv->kernel_final = ufo_kernel_cache_get_kernel (resources, "stat-monitor.cl", "stat_monitor_f32_fin", NULL, error);
     if (priv->kernel_final != NULL)
       UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel_final));
   }
@@ -0,0 +1,1085 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include "common/ufo-expr.h"
+
+/* Pixels per register, every instruction is one vectorised loop over them */
+#define BATCH_SIZE 64
+
+#define UNARY_FUNCTIONS(X) \
+    X (SIN, "sin", sinf) \
+    X (COS, "cos", cosf) \
+    X (TAN, "tan", tanf) \
+    X (ASIN, "asin", asinf) \
+    X (ACOS, "acos", acosf) \
+    X (ATAN, "atan", atanf) \
+    X (SINH, "sinh", sinhf) \
+    X (COSH, "cosh", coshf) \
+    X (TANH, "tanh", tanhf) \
+    X (EXP, "exp", expf) \
+    X (EXP2, "exp2", exp2f) \
+    X (LOG, "log", logf) \
+    X (LOG2, "log2", log2f) \
+    X (LOG10, "log10", log10f) \
+    X (SQRT, "sqrt", sqrtf) \
+    X (RSQRT, "rsqrt", 1.0f / sqrtf) \
+    X (CBRT, "cbrt", cbrtf) \
+    X (FABS, "fabs", fabsf) \
+    X (FLOOR, "floor", floorf) \
+    X (CEIL, "ceil", ceilf) \
+    X (ROUND, "round", roundf) \
+    X (TRUNC, "trunc", truncf)
+
+#define BINARY_FUNCTIONS(X) \
+    X (POW, "pow", powf) \
+    X (ATAN2, "atan2", atan2f) \
+    X (FMOD, "fmod", fmodf) \
+    X (HYPOT, "hypot", hypotf) \
+    X (FMIN, "fmin", fminf) \
+    X (FMAX, "fmax", fmaxf)
+
+#define ENUM_ENTRY(op, name, function) OP_##op,
+#define TABLE_ENTRY(op, name, function) { name, OP_##op },
+
+typedef enum {
+    OP_MOVE,
+    OP_ADD_F, OP_SUB_F, OP_MUL_F, OP_DIV_F, OP_NEG_F,
+    OP_ADD_I, OP_SUB_I, OP_MUL_I, OP_DIV_I, OP_MOD_I, OP_NEG_I,
+    OP_BIT_AND, OP_BIT_OR, OP_BIT_XOR, OP_BIT_NOT, OP_SHL, OP_SHR,
+    OP_LT_F, OP_LE_F, OP_EQ_F, OP_NE_F,
+    OP_LT_I, OP_LE_I, OP_EQ_I, OP_NE_I,
+    OP_AND, OP_OR, OP_NOT,
+    OP_SELECT_F, OP_SELECT_I,
+    OP_I2F, OP_F2I,
+    OP_MIN_I, OP_MAX_I, OP_ABS_I, OP_CLAMP_I,
+    OP_CLAMP_F, OP_MIX, OP_FMA,
+    UNARY_FUNCTIONS (ENUM_ENTRY)
+    BINARY_FUNCTIONS (ENUM_ENTRY)
+} Op;
+
+typedef enum {
+    TYPE_INT,
+    TYPE_FLOAT,
+} Type;
+
+typedef enum {
+    COORDINATE_X = 0,
+    COORDINATE_Y,
+    COORDINATE_Z,
+    COORDINATE_I,
+    N_COORDINATES
+} Coordinate;
+
+typedef struct {
+    const gchar *name;
+    Op op;
+} Function;
+
+typedef struct {
+    Op op;
+    guint dst;
+    guint a, b, c;
+} Instruction;
+
+typedef struct {
+    guint reg;
+    Type type;
+    gdouble value;
+} Constant;
+
+typedef struct {
+    guint reg;
+    Type type;
+} Value;
+
+struct _UfoExpr {
+    GArray *code;
+    GArray *constants;
+    guint n_registers;
+    guint n_inputs;
+    guint n_scalars;
+    gint *input_regs;
+    gint *scalar_regs;
+    gint coordinate_regs[N_COORDINATES];
+    guint result;
+};
+
+typedef struct {
+    UfoExpr *expr;
+    const gchar *pos;
+    const gchar * const *input_names;
+    const gchar * const *scalar_names;
+    GHashTable *temporaries;
+    GError *error;
+} Parser;
+
+static const Function unary_functions[] = { UNARY_FUNCTIONS (TABLE_ENTRY) };
+static const Function binary_functions[] = { BINARY_FUNCTIONS (TABLE_ENTRY) };
+
+static const gchar *coordinate_names[N_COORDINATES] = { "x", "y", "z", "i" };
+
+static const struct {
+    const gchar *name;
+    gdouble value;
+} named_constants[] = {
+    { "M_PI", G_PI },
+    { "M_PI_F", G_PI },
+    { "M_E", G_E },
+    { "M_E_F", G_E },
+    { "MAXFLOAT", G_MAXFLOAT },
+    { "INFINITY", INFINITY },
+    { "NAN", NAN },
+};
+
+static Value parse_expression (Parser *parser);
+
+GQuark
+ufo_expr_error_quark (void)
+{
+    return g_quark_from_static_string ("ufo-expr-error-quark");
+}
+
+static void
+fail (Parser *parser, const gchar *format, ...)
+{
+    va_list args;
+
+    /* Only the first error is reported, parsing continues without effect */
+    if (parser->error != NULL)
+        return;
+
+    va_start (args, format);
+    parser->error = g_error_new_valist (UFO_EXPR_ERROR, 0, format, args);
+    va_end (args);
+}
+
+static void
+skip_space (Parser *parser)
+{
+    while (g_ascii_isspace (*parser->pos))
+        parser->pos++;
+}
+
+static gboolean
+accept (Parser *parser, const gchar *token)
+{
+    const gsize length = strlen (token);
+
+    skip_space (parser);
+
+    if (strncmp (parser->pos, token, length))
+        return FALSE;
+
+    parser->pos += length;
+    return TRUE;
+}
+
+/* Accept @token only if it is not the start of @longer, e.g. & and && */
+static gboolean
+accept_single (Parser *parser, const gchar *token, const gchar *longer)
+{
+    skip_space (parser);
+
+    if (!strncmp (parser->pos, longer, strlen (longer)))
+        return FALSE;
+
+    return accept (parser, token);
+}
+
+static void
+expect (Parser *parser, const gchar *token)
+{
+    if (!accept (parser, token))
+        fail (parser, "Expected `%s'", token);
+}
+
+static gchar *
+parse_identifier (Parser *parser)
+{
+    const gchar *start;
+
+    skip_space (parser);
+    start = parser->pos;
+
+    if (!g_ascii_isalpha (*start) && *start != '_')
+        return NULL;
+
+    while (g_ascii_isalnum (*parser->pos) || *parser->pos == '_')
+        parser->pos++;
+
+    return g_strndup (start, parser->pos - start);
+}
+
+static Value
+emit (Parser *parser, Op op, Type type, guint a, guint b, guint c)
+{
+    Instruction instruction = { op, parser->expr->n_registers++, a, b, c };
+    Value value = { instruction.dst, type };
+
+    g_array_append_val (parser->expr->code, instruction);
+    return value;
+}
+
+static Value
+constant (Parser *parser, Type type, gdouble number)
+{
+    Constant c = { parser->expr->n_registers++, type, number };
+    Value value = { c.reg, type };
+
+    g_array_append_val (parser->expr->constants, c);
+    return value;
+}
+
+static Value
+to_float (Parser *parser, Value value)
+{
+    if (value.type == TYPE_FLOAT)
+        return value;
+
+    return emit (parser, OP_I2F, TYPE_FLOAT, value.reg, 0, 0);
+}
+
+static Value
+to_bool (Parser *parser, Value value)
+{
+    Value zero = constant (parser, value.type, 0.0);
+
+    return emit (parser, value.type == TYPE_FLOAT ? OP_NE_F : OP_NE_I, TYPE_INT,
+                 value.reg, zero.reg, 0);
+}
+
+static Value
+arithmetic (Parser *parser, gchar operator, Value a, Value b)
+{
+    if (a.type == TYPE_INT && b.type == TYPE_INT) {
+        const Op ops[] = { OP_ADD_I, OP_SUB_I, OP_MUL_I, OP_DIV_I, OP_MOD_I };
+        const gchar *operators = "+-*/%";
+
+        return emit (parser, ops[strchr (operators, operator) - operators], TYPE_INT, a.reg, b.reg, 0);
+    }
+    else {
+        const Op ops[] = { OP_ADD_F, OP_SUB_F, OP_MUL_F, OP_DIV_F };
+        const gchar *operators = "+-*/";
+
+        if (operator == '%') {
+            fail (parser, "`%%' needs integer operands, use fmod");
+            return a;
+        }
+
+        a = to_float (parser, a);
+        b = to_float (parser, b);
+        return emit (parser, ops[strchr (operators, operator) - operators], TYPE_FLOAT, a.reg, b.reg, 0);
+    }
+}
+
+static Value
+bitwise (Parser *parser, Op op, Value a, Value b)
+{
+    if (a.type != TYPE_INT || b.type != TYPE_INT) {
+        fail (parser, "Bitwise operators need integer operands");
+        return a;
+    }
+
+    return emit (parser, op, TYPE_INT, a.reg, b.reg, 0);
+}
+
+static Value
+compare (Parser *parser, Op op, gboolean swap, Value a, Value b)
+{
+    Value tmp;
+
+    if (a.type == TYPE_FLOAT || b.type == TYPE_FLOAT) {
+        a = to_float (parser, a);
+        b = to_float (parser, b);
+        op += OP_LT_F - OP_LT_I;
+    }
+
+    if (swap) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    return emit (parser, op, TYPE_INT, a.reg, b.reg, 0);
+}
+
+static gboolean
+lookup_name (const gchar * const *names, const gchar *name, guint *index)
+{
+    for (guint i = 0; names != NULL && names[i] != NULL; i++) {
+        if (!g_strcmp0 (names[i], name)) {
+            *index = i;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static Value
+variable (Parser *parser, const gchar *name)
+{
+    UfoExpr *expr = parser->expr;
+    Value value = { 0, TYPE_FLOAT };
+    gpointer reg;
+    guint index;
+
+    if (g_hash_table_lookup_extended (parser->temporaries, name, NULL, &reg)) {
+        value.reg = GPOINTER_TO_UINT (reg);
+        return value;
+    }
+
+    if (lookup_name (parser->input_names, name, &index)) {
+        if (expr->input_regs[index] < 0)
+            expr->input_regs[index] = (gint) expr->n_registers++;
+
+        value.reg = (guint) expr->input_regs[index];
+        return value;
+    }
+
+    if (lookup_name (parser->scalar_names, name, &index)) {
+        if (expr->scalar_regs[index] < 0)
+            expr->scalar_regs[index] = (gint) expr->n_registers++;
+
+        value.reg = (guint) expr->scalar_regs[index];
+        return value;
+    }
+
+    if (lookup_name (coordinate_names, name, &index)) {
+        if (expr->coordinate_regs[index] < 0)
+            expr->coordinate_regs[index] = (gint) expr->n_registers++;
+
+        value.reg = (guint) expr->coordinate_regs[index];
+        value.type = TYPE_INT;
+        return value;
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS (named_constants); i++) {
+        if (!g_strcmp0 (named_constants[i].name, name))
+            return constant (parser, TYPE_FLOAT, named_constants[i].value);
+    }
+
+    fail (parser, "Unknown identifier `%s'", name);
+    return value;
+}
+
+static Value
+call (Parser *parser, const gchar *name, Value *args, guint n_args)
+{
+    gboolean all_int = TRUE;
+
+    for (guint i = 0; i < n_args; i++)
+        all_int = all_int && args[i].type == TYPE_INT;
+
+    if (n_args == 1) {
+        if (!g_strcmp0 (name, "abs") && all_int)
+            return emit (parser, OP_ABS_I, TYPE_INT, args[0].reg, 0, 0);
+
+        if (!g_strcmp0 (name, "abs"))
+            name = "fabs";
+
+        for (guint i = 0; i < G_N_ELEMENTS (unary_functions); i++) {
+            if (!g_strcmp0 (unary_functions[i].name, name))
+                return emit (parser, unary_functions[i].op, TYPE_FLOAT,
+                             to_float (parser, args[0]).reg, 0, 0);
+        }
+    }
+
+    if (n_args == 2) {
+        if (!g_strcmp0 (name, "min") && all_int)
+            return emit (parser, OP_MIN_I, TYPE_INT, args[0].reg, args[1].reg, 0);
+
+        if (!g_strcmp0 (name, "max") && all_int)
+            return emit (parser, OP_MAX_I, TYPE_INT, args[0].reg, args[1].reg, 0);
+
+        if (!g_strcmp0 (name, "min") || !g_strcmp0 (name, "max"))
+            name = name[1] == 'i' ? "fmin" : "fmax";
+
+        for (guint i = 0; i < G_N_ELEMENTS (binary_functions); i++) {
+            if (!g_strcmp0 (binary_functions[i].name, name))
+                return emit (parser, binary_functions[i].op, TYPE_FLOAT,
+                             to_float (parser, args[0]).reg,
+                             to_float (parser, args[1]).reg, 0);
+        }
+    }
+
+    if (n_args == 3) {
+        const Function ternary_functions[] = {
+            { "clamp", OP_CLAMP_F }, { "mix", OP_MIX }, { "fma", OP_FMA }, { "mad", OP_FMA }
+        };
+
+        if (!g_strcmp0 (name, "clamp") && all_int)
+            return emit (parser, OP_CLAMP_I, TYPE_INT, args[0].reg, args[1].reg, args[2].reg);
+
+        for (guint i = 0; i < G_N_ELEMENTS (ternary_functions); i++) {
+            if (!g_strcmp0 (ternary_functions[i].name, name))
+                return emit (parser, ternary_functions[i].op, TYPE_FLOAT,
+                             to_float (parser, args[0]).reg,
+                             to_float (parser, args[1]).reg,
+                             to_float (parser, args[2]).reg);
+        }
+    }
+
+    fail (parser, "Unknown function `%s' or wrong number of arguments", name);
+    return args[0];
+}
+
+static Value
+parse_number (Parser *parser)
+{
+    const gchar *start = parser->pos;
+    Value value;
+    gchar *end;
+
+    while (g_ascii_isdigit (*parser->pos))
+        parser->pos++;
+
+    if (*parser->pos == '.' || *parser->pos == 'e' || *parser->pos == 'E') {
+        value = constant (parser, TYPE_FLOAT, g_ascii_strtod (start, &end));
+        parser->pos = end;
+    }
+    else {
+        gint64 number = g_ascii_strtoll (start, NULL, 10);
+
+        /* ints are 32 bits wide like in OpenCL, larger literals would be long there */
+        if (number > G_MAXINT32)
+            fail (parser, "Integer literal `%.*s' does not fit into an int", (gint) (parser->pos - start), start);
+
+        value = constant (parser, TYPE_INT, (gdouble) MIN (number, G_MAXINT32));
+    }
+
+    if (*parser->pos == 'f' || *parser->pos == 'F') {
+        parser->pos++;
+        return to_float (parser, value);
+    }
+
+    return value;
+}
+
+static Value
+parse_primary (Parser *parser)
+{
+    Value value = { 0, TYPE_FLOAT };
+    gchar *name;
+
+    skip_space (parser);
+
+    if (g_ascii_isdigit (*parser->pos) || (*parser->pos == '.' && g_ascii_isdigit (parser->pos[1])))
+        return parse_number (parser);
+
+    if (accept (parser, "(")) {
+        value = parse_expression (parser);
+        expect (parser, ")");
+        return value;
+    }
+
+    name = parse_identifier (parser);
+
+    if (name == NULL) {
+        fail (parser, "Unexpected `%s'", *parser->pos ? parser->pos : "end of expression");
+        return value;
+    }
+
+    if (accept (parser, "(")) {
+        Value args[3];
+        guint n_args = 0;
+
+        do {
+            value = parse_expression (parser);
+
+            if (n_args < G_N_ELEMENTS (args))
+                args[n_args] = value;
+
+            n_args++;
+        } while (accept (parser, ","));
+
+        expect (parser, ")");
+
+        if (n_args <= G_N_ELEMENTS (args))
+            value = call (parser, name, args, n_args);
+        else
+            fail (parser, "Too many arguments for `%s'", name);
+    }
+    else {
+        value = variable (parser, name);
+    }
+
+    g_free (name);
+    return value;
+}
+
+static Value
+parse_unary (Parser *parser)
+{
+    const gchar *start;
+    Value value;
+    gchar *type;
+
+    if (accept_single (parser, "-", "--")) {
+        value = parse_unary (parser);
+        return emit (parser, value.type == TYPE_FLOAT ? OP_NEG_F : OP_NEG_I, value.type, value.reg, 0, 0);
+    }
+
+    if (accept_single (parser, "+", "++"))
+        return parse_unary (parser);
+
+    if (accept (parser, "!"))
+        return emit (parser, OP_NOT, TYPE_INT, to_bool (parser, parse_unary (parser)).reg, 0, 0);
+
+    if (accept (parser, "~")) {
+        value = parse_unary (parser);
+        return bitwise (parser, OP_BIT_NOT, value, value);
+    }
+
+    /* Casts look like a parenthesized identifier */
+    start = parser->pos;
+
+    if (accept (parser, "(")) {
+        type = parse_identifier (parser);
+
+        if ((!g_strcmp0 (type, "int") || !g_strcmp0 (type, "float")) && accept (parser, ")")) {
+            gboolean is_int = type[0] == 'i';
+
+            g_free (type);
+            value = parse_unary (parser);
+
+            if (is_int)
+                return value.type == TYPE_INT ? value : emit (parser, OP_F2I, TYPE_INT, value.reg, 0, 0);
+
+            return to_float (parser, value);
+        }
+
+        g_free (type);
+        parser->pos = start;
+    }
+
+    return parse_primary (parser);
+}
+
+static Value
+parse_multiplicative (Parser *parser)
+{
+    Value value = parse_unary (parser);
+
+    while (TRUE) {
+        if (accept_single (parser, "*", "*="))
+            value = arithmetic (parser, '*', value, parse_unary (parser));
+        else if (accept_single (parser, "/", "/="))
+            value = arithmetic (parser, '/', value, parse_unary (parser));
+        else if (accept_single (parser, "%", "%="))
+            value = arithmetic (parser, '%', value, parse_unary (parser));
+        else
+            return value;
+    }
+}
+
+static Value
+parse_additive (Parser *parser)
+{
+    Value value = parse_multiplicative (parser);
+
+    while (TRUE) {
+        if (accept_single (parser, "+", "+="))
+            value = arithmetic (parser, '+', value, parse_multiplicative (parser));
+        else if (accept_single (parser, "-", "-="))
+            value = arithmetic (parser, '-', value, parse_multiplicative (parser));
+        else
+            return value;
+    }
+}
+
+static Value
+parse_shift (Parser *parser)
+{
+    Value value = parse_additive (parser);
+
+    while (TRUE) {
+        if (accept (parser, "<<"))
+            value = bitwise (parser, OP_SHL, value, parse_additive (parser));
+        else if (accept (parser, ">>"))
+            value = bitwise (parser, OP_SHR, value, parse_additive (parser));
+        else
+            return value;
+    }
+}
+
+static Value
+parse_relational (Parser *parser)
+{
+    Value value = parse_shift (parser);
+
+    while (TRUE) {
+        if (accept (parser, "<="))
+            value = compare (parser, OP_LE_I, FALSE, value, parse_shift (parser));
+        else if (accept (parser, ">="))
+            value = compare (parser, OP_LE_I, TRUE, value, parse_shift (parser));
+        else if (accept (parser, "<"))
+            value = compare (parser, OP_LT_I, FALSE, value, parse_shift (parser));
+        else if (accept (parser, ">"))
+            value = compare (parser, OP_LT_I, TRUE, value, parse_shift (parser));
+        else
+            return value;
+    }
+}
+
+static Value
+parse_equality (Parser *parser)
+{
+    Value value = parse_relational (parser);
+
+    while (TRUE) {
+        if (accept (parser, "=="))
+            value = compare (parser, OP_EQ_I, FALSE, value, parse_relational (parser));
+        else if (accept (parser, "!="))
+            value = compare (parser, OP_NE_I, FALSE, value, parse_relational (parser));
+        else
+            return value;
+    }
+}
+
+static Value
+parse_bit_and (Parser *parser)
+{
+    Value value = parse_equality (parser);
+
+    while (accept_single (parser, "&", "&&"))
+        value = bitwise (parser, OP_BIT_AND, value, parse_equality (parser));
+
+    return value;
+}
+
+static Value
+parse_bit_xor (Parser *parser)
+{
+    Value value = parse_bit_and (parser);
+
+    while (accept (parser, "^"))
+        value = bitwise (parser, OP_BIT_XOR, value, parse_bit_and (parser));
+
+    return value;
+}
+
+static Value
+parse_bit_or (Parser *parser)
+{
+    Value value = parse_bit_xor (parser);
+
+    while (accept_single (parser, "|", "||"))
+        value = bitwise (parser, OP_BIT_OR, value, parse_bit_xor (parser));
+
+    return value;
+}
+
+/*
+ * Both sides of && and || are always evaluated, which is fine because the
+ * expressions have no side effects.
+ */
+static Value
+parse_logical_and (Parser *parser)
+{
+    Value value = parse_bit_or (parser);
+
+    while (accept (parser, "&&")) {
+        Value a = to_bool (parser, value);
+        Value b = to_bool (parser, parse_bit_or (parser));
+
+        value = emit (parser, OP_AND, TYPE_INT, a.reg, b.reg, 0);
+    }
+
+    return value;
+}
+
+static Value
+parse_logical_or (Parser *parser)
+{
+    Value value = parse_logical_and (parser);
+
+    while (accept (parser, "||")) {
+        Value a = to_bool (parser, value);
+        Value b = to_bool (parser, parse_logical_and (parser));
+
+        value = emit (parser, OP_OR, TYPE_INT, a.reg, b.reg, 0);
+    }
+
+    return value;
+}
+
+static Value
+parse_expression (Parser *parser)
+{
+    Value condition, a, b;
+
+    condition = parse_logical_or (parser);
+
+    if (!accept (parser, "?"))
+        return condition;
+
+    condition = to_bool (parser, condition);
+    a = parse_expression (parser);
+    expect (parser, ":");
+    b = parse_expression (parser);
+
+    if (a.type == TYPE_INT && b.type == TYPE_INT)
+        return emit (parser, OP_SELECT_I, TYPE_INT, condition.reg, a.reg, b.reg);
+
+    a = to_float (parser, a);
+    b = to_float (parser, b);
+    return emit (parser, OP_SELECT_F, TYPE_FLOAT, condition.reg, a.reg, b.reg);
+}
+
+static gboolean
+is_reserved (Parser *parser, const gchar *name)
+{
+    guint index;
+
+    return lookup_name (parser->input_names, name, &index) ||
+           lookup_name (parser->scalar_names, name, &index) ||
+           lookup_name (coordinate_names, name, &index);
+}
+
+static void
+parse_assignment (Parser *parser)
+{
+    const gchar *operators = "+-*/";
+    Instruction move = { OP_MOVE, 0, 0, 0, 0 };
+    gpointer reg = NULL;
+    gboolean exists;
+    gchar operator = '\0';
+    gchar *name;
+    Value value;
+
+    /* An optional type, temporaries are always float */
+    name = parse_identifier (parser);
+
+    if (!g_strcmp0 (name, "float")) {
+        g_free (name);
+        name = parse_identifier (parser);
+    }
+
+    if (name == NULL) {
+        fail (parser, "Expected an assignment instead of `%s'", parser->pos);
+        return;
+    }
+
+    skip_space (parser);
+
+    if (*parser->pos != '\0' && strchr (operators, *parser->pos) && parser->pos[1] == '=')
+        operator = *parser->pos++;
+
+    if (!accept_single (parser, "=", "==")) {
+        fail (parser, "Expected an assignment to `%s'", name);
+        g_free (name);
+        return;
+    }
+
+    if (is_reserved (parser, name)) {
+        fail (parser, "Cannot assign to `%s'", name);
+        g_free (name);
+        return;
+    }
+
+    exists = g_hash_table_lookup_extended (parser->temporaries, name, NULL, &reg);
+
+    if (operator != '\0' && !exists) {
+        fail (parser, "`%s' is used before it is assigned", name);
+        g_free (name);
+        return;
+    }
+
+    value = parse_expression (parser);
+
+    if (operator != '\0') {
+        Value current = { GPOINTER_TO_UINT (reg), TYPE_FLOAT };
+        value = arithmetic (parser, operator, current, value);
+    }
+
+    if (!exists) {
+        reg = GUINT_TO_POINTER (parser->expr->n_registers++);
+        g_hash_table_insert (parser->temporaries, name, reg);
+    }
+    else {
+        g_free (name);
+    }
+
+    move.dst = GPOINTER_TO_UINT (reg);
+    move.a = to_float (parser, value).reg;
+    g_array_append_val (parser->expr->code, move);
+}
+
+UfoExpr *
+ufo_expr_new (const gchar *expression,
+              const gchar * const *input_names,
+              const gchar * const *scalar_names,
+              GError **error)
+{
+    UfoExpr *expr;
+    Parser parser;
+    gchar **statements;
+    guint n_statements;
+    Value result;
+
+    expr = g_new0 (UfoExpr, 1);
+    expr->code = g_array_new (FALSE, FALSE, sizeof (Instruction));
+    expr->constants = g_array_new (FALSE, FALSE, sizeof (Constant));
+    expr->n_inputs = input_names != NULL ? g_strv_length ((gchar **) input_names) : 0;
+    expr->n_scalars = scalar_names != NULL ? g_strv_length ((gchar **) scalar_names) : 0;
+    expr->input_regs = g_new (gint, MAX (expr->n_inputs, 1));
+    expr->scalar_regs = g_new (gint, MAX (expr->n_scalars, 1));
+
+    for (guint i = 0; i < expr->n_inputs; i++)
+        expr->input_regs[i] = -1;
+
+    for (guint i = 0; i < expr->n_scalars; i++)
+        expr->scalar_regs[i] = -1;
+
+    for (guint i = 0; i < N_COORDINATES; i++)
+        expr->coordinate_regs[i] = -1;
+
+    parser.expr = expr;
+    parser.input_names = input_names;
+    parser.scalar_names = scalar_names;
+    parser.temporaries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    parser.error = NULL;
+
+    /* Drop empty statements, e.g. after a trailing semicolon */
+    statements = g_strsplit (expression, ";", -1);
+    n_statements = 0;
+
+    for (guint i = 0; statements[i] != NULL; i++) {
+        g_strstrip (statements[i]);
+
+        if (statements[i][0] != '\0')
+            statements[n_statements++] = statements[i];
+        else
+            g_free (statements[i]);
+    }
+
+    statements[n_statements] = NULL;
+
+    if (n_statements == 0)
+        fail (&parser, "Expression `%s' is empty", expression);
+
+    for (guint i = 0; i < n_statements && parser.error == NULL; i++) {
+        parser.pos = statements[i];
+
+        if (i < n_statements - 1) {
+            parse_assignment (&parser);
+        }
+        else {
+            result = to_float (&parser, parse_expression (&parser));
+            expr->result = result.reg;
+        }
+
+        skip_space (&parser);
+
+        if (*parser.pos != '\0')
+            fail (&parser, "Unexpected `%s'", parser.pos);
+    }
+
+    g_strfreev (statements);
+    g_hash_table_destroy (parser.temporaries);
+
+    if (parser.error != NULL) {
+        g_propagate_error (error, parser.error);
+        ufo_expr_free (expr);
+        return NULL;
+    }
+
+    return expr;
+}
+
+#define F(r) ((gfloat *) regs[(r)])
+#define I(r) ((gint32 *) regs[(r)])
+#define FOR_LANES _Pragma ("omp simd") for (gint l = 0; l < n; l++)
+
+#define UNARY_CASE(op, name, function) \
+    case OP_##op: FOR_LANES F (d)[l] = function (F (a)[l]); break;
+#define BINARY_CASE(op, name, function) \
+    case OP_##op: FOR_LANES F (d)[l] = function (F (a)[l], F (b)[l]); break;
+
+static void
+execute (const Instruction *code, guint n_instructions, gpointer *regs, gint n)
+{
+    for (guint k = 0; k < n_instructions; k++) {
+        const guint d = code[k].dst;
+        const guint a = code[k].a;
+        const guint b = code[k].b;
+        const guint c = code[k].c;
+
+        switch (code[k].op) {
+            case OP_MOVE: FOR_LANES F (d)[l] = F (a)[l]; break;
+            case OP_ADD_F: FOR_LANES F (d)[l] = F (a)[l] + F (b)[l]; break;
+            case OP_SUB_F: FOR_LANES F (d)[l] = F (a)[l] - F (b)[l]; break;
+            case OP_MUL_F: FOR_LANES F (d)[l] = F (a)[l] * F (b)[l]; break;
+            case OP_DIV_F: FOR_LANES F (d)[l] = F (a)[l] / F (b)[l]; break;
+            case OP_NEG_F: FOR_LANES F (d)[l] = -F (a)[l]; break;
+            case OP_ADD_I: FOR_LANES I (d)[l] = I (a)[l] + I (b)[l]; break;
+            case OP_SUB_I: FOR_LANES I (d)[l] = I (a)[l] - I (b)[l]; break;
+            case OP_MUL_I: FOR_LANES I (d)[l] = I (a)[l] * I (b)[l]; break;
+            /* Division by zero is undefined in OpenCL too, but must not trap here */
+            case OP_DIV_I: FOR_LANES I (d)[l] = I (b)[l] ? I (a)[l] / I (b)[l] : 0; break;
+            case OP_MOD_I: FOR_LANES I (d)[l] = I (b)[l] ? I (a)[l] % I (b)[l] : 0; break;
+            case OP_NEG_I: FOR_LANES I (d)[l] = -I (a)[l]; break;
+            case OP_BIT_AND: FOR_LANES I (d)[l] = I (a)[l] & I (b)[l]; break;
+            case OP_BIT_OR: FOR_LANES I (d)[l] = I (a)[l] | I (b)[l]; break;
+            case OP_BIT_XOR: FOR_LANES I (d)[l] = I (a)[l] ^ I (b)[l]; break;
+            case OP_BIT_NOT: FOR_LANES I (d)[l] = ~I (a)[l]; break;
+            /* Shift amounts are taken modulo the width as in OpenCL */
+            case OP_SHL: FOR_LANES I (d)[l] = (gint32) ((guint32) I (a)[l] << (I (b)[l] & 31)); break;
+            case OP_SHR: FOR_LANES I (d)[l] = I (a)[l] >> (I (b)[l] & 31); break;
+            case OP_LT_F: FOR_LANES I (d)[l] = F (a)[l] < F (b)[l]; break;
+            case OP_LE_F: FOR_LANES I (d)[l] = F (a)[l] <= F (b)[l]; break;
+            case OP_EQ_F: FOR_LANES I (d)[l] = F (a)[l] == F (b)[l]; break;
+            case OP_NE_F: FOR_LANES I (d)[l] = F (a)[l] != F (b)[l]; break;
+            case OP_LT_I: FOR_LANES I (d)[l] = I (a)[l] < I (b)[l]; break;
+            case OP_LE_I: FOR_LANES I (d)[l] = I (a)[l] <= I (b)[l]; break;
+            case OP_EQ_I: FOR_LANES I (d)[l] = I (a)[l] == I (b)[l]; break;
+            case OP_NE_I: FOR_LANES I (d)[l] = I (a)[l] != I (b)[l]; break;
+            case OP_AND: FOR_LANES I (d)[l] = I (a)[l] & I (b)[l]; break;
+            case OP_OR: FOR_LANES I (d)[l] = I (a)[l] | I (b)[l]; break;
+            case OP_NOT: FOR_LANES I (d)[l] = !I (a)[l]; break;
+            case OP_SELECT_F: FOR_LANES F (d)[l] = I (a)[l] ? F (b)[l] : F (c)[l]; break;
+            case OP_SELECT_I: FOR_LANES I (d)[l] = I (a)[l] ? I (b)[l] : I (c)[l]; break;
+            case OP_I2F: FOR_LANES F (d)[l] = (gfloat) I (a)[l]; break;
+            case OP_F2I: FOR_LANES I (d)[l] = (gint32) F (a)[l]; break;
+            case OP_MIN_I: FOR_LANES I (d)[l] = MIN (I (a)[l], I (b)[l]); break;
+            case OP_MAX_I: FOR_LANES I (d)[l] = MAX (I (a)[l], I (b)[l]); break;
+            case OP_ABS_I: FOR_LANES I (d)[l] = ABS (I (a)[l]); break;
+            case OP_CLAMP_I: FOR_LANES I (d)[l] = MIN (MAX (I (a)[l], I (b)[l]), I (c)[l]); break;
+            case OP_CLAMP_F: FOR_LANES F (d)[l] = fminf (fmaxf (F (a)[l], F (b)[l]), F (c)[l]); break;
+            case OP_MIX: FOR_LANES F (d)[l] = F (a)[l] + (F (b)[l] - F (a)[l]) * F (c)[l]; break;
+            case OP_FMA: FOR_LANES F (d)[l] = F (a)[l] * F (b)[l] + F (c)[l]; break;
+            UNARY_FUNCTIONS (UNARY_CASE)
+            BINARY_FUNCTIONS (BINARY_CASE)
+        }
+    }
+}
+
+static void
+fill (gpointer reg, Type type, gdouble value)
+{
+    for (guint l = 0; l < BATCH_SIZE; l++) {
+        if (type == TYPE_FLOAT)
+            ((gfloat *) reg)[l] = (gfloat) value;
+        else
+            ((gint32 *) reg)[l] = (gint32) value;
+    }
+}
+
+void
+ufo_expr_evaluate (UfoExpr *expr,
+                   const gfloat * const *inputs,
+                   const gfloat *scalars,
+                   gfloat *output,
+                   gsize width,
+                   gsize height,
+                   gsize depth)
+{
+    const gint64 w = (gint64) width;
+    const gint64 h = (gint64) height;
+    const gint64 n_pixels = w * h * (gint64) depth;
+    const gint64 n_batches = (n_pixels + BATCH_SIZE - 1) / BATCH_SIZE;
+    const Instruction *code = (const Instruction *) expr->code->data;
+    const guint n_instructions = expr->code->len;
+
+#pragma omp parallel
+    {
+        /* Registers are batches of 32 bit values, either float or int */
+        gfloat *storage = g_malloc (expr->n_registers * BATCH_SIZE * sizeof (gfloat));
+        gpointer *regs = g_new (gpointer, expr->n_registers);
+
+        for (guint r = 0; r < expr->n_registers; r++)
+            regs[r] = storage + r * BATCH_SIZE;
+
+        for (guint r = 0; r < expr->constants->len; r++) {
+            Constant *c = &g_array_index (expr->constants, Constant, r);
+            fill (regs[c->reg], c->type, c->value);
+        }
+
+        for (guint r = 0; r < expr->n_scalars; r++) {
+            if (expr->scalar_regs[r] >= 0)
+                fill (regs[expr->scalar_regs[r]], TYPE_FLOAT, scalars[r]);
+        }
+
+#pragma omp for schedule(static)
+        for (gint64 batch = 0; batch < n_batches; batch++) {
+            const gint64 base = batch * BATCH_SIZE;
+            const gint n = (gint) MIN (BATCH_SIZE, n_pixels - base);
+            gboolean copy_inputs = n < BATCH_SIZE;
+
+            /* Full batches read the inputs in place, the last one is copied */
+            for (guint r = 0; r < expr->n_inputs; r++) {
+                const gint reg = expr->input_regs[r];
+
+                if (reg < 0)
+                    continue;
+
+                if (copy_inputs) {
+                    regs[reg] = storage + reg * BATCH_SIZE;
+                    memcpy (regs[reg], inputs[r] + base, n * sizeof (gfloat));
+                }
+                else {
+                    regs[reg] = (gpointer) (inputs[r] + base);
+                }
+            }
+
+            for (guint j = 0; j < N_COORDINATES; j++) {
+                gint32 *coordinate;
+
+                if (expr->coordinate_regs[j] < 0)
+                    continue;
+
+                coordinate = regs[expr->coordinate_regs[j]];
+
+                for (gint l = 0; l < n; l++) {
+                    const gint64 index = base + l;
+
+                    switch (j) {
+                        case COORDINATE_X: coordinate[l] = (gint32) (index % w); break;
+                        case COORDINATE_Y: coordinate[l] = (gint32) (index / w % h); break;
+                        case COORDINATE_Z: coordinate[l] = (gint32) (index / w / h); break;
+                        default: coordinate[l] = (gint32) index; break;
+                    }
+                }
+            }
+
+            execute (code, n_instructions, regs, n);
+            memcpy (output + base, regs[expr->result], n * sizeof (gfloat));
+        }
+
+        g_free (regs);
+        g_free (storage);
+    }
+}
+
+void
+ufo_expr_free (UfoExpr *expr)
+{
+    if (expr == NULL)
+        return;
+
+    g_array_free (expr->code, TRUE);
+    g_array_free (expr->constants, TRUE);
+    g_free (expr->input_regs);
+    g_free (expr->scalar_regs);
+    g_free (expr);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_EXPR_H
+#define UFO_EXPR_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define UFO_EXPR_ERROR ufo_expr_error_quark ()
+
+GQuark ufo_expr_error_quark (void);
+
+typedef struct _UfoExpr UfoExpr;
+
+/*
+ * Host evaluation of the element-wise expressions understood by the calculate
+ * filter: statements separated by semicolons, of which all but the last
+ * assign to float temporaries (=, +=, -=, *= and /=) and the last is the
+ * result, with the C operators, int and float casts and the common OpenCL
+ * math functions. The names in the NULL-terminated @input_names refer to
+ * per-pixel values, those in @scalar_names to values that are the same for
+ * all pixels, x, y, z are the pixel coordinates and i the linear index.
+ *
+ * The expression is compiled into a list of instructions on registers that
+ * hold a batch of pixels each, so that every instruction is a vectorised
+ * loop. Batches are distributed among the OpenMP threads. @inputs and
+ * @scalars are given in the order of the names.
+ */
+UfoExpr *ufo_expr_new       (const gchar         *expression,
+                             const gchar * const *input_names,
+                             const gchar * const *scalar_names,
+                             GError             **error);
+void     ufo_expr_evaluate  (UfoExpr             *expr,
+                             const gfloat * const *inputs,
+                             const gfloat        *scalars,
+                             gfloat              *output,
+                             gsize                width,
+                             gsize                height,
+                             gsize                depth);
+void     ufo_expr_free      (UfoExpr             *expr);
+
+G_END_DECLS
+
+#endif
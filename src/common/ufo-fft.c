@@ -27,74 +27,165 @@
 #include "oclFFT.h"
 #endif
 
+#ifdef HAVE_FFTW
+#include <fftw3.h>
+#endif
+
 #include "ufo-fft.h"
 
-struct _UfoFft {
-    UfoFftParameter seen;
+/*
+ * Plans are expensive to create (clFFT bakes and compiles kernels, the Apple
+ * FFT builds a program from source) but depend only on the context, the
+ * queue and the transform layout. We therefore keep all plans in a
+ * process-wide, reference-counted cache, so that multiple fft, ifft, filter
+ * and retrieve-phase nodes of a graph share identical plans. Plans own
+ * temporary buffers, which is why they are never shared between queues:
+ * commands on one in-order queue cannot use the buffers concurrently.
+ */
+typedef struct {
+    gchar *key;
+    guint refcount;
+    gsize batch;
+
+    /* serializes enqueueing from the threads of nodes sharing the queue */
+    GMutex lock;
 
 #ifdef HAVE_AMD
     clfftPlanHandle amd_plan;
-    clfftSetupData amd_setup;
 #else
     clFFT_Plan apple_plan;
 #endif
+} UfoFftPlan;
+
+struct _UfoFft {
+    UfoFftParameter seen;
+    UfoFftPlan *plan;
+
+#ifdef HAVE_FFTW
+    /*
+     * Host plans are not shared through the plan cache because FFTW keeps
+     * its own wisdom and re-planning a known transform is cheap.
+     */
+    UfoFftParameter host_param;
+    fftwf_plan host_plans[2][2];    /* [direction][in-place] */
+    fftwf_plan host_r2c_plan;
+    gfloat *host_real;
+#endif
 };
 
+static GMutex cache_mutex;
+static GHashTable *plan_cache = NULL;
+static guint num_ffts = 0;
+static GOnce initialize_once = G_ONCE_INIT;
+
 #ifdef HAVE_AMD
-static GMutex amd_mutex;
-static GList *ffts_created = NULL;
+static clfftSetupData amd_setup;
 #endif
 
+#ifdef HAVE_FFTW
+/* The FFTW planner is not thread-safe, only execution is */
+static GMutex fftw_mutex;
+static gchar *fftw_wisdom_file = NULL;
+#endif
 
-UfoFft *
-ufo_fft_new (void)
+
+static gchar *
+get_cache_dir (void)
 {
-    UfoFft *fft;
+    gchar *path;
+    const gchar *dir;
 
-    fft = g_malloc0 (sizeof (UfoFft));
+    dir = g_getenv ("UFO_FFT_CACHE_DIR");
+
+    /* An empty value disables on-disk caching altogether */
+    if (dir != NULL && dir[0] == '\0')
+        return NULL;
+
+    path = dir != NULL ? g_strdup (dir) : g_build_filename (g_get_user_cache_dir (), "ufo", "fft", NULL);
+
+    if (g_mkdir_with_parents (path, 0755) != 0) {
+        g_warning ("Could not create FFT cache directory `%s'", path);
+        g_free (path);
+        return NULL;
+    }
+
+    return path;
+}
+
+/*
+ * Run once per process through initialize_once, because setting the
+ * environment is not thread-safe and must only happen before the first clFFT
+ * setup. FFTW threads must be initialized before the wisdom is imported.
+ */
+static gpointer
+initialize (gpointer data)
+{
+    gchar *path;
+
+#ifdef HAVE_FFTW
+    fftwf_init_threads ();
+#endif
+
+    path = get_cache_dir ();
+
+    if (path == NULL)
+        return NULL;
 
 #ifdef HAVE_AMD
-    UFO_RESOURCES_CHECK_CLERR (clfftSetup (&fft->amd_setup));
+    /* Respect an explicitly set clFFT kernel cache */
+    g_setenv ("CLFFT_CACHE_PATH", path, FALSE);
+#endif
+
+#ifdef HAVE_FFTW
+    fftw_wisdom_file = g_build_filename (path, "fftwf-wisdom", NULL);
 
-    g_mutex_lock (&amd_mutex);
-    ffts_created = g_list_append (ffts_created, fft);
-    g_mutex_unlock (&amd_mutex);
+    if (g_file_test (fftw_wisdom_file, G_FILE_TEST_EXISTS))
+        fftwf_import_wisdom_from_filename (fftw_wisdom_file);
 #endif
 
-    return fft;
+    g_free (path);
+    return NULL;
 }
 
-cl_int
-ufo_fft_update (UfoFft *fft, cl_context context, cl_command_queue queue, UfoFftParameter *param)
+static gchar *
+make_plan_key (cl_context context, cl_command_queue queue, UfoFftParameter *param)
 {
-    gboolean changed;
-    cl_int error;
+    cl_device_id device = NULL;
 
-    error = CL_SUCCESS;
-    changed = param->size[0] != fft->seen.size[0] || param->size[1] != fft->seen.size[1];
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (queue, CL_QUEUE_DEVICE, sizeof (cl_device_id), &device, NULL));
+
+    return g_strdup_printf ("%p-%p-%p-%i-%zu-%zu-%zu-%zu-%i",
+                            (gpointer) context, (gpointer) device, (gpointer) queue,
+                            param->dimensions,
+                            param->size[0], param->size[1], param->size[2],
+                            param->batch, param->zeropad);
+}
 
-    if (changed)
-        memcpy (&fft->seen, param, sizeof (UfoFftParameter));
+static UfoFftPlan *
+plan_new (const gchar *key, cl_context context, cl_command_queue queue, UfoFftParameter *param, cl_int *error)
+{
+    UfoFftPlan *plan;
+
+    plan = g_malloc0 (sizeof (UfoFftPlan));
+    plan->key = g_strdup (key);
+    plan->refcount = 1;
+    plan->batch = param->batch;
+    g_mutex_init (&plan->lock);
 
 #ifdef HAVE_AMD
-    if (fft->amd_plan == 0 || changed) {
+    {
         /* we use param->dimension to index into this array! */
         clfftDim dimension[4] = { 0, CLFFT_1D, CLFFT_2D, CLFFT_3D };
 
-        if (fft->amd_plan != 0) {
-            clfftDestroyPlan (&fft->amd_plan);
-            fft->amd_plan = 0;
-        }
-
-        UFO_RESOURCES_CHECK_CLERR (clfftCreateDefaultPlan (&fft->amd_plan, context, dimension[param->dimensions], param->size));
-        UFO_RESOURCES_CHECK_CLERR (clfftSetPlanBatchSize (fft->amd_plan, param->batch));
-        UFO_RESOURCES_CHECK_CLERR (clfftSetPlanPrecision (fft->amd_plan, CLFFT_SINGLE));
-        UFO_RESOURCES_CHECK_CLERR (clfftSetLayout (fft->amd_plan, CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED));
-        UFO_RESOURCES_CHECK_CLERR (clfftSetResultLocation (fft->amd_plan, param->zeropad ? CLFFT_INPLACE : CLFFT_OUTOFPLACE));
-        UFO_RESOURCES_CHECK_CLERR (clfftBakePlan (fft->amd_plan, 1, &queue, NULL, NULL));
+        UFO_RESOURCES_CHECK_CLERR (clfftCreateDefaultPlan (&plan->amd_plan, context, dimension[param->dimensions], param->size));
+        UFO_RESOURCES_CHECK_CLERR (clfftSetPlanBatchSize (plan->amd_plan, param->batch));
+        UFO_RESOURCES_CHECK_CLERR (clfftSetPlanPrecision (plan->amd_plan, CLFFT_SINGLE));
+        UFO_RESOURCES_CHECK_CLERR (clfftSetLayout (plan->amd_plan, CLFFT_COMPLEX_INTERLEAVED, CLFFT_COMPLEX_INTERLEAVED));
+        UFO_RESOURCES_CHECK_CLERR (clfftSetResultLocation (plan->amd_plan, param->zeropad ? CLFFT_INPLACE : CLFFT_OUTOFPLACE));
+        *error = clfftBakePlan (plan->amd_plan, 1, &queue, NULL, NULL);
     }
 #else
-    if (fft->apple_plan == NULL || changed) {
+    {
         clFFT_Dim3 size;
 
         /* we use param->dimension to index into this array! */
@@ -104,14 +195,111 @@ ufo_fft_update (UfoFft *fft, cl_context context, cl_command_queue queue, UfoFftP
         size.y = param->size[1];
         size.z = param->size[2];
 
-        if (fft->apple_plan != NULL) {
-            clFFT_DestroyPlan (fft->apple_plan);
-            fft->apple_plan = NULL;
-        }
+        plan->apple_plan = clFFT_CreatePlan (context, size, dimension[param->dimensions], clFFT_InterleavedComplexFormat, error);
+    }
+#endif
+
+    return plan;
+}
+
+static void
+plan_free (UfoFftPlan *plan)
+{
+#ifdef HAVE_AMD
+    if (plan->amd_plan != 0)
+        clfftDestroyPlan (&plan->amd_plan);
+#else
+    if (plan->apple_plan != NULL)
+        clFFT_DestroyPlan (plan->apple_plan);
+#endif
+
+    g_mutex_clear (&plan->lock);
+    g_free (plan->key);
+    g_free (plan);
+}
+
+/* must be called with cache_mutex held */
+static void
+plan_unref (UfoFftPlan *plan)
+{
+    if (plan == NULL)
+        return;
 
-        fft->apple_plan = clFFT_CreatePlan (context, size, dimension[param->dimensions], clFFT_InterleavedComplexFormat, &error);
+    g_assert (plan->refcount > 0);
+
+    if (--plan->refcount == 0) {
+        g_hash_table_remove (plan_cache, plan->key);
+        plan_free (plan);
     }
+}
+
+UfoFft *
+ufo_fft_new (void)
+{
+    UfoFft *fft;
+
+    fft = g_malloc0 (sizeof (UfoFft));
+
+    g_once (&initialize_once, initialize, NULL);
+    g_mutex_lock (&cache_mutex);
+
+    if (num_ffts == 0) {
+        plan_cache = g_hash_table_new (g_str_hash, g_str_equal);
+
+#ifdef HAVE_AMD
+        UFO_RESOURCES_CHECK_CLERR (clfftInitSetupData (&amd_setup));
+        UFO_RESOURCES_CHECK_CLERR (clfftSetup (&amd_setup));
 #endif
+    }
+
+    num_ffts++;
+    g_mutex_unlock (&cache_mutex);
+
+    return fft;
+}
+
+cl_int
+ufo_fft_update (UfoFft *fft, cl_context context, cl_command_queue queue, UfoFftParameter *param)
+{
+    UfoFftPlan *plan;
+    gchar *key;
+    cl_int error;
+
+    error = CL_SUCCESS;
+    key = make_plan_key (context, queue, param);
+
+    if (fft->plan != NULL && !g_strcmp0 (fft->plan->key, key)) {
+        g_free (key);
+        return error;
+    }
+
+    memcpy (&fft->seen, param, sizeof (UfoFftParameter));
+
+    g_mutex_lock (&cache_mutex);
+
+    plan_unref (fft->plan);
+    fft->plan = NULL;
+
+    plan = g_hash_table_lookup (plan_cache, key);
+
+    if (plan != NULL) {
+        plan->refcount++;
+    }
+    else {
+        plan = plan_new (key, context, queue, param, &error);
+
+        if (error != CL_SUCCESS) {
+            plan_free (plan);
+            plan = NULL;
+        }
+        else {
+            g_hash_table_insert (plan_cache, plan->key, plan);
+        }
+    }
+
+    fft->plan = plan;
+    g_mutex_unlock (&cache_mutex);
+    g_free (key);
 
     return error;
 }
@@ -121,35 +309,289 @@ ufo_fft_execute (UfoFft *fft, cl_command_queue queue, UfoProfiler *profiler,
                  cl_mem in_mem, cl_mem out_mem, UfoFftDirection direction,
                  cl_uint num_events, cl_event *event_list, cl_event *event)
 {
+    UfoFftPlan *plan;
+    cl_int error;
+
+    plan = fft->plan;
+    g_return_val_if_fail (plan != NULL, CL_INVALID_VALUE);
+
+    g_mutex_lock (&plan->lock);
+
 #ifdef HAVE_AMD
-    return clfftEnqueueTransform (fft->amd_plan,
-                                  direction == UFO_FFT_FORWARD ? CLFFT_FORWARD : CLFFT_BACKWARD,
-                                  1, &queue,
-                                  num_events, event_list, event, &in_mem, &out_mem, NULL);
+    error = clfftEnqueueTransform (plan->amd_plan,
+                                   direction == UFO_FFT_FORWARD ? CLFFT_FORWARD : CLFFT_BACKWARD,
+                                   1, &queue,
+                                   num_events, event_list, event, &in_mem, &out_mem, NULL);
 #else
-    return clFFT_ExecuteInterleaved_Ufo (queue, fft->apple_plan,
-                                         fft->seen.batch,
-                                         direction == UFO_FFT_FORWARD ? clFFT_Forward : clFFT_Inverse,
-                                         in_mem, out_mem, num_events, event_list, event, profiler);
+    error = clFFT_ExecuteInterleaved_Ufo (queue, plan->apple_plan,
+                                          plan->batch,
+                                          direction == UFO_FFT_FORWARD ? clFFT_Forward : clFFT_Inverse,
+                                          in_mem, out_mem, num_events, event_list, event, profiler);
 #endif
+
+    g_mutex_unlock (&plan->lock);
+
+    return error;
+}
+
+#ifdef HAVE_FFTW
+static void
+destroy_host_plans (UfoFft *fft)
+{
+    g_mutex_lock (&fftw_mutex);
+
+    for (guint i = 0; i < 2; i++) {
+        for (guint j = 0; j < 2; j++) {
+            if (fft->host_plans[i][j] != NULL) {
+                fftwf_destroy_plan (fft->host_plans[i][j]);
+                fft->host_plans[i][j] = NULL;
+            }
+        }
+    }
+
+    if (fft->host_r2c_plan != NULL) {
+        fftwf_destroy_plan (fft->host_r2c_plan);
+        fft->host_r2c_plan = NULL;
+    }
+
+    g_mutex_unlock (&fftw_mutex);
+
+    fftwf_free (fft->host_real);
+    fft->host_real = NULL;
+}
+
+/*
+ * Fill @n with the transform size in FFTW (row-major) order and return the
+ * rank of the transform.
+ */
+static int
+get_host_size (UfoFftParameter *param, int *n)
+{
+    int rank = (int) param->dimensions;
+
+    for (int i = 0; i < rank; i++)
+        n[i] = (int) param->size[rank - 1 - i];
+
+    return rank;
+}
+
+static gsize
+get_host_num_elements (UfoFftParameter *param)
+{
+    gsize num = 1;
+
+    for (guint i = 0; i < (guint) param->dimensions; i++)
+        num *= param->size[i];
+
+    return num;
+}
+
+static void
+export_wisdom (void)
+{
+    if (fftw_wisdom_file != NULL && !fftwf_export_wisdom_to_filename (fftw_wisdom_file))
+        g_warning ("Could not write FFTW wisdom to `%s'", fftw_wisdom_file);
 }
 
+/**
+ * ufo_fft_update_host:
+ * @fft: A #UfoFft
+ * @param: Transform parameters
+ *
+ * Prepare @fft for transforms of host memory with FFTW. Plans are created
+ * lazily on first execution and re-used as long as @param does not change.
+ */
+void
+ufo_fft_update_host (UfoFft *fft, UfoFftParameter *param)
+{
+    /* Field by field, the padding of the structs is not initialized */
+    if (fft->host_param.dimensions == param->dimensions &&
+        fft->host_param.size[0] == param->size[0] &&
+        fft->host_param.size[1] == param->size[1] &&
+        fft->host_param.size[2] == param->size[2] &&
+        fft->host_param.batch == param->batch &&
+        fft->host_param.zeropad == param->zeropad)
+        return;
+
+    destroy_host_plans (fft);
+    memcpy (&fft->host_param, param, sizeof (UfoFftParameter));
+}
+
+static fftwf_plan
+get_host_plan (UfoFft *fft, UfoFftDirection direction, gboolean in_place)
+{
+    fftwf_plan *plan;
+
+    plan = &fft->host_plans[direction == UFO_FFT_FORWARD ? 0 : 1][in_place ? 1 : 0];
+
+    if (*plan == NULL) {
+        fftwf_complex *in;
+        fftwf_complex *out;
+        gsize num;
+        int n[3];
+        int rank;
+
+        rank = get_host_size (&fft->host_param, n);
+        num = get_host_num_elements (&fft->host_param);
+
+        g_mutex_lock (&fftw_mutex);
+
+        /* Plan on scratch memory, FFTW_MEASURE overwrites the arrays */
+        in = fftwf_malloc (num * fft->host_param.batch * sizeof (fftwf_complex));
+        out = in_place ? in : fftwf_malloc (num * fft->host_param.batch * sizeof (fftwf_complex));
+
+        fftwf_plan_with_nthreads ((int) g_get_num_processors ());
+        *plan = fftwf_plan_many_dft (rank, n, (int) fft->host_param.batch,
+                                     in, NULL, 1, (int) num,
+                                     out, NULL, 1, (int) num,
+                                     direction == UFO_FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD,
+                                     FFTW_MEASURE | FFTW_UNALIGNED);
+
+        if (out != in)
+            fftwf_free (out);
+
+        fftwf_free (in);
+        export_wisdom ();
+        g_mutex_unlock (&fftw_mutex);
+    }
+
+    return *plan;
+}
+
+/**
+ * ufo_fft_execute_host:
+ * @fft: A #UfoFft
+ * @in: Interleaved complex input
+ * @out: Interleaved complex output, may be the same as @in
+ * @direction: Direction of the transform
+ *
+ * Compute an unnormalized complex-to-complex transform of host memory.
+ */
+void
+ufo_fft_execute_host (UfoFft *fft, gfloat *in, gfloat *out, UfoFftDirection direction)
+{
+    fftwf_plan plan;
+
+    plan = get_host_plan (fft, direction, in == out);
+    g_return_if_fail (plan != NULL);
+    fftwf_execute_dft (plan, (fftwf_complex *) in, (fftwf_complex *) out);
+}
+
+/**
+ * ufo_fft_execute_host_r2c:
+ * @fft: A #UfoFft
+ * @in: Real input with rows of @in_width values
+ * @in_width: Number of input values per row
+ * @in_height: Number of input rows per 2-D slice, ignored for 1-D transforms
+ *   where every row is a batch
+ * @out: Interleaved complex output of the full transform size
+ *
+ * Zero-pad real input to the transform size and compute the forward
+ * transform with a real-to-complex plan. The redundant half of the spectrum
+ * is restored from Hermitian symmetry, so @out has the same layout as the
+ * output of ufo_fft_execute_host() on spread complex input.
+ */
+void
+ufo_fft_execute_host_r2c (UfoFft *fft, const gfloat *in, gsize in_width, gsize in_height, gfloat *out)
+{
+    UfoFftParameter *param;
+    gsize width;
+    gsize num;
+    gsize num_rows;
+    gsize copy_width;
+    int n[3];
+    int rank;
+
+    param = &fft->host_param;
+    rank = get_host_size (param, n);
+    num = get_host_num_elements (param);
+    width = param->size[0];
+    num_rows = num / width;
+    copy_width = MIN (in_width, width);
+
+    if (fft->host_r2c_plan == NULL) {
+        int onembed[3];
+
+        fft->host_real = fftwf_malloc (num * param->batch * sizeof (gfloat));
+
+        /* Write half spectra directly into rows of full width */
+        memcpy (onembed, n, sizeof (onembed));
+
+        g_mutex_lock (&fftw_mutex);
+        fftwf_plan_with_nthreads ((int) g_get_num_processors ());
+        fft->host_r2c_plan = fftwf_plan_many_dft_r2c (rank, n, (int) param->batch,
+                                                      fft->host_real, NULL, 1, (int) num,
+                                                      (fftwf_complex *) out, onembed, 1, (int) num,
+                                                      FFTW_ESTIMATE | FFTW_UNALIGNED);
+        g_mutex_unlock (&fftw_mutex);
+
+        g_return_if_fail (fft->host_r2c_plan != NULL);
+    }
+
+    /* Zero-pad input rows */
+#pragma omp parallel for
+    for (gsize b = 0; b < param->batch; b++) {
+        for (gsize r = 0; r < num_rows; r++) {
+            gfloat *dst = fft->host_real + (b * num_rows + r) * width;
+            gsize row = param->dimensions == UFO_FFT_1D ? b : b * in_height + r;
+
+            if (param->dimensions == UFO_FFT_1D || r < in_height) {
+                memcpy (dst, in + row * in_width, copy_width * sizeof (gfloat));
+                memset (dst + copy_width, 0, (width - copy_width) * sizeof (gfloat));
+            }
+            else {
+                memset (dst, 0, width * sizeof (gfloat));
+            }
+        }
+    }
+
+    fftwf_execute_dft_r2c (fft->host_r2c_plan, fft->host_real, (fftwf_complex *) out);
+
+    /* Restore X[k] = conj (X[-k]) for the upper half of each row */
+#pragma omp parallel for
+    for (gsize b = 0; b < param->batch; b++) {
+        gfloat *slice = out + 2 * b * num;
+        gsize height = rank > 1 ? param->size[1] : 1;
+
+        for (gsize r = 0; r < num_rows; r++) {
+            gsize y = r % height;
+            gsize z = r / height;
+            gsize y_mirror = (height - y) % height;
+            gsize z_mirror = rank > 2 ? (param->size[2] - z) % param->size[2] : 0;
+            gfloat *row = slice + 2 * r * width;
+            gfloat *mirror = slice + 2 * (z_mirror * height + y_mirror) * width;
+
+            for (gsize x = width / 2 + 1; x < width; x++) {
+                row[2 * x] = mirror[2 * (width - x)];
+                row[2 * x + 1] = -mirror[2 * (width - x) + 1];
+            }
+        }
+    }
+}
+#endif
+
 void
 ufo_fft_destroy (UfoFft *fft)
 {
-#ifdef HAVE_AMD
-    g_mutex_lock (&amd_mutex);
+#ifdef HAVE_FFTW
+    destroy_host_plans (fft);
+#endif
 
-    clfftDestroyPlan (&fft->amd_plan);
-    ffts_created = g_list_remove (ffts_created, fft);
+    g_mutex_lock (&cache_mutex);
 
-    if (g_list_length (ffts_created) == 0)
-        clfftTeardown ();
+    plan_unref (fft->plan);
+    num_ffts--;
 
-    g_mutex_unlock (&amd_mutex);
-#else
-    clFFT_DestroyPlan (fft->apple_plan);
+    if (num_ffts == 0) {
+        g_hash_table_destroy (plan_cache);
+        plan_cache = NULL;
+
+#ifdef HAVE_AMD
+        clfftTeardown ();
 #endif
+    }
+
+    g_mutex_unlock (&cache_mutex);
 
     g_free (fft);
 }
@@ -63,4 +63,18 @@ cl_int  ufo_fft_execute (UfoFft            *fft,
                          cl_event          *event);
 void    ufo_fft_destroy (UfoFft            *fft);
 
+#ifdef HAVE_FFTW
+void    ufo_fft_update_host      (UfoFft            *fft,
+                                  UfoFftParameter   *param);
+void    ufo_fft_execute_host     (UfoFft            *fft,
+                                  gfloat            *in,
+                                  gfloat            *out,
+                                  UfoFftDirection    direction);
+void    ufo_fft_execute_host_r2c (UfoFft            *fft,
+                                  const gfloat      *in,
+                                  gsize              in_width,
+                                  gsize              in_height,
+                                  gfloat            *out);
+#endif
+
 #endif
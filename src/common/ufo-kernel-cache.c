@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include "common/ufo-kernel-cache.h"
+
+#define KERNELS_DATA_KEY "ufo-kernel-cache-kernels"
+#define MAX_INCLUDE_DEPTH 8
+
+static GMutex kernels_mutex;
+
+
+static gchar *
+get_cache_dir (void)
+{
+    gchar *path;
+    const gchar *dir;
+
+    dir = g_getenv ("UFO_KERNEL_CACHE_DIR");
+
+    /* An empty value disables on-disk caching altogether */
+    if (dir != NULL && dir[0] == '\0')
+        return NULL;
+
+    path = dir != NULL ? g_strdup (dir) : g_build_filename (g_get_user_cache_dir (), "ufo", "kernels", NULL);
+
+    if (g_mkdir_with_parents (path, 0755) != 0) {
+        g_warning ("Could not create kernel cache directory `%s'", path);
+        g_free (path);
+        return NULL;
+    }
+
+    return path;
+}
+
+static gchar *
+get_device_string (cl_device_id device, cl_device_info param)
+{
+    gchar *result;
+    gsize size;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, param, 0, NULL, &size));
+    result = g_malloc0 (size + 1);
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, param, size, result, NULL));
+
+    return result;
+}
+
+static gchar *
+get_build_options (cl_device_id device, const gchar *options)
+{
+    gchar *name;
+    gchar *result;
+
+    /* Same options ufo-core uses, kernels check DEVICE_<NAME> for tuning */
+    name = g_strstrip (get_device_string (device, CL_DEVICE_NAME));
+
+    for (gchar *c = name; *c != '\0'; c++)
+        *c = g_ascii_isalnum (*c) ? g_ascii_toupper (*c) : '_';
+
+    result = g_strdup_printf ("-cl-mad-enable -DDEVICE_%s %s", name, options != NULL ? options : "");
+    g_free (name);
+
+    return result;
+}
+
+static gchar *
+get_cache_path (const gchar *dir,
+                cl_device_id device,
+                const gchar *source,
+                const gchar *options)
+{
+    GChecksum *checksum;
+    gchar *filename;
+    gchar *path;
+    cl_device_info info[] = {CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+    /* Hash the terminators too, otherwise moving text between fields collides */
+    g_checksum_update (checksum, (const guchar *) source, strlen (source) + 1);
+    g_checksum_update (checksum, (const guchar *) options, strlen (options) + 1);
+
+    for (guint i = 0; i < G_N_ELEMENTS (info); i++) {
+        gchar *value;
+
+        value = get_device_string (device, info[i]);
+        g_checksum_update (checksum, (const guchar *) value, strlen (value) + 1);
+        g_free (value);
+    }
+
+    filename = g_strdup_printf ("%s.bin", g_checksum_get_string (checksum));
+    path = g_build_filename (dir, filename, NULL);
+
+    g_free (filename);
+    g_checksum_free (checksum);
+
+    return path;
+}
+
+static gchar *
+get_build_log (cl_program program, cl_device_id device)
+{
+    gchar *log;
+    gsize size;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetProgramBuildInfo (program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size));
+    log = g_malloc0 (size + 1);
+    UFO_RESOURCES_CHECK_CLERR (clGetProgramBuildInfo (program, device, CL_PROGRAM_BUILD_LOG, size, log, NULL));
+
+    return log;
+}
+
+static guchar *
+build_binary (cl_context context,
+              cl_device_id device,
+              const gchar *source,
+              const gchar *options,
+              gsize *size,
+              GError **error)
+{
+    cl_program program;
+    cl_int errcode;
+    guchar *binary;
+
+    program = clCreateProgramWithSource (context, 1, &source, NULL, &errcode);
+
+    if (errcode != CL_SUCCESS) {
+        g_set_error (error, UFO_RESOURCES_ERROR, UFO_RESOURCES_ERROR_CREATE_PROGRAM,
+                     "Failed to create program: %s", ufo_resources_clerr (errcode));
+        return NULL;
+    }
+
+    errcode = clBuildProgram (program, 1, &device, options, NULL, NULL);
+
+    if (errcode != CL_SUCCESS) {
+        gchar *log;
+
+        log = get_build_log (program, device);
+        g_set_error (error, UFO_RESOURCES_ERROR, UFO_RESOURCES_ERROR_BUILD_PROGRAM,
+                     "Failed to build program: %s\n%s", ufo_resources_clerr (errcode), log);
+        g_free (log);
+        UFO_RESOURCES_CHECK_CLERR (clReleaseProgram (program));
+        return NULL;
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clGetProgramInfo (program, CL_PROGRAM_BINARY_SIZES, sizeof (gsize), size, NULL));
+    binary = g_malloc (*size);
+    UFO_RESOURCES_CHECK_CLERR (clGetProgramInfo (program, CL_PROGRAM_BINARIES, sizeof (guchar *), &binary, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clReleaseProgram (program));
+
+    return binary;
+}
+
+static guchar *
+get_binary (cl_context context,
+            cl_device_id device,
+            const gchar *source,
+            const gchar *options,
+            const gchar *path,
+            gboolean use_cached,
+            gsize *size,
+            GError **error)
+{
+    GError *tmp_error = NULL;
+    gchar *contents;
+    guchar *binary;
+
+    if (path == NULL)
+        return build_binary (context, device, source, options, size, error);
+
+    if (use_cached && g_file_get_contents (path, &contents, size, NULL) && *size > 0)
+        return (guchar *) contents;
+
+    binary = build_binary (context, device, source, options, size, error);
+
+    if (binary == NULL)
+        return NULL;
+
+    /* A failed write only costs another compilation next time */
+    if (!g_file_set_contents (path, (const gchar *) binary, *size, &tmp_error)) {
+        g_debug ("Could not cache program binary: %s", tmp_error->message);
+        g_error_free (tmp_error);
+    }
+
+    return binary;
+}
+
+static cl_program
+create_program (UfoResources *resources,
+                const gchar *dir,
+                const gchar *source,
+                const gchar *options,
+                gboolean use_cached,
+                GError **error)
+{
+    cl_context context;
+    cl_program program = NULL;
+    cl_device_id *devices;
+    guchar **binaries;
+    gchar **paths;
+    gsize *sizes;
+    GList *device_list;
+    GList *it;
+    guint n_devices;
+    guint i = 0;
+    cl_int errcode;
+
+    context = ufo_resources_get_context (resources);
+    device_list = ufo_resources_get_devices (resources);
+    n_devices = g_list_length (device_list);
+
+    devices = g_new0 (cl_device_id, n_devices);
+    binaries = g_new0 (guchar *, n_devices);
+    paths = g_new0 (gchar *, n_devices);
+    sizes = g_new0 (gsize, n_devices);
+
+    for (it = g_list_first (device_list); it != NULL; it = g_list_next (it), i++) {
+        gchar *device_options;
+
+        devices[i] = it->data;
+        device_options = get_build_options (devices[i], options);
+        paths[i] = dir != NULL ? get_cache_path (dir, devices[i], source, device_options) : NULL;
+        binaries[i] = get_binary (context, devices[i], source, device_options, paths[i],
+                                  use_cached, &sizes[i], error);
+        g_free (device_options);
+
+        if (binaries[i] == NULL)
+            goto cleanup;
+    }
+
+    program = clCreateProgramWithBinary (context, n_devices, devices, sizes,
+                                         (const guchar **) binaries, NULL, &errcode);
+
+    if (errcode == CL_SUCCESS)
+        errcode = clBuildProgram (program, n_devices, devices, NULL, NULL, NULL);
+
+    if (errcode != CL_SUCCESS) {
+        if (program != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clReleaseProgram (program));
+
+        program = NULL;
+
+        if (use_cached && dir != NULL) {
+            /* Binaries written by an older driver that still reports the same version */
+            for (i = 0; i < n_devices; i++)
+                g_unlink (paths[i]);
+
+            program = create_program (resources, dir, source, options, FALSE, error);
+        }
+        else {
+            g_set_error (error, UFO_RESOURCES_ERROR, UFO_RESOURCES_ERROR_BUILD_PROGRAM,
+                         "Failed to load program binary: %s", ufo_resources_clerr (errcode));
+        }
+    }
+
+cleanup:
+    for (i = 0; i < n_devices; i++) {
+        g_free (binaries[i]);
+        g_free (paths[i]);
+    }
+
+    g_free (paths);
+    g_free (binaries);
+    g_free (sizes);
+    g_free (devices);
+    g_list_free (device_list);
+
+    return program;
+}
+
+static void
+release_kernel (gpointer data)
+{
+    UFO_RESOURCES_CHECK_CLERR (clReleaseKernel ((cl_kernel) data));
+}
+
+static void
+register_kernel (UfoResources *resources, cl_kernel kernel)
+{
+    GPtrArray *kernels;
+
+    /* Tie the kernel lifetime to @resources just like ufo-core does */
+    g_mutex_lock (&kernels_mutex);
+    kernels = g_object_get_data (G_OBJECT (resources), KERNELS_DATA_KEY);
+
+    if (kernels == NULL) {
+        kernels = g_ptr_array_new_with_free_func (release_kernel);
+        g_object_set_data_full (G_OBJECT (resources), KERNELS_DATA_KEY, kernels,
+                                (GDestroyNotify) g_ptr_array_unref);
+    }
+
+    g_ptr_array_add (kernels, kernel);
+    g_mutex_unlock (&kernels_mutex);
+}
+
+static gboolean
+expand_includes (UfoResources *resources,
+                 GString *result,
+                 const gchar *source,
+                 guint depth,
+                 GError **error)
+{
+    gchar **lines;
+    gboolean success = TRUE;
+
+    if (depth > MAX_INCLUDE_DEPTH) {
+        g_set_error (error, UFO_RESOURCES_ERROR, UFO_RESOURCES_ERROR_LOAD_PROGRAM,
+                     "Kernel includes nested too deeply");
+        return FALSE;
+    }
+
+    /* Includes are resolved here because the kernel path is only known to ufo-core */
+    lines = g_strsplit (source, "\n", -1);
+
+    for (guint i = 0; lines[i] != NULL && success; i++) {
+        gchar *line = g_strstrip (g_strdup (lines[i]));
+
+        if (g_str_has_prefix (line, "#include \"") && g_str_has_suffix (line, "\"") && strlen (line) > 11) {
+            gchar *filename;
+            gchar *included;
+
+            filename = g_strndup (line + 10, strlen (line) - 11);
+            included = ufo_resources_get_kernel_source (resources, filename, error);
+            success = included != NULL && expand_includes (resources, result, included, depth + 1, error);
+
+            g_free (included);
+            g_free (filename);
+        }
+        else {
+            g_string_append (result, lines[i]);
+            g_string_append_c (result, '\n');
+        }
+
+        g_free (line);
+    }
+
+    g_strfreev (lines);
+
+    return success;
+}
+
+cl_kernel
+ufo_kernel_cache_get_kernel_from_source (UfoResources *resources,
+                                         const gchar *source,
+                                         const gchar *kernel_name,
+                                         const gchar *options,
+                                         GError **error)
+{
+    cl_program program;
+    cl_kernel kernel;
+    cl_int errcode;
+    gchar *dir;
+
+    dir = get_cache_dir ();
+
+    program = create_program (resources, dir, source, options, TRUE, error);
+    g_free (dir);
+
+    if (program == NULL)
+        return NULL;
+
+    kernel = clCreateKernel (program, kernel_name, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (clReleaseProgram (program));
+
+    if (errcode != CL_SUCCESS) {
+        g_set_error (error, UFO_RESOURCES_ERROR, UFO_RESOURCES_ERROR_CREATE_KERNEL,
+                     "Failed to create kernel `%s': %s", kernel_name, ufo_resources_clerr (errcode));
+        return NULL;
+    }
+
+    register_kernel (resources, kernel);
+
+    return kernel;
+}
+
+cl_kernel
+ufo_kernel_cache_get_kernel (UfoResources *resources,
+                             const gchar *filename,
+                             const gchar *kernel_name,
+                             const gchar *options,
+                             GError **error)
+{
+    GString *source;
+    gchar *raw_source;
+    cl_kernel kernel = NULL;
+
+    raw_source = ufo_resources_get_kernel_source (resources, filename, error);
+
+    if (raw_source == NULL)
+        return NULL;
+
+    source = g_string_new (NULL);
+
+    if (expand_includes (resources, source, raw_source, 0, error))
+        kernel = ufo_kernel_cache_get_kernel_from_source (resources, source->str, kernel_name, options, error);
+
+    g_string_free (source, TRUE);
+    g_free (raw_source);
+
+    return kernel;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_KERNEL_CACHE_H
+#define UFO_KERNEL_CACHE_H
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <ufo/ufo.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Drop-in replacements for ufo_resources_get_kernel(),
+ * ufo_resources_get_kernel_with_opts() and
+ * ufo_resources_get_kernel_from_source(), which store the built program
+ * binaries on disk and load them on subsequent runs instead of compiling the
+ * source again. Like the originals, the returned kernel is owned by @resources
+ * and must be retained by the caller.
+ *
+ * The cache lives in $UFO_KERNEL_CACHE_DIR or, if unset, in
+ * $XDG_CACHE_HOME/ufo/kernels. Setting UFO_KERNEL_CACHE_DIR to an empty string
+ * disables caching.
+ */
+cl_kernel ufo_kernel_cache_get_kernel             (UfoResources  *resources,
+                                                   const gchar   *filename,
+                                                   const gchar   *kernel_name,
+                                                   const gchar   *options,
+                                                   GError       **error);
+cl_kernel ufo_kernel_cache_get_kernel_from_source (UfoResources  *resources,
+                                                   const gchar   *source,
+                                                   const gchar   *kernel_name,
+                                                   const gchar   *options,
+                                                   GError       **error);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ufo-ramp.h"
+
+void
+ufo_ramp_fill (gfloat *filter, guint width, gdouble scale)
+{
+    const gdouble step = 2.0 / width;
+
+    filter[0] = filter[1] = 0.5 / width;
+
+    for (guint k = 1; k < width / 4 + 1; k++) {
+        filter[2*k] = k * step * scale;
+        filter[2*k + 1] = filter[2*k];
+    }
+}
+
+void
+ufo_ramp_mirror (gfloat *filter, guint width)
+{
+    for (guint k = width/2 + 2; k < width; k += 2) {
+        filter[k] = filter[width - k];
+        filter[k + 1] = filter[width - k + 1];
+    }
+}
+
+gfloat *
+ufo_ramp_new (guint width, gdouble scale)
+{
+    gfloat *filter;
+
+    filter = g_malloc0 (width * sizeof (gfloat));
+    ufo_ramp_fill (filter, width, scale);
+    ufo_ramp_mirror (filter, width);
+
+    return filter;
+}
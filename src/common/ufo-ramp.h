@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_RAMP_H
+#define UFO_RAMP_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Frequency ramp in the interleaved complex layout of the 1D FFT of @width
+ * real values, i.e. @width / 2 complex coefficients. ufo_ramp_fill() sets the
+ * DC term and the ramp up to the Nyquist frequency, scaled by @scale, and
+ * ufo_ramp_mirror() copies it to the negative frequencies.
+ * ufo_ramp_new() returns the complete, mirrored ramp, free it with g_free().
+ */
+void     ufo_ramp_fill   (gfloat    *filter,
+                          guint      width,
+                          gdouble    scale);
+void     ufo_ramp_mirror (gfloat    *filter,
+                          guint      width);
+gfloat  *ufo_ramp_new    (guint      width,
+                          gdouble    scale);
+
+G_END_DECLS
+
+#endif
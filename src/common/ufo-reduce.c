@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common/ufo-reduce.h"
+
+/*
+ * The loops are independent per pixel, so they are split among the threads
+ * and vectorised. None of them may be compiled with -ffast-math, which would
+ * remove the Kahan compensation.
+ */
+
+void
+ufo_reduce_add (gfloat *sum, gfloat *compensation, const gfloat *input, gsize n)
+{
+    const gint64 size = (gint64) n;
+
+    if (compensation == NULL) {
+#pragma omp parallel for simd
+        for (gint64 i = 0; i < size; i++)
+            sum[i] += input[i];
+
+        return;
+    }
+
+#pragma omp parallel for simd
+    for (gint64 i = 0; i < size; i++) {
+        const gfloat y = input[i] - compensation[i];
+        const gfloat t = sum[i] + y;
+
+        compensation[i] = (t - sum[i]) - y;
+        sum[i] = t;
+    }
+}
+
+void
+ufo_reduce_min (gfloat *result, const gfloat *input, gsize n)
+{
+    const gint64 size = (gint64) n;
+
+#pragma omp parallel for simd
+    for (gint64 i = 0; i < size; i++)
+        result[i] = input[i] < result[i] ? input[i] : result[i];
+}
+
+void
+ufo_reduce_max (gfloat *result, const gfloat *input, gsize n)
+{
+    const gint64 size = (gint64) n;
+
+#pragma omp parallel for simd
+    for (gint64 i = 0; i < size; i++)
+        result[i] = input[i] > result[i] ? input[i] : result[i];
+}
+
+void
+ufo_reduce_welford (gfloat *mean, gfloat *m2, const gfloat *input, guint count, gsize n)
+{
+    const gint64 size = (gint64) n;
+    const gfloat weight = 1.0f / count;
+
+#pragma omp parallel for simd
+    for (gint64 i = 0; i < size; i++) {
+        const gfloat delta = input[i] - mean[i];
+
+        mean[i] += delta * weight;
+        m2[i] += delta * (input[i] - mean[i]);
+    }
+}
+
+void
+ufo_reduce_scale (gfloat *data, gfloat scale, gsize n)
+{
+    const gint64 size = (gint64) n;
+
+#pragma omp parallel for simd
+    for (gint64 i = 0; i < size; i++)
+        data[i] *= scale;
+}
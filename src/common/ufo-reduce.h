@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_REDUCE_H
+#define UFO_REDUCE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Element-wise accumulation of a frame of @n pixels into a running result,
+ * vectorised and shared among the OpenMP threads. With a non-NULL
+ * @compensation, ufo_reduce_add() uses Kahan summation, the compensation
+ * array must be zeroed before the first frame. ufo_reduce_welford() updates
+ * the running @mean and sum of squared deviations @m2 with the @count-th
+ * frame, starting at 1.
+ */
+void ufo_reduce_add     (gfloat         *sum,
+                         gfloat         *compensation,
+                         const gfloat   *input,
+                         gsize           n);
+void ufo_reduce_min     (gfloat         *result,
+                         const gfloat   *input,
+                         gsize           n);
+void ufo_reduce_max     (gfloat         *result,
+                         const gfloat   *input,
+                         gsize           n);
+void ufo_reduce_welford (gfloat         *mean,
+                         gfloat         *m2,
+                         const gfloat   *input,
+                         guint           count,
+                         gsize           n);
+void ufo_reduce_scale   (gfloat         *data,
+                         gfloat          scale,
+                         gsize           n);
+
+G_END_DECLS
+
+#endif
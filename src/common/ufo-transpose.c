@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2011-2014 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "common/ufo-transpose.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+/* Blocks up to this many pixels are transposed directly */
+#define BASE_BLOCK_SIZE     (128 * 128)
+
+/* Rows of the input handed to one thread at a time */
+#define BAND_HEIGHT         256
+
+typedef void (*MicroKernel) (const gfloat *src, gsize src_stride, gfloat *dst, gsize dst_stride);
+
+typedef struct {
+    const gchar *name;
+    gsize tile;
+    MicroKernel kernel;
+} Engine;
+
+static void
+transpose_scalar (const gfloat *src, gsize src_stride, gfloat *dst, gsize dst_stride)
+{
+    for (gsize i = 0; i < 8; i++)
+        for (gsize j = 0; j < 8; j++)
+            dst[j * dst_stride + i] = src[i * src_stride + j];
+}
+
+#ifdef HAVE_X86_DISPATCH
+__attribute__((target("sse")))
+static void
+transpose_sse (const gfloat *src, gsize src_stride, gfloat *dst, gsize dst_stride)
+{
+    __m128 row1 = _mm_loadu_ps (src);
+    __m128 row2 = _mm_loadu_ps (src + src_stride);
+    __m128 row3 = _mm_loadu_ps (src + 2 * src_stride);
+    __m128 row4 = _mm_loadu_ps (src + 3 * src_stride);
+    _MM_TRANSPOSE4_PS (row1, row2, row3, row4);
+    _mm_storeu_ps (dst, row1);
+    _mm_storeu_ps (dst + dst_stride, row2);
+    _mm_storeu_ps (dst + 2 * dst_stride, row3);
+    _mm_storeu_ps (dst + 3 * dst_stride, row4);
+}
+
+/*
+ * The micro kernels below are written out without loops, so that the rows
+ * stay in registers regardless of the unrolling heuristics of the compiler.
+ */
+__attribute__((target("avx2")))
+static void
+transpose_avx2 (const gfloat *src, gsize src_stride, gfloat *dst, gsize dst_stride)
+{
+    __m256 r0, r1, r2, r3, r4, r5, r6, r7;
+    __m256 t0, t1, t2, t3, t4, t5, t6, t7;
+
+    r0 = _mm256_loadu_ps (src + 0 * src_stride);
+    r1 = _mm256_loadu_ps (src + 1 * src_stride);
+    r2 = _mm256_loadu_ps (src + 2 * src_stride);
+    r3 = _mm256_loadu_ps (src + 3 * src_stride);
+    r4 = _mm256_loadu_ps (src + 4 * src_stride);
+    r5 = _mm256_loadu_ps (src + 5 * src_stride);
+    r6 = _mm256_loadu_ps (src + 6 * src_stride);
+    r7 = _mm256_loadu_ps (src + 7 * src_stride);
+
+    t0 = _mm256_unpacklo_ps (r0, r1);
+    t1 = _mm256_unpackhi_ps (r0, r1);
+    t2 = _mm256_unpacklo_ps (r2, r3);
+    t3 = _mm256_unpackhi_ps (r2, r3);
+    t4 = _mm256_unpacklo_ps (r4, r5);
+    t5 = _mm256_unpackhi_ps (r4, r5);
+    t6 = _mm256_unpacklo_ps (r6, r7);
+    t7 = _mm256_unpackhi_ps (r6, r7);
+
+    r0 = _mm256_shuffle_ps (t0, t2, _MM_SHUFFLE (1, 0, 1, 0));
+    r1 = _mm256_shuffle_ps (t0, t2, _MM_SHUFFLE (3, 2, 3, 2));
+    r2 = _mm256_shuffle_ps (t1, t3, _MM_SHUFFLE (1, 0, 1, 0));
+    r3 = _mm256_shuffle_ps (t1, t3, _MM_SHUFFLE (3, 2, 3, 2));
+    r4 = _mm256_shuffle_ps (t4, t6, _MM_SHUFFLE (1, 0, 1, 0));
+    r5 = _mm256_shuffle_ps (t4, t6, _MM_SHUFFLE (3, 2, 3, 2));
+    r6 = _mm256_shuffle_ps (t5, t7, _MM_SHUFFLE (1, 0, 1, 0));
+    r7 = _mm256_shuffle_ps (t5, t7, _MM_SHUFFLE (3, 2, 3, 2));
+
+    /* Combine the 128-bit halves of rows 0-3 and 4-7 */
+    _mm256_storeu_ps (dst + 0 * dst_stride, _mm256_permute2f128_ps (r0, r4, 0x20));
+    _mm256_storeu_ps (dst + 1 * dst_stride, _mm256_permute2f128_ps (r1, r5, 0x20));
+    _mm256_storeu_ps (dst + 2 * dst_stride, _mm256_permute2f128_ps (r2, r6, 0x20));
+    _mm256_storeu_ps (dst + 3 * dst_stride, _mm256_permute2f128_ps (r3, r7, 0x20));
+    _mm256_storeu_ps (dst + 4 * dst_stride, _mm256_permute2f128_ps (r0, r4, 0x31));
+    _mm256_storeu_ps (dst + 5 * dst_stride, _mm256_permute2f128_ps (r1, r5, 0x31));
+    _mm256_storeu_ps (dst + 6 * dst_stride, _mm256_permute2f128_ps (r2, r6, 0x31));
+    _mm256_storeu_ps (dst + 7 * dst_stride, _mm256_permute2f128_ps (r3, r7, 0x31));
+}
+
+#define LO_PD(a, b) _mm512_castpd_ps (_mm512_unpacklo_pd (_mm512_castps_pd (a), _mm512_castps_pd (b)))
+#define HI_PD(a, b) _mm512_castpd_ps (_mm512_unpackhi_pd (_mm512_castps_pd (a), _mm512_castps_pd (b)))
+
+/*
+ * Output rows j, 4 + j, 8 + j and 12 + j are lanes 0 to 3 of a, b, c and d
+ * gathered across the four registers.
+ */
+#define STORE_AVX512(j, a, b, c, d) {                                                       \
+    const __m512 low01 = _mm512_shuffle_f32x4 (a, b, 0x44);                                 \
+    const __m512 high01 = _mm512_shuffle_f32x4 (a, b, 0xee);                                \
+    const __m512 low23 = _mm512_shuffle_f32x4 (c, d, 0x44);                                 \
+    const __m512 high23 = _mm512_shuffle_f32x4 (c, d, 0xee);                                \
+    _mm512_storeu_ps (dst + (0 + j) * dst_stride, _mm512_shuffle_f32x4 (low01, low23, 0x88));   \
+    _mm512_storeu_ps (dst + (4 + j) * dst_stride, _mm512_shuffle_f32x4 (low01, low23, 0xdd));   \
+    _mm512_storeu_ps (dst + (8 + j) * dst_stride, _mm512_shuffle_f32x4 (high01, high23, 0x88)); \
+    _mm512_storeu_ps (dst + (12 + j) * dst_stride, _mm512_shuffle_f32x4 (high01, high23, 0xdd));\
+}
+
+__attribute__((target("avx512f")))
+static void
+transpose_avx512 (const gfloat *src, gsize src_stride, gfloat *dst, gsize dst_stride)
+{
+    __m512 r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15;
+    __m512 t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15;
+
+    r0 = _mm512_loadu_ps (src + 0 * src_stride);
+    r1 = _mm512_loadu_ps (src + 1 * src_stride);
+    r2 = _mm512_loadu_ps (src + 2 * src_stride);
+    r3 = _mm512_loadu_ps (src + 3 * src_stride);
+    r4 = _mm512_loadu_ps (src + 4 * src_stride);
+    r5 = _mm512_loadu_ps (src + 5 * src_stride);
+    r6 = _mm512_loadu_ps (src + 6 * src_stride);
+    r7 = _mm512_loadu_ps (src + 7 * src_stride);
+    r8 = _mm512_loadu_ps (src + 8 * src_stride);
+    r9 = _mm512_loadu_ps (src + 9 * src_stride);
+    r10 = _mm512_loadu_ps (src + 10 * src_stride);
+    r11 = _mm512_loadu_ps (src + 11 * src_stride);
+    r12 = _mm512_loadu_ps (src + 12 * src_stride);
+    r13 = _mm512_loadu_ps (src + 13 * src_stride);
+    r14 = _mm512_loadu_ps (src + 14 * src_stride);
+    r15 = _mm512_loadu_ps (src + 15 * src_stride);
+
+    t0 = _mm512_unpacklo_ps (r0, r1);
+    t1 = _mm512_unpackhi_ps (r0, r1);
+    t2 = _mm512_unpacklo_ps (r2, r3);
+    t3 = _mm512_unpackhi_ps (r2, r3);
+    t4 = _mm512_unpacklo_ps (r4, r5);
+    t5 = _mm512_unpackhi_ps (r4, r5);
+    t6 = _mm512_unpacklo_ps (r6, r7);
+    t7 = _mm512_unpackhi_ps (r6, r7);
+    t8 = _mm512_unpacklo_ps (r8, r9);
+    t9 = _mm512_unpackhi_ps (r8, r9);
+    t10 = _mm512_unpacklo_ps (r10, r11);
+    t11 = _mm512_unpackhi_ps (r10, r11);
+    t12 = _mm512_unpacklo_ps (r12, r13);
+    t13 = _mm512_unpackhi_ps (r12, r13);
+    t14 = _mm512_unpacklo_ps (r14, r15);
+    t15 = _mm512_unpackhi_ps (r14, r15);
+
+    /* Afterwards lane l of r(4k + j) holds column 4l + j of rows 4k to 4k + 3 */
+    r0 = LO_PD (t0, t2);
+    r1 = HI_PD (t0, t2);
+    r2 = LO_PD (t1, t3);
+    r3 = HI_PD (t1, t3);
+    r4 = LO_PD (t4, t6);
+    r5 = HI_PD (t4, t6);
+    r6 = LO_PD (t5, t7);
+    r7 = HI_PD (t5, t7);
+    r8 = LO_PD (t8, t10);
+    r9 = HI_PD (t8, t10);
+    r10 = LO_PD (t9, t11);
+    r11 = HI_PD (t9, t11);
+    r12 = LO_PD (t12, t14);
+    r13 = HI_PD (t12, t14);
+    r14 = LO_PD (t13, t15);
+    r15 = HI_PD (t13, t15);
+
+    STORE_AVX512 (0, r0, r4, r8, r12);
+    STORE_AVX512 (1, r1, r5, r9, r13);
+    STORE_AVX512 (2, r2, r6, r10, r14);
+    STORE_AVX512 (3, r3, r7, r11, r15);
+}
+
+#undef LO_PD
+#undef HI_PD
+#undef STORE_AVX512
+#endif
+
+static const Engine engines[UFO_TRANSPOSE_ISA_LAST] = {
+    [UFO_TRANSPOSE_ISA_SCALAR] = { "scalar", 8, transpose_scalar },
+#ifdef HAVE_X86_DISPATCH
+    [UFO_TRANSPOSE_ISA_SSE] = { "sse", 4, transpose_sse },
+    [UFO_TRANSPOSE_ISA_AVX2] = { "avx2", 8, transpose_avx2 },
+    [UFO_TRANSPOSE_ISA_AVX512] = { "avx512", 16, transpose_avx512 },
+#endif
+};
+
+static const Engine *engine = NULL;
+
+static gboolean
+isa_supported (UfoTransposeIsa isa)
+{
+    if (isa == UFO_TRANSPOSE_ISA_SCALAR)
+        return TRUE;
+
+#ifdef HAVE_X86_DISPATCH
+    __builtin_cpu_init ();
+
+    switch (isa) {
+        case UFO_TRANSPOSE_ISA_SSE:
+            return __builtin_cpu_supports ("sse");
+        case UFO_TRANSPOSE_ISA_AVX2:
+            return __builtin_cpu_supports ("avx2");
+        case UFO_TRANSPOSE_ISA_AVX512:
+            return __builtin_cpu_supports ("avx512f");
+        default:
+            break;
+    }
+#endif
+
+    return FALSE;
+}
+
+gboolean
+ufo_transpose_set_isa (UfoTransposeIsa isa)
+{
+    if (isa == UFO_TRANSPOSE_ISA_AUTO) {
+        for (gint i = UFO_TRANSPOSE_ISA_LAST - 1; i > UFO_TRANSPOSE_ISA_AUTO; i--) {
+            if (isa_supported (i)) {
+                engine = &engines[i];
+                return TRUE;
+            }
+        }
+    }
+
+    if (isa <= UFO_TRANSPOSE_ISA_AUTO || isa >= UFO_TRANSPOSE_ISA_LAST || !isa_supported (isa))
+        return FALSE;
+
+    engine = &engines[isa];
+    return TRUE;
+}
+
+static const Engine *
+get_engine (void)
+{
+    if (engine == NULL)
+        ufo_transpose_set_isa (UFO_TRANSPOSE_ISA_AUTO);
+
+    return engine;
+}
+
+const gchar *
+ufo_transpose_get_isa_name (void)
+{
+    return get_engine ()->name;
+}
+
+static void
+transpose_block (const Engine *e,
+                 const gfloat *src, gsize src_stride,
+                 gfloat *dst, gsize dst_stride,
+                 gsize row, gsize n_rows, gsize col, gsize n_cols)
+{
+    const gsize row_end = row + n_rows;
+    const gsize col_end = col + n_cols;
+    const gsize fast_row_end = row + n_rows - n_rows % e->tile;
+    const gsize fast_col_end = col + n_cols - n_cols % e->tile;
+
+    /* Walk along the output rows so that the written cache lines are completed */
+    for (gsize j = col; j < fast_col_end; j += e->tile)
+        for (gsize i = row; i < fast_row_end; i += e->tile)
+            e->kernel (src + i * src_stride + j, src_stride, dst + j * dst_stride + i, dst_stride);
+
+    /* Outliers of the tile grid, only present at the frame borders */
+    for (gsize i = row; i < row_end; i++) {
+        for (gsize j = i < fast_row_end ? fast_col_end : col; j < col_end; j++)
+            dst[j * dst_stride + i] = src[i * src_stride + j];
+    }
+}
+
+/*
+ * Halve the longer side until the block is small enough, splitting on
+ * multiples of the tile size so that only the frame borders have outliers.
+ */
+static void
+transpose_recursive (const Engine *e,
+                     const gfloat *src, gsize src_stride,
+                     gfloat *dst, gsize dst_stride,
+                     gsize row, gsize n_rows, gsize col, gsize n_cols)
+{
+    gsize half;
+
+    if (n_rows * n_cols <= BASE_BLOCK_SIZE) {
+        transpose_block (e, src, src_stride, dst, dst_stride, row, n_rows, col, n_cols);
+        return;
+    }
+
+    if (n_rows >= n_cols) {
+        half = (n_rows / 2 + e->tile - 1) / e->tile * e->tile;
+
+        if (half == 0 || half >= n_rows) {
+            transpose_block (e, src, src_stride, dst, dst_stride, row, n_rows, col, n_cols);
+            return;
+        }
+
+        transpose_recursive (e, src, src_stride, dst, dst_stride, row, half, col, n_cols);
+        transpose_recursive (e, src, src_stride, dst, dst_stride, row + half, n_rows - half, col, n_cols);
+    }
+    else {
+        half = (n_cols / 2 + e->tile - 1) / e->tile * e->tile;
+
+        if (half == 0 || half >= n_cols) {
+            transpose_block (e, src, src_stride, dst, dst_stride, row, n_rows, col, n_cols);
+            return;
+        }
+
+        transpose_recursive (e, src, src_stride, dst, dst_stride, row, n_rows, col, half);
+        transpose_recursive (e, src, src_stride, dst, dst_stride, row, n_rows, col + half, n_cols - half);
+    }
+}
+
+void
+ufo_transpose (const gfloat *src, gfloat *dst, gsize width, gsize height)
+{
+    const Engine *e = get_engine ();
+    const gint n_bands = (gint) ((height + BAND_HEIGHT - 1) / BAND_HEIGHT);
+
+#pragma omp parallel for schedule(dynamic)
+    for (gint band = 0; band < n_bands; band++) {
+        const gsize row = (gsize) band * BAND_HEIGHT;
+
+        transpose_recursive (e, src, width, dst, height, row, MIN (BAND_HEIGHT, height - row), 0, width);
+    }
+}
+
+/*
+ * Swap every tile above the diagonal with its mirror tile, both are
+ * transposed through small buffers that stay in the L1 cache.
+ */
+void
+ufo_transpose_inplace_square (gfloat *data, gsize size)
+{
+    const Engine *e = get_engine ();
+    const gsize tile = e->tile;
+    const gsize fast_size = size - size % tile;
+    const gint n_tiles = (gint) (fast_size / tile);
+
+#pragma omp parallel for schedule(dynamic)
+    for (gint ti = 0; ti < n_tiles; ti++) {
+        gfloat upper[16 * 16];
+        gfloat lower[16 * 16];
+        const gsize i = (gsize) ti * tile;
+
+        for (gsize j = i; j < fast_size; j += tile) {
+            gfloat *a = data + i * size + j;
+            gfloat *b = data + j * size + i;
+
+            e->kernel (a, size, upper, tile);
+
+            if (i != j)
+                e->kernel (b, size, lower, tile);
+
+            for (gsize k = 0; k < tile; k++) {
+                memcpy (b + k * size, upper + k * tile, tile * sizeof (gfloat));
+
+                if (i != j)
+                    memcpy (a + k * size, lower + k * tile, tile * sizeof (gfloat));
+            }
+        }
+    }
+
+    /* Outliers of the tile grid in the last rows and columns */
+    for (gsize i = 0; i < size; i++) {
+        for (gsize j = MAX (i + 1, fast_size); j < size; j++) {
+            const gfloat tmp = data[i * size + j];
+
+            data[i * size + j] = data[j * size + i];
+            data[j * size + i] = tmp;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011-2014 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_TRANSPOSE_H
+#define UFO_TRANSPOSE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    UFO_TRANSPOSE_ISA_AUTO = 0,
+    UFO_TRANSPOSE_ISA_SCALAR,
+    UFO_TRANSPOSE_ISA_SSE,
+    UFO_TRANSPOSE_ISA_AVX2,
+    UFO_TRANSPOSE_ISA_AVX512,
+    UFO_TRANSPOSE_ISA_LAST
+} UfoTransposeIsa;
+
+/*
+ * Host transposition of a @width x @height frame into a @height x @width frame.
+ * The frame is split recursively along its longer side until the blocks fit
+ * into the cache, the blocks are transposed with the widest micro kernel the
+ * CPU supports (4x4 SSE, 8x8 AVX2 or 16x16 AVX-512) and the work is shared
+ * among the OpenMP threads.
+ */
+void         ufo_transpose                  (const gfloat    *src,
+                                             gfloat          *dst,
+                                             gsize            width,
+                                             gsize            height);
+void         ufo_transpose_inplace_square   (gfloat          *data,
+                                             gsize            size);
+gboolean     ufo_transpose_set_isa          (UfoTransposeIsa  isa);
+const gchar *ufo_transpose_get_isa_name     (void);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common/ufo-tuner.h"
+
+#define CACHE_FILENAME  "work-groups.ini"
+#define DEFAULT_CHOICE  "default"
+#define MAX_RUNS        3
+#define SLOW_KERNEL     0.05
+
+typedef struct {
+    guint n_dims;
+    gsize local[3];
+} Choice;
+
+static GMutex tuner_mutex;
+static gboolean tuner_initialized = FALSE;
+static gchar *tuner_file = NULL;
+static GKeyFile *tuner_cache = NULL;
+static GHashTable *tuned_keys = NULL;
+
+
+static gchar *
+get_cache_dir (void)
+{
+    gchar *path;
+    const gchar *dir;
+
+    dir = g_getenv ("UFO_TUNE_CACHE_DIR");
+
+    /* An empty value disables tuning altogether */
+    if (dir != NULL && dir[0] == '\0')
+        return NULL;
+
+    path = dir != NULL ? g_strdup (dir) : g_build_filename (g_get_user_cache_dir (), "ufo", "tune", NULL);
+
+    if (g_mkdir_with_parents (path, 0755) != 0) {
+        g_warning ("Could not create tuning cache directory `%s'", path);
+        g_free (path);
+        return NULL;
+    }
+
+    return path;
+}
+
+static void
+initialize (void)
+{
+    gchar *dir;
+
+    tuner_initialized = TRUE;
+    dir = get_cache_dir ();
+
+    if (dir == NULL)
+        return;
+
+    tuner_file = g_build_filename (dir, CACHE_FILENAME, NULL);
+    tuner_cache = g_key_file_new ();
+    tuned_keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_key_file_load_from_file (tuner_cache, tuner_file, G_KEY_FILE_NONE, NULL);
+    g_free (dir);
+}
+
+static gchar *
+get_device_group (cl_device_id device)
+{
+    gchar name[256] = {0};
+    gchar driver[256] = {0};
+
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DEVICE_NAME, sizeof (name) - 1, name, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DRIVER_VERSION, sizeof (driver) - 1, driver, NULL));
+
+    /* Brackets would end the group header */
+    return g_strdelimit (g_strdup_printf ("%s / %s", g_strstrip (name), g_strstrip (driver)), "[]", '_');
+}
+
+static gchar *
+get_build_options (cl_kernel kernel, cl_device_id device)
+{
+    cl_program program;
+    gchar *options;
+    gsize size;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetKernelInfo (kernel, CL_KERNEL_PROGRAM, sizeof (cl_program), &program, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetProgramBuildInfo (program, device, CL_PROGRAM_BUILD_OPTIONS, 0, NULL, &size));
+    options = g_malloc0 (size + 1);
+    UFO_RESOURCES_CHECK_CLERR (clGetProgramBuildInfo (program, device, CL_PROGRAM_BUILD_OPTIONS, size, options, NULL));
+
+    return g_strstrip (options);
+}
+
+static gchar *
+get_kernel_key (cl_kernel kernel, cl_device_id device, guint n_dims, const gsize *global_work_size)
+{
+    gchar name[256] = {0};
+    gchar *options;
+    cl_uint n_args;
+    GString *key;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetKernelInfo (kernel, CL_KERNEL_FUNCTION_NAME, sizeof (name) - 1, name, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetKernelInfo (kernel, CL_KERNEL_NUM_ARGS, sizeof (cl_uint), &n_args, NULL));
+
+    /* The argument count tells apart equally named kernels from different files */
+    key = g_string_new (NULL);
+    g_string_printf (key, "%s/%u/", name, n_args);
+
+    /*
+     * The local size must divide the global size, so a choice only holds for
+     * the exact size it was tuned for.
+     */
+    for (guint i = 0; i < n_dims; i++)
+        g_string_append_printf (key, i == 0 ? "%zu" : "x%zu", global_work_size[i]);
+
+    /* Options such as the box size of the median change the kernel, they
+     * may contain '=' which is not allowed in keys, so only a digest is kept */
+    options = get_build_options (kernel, device);
+
+    if (options[0] != '\0') {
+        gchar *digest = g_compute_checksum_for_string (G_CHECKSUM_SHA1, options, -1);
+
+        g_string_append_printf (key, "/%.12s", digest);
+        g_free (digest);
+    }
+
+    g_free (options);
+    return g_string_free (key, FALSE);
+}
+
+static gboolean
+parse_choice (const gchar *value, guint n_dims, Choice *choice)
+{
+    gchar **parts;
+    gboolean valid;
+
+    choice->n_dims = 0;
+
+    if (g_strcmp0 (value, DEFAULT_CHOICE) == 0)
+        return TRUE;
+
+    parts = g_strsplit (value, ",", -1);
+    valid = g_strv_length (parts) == n_dims;
+
+    for (guint i = 0; valid && i < n_dims; i++) {
+        choice->local[i] = (gsize) g_ascii_strtoull (parts[i], NULL, 10);
+        valid = choice->local[i] > 0;
+    }
+
+    if (valid)
+        choice->n_dims = n_dims;
+
+    g_strfreev (parts);
+    return valid;
+}
+
+static gchar *
+format_choice (Choice *choice)
+{
+    GString *value;
+
+    if (choice->n_dims == 0)
+        return g_strdup (DEFAULT_CHOICE);
+
+    value = g_string_new (NULL);
+
+    for (guint i = 0; i < choice->n_dims; i++)
+        g_string_append_printf (value, i == 0 ? "%zu" : ",%zu", choice->local[i]);
+
+    return g_string_free (value, FALSE);
+}
+
+static GArray *
+make_candidates (cl_device_id device, cl_kernel kernel, guint n_dims, const gsize *global_work_size)
+{
+    static const gsize sizes[] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+    const guint n_sizes = G_N_ELEMENTS (sizes);
+    GArray *candidates;
+    gsize max_group_size;
+    gsize max_item_sizes[3] = {1, 1, 1};
+    gsize min_group_size;
+    guint n_combinations = 1;
+
+    UFO_RESOURCES_CHECK_CLERR (clGetKernelWorkGroupInfo (kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                                                         sizeof (gsize), &max_group_size, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                                                sizeof (max_item_sizes), max_item_sizes, NULL));
+
+    /* Groups smaller than a warp or wavefront are never worth timing */
+    min_group_size = MIN (32, max_group_size);
+    candidates = g_array_new (FALSE, FALSE, sizeof (Choice));
+
+    for (guint i = 0; i < n_dims; i++)
+        n_combinations *= n_sizes;
+
+    for (guint c = 0; c < n_combinations; c++) {
+        Choice choice = { .n_dims = n_dims, .local = {1, 1, 1} };
+        gsize product = 1;
+        gboolean valid = TRUE;
+        guint index = c;
+
+        for (guint i = 0; i < n_dims && valid; i++) {
+            gsize size = sizes[index % n_sizes];
+
+            index /= n_sizes;
+            choice.local[i] = size;
+            product *= size;
+
+            /* OpenCL 1.x requires the global size to be a multiple */
+            valid = size <= max_item_sizes[i] && size <= global_work_size[i] &&
+                    global_work_size[i] % size == 0 && (i < 2 || size <= 8);
+        }
+
+        if (valid && product >= min_group_size && product <= max_group_size)
+            g_array_append_val (candidates, choice);
+    }
+
+    return candidates;
+}
+
+static gdouble
+time_kernel (cl_command_queue queue, cl_kernel kernel, guint n_dims,
+             const gsize *global_work_size, const gsize *local_work_size, guint runs)
+{
+    GTimer *timer;
+    gdouble best = G_MAXDOUBLE;
+
+    timer = g_timer_new ();
+
+    for (guint i = 0; i < runs; i++) {
+        cl_int errcode;
+
+        g_timer_start (timer);
+        errcode = clEnqueueNDRangeKernel (queue, kernel, n_dims, NULL, global_work_size, local_work_size,
+                                          0, NULL, NULL);
+
+        /* Local sizes may still exceed the private or local memory budget */
+        if (errcode != CL_SUCCESS) {
+            best = -1.0;
+            break;
+        }
+
+        UFO_RESOURCES_CHECK_CLERR (clFinish (queue));
+        best = MIN (best, g_timer_elapsed (timer, NULL));
+    }
+
+    g_timer_destroy (timer);
+    return best;
+}
+
+static void
+tune (cl_command_queue queue, cl_device_id device, cl_kernel kernel,
+      guint n_dims, const gsize *global_work_size, Choice *best)
+{
+    GArray *candidates;
+    gdouble best_time;
+    guint runs;
+
+    UFO_RESOURCES_CHECK_CLERR (clFinish (queue));
+
+    /* Warm up and take the implementation's choice as the baseline */
+    time_kernel (queue, kernel, n_dims, global_work_size, NULL, 1);
+    best_time = time_kernel (queue, kernel, n_dims, global_work_size, NULL, MAX_RUNS);
+    best->n_dims = 0;
+
+    runs = best_time > SLOW_KERNEL ? 1 : MAX_RUNS;
+    candidates = make_candidates (device, kernel, n_dims, global_work_size);
+
+    for (guint i = 0; i < candidates->len; i++) {
+        Choice *choice = &g_array_index (candidates, Choice, i);
+        gdouble elapsed;
+
+        elapsed = time_kernel (queue, kernel, n_dims, global_work_size, choice->local, runs);
+
+        if (elapsed >= 0.0 && elapsed < best_time) {
+            best_time = elapsed;
+            *best = *choice;
+        }
+    }
+
+    g_array_free (candidates, TRUE);
+}
+
+static void
+store (const gchar *group, const gchar *key, Choice *choice)
+{
+    GKeyFile *current;
+    GError *error = NULL;
+    gchar *value;
+    gchar *data;
+    gsize length;
+
+    value = format_choice (choice);
+    g_key_file_set_string (tuner_cache, group, key, value);
+
+    /* Every plugin has its own copy of this state, merge with what others wrote */
+    current = g_key_file_new ();
+    g_key_file_load_from_file (current, tuner_file, G_KEY_FILE_KEEP_COMMENTS, NULL);
+    g_key_file_set_string (current, group, key, value);
+    data = g_key_file_to_data (current, &length, NULL);
+
+    if (!g_file_set_contents (tuner_file, data, length, &error)) {
+        g_warning ("Could not store tuned work group size: %s", error->message);
+        g_error_free (error);
+    }
+
+    g_free (data);
+    g_free (value);
+    g_key_file_free (current);
+}
+
+static gboolean
+get_choice (cl_command_queue queue, cl_kernel kernel, guint n_dims,
+            const gsize *global_work_size, Choice *choice)
+{
+    cl_device_id device;
+    gchar *group;
+    gchar *key;
+    gchar *value;
+    gboolean retune;
+
+    g_mutex_lock (&tuner_mutex);
+
+    if (!tuner_initialized)
+        initialize ();
+
+    if (tuner_cache == NULL) {
+        g_mutex_unlock (&tuner_mutex);
+        return FALSE;
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (queue, CL_QUEUE_DEVICE, sizeof (cl_device_id), &device, NULL));
+    group = get_device_group (device);
+    key = get_kernel_key (kernel, device, n_dims, global_work_size);
+    value = g_key_file_get_string (tuner_cache, group, key, NULL);
+    retune = g_getenv ("UFO_TUNE_FORCE") != NULL && !g_hash_table_contains (tuned_keys, key);
+
+    if (value == NULL || retune || !parse_choice (value, n_dims, choice)) {
+        gchar *tuned;
+
+        tune (queue, device, kernel, n_dims, global_work_size, choice);
+        store (group, key, choice);
+        g_hash_table_add (tuned_keys, g_strdup (key));
+
+        tuned = format_choice (choice);
+        g_debug ("Tuned %s on %s: %s", key, group, tuned);
+        g_free (tuned);
+    }
+
+    g_free (value);
+    g_free (key);
+    g_free (group);
+    g_mutex_unlock (&tuner_mutex);
+
+    return TRUE;
+}
+
+gboolean
+ufo_tuner_get_local_work_size (cl_command_queue queue,
+                               cl_kernel kernel,
+                               guint n_dims,
+                               gsize *global_work_size,
+                               gsize *local_work_size)
+{
+    Choice choice;
+
+    if (!get_choice (queue, kernel, n_dims, global_work_size, &choice) || choice.n_dims == 0)
+        return FALSE;
+
+    /* Guard against edited or stale cache entries, an invalid local size
+     * would make the launch fail and the kernel silently not run */
+    for (guint i = 0; i < n_dims; i++) {
+        if (global_work_size[i] % choice.local[i])
+            return FALSE;
+
+        local_work_size[i] = choice.local[i];
+    }
+
+    return TRUE;
+}
+
+void
+ufo_tuner_call (UfoProfiler *profiler,
+                cl_command_queue queue,
+                cl_kernel kernel,
+                guint n_dims,
+                gsize *global_work_size)
+{
+    gsize local_work_size[3];
+
+    if (ufo_tuner_get_local_work_size (queue, kernel, n_dims, global_work_size, local_work_size))
+        ufo_profiler_call (profiler, queue, kernel, n_dims, global_work_size, local_work_size);
+    else
+        ufo_profiler_call (profiler, queue, kernel, n_dims, global_work_size, NULL);
+}
+
+gchar *
+ufo_tuner_get_cache_file (void)
+{
+    gchar *dir;
+    gchar *path;
+
+    dir = get_cache_dir ();
+
+    if (dir == NULL)
+        return NULL;
+
+    path = g_build_filename (dir, CACHE_FILENAME, NULL);
+    g_free (dir);
+
+    return path;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UFO_TUNER_H
+#define UFO_TUNER_H
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <ufo/ufo.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Replacement for ufo_profiler_call() with a NULL local work size. On first
+ * use of a kernel with a given device, build options and global size, a set
+ * of local sizes is timed and the fastest is stored in
+ * $UFO_TUNE_CACHE_DIR/work-groups.ini (default $XDG_CACHE_HOME/ufo/tune) for
+ * subsequent runs. Because the kernel is run several times while tuning, it
+ * must not accumulate into or update its own input.
+ *
+ * Setting UFO_TUNE_CACHE_DIR to an empty string disables tuning, setting
+ * UFO_TUNE_FORCE re-tunes every kernel once per process.
+ *
+ * ufo_tuner_get_local_work_size() returns the same choice for launches that
+ * need an event wait list, FALSE means the implementation should pick one.
+ */
+void     ufo_tuner_call                 (UfoProfiler        *profiler,
+                                         cl_command_queue    queue,
+                                         cl_kernel           kernel,
+                                         guint               n_dims,
+                                         gsize              *global_work_size);
+gboolean ufo_tuner_get_local_work_size  (cl_command_queue    queue,
+                                         cl_kernel           kernel,
+                                         guint               n_dims,
+                                         gsize              *global_work_size,
+                                         gsize              *local_work_size);
+gchar   *ufo_tuner_get_cache_file       (void);
+
+G_END_DECLS
+
+#endif
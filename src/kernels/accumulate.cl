@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compensated summation, so that thousands of frames do not lose precision */
+kernel void
+accumulate_add (global const float *input,
+                global float *sum,
+                global float *compensation,
+                const int first)
+{
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+
+    if (first) {
+        sum[idx] = input[idx];
+        compensation[idx] = 0.0f;
+    }
+    else {
+        const float y = input[idx] - compensation[idx];
+        const float t = sum[idx] + y;
+
+        compensation[idx] = (t - sum[idx]) - y;
+        sum[idx] = t;
+    }
+}
+
+kernel void
+accumulate_scale (global float *sum,
+                  const float scale)
+{
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+
+    sum[idx] *= scale;
+}
+
+kernel void
+accumulate_min (global const float *input,
+                global float *result,
+                const int first)
+{
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+
+    result[idx] = first ? input[idx] : fmin (result[idx], input[idx]);
+}
+
+kernel void
+accumulate_max (global const float *input,
+                global float *result,
+                const int first)
+{
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+
+    result[idx] = first ? input[idx] : fmax (result[idx], input[idx]);
+}
+
+/* Running mean and sum of squared deviations of the first @count frames */
+kernel void
+accumulate_welford (global const float *input,
+                    global float *mean,
+                    global float *m2,
+                    const int count)
+{
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+    const float value = input[idx];
+    float delta;
+
+    if (count == 1) {
+        mean[idx] = value;
+        m2[idx] = 0.0f;
+        return;
+    }
+
+    delta = value - mean[idx];
+    mean[idx] += delta / count;
+    m2[idx] += delta * (value - mean[idx]);
+}
+
+static float
+get_key (float value, float center, int absolute)
+{
+    return absolute ? fabs (value - center) : value;
+}
+
+/*
+ * Select the value with the k-th smallest key from the column of a frame stack
+ * in place. Neighbouring work items access neighbouring pixels, so all
+ * accesses are coalesced.
+ */
+static float
+select_kth (global float *column,
+            size_t stride,
+            int n,
+            int k,
+            float center,
+            int absolute)
+{
+    int left = 0;
+    int right = n - 1;
+
+    while (left < right) {
+        const float pivot = get_key (column[((left + right) / 2) * stride], center, absolute);
+        int i = left;
+        int j = right;
+
+        do {
+            while (get_key (column[i * stride], center, absolute) < pivot)
+                i++;
+
+            while (pivot < get_key (column[j * stride], center, absolute))
+                j--;
+
+            if (i <= j) {
+                const float tmp = column[i * stride];
+
+                column[i * stride] = column[j * stride];
+                column[j * stride] = tmp;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+
+        if (j < k)
+            left = i;
+
+        if (k < i)
+            right = j;
+    }
+
+    return column[k * stride];
+}
+
+/*
+ * Median of @n stacked frames. With a positive @rejection, the result is the
+ * mean of all values within @rejection robust standard deviations (1.4826
+ * times the median absolute deviation) of the median.
+ */
+kernel void
+accumulate_median (global float *stack,
+                   global float *output,
+                   const int n,
+                   const float rejection)
+{
+    const size_t stride = get_global_size (0) * get_global_size (1);
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+    global float *column = stack + idx;
+    float median;
+    float threshold;
+    float sum = 0.0f;
+    int count = 0;
+
+    median = select_kth (column, stride, n, n / 2, 0.0f, 0);
+
+    if (n % 2 == 0) {
+        /* Everything below n / 2 is not larger, its maximum is the lower median */
+        float lower = column[0];
+
+        for (int i = 1; i < n / 2; i++)
+            lower = fmax (lower, column[i * stride]);
+
+        median = 0.5f * (median + lower);
+    }
+
+    if (rejection <= 0.0f || n < 3) {
+        output[idx] = median;
+        return;
+    }
+
+    threshold = rejection * 1.4826f * fabs (select_kth (column, stride, n, n / 2, median, 1) - median);
+
+    for (int i = 0; i < n; i++) {
+        const float value = column[i * stride];
+
+        if (fabs (value - median) <= threshold) {
+            sum += value;
+            count++;
+        }
+    }
+
+    output[idx] = count > 0 ? sum / count : median;
+}
@@ -34,11 +34,16 @@ backproject_nearest (global float *sinogram,
 {
     const int idx = get_global_id(0);
     const int idy = get_global_id(1);
+    const int idz = get_global_id(2);
     const int width = get_global_size(0);
     const float bx = idx - axis_pos + x_offset + 0.5f;
     const float by = idy - axis_pos + y_offset + 0.5f;
     float sum = 0.0f;
 
+    /* A batch of sinograms is reconstructed into as many slices */
+    sinogram += idz * n_projections * width;
+    slice += idz * width * get_global_size(1);
+
     for(int proj = 0; proj < n_projections; proj++) {
         float h = axis_pos + bx * cos_lut[angle_offset + proj] + by * sin_lut[angle_offset + proj];
         sum += sinogram[(int)(proj * width + h)];
@@ -78,3 +83,29 @@ backproject_tex (read_only image2d_t sinogram,
     slice[idy * get_global_size(0) + idx] = sum * M_PI_F / n_projections;
 }
 
+kernel void
+backproject_tex3d (read_only image3d_t sinograms,
+                   global float *slices,
+                   constant float *sin_lut,
+                   constant float *cos_lut,
+                   const unsigned int x_offset,
+                   const unsigned int y_offset,
+                   const unsigned int angle_offset,
+                   const unsigned int n_projections,
+                   const float axis_pos)
+{
+    const int idx = get_global_id(0);
+    const int idy = get_global_id(1);
+    const int idz = get_global_id(2);
+    const float bx = idx - axis_pos + x_offset + 0.5f;
+    const float by = idy - axis_pos + y_offset + 0.5f;
+    float sum = 0.0f;
+
+    /* Sampling at the center of a layer does not mix neighbouring sinograms */
+    for(int proj = 0; proj < n_projections; proj++) {
+        float h = by * sin_lut[angle_offset + proj] + bx * cos_lut[angle_offset + proj] + axis_pos;
+        sum += read_imagef (sinograms, volumeSampler, (float4)(h, proj + 0.5f, idz + 0.5f, 0.0f)).x;
+    }
+
+    slices[(idz * get_global_size(1) + idy) * get_global_size(0) + idx] = sum * M_PI_F / n_projections;
+}
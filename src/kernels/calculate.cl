@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2011-2014 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Partial sum, minimum and maximum of @n values, one triple per work group.
+ * @scratch must hold three floats per work item and the work group size must
+ * be a power of two.
+ */
+kernel void
+calculate_reduce (global const float *input,
+                  global float *partials,
+                  const ulong n,
+                  local float *scratch)
+{
+    const int lid = get_local_id (0);
+    const int size = get_local_size (0);
+    local float *sums = scratch;
+    local float *lows = scratch + size;
+    local float *highs = scratch + 2 * size;
+    float sum = 0.0f;
+    float low = INFINITY;
+    float high = -INFINITY;
+
+    for (size_t i = get_global_id (0); i < n; i += get_global_size (0)) {
+        const float value = input[i];
+
+        sum += value;
+        low = fmin (low, value);
+        high = fmax (high, value);
+    }
+
+    sums[lid] = sum;
+    lows[lid] = low;
+    highs[lid] = high;
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = size / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            sums[lid] += sums[lid + stride];
+            lows[lid] = fmin (lows[lid], lows[lid + stride]);
+            highs[lid] = fmax (highs[lid], highs[lid + stride]);
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        partials[3 * get_group_id (0)] = sums[0];
+        partials[3 * get_group_id (0) + 1] = lows[0];
+        partials[3 * get_group_id (0) + 2] = highs[0];
+    }
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Center of rotation by cross-correlating sinogram rows with the mirrored rows
+ * taken 180 degrees later. Each pair is packed into one complex row (first row
+ * real, mirrored row imaginary) so that one FFT yields both spectra. All
+ * kernels are run with one work group of BLOCK_SIZE items per pair.
+ */
+
+#define BLOCK_SIZE 128
+
+kernel void
+cor_pack (global float *sinogram,
+          global float2 *packed,
+          const int width,
+          const int offset,
+          const int padded_width)
+{
+    local float sums[2][BLOCK_SIZE];
+    const int lid = get_local_id (0);
+    const int pair = get_group_id (1);
+    global float *first = sinogram + pair * width;
+    global float *second = sinogram + (pair + offset) * width;
+    float mean_first = 0.0f;
+    float mean_second = 0.0f;
+
+    for (int x = lid; x < width; x += BLOCK_SIZE) {
+        mean_first += first[x];
+        mean_second += second[x];
+    }
+
+    sums[0][lid] = mean_first;
+    sums[1][lid] = mean_second;
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = BLOCK_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            sums[0][lid] += sums[0][lid + stride];
+            sums[1][lid] += sums[1][lid + stride];
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    /* Without the mean the zero padding would bias the peak towards zero shift */
+    mean_first = sums[0][0] / width;
+    mean_second = sums[1][0] / width;
+
+    for (int x = lid; x < padded_width; x += BLOCK_SIZE) {
+        packed[pair * padded_width + x] = x < width ?
+            (float2) (first[x] - mean_first, second[width - 1 - x] - mean_second) :
+            (float2) (0.0f, 0.0f);
+    }
+}
+
+kernel void
+cor_cross_spectrum (global float2 *spectrum,
+                    global float2 *cross)
+{
+    const int idx = get_global_id (0);
+    const int pair = get_global_id (1);
+    const int padded_width = get_global_size (0);
+    const float2 z = spectrum[pair * padded_width + idx];
+    const float2 z_mirror = spectrum[pair * padded_width + (padded_width - idx) % padded_width];
+    /* Separate the spectra of the real and imaginary input */
+    const float2 a = 0.5f * (float2) (z.x + z_mirror.x, z.y - z_mirror.y);
+    const float2 b = 0.5f * (float2) (z.y + z_mirror.y, z_mirror.x - z.x);
+
+    /* a * conj (b) */
+    cross[pair * padded_width + idx] = (float2) (a.x * b.x + a.y * b.y, a.y * b.x - a.x * b.y);
+}
+
+kernel void
+cor_peak (global float2 *correlation,
+          global float4 *peaks,
+          const int max_shift,
+          const int padded_width)
+{
+    local float values[BLOCK_SIZE];
+    local int indices[BLOCK_SIZE];
+    const int lid = get_local_id (0);
+    const int pair = get_group_id (1);
+    global float2 *row = correlation + pair * padded_width;
+    float best = -INFINITY;
+    int best_index = 0;
+
+    for (int shift = lid - max_shift; shift <= max_shift; shift += BLOCK_SIZE) {
+        const int index = (shift + padded_width) % padded_width;
+
+        if (row[index].x > best) {
+            best = row[index].x;
+            best_index = index;
+        }
+    }
+
+    values[lid] = best;
+    indices[lid] = best_index;
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = BLOCK_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride && values[lid + stride] > values[lid]) {
+            values[lid] = values[lid + stride];
+            indices[lid] = indices[lid + stride];
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        const int index = indices[0];
+
+        /* Neighbours for the sub-pixel fit on the host */
+        peaks[pair] = (float4) ((float) index,
+                                row[(index + padded_width - 1) % padded_width].x,
+                                row[index].x,
+                                row[(index + 1) % padded_width].x);
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feldkamp-Davis-Kress reconstruction. Detector coordinates are in pixels with
+ * pixel i covering [i, i + 1), volume coordinates in voxels relative to the
+ * rotation axis and the central plane.
+ */
+
+kernel void
+fdk_weight (global float *projection,
+            global float2 *padded,
+            const int width,
+            const float2 center,
+            const float focal_length)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int padded_width = get_global_size (0);
+    float value = 0.0f;
+
+    if (idx < width) {
+        const float u = idx + 0.5f - center.x;
+        const float v = idy + 0.5f - center.y;
+
+        value = projection[idy * width + idx] * focal_length * rsqrt (focal_length * focal_length + u * u + v * v);
+    }
+
+    padded[idy * padded_width + idx] = (float2) (value, 0.0f);
+}
+
+kernel void
+fdk_store (global float2 *padded,
+           global float *filtered,
+           const int padded_width,
+           const float scale)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+
+    filtered[idy * get_global_size (0) + idx] = padded[idy * padded_width + idx].x * scale;
+}
+
+/*
+ * Backproject @burst filtered projections which are stacked vertically in
+ * @projections, each followed by one row of zeros so that linear
+ * interpolation does not mix neighbouring projections.
+ */
+kernel void
+fdk_backproject (read_only image2d_t projections,
+                 sampler_t sampler,
+                 global float *volume,
+                 const int3 size,
+                 const float2 x_region,
+                 const float2 y_region,
+                 const float2 z_region,
+                 global float2 *trig,
+                 const int burst,
+                 const int block_height,
+                 const float source_distance,
+                 const float focal_length,
+                 const float2 center,
+                 const int cumulate)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int idz = get_global_id (2);
+    float sum = 0.0f;
+
+    if (idx >= size.x || idy >= size.y || idz >= size.z)
+        return;
+
+    const float x = x_region.x + (idx + 0.5f) * x_region.y;
+    const float y = y_region.x + (idy + 0.5f) * y_region.y;
+    const float z = z_region.x + (idz + 0.5f) * z_region.y;
+
+    for (int i = 0; i < burst; i++) {
+        const float2 cs = trig[i];
+        const float s = x * cs.x + y * cs.y;
+        const float t = y * cs.x - x * cs.y;
+        const float distance = source_distance + t;
+        const float magnification = focal_length / distance;
+        const float u = s * magnification + center.x;
+        const float v = z * magnification + center.y;
+        const float weight = source_distance / distance;
+
+        if (v > -1.0f && v < block_height - 1.0f)
+            sum += weight * weight * read_imagef (projections, sampler, (float2) (u, v + i * block_height)).x;
+    }
+
+    const size_t index = ((size_t) idz * size.y + idy) * size.x + idx;
+
+    if (cumulate)
+        volume[index] += sum;
+    else
+        volume[index] = sum;
+}
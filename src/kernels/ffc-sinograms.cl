@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flat-field correct one projection and store row y as row @index of
+ * sinogram y in the stack of @n_projections high sinograms.
+ */
+static void
+correct_into_sinograms (float value,
+                        global const float *dark,
+                        global const float *flat,
+                        global float *sinograms,
+                        const int index,
+                        const int n_projections,
+                        const int absorptivity,
+                        const int fix_abnormal,
+                        const float dark_scale)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int width = get_global_size (0);
+    const int pixel = idy * width + idx;
+    const float cdark = dark[pixel] * dark_scale;
+    float result;
+
+    if (absorptivity)
+        result = log ((flat[pixel] - cdark) / (value - cdark));
+    else
+        result = (value - cdark) / (flat[pixel] - cdark);
+
+    if (fix_abnormal && (isnan (result) || isinf (result)))
+        result = 0.0f;
+
+    sinograms[((size_t) idy * n_projections + index) * width + idx] = result;
+}
+
+kernel void
+ffc_sinograms (global const float *projection,
+               global const float *dark,
+               global const float *flat,
+               global float *sinograms,
+               const int index,
+               const int n_projections,
+               const int absorptivity,
+               const int fix_abnormal,
+               const float dark_scale)
+{
+    correct_into_sinograms (projection[get_global_id (1) * get_global_size (0) + get_global_id (0)],
+                            dark, flat, sinograms, index, n_projections,
+                            absorptivity, fix_abnormal, dark_scale);
+}
+
+kernel void
+ffc_sinograms_16 (global const ushort *projection,
+                  global const float *dark,
+                  global const float *flat,
+                  global float *sinograms,
+                  const int index,
+                  const int n_projections,
+                  const int absorptivity,
+                  const int fix_abnormal,
+                  const float dark_scale)
+{
+    correct_into_sinograms ((float) projection[get_global_id (1) * get_global_size (0) + get_global_id (0)],
+                            dark, flat, sinograms, index, n_projections,
+                            absorptivity, fix_abnormal, dark_scale);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "accumulate.cl"
+
+/* Must match the Mode enum of ufo-flatten-task.c */
+#define MODE_MIN            1
+#define MODE_MAX            2
+#define MODE_SUM            3
+#define MODE_MEDIAN         4
+#define MODE_PERCENTILE     5
+#define MODE_TRIMMED_MEAN   6
+
+/*
+ * Reduce the @n frames of @stack pixel-wise. The selecting modes reorder the
+ * columns of @stack in place.
+ */
+kernel void
+flatten (global float *stack,
+         global float *output,
+         const int n,
+         const int mode,
+         const float percentile,
+         const float trim)
+{
+    const size_t stride = get_global_size (0) * get_global_size (1);
+    const size_t idx = get_global_id (1) * get_global_size (0) + get_global_id (0);
+    global float *column = stack + idx;
+    float result = column[0];
+
+    if (mode == MODE_MIN) {
+        for (int i = 1; i < n; i++)
+            result = fmin (result, column[i * stride]);
+    }
+    else if (mode == MODE_MAX) {
+        for (int i = 1; i < n; i++)
+            result = fmax (result, column[i * stride]);
+    }
+    else if (mode == MODE_SUM) {
+        for (int i = 1; i < n; i++)
+            result += column[i * stride];
+    }
+    else if (mode == MODE_MEDIAN || mode == MODE_PERCENTILE) {
+        /* The median is the upper middle value for an even n, not interpolated */
+        const float rank = mode == MODE_MEDIAN ? n / 2 : percentile / 100.0f * (n - 1);
+        const int k = (int) rank;
+        const float fraction = rank - k;
+
+        result = select_kth (column, stride, n, k, 0.0f, 0);
+
+        if (fraction > 0.0f && k + 1 < n) {
+            /* Everything above k is not smaller, its minimum is the next value */
+            float next = column[(k + 1) * stride];
+
+            for (int i = k + 2; i < n; i++)
+                next = fmin (next, column[i * stride]);
+
+            result += fraction * (next - result);
+        }
+    }
+    else if (mode == MODE_TRIMMED_MEAN) {
+        const int k = min ((int) (trim * n), (n - 1) / 2);
+        float sum = 0.0f;
+
+        if (k > 0) {
+            select_kth (column, stride, n, k, 0.0f, 0);
+            select_kth (column + k * stride, stride, n - k, n - 1 - 2 * k, 0.0f, 0);
+        }
+
+        for (int i = k; i < n - k; i++)
+            sum += column[i * stride];
+
+        result = sum / (n - 2 * k);
+    }
+
+    output[idx] = result;
+}
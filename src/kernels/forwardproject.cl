@@ -17,42 +17,67 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef ANGLES_PER_ITEM
+#define ANGLES_PER_ITEM 8
+#endif
+
+#include "joseph.cl"
+
 constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
                              CLK_ADDRESS_CLAMP |
                              CLK_FILTER_LINEAR;
 
-kernel void
-forwardproject(read_only image2d_t slice,
-               global float *sinogram,
-               float angle_step)
+/* The texture unit interpolates between the pixels of a line */
+static float
+project (read_only image2d_t slice,
+         const float s,
+         const float c,
+         const float sn,
+         const float center_x,
+         const float center_y)
 {
-    const int idx = get_global_id(0);
-    const int idy = get_global_id(1);
-    const int slice_width = get_global_size(0);
-
-    const float angle = idy * angle_step;
-    /* radius of object circle */
-    const float r = slice_width / 2.0f;
-    /* positive/negative distance from detector center */
-    const float d = idx - r;
-    /* length of the cut through the circle */
-    const float l = sqrt(4.0f*r*r - 4.0f*d*d);
-
-    /* vector in detector direction */
-    float2 D = (float2) (cos(angle), sin(angle));
-    D = normalize(D);
-
-    /* vector perpendicular to the detector */
-    const float2 N = (float2) (D.y, -D.x);
-
-    /* sample point in the circle traveling along N */
-    float2 sample = d * D - l/2.0f * N + ((float2) (r, r));
+    const JosephRay ray = joseph_ray (s, c, sn, get_image_width (slice), get_image_height (slice),
+                                      center_x, center_y);
     float sum = 0.0f;
 
-    for (int i = 0; i < l; i++) {
-        sum += read_imagef(slice, sampler, sample).x;
-        sample += N;
-    }
+    for (int line = ray.first; line <= ray.last; line++)
+        sum += read_imagef (slice, sampler, joseph_position (&ray, line)).x;
+
+    return sum * ray.scale;
+}
+
+/*
+ * Every work item computes one detector pixel for ANGLES_PER_ITEM angles, the
+ * sines and cosines of which the work group shares in local memory. Requires
+ * a local size of at least ANGLES_PER_ITEM in the first dimension and one in
+ * the second.
+ */
+kernel void
+forwardproject (read_only image2d_t slice,
+                global float *sinogram,
+                global const float *sin_lut,
+                global const float *cos_lut,
+                const int n_angles,
+                const int det_width,
+                const float axis_pos,
+                const float center_x,
+                const float center_y)
+{
+    local float2 lut[ANGLES_PER_ITEM];
+    const int idx = get_global_id (0);
+    const int lid = get_local_id (0);
+    const int first_angle = get_global_id (1) * ANGLES_PER_ITEM;
+    const int count = min (ANGLES_PER_ITEM, n_angles - first_angle);
+    const float s = idx + 0.5f - axis_pos;
+
+    if (lid < count)
+        lut[lid] = (float2) (cos_lut[first_angle + lid], sin_lut[first_angle + lid]);
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    if (idx >= det_width)
+        return;
 
-    sinogram[idy * slice_width + idx] = sum;
+    for (int i = 0; i < count; i++)
+        sinogram[(first_angle + i) * det_width + idx] = project (slice, s, lut[i].x, lut[i].y, center_x, center_y);
 }
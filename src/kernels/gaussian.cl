@@ -17,6 +17,10 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Separable convolution with 2 * half_num_weights + 1 weights, pixels outside
+ * the frame are replaced by the nearest border pixel.
+ */
 kernel void
 h_gaussian (global float *input,
             global float *output,
@@ -26,14 +30,11 @@ h_gaussian (global float *input,
     const int x = get_global_id(0);
     const int y = get_global_id(1);
     const int width = get_global_size(0);
-    const int height = get_global_size(1);
-
-    const int from = max(0, x - half_num_weights);
-    const int to = min(width, x + half_num_weights);
+    global float *row = input + y * width;
     float sum = 0.0f;
 
-    for (int i = from; i < to; i++)
-        sum += input[y * width + i] * weights[i - from];
+    for (int i = -half_num_weights; i <= half_num_weights; i++)
+        sum += row[clamp (x + i, 0, width - 1)] * weights[i + half_num_weights];
 
     output[y * width + x] = sum;
 }
@@ -48,12 +49,53 @@ v_gaussian (global float *input,
     const int y = get_global_id(1);
     const int width = get_global_size(0);
     const int height = get_global_size(1);
-
-    const int from = max(0, y - half_num_weights);
-    const int to = min(height, y + half_num_weights);
     float sum = 0.0f;
-    for (int i = from; i < to; i++)
-        sum += input[i * width + x] * weights[i - from];
+
+    for (int i = -half_num_weights; i <= half_num_weights; i++)
+        sum += input[clamp (y + i, 0, height - 1) * width + x] * weights[i + half_num_weights];
 
     output[y * width + x] = sum;
 }
+
+/*
+ * Third order recursive Gaussian along the columns, one work item
+ * per column so that neighbouring work items access neighbouring pixels. The
+ * causal pass starts from the steady state of the first pixel, the
+ * anti-causal one from that of the last causal result. The cost does not
+ * depend on sigma. Rows are filtered by transposing and filtering columns.
+ */
+kernel void
+iir_columns (global const float *input,
+             global float *output,
+             const int width,
+             const int height,
+             const float b,
+             const float b1,
+             const float b2,
+             const float b3)
+{
+    const int x = get_global_id (0);
+    float w1, w2, w3;
+
+    w1 = w2 = w3 = input[x];
+
+    for (int y = 0; y < height; y++) {
+        const float w = b * input[y * width + x] + b1 * w1 + b2 * w2 + b3 * w3;
+
+        output[y * width + x] = w;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+    }
+
+    w2 = w3 = w1;
+
+    for (int y = height - 1; y >= 0; y--) {
+        const float w = b * output[y * width + x] + b1 * w1 + b2 * w2 + b3 * w3;
+
+        output[y * width + x] = w;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+    }
+}
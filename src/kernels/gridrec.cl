@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Gridding reconstruction. Two real sinograms are packed into the real and
+ * imaginary part of one complex sinogram, so that a single pass reconstructs
+ * two slices. All spectra are stored in FFT order, i.e. frequency k < 0 is
+ * found at index k + N.
+ */
+
+kernel void
+gridrec_spread (global float *sinogram,
+                global float2 *projections,
+                const int width,
+                const ulong offset,
+                const int pair,
+                const int center)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int padded_width = get_global_size (0);
+    const int t = (idx < padded_width / 2 ? idx : idx - padded_width) + center;
+    float2 value = (float2) (0.0f, 0.0f);
+
+    if (t >= 0 && t < width) {
+        /* Sinograms are offset by width * number of angles */
+        global float *first = sinogram + offset + idy * width;
+
+        value.x = first[t];
+
+        if (pair)
+            value.y = first[(size_t) width * get_global_size (1) + t];
+    }
+
+    projections[idy * padded_width + idx] = value;
+}
+
+kernel void
+gridrec_filter (global float2 *projections,
+                const float shift,
+                const float scale)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int padded_width = get_global_size (0);
+    const int k = idx < padded_width / 2 ? idx : idx - padded_width;
+    const float ramp = (k == 0 ? 0.25f : fabs ((float) k)) * scale / padded_width;
+    const float phase = 2.0f * M_PI_F * k * shift / padded_width;
+    const float c = cos (phase);
+    const float s = sin (phase);
+    const float2 p = projections[idy * padded_width + idx];
+
+    projections[idy * padded_width + idx] = ramp * (float2) (p.x * c - p.y * s, p.x * s + p.y * c);
+}
+
+kernel void
+gridrec_grid (global float2 *projections,
+              global float2 *grid,
+              global float *sin_lut,
+              global float *cos_lut,
+              global float *kernel_lut,
+              const float lut_scale,
+              const float half_width,
+              const int n_angles,
+              const float angle_step,
+              const float angle_offset,
+              const float shift)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int size = get_global_size (0);
+    const float u = idx < size / 2 ? idx : idx - size;
+    const float v = idy < size / 2 ? idy : idy - size;
+    const float r = hypot (u, v);
+    const float search = half_width * M_SQRT2_F;
+    const float range = n_angles * angle_step;
+    float2 sum = (float2) (0.0f, 0.0f);
+
+    if (r < size / 2 + search) {
+        /* Only rays passing within the kernel support contribute */
+        const float alpha = r > search ? asin (search / r) : M_PI_2_F;
+        float phi = atan2 (v, u) - angle_offset;
+
+        phi = phi - floor (phi / (2.0f * M_PI_F)) * 2.0f * M_PI_F;
+
+        /* Every line through the origin is hit at phi and phi + pi */
+        for (float s = -M_PI_F; phi + s - alpha < range; s += M_PI_F) {
+            const int lo = max (0, (int) ceil ((phi + s - alpha) / angle_step));
+            const int hi = min (n_angles, (int) ceil ((phi + s + alpha) / angle_step));
+
+            for (int j = lo; j < hi; j++) {
+                const float c = cos_lut[j];
+                const float sn = sin_lut[j];
+                const float k = u * c + v * sn;
+                const int k_lo = max ((int) ceil (k - search), -size / 2);
+                const int k_hi = min ((int) floor (k + search), size / 2 - 1);
+
+                for (int ks = k_lo; ks <= k_hi; ks++) {
+                    const float du = fabs (u - ks * c);
+                    const float dv = fabs (v - ks * sn);
+
+                    if (du < half_width && dv < half_width) {
+                        const float w = kernel_lut[(int) (du * lut_scale)] * kernel_lut[(int) (dv * lut_scale)];
+                        sum += w * projections[j * size + (ks < 0 ? ks + size : ks)];
+                    }
+                }
+            }
+        }
+
+        /* Shift the reconstruction so that pixels are centered like in backproject */
+        {
+            const float phase = 2.0f * M_PI_F * (u + v) * shift / size;
+            const float c = cos (phase);
+            const float sn = sin (phase);
+
+            sum = (float2) (sum.x * c - sum.y * sn, sum.x * sn + sum.y * c);
+        }
+    }
+
+    grid[idy * size + idx] = sum;
+}
+
+kernel void
+gridrec_crop (global float2 *image,
+              global float *slices,
+              global float *deapodization,
+              const int size,
+              const ulong offset,
+              const int pair)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int width = get_global_size (0);
+    const int x = idx - width / 2;
+    const int y = idy - width / 2;
+    const float2 value = image[((y + size) % size) * size + (x + size) % size];
+    const float weight = deapodization[idx] * deapodization[idy] / size;
+
+    global float *first = slices + offset + idy * width;
+
+    first[idx] = value.x * weight;
+
+    if (pair)
+        first[(size_t) width * width + idx] = value.y * weight;
+}
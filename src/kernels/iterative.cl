@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Projector pair and vector operations for the iterative reconstruction. The
+ * slice is square with the rotation axis at axis_pos in both directions, the
+ * backward projector is the exact transpose of the forward projector, which
+ * CGLS requires to converge to the least-squares solution.
+ */
+
+#include "joseph.cl"
+
+static float
+project (global const float *volume,
+         const int width,
+         const float s,
+         const float c,
+         const float sn,
+         const float axis_pos)
+{
+    const JosephRay ray = joseph_ray (s, c, sn, width, width, axis_pos, axis_pos);
+    const int stride = ray.rows ? 1 : width;
+    float sum = 0.0f;
+
+    for (int line = ray.first; line <= ray.last; line++) {
+        const float position = ray.start + line * ray.step - 0.5f;
+        const int i = (int) floor (position);
+        const float w = position - i;
+        global const float *base = volume + (ray.rows ? line * width : line);
+
+        if (i >= 0 && i < width)
+            sum += (1.0f - w) * base[i * stride];
+
+        if (i + 1 >= 0 && i + 1 < width)
+            sum += w * base[(i + 1) * stride];
+    }
+
+    return sum * ray.scale;
+}
+
+kernel void
+ir_forward (global const float *volume,
+            global float *sinogram,
+            global const float *sin_lut,
+            global const float *cos_lut,
+            const int width,
+            const int angle_start,
+            const float axis_pos)
+{
+    const int idx = get_global_id (0);
+    const int angle = angle_start + get_global_id (1);
+    const int det_width = get_global_size (0);
+
+    sinogram[angle * det_width + idx] = project (volume, width, idx + 0.5f - axis_pos,
+                                                 cos_lut[angle], sin_lut[angle], axis_pos);
+}
+
+kernel void
+ir_backward (global const float *sinogram,
+             global float *volume,
+             global const float *sin_lut,
+             global const float *cos_lut,
+             const int det_width,
+             const int angle_start,
+             const int n_angles,
+             const float axis_pos)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int width = get_global_size (0);
+    const float x = idx + 0.5f - axis_pos;
+    const float y = idy + 0.5f - axis_pos;
+    float sum = 0.0f;
+
+    for (int angle = angle_start; angle < angle_start + n_angles; angle++)
+        sum += joseph_adjoint (sinogram + angle * det_width, det_width, axis_pos,
+                               cos_lut[angle], sin_lut[angle], x, y);
+
+    volume[idy * width + idx] = sum;
+}
+
+/*
+ * SART in two passes per projection: the weighted residual of the projection
+ * and the update of the slice with its backprojection.
+ */
+kernel void
+ir_sart_residual (global const float *volume,
+                  global const float *measured,
+                  global const float *row_weights,
+                  global float *residual,
+                  global const float *sin_lut,
+                  global const float *cos_lut,
+                  const int width,
+                  const int angle,
+                  const float axis_pos)
+{
+    const int idx = get_global_id (0);
+    const int index = angle * get_global_size (0) + idx;
+    const float projected = project (volume, width, idx + 0.5f - axis_pos,
+                                     cos_lut[angle], sin_lut[angle], axis_pos);
+
+    residual[index] = (measured[index] - projected) * row_weights[index];
+}
+
+kernel void
+ir_sart_update (global float *volume,
+                global const float *residual,
+                global const float *sin_lut,
+                global const float *cos_lut,
+                const int det_width,
+                const int angle,
+                const float axis_pos,
+                const float relaxation,
+                const int positivity)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int index = idy * get_global_size (0) + idx;
+    const float correction = joseph_adjoint (residual + angle * det_width, det_width, axis_pos,
+                                             cos_lut[angle], sin_lut[angle],
+                                             idx + 0.5f - axis_pos, idy + 0.5f - axis_pos);
+    const float value = volume[index] + relaxation * correction;
+
+    volume[index] = positivity ? max (value, 0.0f) : value;
+}
+
+kernel void
+ir_set (global float *data,
+        const float value)
+{
+    data[get_global_id (0)] = value;
+}
+
+kernel void
+ir_invert (global float *data)
+{
+    const int idx = get_global_id (0);
+    const float value = data[idx];
+
+    data[idx] = value > 1e-6f ? 1.0f / value : 0.0f;
+}
+
+kernel void
+ir_residual (global const float *measured,
+             global const float *projected,
+             global float *residual,
+             const int offset)
+{
+    const int idx = offset + get_global_id (0);
+
+    residual[idx] = measured[idx] - projected[idx];
+}
+
+kernel void
+ir_multiply (global float *data,
+             global const float *weights,
+             const int offset)
+{
+    const int idx = offset + get_global_id (0);
+
+    data[idx] *= weights[idx];
+}
+
+kernel void
+ir_update (global float *volume,
+           global const float *correction,
+           global const float *weights,
+           const float relaxation,
+           const int positivity)
+{
+    const int idx = get_global_id (0);
+    const float value = volume[idx] + relaxation * weights[idx] * correction[idx];
+
+    volume[idx] = positivity ? max (value, 0.0f) : value;
+}
+
+/* y = y + a * x */
+kernel void
+ir_axpy (global float *y,
+         global const float *x,
+         const float a)
+{
+    const int idx = get_global_id (0);
+
+    y[idx] += a * x[idx];
+}
+
+/* y = x + b * y */
+kernel void
+ir_xpby (global float *y,
+         global const float *x,
+         const float b)
+{
+    const int idx = get_global_id (0);
+
+    y[idx] = x[idx] + b * y[idx];
+}
+
+/* Partial dot products, one per work group, summed up on the host */
+kernel void
+ir_dot (global const float *a,
+        global const float *b,
+        global float *partial,
+        local float *scratch,
+        const int n)
+{
+    const int lid = get_local_id (0);
+    float sum = 0.0f;
+
+    for (int i = get_global_id (0); i < n; i += get_global_size (0))
+        sum += a[i] * b[i];
+
+    scratch[lid] = sum;
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = get_local_size (0) / 2; stride > 0; stride >>= 1) {
+        if (lid < stride)
+            scratch[lid] += scratch[lid + stride];
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0)
+        partial[get_group_id (0)] = scratch[0];
+}
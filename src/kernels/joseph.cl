@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Joseph's projector shared by forwardproject.cl and iterative.cl. A ray is
+ * sampled once per row, or per column if it is closer to horizontal, with
+ * linear interpolation between the two nearest pixels. Only the lines which
+ * the ray actually crosses are visited. Pixel (x, y) is at x + 0.5 - center_x
+ * relative to the rotation axis, just like in backproject.cl, and detector
+ * pixel d at d + 0.5 - axis_pos.
+ */
+
+typedef struct {
+    float start;    /* image coordinate along the line in line 0 */
+    float step;     /* increment of that coordinate per line */
+    float scale;    /* length of the ray segment within one line */
+    int first;
+    int last;
+    int rows;       /* lines are rows, otherwise columns */
+} JosephRay;
+
+/* Ray at detector coordinate @s and the angle with cosine @c and sine @sn */
+static JosephRay
+joseph_ray (const float s,
+            const float c,
+            const float sn,
+            const int width,
+            const int height,
+            const float center_x,
+            const float center_y)
+{
+    JosephRay ray;
+    int extent;
+
+    ray.rows = fabs (c) >= fabs (sn);
+    ray.first = 0;
+
+    if (ray.rows) {
+        ray.start = (s - (0.5f - center_y) * sn) / c + center_x;
+        ray.step = -sn / c;
+        ray.scale = 1.0f / fabs (c);
+        ray.last = height - 1;
+        extent = width;
+    }
+    else {
+        ray.start = (s - (0.5f - center_x) * c) / sn + center_y;
+        ray.step = -c / sn;
+        ray.scale = 1.0f / fabs (sn);
+        ray.last = width - 1;
+        extent = height;
+    }
+
+    if (fabs (ray.step) > 1e-6f) {
+        const float lo = (-0.5f - ray.start) / ray.step;
+        const float hi = (extent + 0.5f - ray.start) / ray.step;
+
+        ray.first = max (ray.first, (int) ceil (min (lo, hi)));
+        ray.last = min (ray.last, (int) floor (max (lo, hi)));
+    }
+    else if (ray.start <= -0.5f || ray.start >= extent + 0.5f) {
+        ray.last = -1;
+    }
+
+    return ray;
+}
+
+/* Image coordinates of the sample in @line, pixel centers are at i + 0.5 */
+static float2
+joseph_position (const JosephRay *ray, const int line)
+{
+    const float position = ray->start + line * ray->step;
+
+    return ray->rows ? (float2) (position, line + 0.5f) : (float2) (line + 0.5f, position);
+}
+
+/*
+ * Exact transpose of the projector for one angle, i.e. the weighted sum of the
+ * detector @row over all rays which sample the pixel at (@x, @y) relative to
+ * the axis. A ray samples the pixel with weight 1 - |u| where u is its offset
+ * along the line, which is (d - d0) / m for the detector pixel d, the
+ * projection d0 of the pixel center and the larger m of |cos| and |sin|.
+ */
+static float
+joseph_adjoint (global const float *row,
+                const int det_width,
+                const float axis_pos,
+                const float c,
+                const float sn,
+                const float x,
+                const float y)
+{
+    const float m = max (fabs (c), fabs (sn));
+    const float d0 = x * c + y * sn + axis_pos - 0.5f;
+    const int first = max ((int) ceil (d0 - m), 0);
+    const int last = min ((int) floor (d0 + m), det_width - 1);
+    float sum = 0.0f;
+
+    for (int d = first; d <= last; d++)
+        sum += (1.0f - fabs (d - d0) / m) * row[d];
+
+    return sum / m;
+}
@@ -17,62 +17,150 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* These kernels assume that MEDIAN_BOX_SIZE is defined! */
-#ifndef MEDIAN_BOX_SIZE
-0   /* Hope the compilers complain about that */
-#endif
+/*
+ * Both kernels take the window size at run time, so that the program is built
+ * only once, and clamp the window at the frame borders.
+ */
 
-kernel void
-filter_inner (global float *input,
-              global float *output)
+/* Largest window handled by median_small */
+#define SMALL_MAX_SIZE      7
+#define SMALL_BUFFER_SIZE   (SMALL_MAX_SIZE * SMALL_MAX_SIZE / 2 + 2)
+
+static float
+fetch (global const float *input, int x, int y, int width, int height)
 {
-    const int HALF_SIZE = (MEDIAN_BOX_SIZE - 1) / 2;
+    return input[clamp (y, 0, height - 1) * width + clamp (x, 0, width - 1)];
+}
 
-    /* Shift by half the median size to get correct index */
-    int idx = get_global_id(0) + HALF_SIZE;
-    int idy = get_global_id(1) + HALF_SIZE;
+/* Remove the smallest and the largest of the first *count values */
+static void
+drop_extremes (float *buffer, int *count)
+{
+    int low = buffer[0] <= buffer[1] ? 0 : 1;
+    int high = 1 - low;
+    int first, second;
+
+    for (int i = 2; i < *count; i++) {
+        if (buffer[i] < buffer[low])
+            low = i;
+        else if (buffer[i] > buffer[high])
+            high = i;
+    }
 
-    /* Add median size to get correct width and height */
-    int width = get_global_size(0) + MEDIAN_BOX_SIZE - 1;
-    int height = get_global_size(1) + MEDIAN_BOX_SIZE - 1;
+    first = max (low, high);
+    second = min (low, high);
+    buffer[first] = buffer[--(*count)];
+    buffer[second] = buffer[--(*count)];
+}
 
-    float elements[MEDIAN_BOX_SIZE * MEDIAN_BOX_SIZE];
+/*
+ * Forgetful selection: only n / 2 + 2 values are kept, whenever a new one
+ * arrives the extremes are dropped because neither can be the median any more.
+ * This keeps the private memory small for windows up to SMALL_MAX_SIZE.
+ */
+kernel void
+median_small (global const float *input,
+              global float *output,
+              const int size)
+{
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int width = get_global_size (0);
+    const int height = get_global_size (1);
+    const int half = size / 2;
+    const int keep = size * size / 2 + 2;
+    float buffer[SMALL_BUFFER_SIZE];
+    int count = 0;
+    int seen = 0;
 
-    /* Start at top left corner and pull out data */
-    /* int index = (idy - HALF_SIZE) * width + idx - HALF_SIZE; */
-    int i = 0;
+    for (int y = -half; y <= half; y++) {
+        for (int x = -half; x <= half; x++, seen++) {
+            if (seen >= keep)
+                drop_extremes (buffer, &count);
 
-    for (int y = idy - HALF_SIZE; y < idy + HALF_SIZE + 1; y++) {
-        for (int x = idx - HALF_SIZE; x < idx + HALF_SIZE + 1; x++) {
-            elements[i++] = input[y * width + x];
+            buffer[count++] = fetch (input, idx + x, idy + y, width, height);
         }
     }
 
-    /* Sort elements with (for now) insertion sort */
-    for (int i = 1; i < MEDIAN_BOX_SIZE * MEDIAN_BOX_SIZE; i++) {
-        int j = i;
+    /* Three values are left, drop their extremes */
+    drop_extremes (buffer, &count);
+    output[idy * width + idx] = buffer[0];
+}
 
-        while (j > 0 && elements[j-1] > elements[j]) {
-            float tmp = elements[j-1];
-            elements[j-1] = elements[j];
-            elements[j] = tmp;
-            j--;
-        }
-    }
+/* Map floats to unsigned integers with the same order */
+static uint
+to_key (float value)
+{
+    const uint bits = as_uint (value);
 
-    output[idy * width + idx] = elements[MEDIAN_BOX_SIZE * MEDIAN_BOX_SIZE / 2];
+    return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
 }
 
+static float
+from_key (uint key)
+{
+    return as_float ((key & 0x80000000) ? key & 0x7fffffff : ~key);
+}
+
+/*
+ * The work group loads its pixels and the window borders into local memory,
+ * then every work item determines the median bit by bit from the most
+ * significant one by counting the values below the candidate. The cost per
+ * pixel is 32 passes over the window regardless of the data.
+ */
 kernel void
-fill (global float *input,
-      global float *output)
+median_large (global const float *input,
+              global float *output,
+              const int size,
+              const int width,
+              const int height,
+              local float *tile)
 {
-    const int HALF_SIZE = (MEDIAN_BOX_SIZE - 1) / 2;
-    int idx = get_global_id(0);
-    int idy = get_global_id(1);
-    int width = get_global_size(0);
-    int height = get_global_size(1);
-
-    if (abs(idx - width) < HALF_SIZE && abs(idy - height) < HALF_SIZE)
-        output[idy * width + idx] = input[idy * width + idx];
+    const int half = size / 2;
+    const int lx = get_local_id (0);
+    const int ly = get_local_id (1);
+    const int local_width = get_local_size (0);
+    const int local_height = get_local_size (1);
+    const int tile_width = local_width + size - 1;
+    const int tile_height = local_height + size - 1;
+    const int origin_x = get_group_id (0) * local_width - half;
+    const int origin_y = get_group_id (1) * local_height - half;
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    uint rank = size * size / 2;
+    uint prefix = 0;
+    uint mask = 0;
+
+    for (int y = ly; y < tile_height; y += local_height)
+        for (int x = lx; x < tile_width; x += local_width)
+            tile[y * tile_width + x] = fetch (input, origin_x + x, origin_y + y, width, height);
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    if (idx >= width || idy >= height)
+        return;
+
+    for (int bit = 31; bit >= 0; bit--) {
+        const uint candidate = 1u << bit;
+        uint count = 0;
+
+        for (int y = 0; y < size; y++) {
+            local const float *row = tile + (ly + y) * tile_width + lx;
+
+            for (int x = 0; x < size; x++) {
+                const uint key = to_key (row[x]);
+
+                count += (key & mask) == prefix && !(key & candidate);
+            }
+        }
+
+        if (rank >= count) {
+            rank -= count;
+            prefix |= candidate;
+        }
+
+        mask |= candidate;
+    }
+
+    output[idy * width + idx] = from_key (prefix);
 }
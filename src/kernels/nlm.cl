@@ -17,64 +17,87 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define SEARCH_RADIUS   10
-#define NB_RADIUS       3
-#define SIGMA           2
-
-#define flatten(x,y,r,w) ((y-r)*w + (x-r))
+/*
+ * Non-local means with the patch distances of one search offset (dx, dy) at a
+ * time: the squared differences between the frame and the shifted frame are
+ * box filtered separably, first along rows, then with a running sum along
+ * columns. Coordinates are clamped at the frame borders. Stacks are processed
+ * at once, the last global dimension selects the frame.
+ */
 
-/* Compute the distance of two neighbourhood vectors _starting_ from index i
-   and j and edge length radius */
-float
-dist (global float *input,
-      int i,
-      int j,
-      int radius,
-      int image_width)
+kernel void
+nlm_rows (global const float *input,
+          global float *row_sums,
+          const int dx,
+          const int dy,
+          const int radius)
 {
-    float dist = 0.0f, tmp;
-    float wsize = (2.0f * radius + 1.0f);
-    wsize *= wsize;
+    const int idx = get_global_id (0);
+    const int idy = get_global_id (1);
+    const int width = get_global_size (0);
+    const int height = get_global_size (1);
+    const size_t offset = (size_t) get_global_id (2) * width * height;
+    global const float *row = input + offset + idy * width;
+    global const float *shifted = input + offset + clamp (idy + dy, 0, height - 1) * width;
+    float sum = 0.0f;
 
-    const int nb_width = 2 * radius + 1;
-    const int stride = image_width - nb_width;
-    for (int k = 0; k < nb_width; k++, i += stride, j += stride) {
-        for (int l = 0; l < nb_width; l++, i++, j++) {
-            tmp = input[i] - input[j];
-            dist += tmp * tmp;
-        }
+    for (int k = -radius; k <= radius; k++) {
+        const int x = clamp (idx + k, 0, width - 1);
+        const float difference = row[x] - shifted[clamp (x + dx, 0, width - 1)];
+
+        sum += difference * difference;
     }
-    return dist / wsize;
+
+    row_sums[offset + idy * width + idx] = sum;
 }
 
 kernel void
-nlm(global float *input,
-    global float *output)
+nlm_columns (global const float *input,
+             global const float *row_sums,
+             global float *weights,
+             global float *output,
+             const int dx,
+             const int dy,
+             const int radius,
+             const int height,
+             const float scale,
+             const float bias,
+             const int first)
 {
-    const int x = get_global_id(0);
-    const int y = get_global_id(1);
-    const int width = get_global_size(0);
-    const int height = get_global_size(1);
+    const int idx = get_global_id (0);
+    const int width = get_global_size (0);
+    const size_t offset = (size_t) get_global_id (1) * width * height;
+    const int sx = clamp (idx + dx, 0, width - 1);
+    global const float *frame = input + offset;
+    global const float *sums = row_sums + offset + idx;
+    float sum = 0.0f;
 
-    float total_weight = 0.0f;
-    float pixel_value = 0.0f;
+    for (int k = -radius; k <= radius; k++)
+        sum += sums[clamp (k, 0, height - 1) * width];
 
-    /* Compute the upper left (sx,sy) and lower right (tx, ty) corner points
-       of our search window */
-    int r = min(NB_RADIUS, min(width - 1 - x, min (height - 1 - y, min(x, y))));
-    int sx = max(x - SEARCH_RADIUS, r);
-    int sy = max(y - SEARCH_RADIUS, r);
-    int tx = min(x + SEARCH_RADIUS, width - 1 - r);
-    int ty = min(y + SEARCH_RADIUS, height - 1 - r);
+    for (int y = 0; y < height; y++) {
+        const size_t index = offset + y * width + idx;
+        const float weight = exp (-fmax (sum * scale - bias, 0.0f));
+        const float value = weight * frame[clamp (y + dy, 0, height - 1) * width + sx];
 
-    for (int i = sx; i < tx; i++) {
-        for (int j = sy; j < ty; j++) {
-            float d = dist(input, flatten(x, y, r, width), flatten(i,j,r,width), r, width);
-            float weight = exp(- (SIGMA * SIGMA * 100) * d);
-            pixel_value += weight * input[j*width + i];
-            total_weight += weight;
+        if (first) {
+            weights[index] = weight;
+            output[index] = value;
         }
+        else {
+            weights[index] += weight;
+            output[index] += value;
+        }
+
+        sum += sums[min (y + radius + 1, height - 1) * width] - sums[max (y - radius, 0) * width];
     }
+}
+
+kernel void
+nlm_normalize (global float *output,
+               global const float *weights)
+{
+    const size_t index = get_global_id (0);
 
-    output[y*width + x] = pixel_value / total_weight;
+    output[index] /= weights[index];
 }
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2011-2014 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define TILE_SIZE 16
+
+/*
+ * Transpose a width x height frame. Each work group reads a tile with
+ * coalesced row accesses into local memory and writes it back transposed,
+ * again row by row. The extra column avoids local memory bank conflicts.
+ * Must be launched with a TILE_SIZE x TILE_SIZE work group on a global size
+ * rounded up to multiples of TILE_SIZE.
+ */
+kernel void
+transpose (global const float *input,
+           global float *output,
+           const int width,
+           const int height)
+{
+    local float tile[TILE_SIZE][TILE_SIZE + 1];
+    const int lx = get_local_id (0);
+    const int ly = get_local_id (1);
+    int x = get_group_id (0) * TILE_SIZE + lx;
+    int y = get_group_id (1) * TILE_SIZE + ly;
+
+    if (x < width && y < height)
+        tile[ly][lx] = input[y * width + x];
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    x = get_group_id (1) * TILE_SIZE + lx;
+    y = get_group_id (0) * TILE_SIZE + ly;
+
+    if (x < height && y < width)
+        output[y * height + x] = tile[lx][ly];
+}
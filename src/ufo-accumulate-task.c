@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "ufo-accumulate-task.h"
+#include "common/ufo-kernel-cache.h"
+
+/**
+ * SECTION:ufo-accumulate-task
+ * @Short_description: Reduce a stream of frames on the device
+ * @Title: accumulate
+ *
+ * Reduces a stream of frames, typically dark or flat fields, to their mean or
+ * (outlier-rejected) median without leaving the device, so that the result can
+ * be fed directly into flat-field-correct.
+ */
+
+typedef enum {
+    MODE_MEAN,
+    MODE_MEDIAN,
+} Mode;
+
+static GEnumValue mode_values[] = {
+    { MODE_MEAN,   "MODE_MEAN",   "mean" },
+    { MODE_MEDIAN, "MODE_MEDIAN", "median" },
+    { 0, NULL, NULL}
+};
+
+struct _UfoAccumulateTaskPrivate {
+    Mode mode;
+    gfloat rejection;
+    cl_context context;
+    cl_kernel add_kernel;
+    cl_kernel scale_kernel;
+    cl_kernel median_kernel;
+    cl_mem compensation_mem;
+    cl_mem stack_mem;
+    guint capacity;
+    guint count;
+    gboolean generated;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoAccumulateTask, ufo_accumulate_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_ACCUMULATE_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_ACCUMULATE_TASK, UfoAccumulateTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_MODE,
+    PROP_REJECTION,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_accumulate_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_ACCUMULATE_TASK, NULL));
+}
+
+static void
+release_mems (UfoAccumulateTaskPrivate *priv)
+{
+    if (priv->compensation_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->compensation_mem));
+        priv->compensation_mem = NULL;
+    }
+
+    if (priv->stack_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->stack_mem));
+        priv->stack_mem = NULL;
+    }
+
+    priv->capacity = 0;
+}
+
+static void
+ufo_accumulate_task_setup (UfoTask *task,
+                           UfoResources *resources,
+                           GError **error)
+{
+    UfoAccumulateTaskPrivate *priv;
+
+    priv = UFO_ACCUMULATE_TASK_GET_PRIVATE (task);
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    priv->add_kernel = ufo_kernel_cache_get_kernel (resources, "accumulate.cl", "accumulate_add", NULL, error);
+
+    if (priv->add_kernel == NULL)
+        return;
+
+    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->add_kernel));
+    priv->scale_kernel = ufo_kernel_cache_get_kernel (resources, "accumulate.cl", "accumulate_scale", NULL, error);
+
+    if (priv->scale_kernel == NULL)
+        return;
+
+    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->scale_kernel));
+    priv->median_kernel = ufo_kernel_cache_get_kernel (resources, "accumulate.cl", "accumulate_median", NULL, error);
+
+    if (priv->median_kernel == NULL)
+        return;
+
+    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->median_kernel));
+
+    release_mems (priv);
+    priv->count = 0;
+    priv->generated = FALSE;
+}
+
+static void
+ufo_accumulate_task_get_requisition (UfoTask *task,
+                                     UfoBuffer **inputs,
+                                     UfoRequisition *requisition)
+{
+    ufo_buffer_get_requisition (inputs[0], requisition);
+}
+
+static guint
+ufo_accumulate_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_accumulate_task_get_num_dimensions (UfoTask *task,
+                                        guint input)
+{
+    return 2;
+}
+
+static UfoTaskMode
+ufo_accumulate_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_GPU;
+}
+
+/* Make room for one more frame, doubling the stack to amortize the copies */
+static void
+grow_stack (UfoAccumulateTaskPrivate *priv,
+            cl_command_queue cmd_queue,
+            gsize frame_size)
+{
+    cl_mem new_mem;
+    cl_int errcode;
+    guint capacity;
+
+    capacity = MAX (16, 2 * priv->capacity);
+    new_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, capacity * frame_size, NULL, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+
+    if (priv->stack_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, priv->stack_mem, new_mem, 0, 0,
+                                                        priv->count * frame_size, 0, NULL, NULL));
+        UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->stack_mem));
+    }
+
+    priv->stack_mem = new_mem;
+    priv->capacity = capacity;
+}
+
+static gboolean
+ufo_accumulate_task_process (UfoTask *task,
+                             UfoBuffer **inputs,
+                             UfoBuffer *output,
+                             UfoRequisition *requisition)
+{
+    UfoAccumulateTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem;
+    gsize frame_size;
+
+    priv = UFO_ACCUMULATE_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+    frame_size = requisition->dims[0] * requisition->dims[1] * sizeof (gfloat);
+
+    if (priv->mode == MODE_MEAN) {
+        cl_mem out_mem;
+        cl_int first;
+        cl_int errcode;
+
+        if (priv->compensation_mem == NULL) {
+            priv->compensation_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, frame_size, NULL, &errcode);
+            UFO_RESOURCES_CHECK_CLERR (errcode);
+        }
+
+        out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+        first = priv->count == 0;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->add_kernel, 0, sizeof (cl_mem), &in_mem));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->add_kernel, 1, sizeof (cl_mem), &out_mem));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->add_kernel, 2, sizeof (cl_mem), &priv->compensation_mem));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->add_kernel, 3, sizeof (cl_int), &first));
+        ufo_profiler_call (profiler, cmd_queue, priv->add_kernel, 2, requisition->dims, NULL);
+    }
+    else {
+        if (priv->count == priv->capacity)
+            grow_stack (priv, cmd_queue, frame_size);
+
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, in_mem, priv->stack_mem, 0,
+                                                        priv->count * frame_size, frame_size,
+                                                        0, NULL, NULL));
+    }
+
+    priv->count++;
+
+    return TRUE;
+}
+
+static gboolean
+ufo_accumulate_task_generate (UfoTask *task,
+                              UfoBuffer *output,
+                              UfoRequisition *requisition)
+{
+    UfoAccumulateTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem out_mem;
+
+    priv = UFO_ACCUMULATE_TASK_GET_PRIVATE (task);
+
+    if (priv->generated || priv->count == 0)
+        return FALSE;
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    if (priv->mode == MODE_MEAN) {
+        gfloat scale = 1.0f / priv->count;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->scale_kernel, 0, sizeof (cl_mem), &out_mem));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->scale_kernel, 1, sizeof (gfloat), &scale));
+        ufo_profiler_call (profiler, cmd_queue, priv->scale_kernel, 2, requisition->dims, NULL);
+    }
+    else {
+        cl_int count = (cl_int) priv->count;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->median_kernel, 0, sizeof (cl_mem), &priv->stack_mem));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->median_kernel, 1, sizeof (cl_mem), &out_mem));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->median_kernel, 2, sizeof (cl_int), &count));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->median_kernel, 3, sizeof (gfloat), &priv->rejection));
+        ufo_profiler_call (profiler, cmd_queue, priv->median_kernel, 2, requisition->dims, NULL);
+    }
+
+    /* The stack is not needed anymore, give the memory back to the pipeline */
+    UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+    release_mems (priv);
+
+    priv->generated = TRUE;
+    return TRUE;
+}
+
+static void
+ufo_accumulate_task_set_property (GObject *object,
+                                  guint property_id,
+                                  const GValue *value,
+                                  GParamSpec *pspec)
+{
+    UfoAccumulateTaskPrivate *priv = UFO_ACCUMULATE_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_MODE:
+            priv->mode = g_value_get_enum (value);
+            break;
+        case PROP_REJECTION:
+            priv->rejection = g_value_get_float (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_accumulate_task_get_property (GObject *object,
+                                  guint property_id,
+                                  GValue *value,
+                                  GParamSpec *pspec)
+{
+    UfoAccumulateTaskPrivate *priv = UFO_ACCUMULATE_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_MODE:
+            g_value_set_enum (value, priv->mode);
+            break;
+        case PROP_REJECTION:
+            g_value_set_float (value, priv->rejection);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_accumulate_task_finalize (GObject *object)
+{
+    UfoAccumulateTaskPrivate *priv;
+
+    priv = UFO_ACCUMULATE_TASK_GET_PRIVATE (object);
+    release_mems (priv);
+
+    if (priv->add_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->add_kernel));
+        priv->add_kernel = NULL;
+    }
+
+    if (priv->scale_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->scale_kernel));
+        priv->scale_kernel = NULL;
+    }
+
+    if (priv->median_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->median_kernel));
+        priv->median_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_accumulate_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_accumulate_task_setup;
+    iface->get_num_inputs = ufo_accumulate_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_accumulate_task_get_num_dimensions;
+    iface->get_mode = ufo_accumulate_task_get_mode;
+    iface->get_requisition = ufo_accumulate_task_get_requisition;
+    iface->process = ufo_accumulate_task_process;
+    iface->generate = ufo_accumulate_task_generate;
+}
+
+static void
+ufo_accumulate_task_class_init (UfoAccumulateTaskClass *klass)
+{
+    GObjectClass *oclass = G_OBJECT_CLASS (klass);
+
+    oclass->set_property = ufo_accumulate_task_set_property;
+    oclass->get_property = ufo_accumulate_task_get_property;
+    oclass->finalize = ufo_accumulate_task_finalize;
+
+    properties[PROP_MODE] =
+        g_param_spec_enum ("mode",
+                           "Reduction mode (mean, median)",
+                           "Reduction mode (mean, median)",
+                           g_enum_register_static ("ufo_accumulate_mode", mode_values),
+                           MODE_MEAN, G_PARAM_READWRITE);
+
+    properties[PROP_REJECTION] =
+        g_param_spec_float ("rejection",
+                            "Outlier rejection threshold in robust standard deviations",
+                            "Outlier rejection threshold in robust standard deviations, 0 disables rejection",
+                            0.0f, G_MAXFLOAT, 0.0f,
+                            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    g_type_class_add_private (oclass, sizeof(UfoAccumulateTaskPrivate));
+}
+
+static void
+ufo_accumulate_task_init(UfoAccumulateTask *self)
+{
+    self->priv = UFO_ACCUMULATE_TASK_GET_PRIVATE(self);
+    self->priv->mode = MODE_MEAN;
+    self->priv->rejection = 0.0f;
+    self->priv->context = NULL;
+    self->priv->add_kernel = NULL;
+    self->priv->scale_kernel = NULL;
+    self->priv->median_kernel = NULL;
+    self->priv->compensation_mem = NULL;
+    self->priv->stack_mem = NULL;
+    self->priv->capacity = 0;
+    self->priv->count = 0;
+    self->priv->generated = FALSE;
+}
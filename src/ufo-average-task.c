@@ -17,22 +17,47 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
 #include <string.h>
-#include <gmodule.h>
 
 #include "ufo-average-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-reduce.h"
 
 
 struct _UfoAverageTaskPrivate {
-    gfloat *averaged;
     gboolean is_data_averaged;
     guint counter;
     guint n_generate;
+    gboolean compensated;
+    gboolean variance;
+    gboolean use_gpu;
+    gsize dims[2];
+
+    /* Running sum or, when computing the variance, running mean */
+    gfloat *sum;
+    gfloat *compensation;
+    gfloat *m2;
+
+    /* On the device the second buffer holds either the compensation or m2 */
+    cl_context context;
+    cl_kernel add_kernel;
+    cl_kernel welford_kernel;
+    cl_kernel scale_kernel;
+    cl_mem sum_mem;
+    cl_mem second_mem;
 };
 
 enum {
     PROP_0,
     PROP_NUM_GENERATE,
+    PROP_COMPENSATED,
+    PROP_VARIANCE,
+    PROP_USE_GPU,
     N_PROPERTIES
 };
 
@@ -53,11 +78,61 @@ ufo_average_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_AVERAGE_TASK, NULL));
 }
 
+static cl_kernel
+get_kernel (UfoResources *resources, const gchar *name, GError **error)
+{
+    cl_kernel kernel;
+
+    kernel = ufo_kernel_cache_get_kernel (resources, "accumulate.cl", name, NULL, error);
+
+    if (kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (kernel));
+
+    return kernel;
+}
+
 static void
 ufo_average_task_setup (UfoTask *task,
                          UfoResources *resources,
                          GError **error)
 {
+    UfoAverageTaskPrivate *priv;
+
+    priv = UFO_AVERAGE_TASK_GET_PRIVATE (UFO_AVERAGE_TASK (task));
+
+    if (!priv->use_gpu)
+        return;
+
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    priv->add_kernel = get_kernel (resources, "accumulate_add", error);
+
+    if (priv->add_kernel != NULL)
+        priv->welford_kernel = get_kernel (resources, "accumulate_welford", error);
+
+    if (priv->welford_kernel != NULL)
+        priv->scale_kernel = get_kernel (resources, "accumulate_scale", error);
+}
+
+static void
+allocate (UfoAverageTaskPrivate *priv)
+{
+    const gsize size = priv->dims[0] * priv->dims[1] * sizeof (gfloat);
+    cl_int errcode;
+
+    if (!priv->use_gpu) {
+        priv->sum = g_malloc0 (size);
+        priv->compensation = priv->compensated ? g_malloc0 (size) : NULL;
+        priv->m2 = priv->variance ? g_malloc0 (size) : NULL;
+        return;
+    }
+
+    /* The kernels initialize the buffers with the first frame */
+    priv->sum_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    priv->second_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
 }
 
 static void
@@ -70,9 +145,16 @@ ufo_average_task_get_requisition (UfoTask *task,
     priv = UFO_AVERAGE_TASK_GET_PRIVATE (UFO_AVERAGE_TASK (task));
     ufo_buffer_get_requisition (inputs[0], requisition);
 
-    if (priv->averaged == NULL) {
-        priv->averaged = g_malloc0 (requisition->dims[0] *
-                                    requisition->dims[1] * sizeof (gfloat));
+    if (priv->sum == NULL && priv->sum_mem == NULL) {
+        priv->dims[0] = requisition->dims[0];
+        priv->dims[1] = requisition->dims[1];
+        allocate (priv);
+    }
+
+    /* Mean and variance are stacked */
+    if (priv->variance) {
+        requisition->n_dims = 3;
+        requisition->dims[2] = 2;
     }
 }
 
@@ -93,9 +175,42 @@ ufo_average_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_average_task_get_mode (UfoTask *task)
 {
+    if (UFO_AVERAGE_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_GPU;
+
     return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_CPU;
 }
 
+static cl_command_queue
+get_cmd_queue (UfoTask *task)
+{
+    return ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+}
+
+static void
+process_device (UfoAverageTaskPrivate *priv, UfoTask *task, UfoBuffer *input)
+{
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_kernel kernel;
+    cl_mem in_mem;
+    cl_int arg;
+
+    cmd_queue = get_cmd_queue (task);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    in_mem = ufo_buffer_get_device_array (input, cmd_queue);
+
+    /* accumulate_welford takes the frame count, accumulate_add the first flag */
+    kernel = priv->variance ? priv->welford_kernel : priv->add_kernel;
+    arg = priv->variance ? (cl_int) priv->counter + 1 : priv->counter == 0;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &priv->sum_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->second_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_int), &arg));
+    ufo_profiler_call (profiler, cmd_queue, kernel, 2, priv->dims, NULL);
+}
+
 static gboolean
 ufo_average_task_process (UfoTask *task,
                            UfoBuffer **inputs,
@@ -104,21 +219,53 @@ ufo_average_task_process (UfoTask *task,
 {
     UfoAverageTaskPrivate *priv;
     gfloat *in_array;
-    gfloat *out_array;
     gsize n_pixels;
 
     priv = UFO_AVERAGE_TASK_GET_PRIVATE (UFO_AVERAGE_TASK (task));
-    n_pixels = requisition->dims[0] * requisition->dims[1];
-    in_array = ufo_buffer_get_host_array (inputs[0], NULL);
-    out_array = ufo_buffer_get_host_array (output, NULL);
 
-    for (gsize i = 0; i < n_pixels; i++)
-        out_array[i] += in_array[i];
+    if (priv->use_gpu)
+        process_device (priv, task, inputs[0]);
+    else {
+        n_pixels = priv->dims[0] * priv->dims[1];
+        in_array = ufo_buffer_get_host_array (inputs[0], NULL);
+
+        if (priv->variance)
+            ufo_reduce_welford (priv->sum, priv->m2, in_array, priv->counter + 1, n_pixels);
+        else
+            ufo_reduce_add (priv->sum, priv->compensation, in_array, n_pixels);
+    }
 
     priv->counter++;
     return TRUE;
 }
 
+static void
+scale_device (UfoAverageTaskPrivate *priv, UfoTask *task, cl_mem mem, gfloat scale)
+{
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->scale_kernel, 0, sizeof (cl_mem), &mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->scale_kernel, 1, sizeof (cl_float), &scale));
+    ufo_profiler_call (ufo_task_node_get_profiler (UFO_TASK_NODE (task)), get_cmd_queue (task),
+                       priv->scale_kernel, 2, priv->dims, NULL);
+}
+
+static void
+copy_result_device (UfoAverageTaskPrivate *priv, UfoTask *task, UfoBuffer *output)
+{
+    const gsize size = priv->dims[0] * priv->dims[1] * sizeof (gfloat);
+    cl_command_queue cmd_queue;
+    cl_mem out_mem;
+
+    cmd_queue = get_cmd_queue (task);
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, priv->sum_mem, out_mem,
+                                                    0, 0, size, 0, NULL, NULL));
+
+    if (priv->variance)
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, priv->second_mem, out_mem,
+                                                        0, size, size, 0, NULL, NULL));
+}
+
 static gboolean
 ufo_average_task_generate (UfoTask *task,
                             UfoBuffer *output,
@@ -127,23 +274,40 @@ ufo_average_task_generate (UfoTask *task,
     UfoAverageTaskPrivate *priv;
     gfloat *out_array;
     gsize n_pixels;
+    gfloat scale;
 
     priv = UFO_AVERAGE_TASK_GET_PRIVATE (UFO_AVERAGE_TASK (task));
 
-    if (priv->n_generate == 0)
+    if (priv->n_generate == 0 || priv->counter == 0)
         return FALSE;
 
-    out_array = ufo_buffer_get_host_array (output, NULL);
-    n_pixels = requisition->dims[0] * requisition->dims[1];
+    n_pixels = priv->dims[0] * priv->dims[1];
 
     if (!priv->is_data_averaged) {
-        for (gsize i = 0; i < n_pixels; i++)
-            priv->averaged[i] = out_array[i] / (gfloat) priv->counter;
+        /* The mean is already normalized, the sample variance is m2 / (n - 1) */
+        if (priv->variance)
+            scale = priv->counter > 1 ? 1.0f / (priv->counter - 1) : 0.0f;
+        else
+            scale = 1.0f / (gfloat) priv->counter;
+
+        if (priv->use_gpu)
+            scale_device (priv, task, priv->variance ? priv->second_mem : priv->sum_mem, scale);
+        else
+            ufo_reduce_scale (priv->variance ? priv->m2 : priv->sum, scale, n_pixels);
 
         priv->is_data_averaged = TRUE;
     }
 
-    g_memmove (out_array, priv->averaged, n_pixels * sizeof (float));
+    if (priv->use_gpu)
+        copy_result_device (priv, task, output);
+    else {
+        out_array = ufo_buffer_get_host_array (output, NULL);
+        memcpy (out_array, priv->sum, n_pixels * sizeof (gfloat));
+
+        if (priv->variance)
+            memcpy (out_array + n_pixels, priv->m2, n_pixels * sizeof (gfloat));
+    }
+
     priv->n_generate--;
 
     return TRUE;
@@ -168,10 +332,44 @@ ufo_average_task_finalize (GObject *object)
 
     priv = UFO_AVERAGE_TASK_GET_PRIVATE (object);
 
-    if (priv->averaged != NULL) {
-        g_free (priv->averaged);
-        priv->averaged = NULL;
+    g_free (priv->sum);
+    g_free (priv->compensation);
+    g_free (priv->m2);
+    priv->sum = NULL;
+    priv->compensation = NULL;
+    priv->m2 = NULL;
+
+    if (priv->sum_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->sum_mem));
+        priv->sum_mem = NULL;
+    }
+
+    if (priv->second_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->second_mem));
+        priv->second_mem = NULL;
     }
+
+    if (priv->add_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->add_kernel));
+        priv->add_kernel = NULL;
+    }
+
+    if (priv->welford_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->welford_kernel));
+        priv->welford_kernel = NULL;
+    }
+
+    if (priv->scale_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->scale_kernel));
+        priv->scale_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_average_task_parent_class)->finalize (object);
 }
 
 static void
@@ -186,6 +384,15 @@ ufo_average_task_set_property (GObject *object,
         case PROP_NUM_GENERATE:
             priv->n_generate = g_value_get_uint (value);
             break;
+        case PROP_COMPENSATED:
+            priv->compensated = g_value_get_boolean (value);
+            break;
+        case PROP_VARIANCE:
+            priv->variance = g_value_get_boolean (value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -204,6 +411,15 @@ ufo_average_task_get_property (GObject *object,
         case PROP_NUM_GENERATE:
             g_value_set_uint (value, priv->n_generate);
             break;
+        case PROP_COMPENSATED:
+            g_value_set_boolean (value, priv->compensated);
+            break;
+        case PROP_VARIANCE:
+            g_value_set_boolean (value, priv->variance);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
             break;
@@ -228,6 +444,27 @@ ufo_average_task_class_init (UfoAverageTaskClass *klass)
                            1, G_MAXUINT, 1,
                            G_PARAM_READWRITE);
 
+    properties[PROP_COMPENSATED] =
+        g_param_spec_boolean ("compensated",
+                              "Use compensated summation on the host",
+                              "Use compensated (Kahan) summation on the host",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_VARIANCE] =
+        g_param_spec_boolean ("variance",
+                              "Output mean and variance",
+                              "Output mean and sample variance stacked in one buffer, computed in one pass",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+                              "Accumulate on the GPU",
+                              "Accumulate on the GPU, so that only the result leaves the device",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -239,7 +476,18 @@ ufo_average_task_init(UfoAverageTask *self)
 {
     self->priv = UFO_AVERAGE_TASK_GET_PRIVATE(self);
     self->priv->counter = 0;
-    self->priv->averaged = NULL;
     self->priv->n_generate = 1;
     self->priv->is_data_averaged = FALSE;
+    self->priv->compensated = FALSE;
+    self->priv->variance = FALSE;
+    self->priv->use_gpu = FALSE;
+    self->priv->sum = NULL;
+    self->priv->compensation = NULL;
+    self->priv->m2 = NULL;
+    self->priv->context = NULL;
+    self->priv->add_kernel = NULL;
+    self->priv->welford_kernel = NULL;
+    self->priv->scale_kernel = NULL;
+    self->priv->sum_mem = NULL;
+    self->priv->second_mem = NULL;
 }
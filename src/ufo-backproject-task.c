@@ -25,6 +25,8 @@
 
 #include <math.h>
 #include "ufo-backproject-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-tuner.h"
 
 
 typedef enum {
@@ -38,10 +40,23 @@ static GEnumValue mode_values[] = {
     { 0, NULL, NULL}
 };
 
+/* A horizontal band of the output slice reconstructed on one device */
+typedef struct {
+    cl_command_queue queue;
+    cl_mem in_mem;
+    cl_mem out_mem;
+    gsize first_row;
+    gsize n_rows;
+    /* input copied from the node's queue, band copied back into the output */
+    cl_event copied;
+    cl_event gathered;
+} Tile;
+
 struct _UfoBackprojectTaskPrivate {
     cl_context context;
     cl_kernel nearest_kernel;
     cl_kernel texture_kernel;
+    cl_kernel texture_3d_kernel;
     cl_mem sin_lut;
     cl_mem cos_lut;
     gfloat *host_sin_lut;
@@ -59,6 +74,13 @@ struct _UfoBackprojectTaskPrivate {
     gint roi_width;
     gint roi_height;
     Mode mode;
+    gboolean tiled;
+    GList *queues;
+    Tile *tiles;
+    guint n_tiles;
+    /* sizes the tiles were created for */
+    gsize tiles_in_dims[2];
+    gsize tiles_out_dims[2];
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -81,6 +103,7 @@ enum {
     PROP_ROI_WIDTH,
     PROP_ROI_HEIGHT,
     PROP_MODE,
+    PROP_TILED,
     N_PROPERTIES
 };
 
@@ -92,6 +115,209 @@ ufo_backproject_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_BACKPROJECT_TASK, NULL));
 }
 
+/*
+ * Run @kernel on @cmd_queue. If @wait_event is not NULL, the kernel is
+ * enqueued depending on it, which the profiler cannot do.
+ */
+static void
+launch (UfoBackprojectTaskPrivate *priv,
+        UfoProfiler *profiler,
+        cl_command_queue cmd_queue,
+        cl_kernel kernel,
+        cl_mem in_mem,
+        cl_mem out_mem,
+        guint roi_y,
+        gfloat axis_pos,
+        guint n_dims,
+        gsize *global_work_size,
+        cl_event wait_event)
+{
+    gsize local_work_size[3];
+    gboolean has_local;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (guint),  &priv->roi_x));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 5, sizeof (guint),  &roi_y));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 6, sizeof (guint),  &priv->offset));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (guint),  &priv->burst_projections));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (gfloat), &axis_pos));
+
+    if (wait_event == NULL) {
+        ufo_tuner_call (profiler, cmd_queue, kernel, n_dims, global_work_size);
+        return;
+    }
+
+    has_local = ufo_tuner_get_local_work_size (cmd_queue, kernel, n_dims, global_work_size, local_work_size);
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (cmd_queue, kernel, n_dims, NULL, global_work_size,
+                                                       has_local ? local_work_size : NULL,
+                                                       1, &wait_event, NULL));
+}
+
+static void
+create_tiles (UfoBackprojectTaskPrivate *priv,
+              UfoRequisition *in_req,
+              UfoRequisition *requisition)
+{
+    cl_image_format format;
+    gsize rows_per_tile;
+    cl_int errcode;
+    GList *it;
+    guint i = 0;
+
+    /* Split along y so that every band is contiguous in the output and the
+     * kernels see the same width as without tiling */
+    priv->n_tiles = g_list_length (priv->queues);
+    rows_per_tile = (requisition->dims[1] + priv->n_tiles - 1) / priv->n_tiles;
+    priv->tiles = g_new0 (Tile, priv->n_tiles);
+
+    format.image_channel_order = CL_INTENSITY;
+    format.image_channel_data_type = CL_FLOAT;
+
+    for (it = g_list_first (priv->queues); it != NULL; it = g_list_next (it)) {
+        Tile *tile = &priv->tiles[i];
+
+        tile->first_row = i * rows_per_tile;
+
+        if (tile->first_row >= requisition->dims[1])
+            break;
+
+        tile->queue = it->data;
+        tile->n_rows = MIN (rows_per_tile, requisition->dims[1] - tile->first_row);
+
+        if (priv->mode == MODE_TEXTURE) {
+            tile->in_mem = clCreateImage2D (priv->context, CL_MEM_READ_ONLY, &format,
+                                            in_req->dims[0], in_req->dims[1], 0, NULL, &errcode);
+        }
+        else {
+            tile->in_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY,
+                                           in_req->dims[0] * in_req->dims[1] * sizeof (gfloat), NULL, &errcode);
+        }
+
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+
+        tile->out_mem = clCreateBuffer (priv->context, CL_MEM_WRITE_ONLY,
+                                        requisition->dims[0] * tile->n_rows * sizeof (gfloat), NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        i++;
+    }
+
+    priv->n_tiles = i;
+    priv->tiles_in_dims[0] = in_req->dims[0];
+    priv->tiles_in_dims[1] = in_req->dims[1];
+    priv->tiles_out_dims[0] = requisition->dims[0];
+    priv->tiles_out_dims[1] = requisition->dims[1];
+    g_debug ("backproject: splitting %zu rows across %u devices", requisition->dims[1], priv->n_tiles);
+}
+
+static void
+release_tiles (UfoBackprojectTaskPrivate *priv)
+{
+    for (guint i = 0; i < priv->n_tiles; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->tiles[i].in_mem));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->tiles[i].out_mem));
+    }
+
+    g_free (priv->tiles);
+    priv->tiles = NULL;
+    priv->n_tiles = 0;
+}
+
+/* The gathering copies follow the kernels, which follow the input copies */
+static void
+wait_for_tiles (UfoBackprojectTaskPrivate *priv)
+{
+    for (guint i = 0; i < priv->n_tiles; i++) {
+        Tile *tile = &priv->tiles[i];
+
+        UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (1, &tile->gathered));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (tile->gathered));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (tile->copied));
+        tile->gathered = NULL;
+        tile->copied = NULL;
+    }
+}
+
+/*
+ * Copy the sinogram from the device memory of @input to every device,
+ * reconstruct one band of the slice on each and copy the bands into the device
+ * memory of @output. All tiles share the context of @queue, so the copies stay
+ * on the devices. Each kernel depends on its input copy and the host only
+ * waits once for the gathered bands.
+ */
+static void
+process_tiled (UfoBackprojectTaskPrivate *priv,
+               UfoProfiler *profiler,
+               cl_command_queue queue,
+               UfoBuffer *input,
+               UfoBuffer *output,
+               UfoRequisition *requisition,
+               gfloat axis_pos)
+{
+    UfoRequisition in_req;
+    cl_mem in_mem;
+    cl_mem out_mem;
+    cl_kernel kernel;
+    gsize row_size;
+
+    ufo_buffer_get_requisition (input, &in_req);
+
+    if (priv->tiles != NULL &&
+        (priv->tiles_in_dims[0] != in_req.dims[0] || priv->tiles_in_dims[1] != in_req.dims[1] ||
+         priv->tiles_out_dims[0] != requisition->dims[0] || priv->tiles_out_dims[1] != requisition->dims[1]))
+        release_tiles (priv);
+
+    if (priv->tiles == NULL)
+        create_tiles (priv, &in_req, requisition);
+
+    kernel = priv->mode == MODE_TEXTURE ? priv->texture_kernel : priv->nearest_kernel;
+    out_mem = ufo_buffer_get_device_array (output, queue);
+    row_size = requisition->dims[0] * sizeof (gfloat);
+
+    /* Enqueued on the node's queue, the copies are ordered after the commands
+     * that produced the input */
+    if (priv->mode == MODE_TEXTURE) {
+        gsize origin[3] = {0, 0, 0};
+        gsize region[3] = {in_req.dims[0], in_req.dims[1], 1};
+
+        in_mem = ufo_buffer_get_device_image (input, queue);
+
+        for (guint i = 0; i < priv->n_tiles; i++)
+            UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyImage (queue, in_mem, priv->tiles[i].in_mem,
+                                                           origin, origin, region,
+                                                           0, NULL, &priv->tiles[i].copied));
+    }
+    else {
+        in_mem = ufo_buffer_get_device_array (input, queue);
+
+        for (guint i = 0; i < priv->n_tiles; i++)
+            UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (queue, in_mem, priv->tiles[i].in_mem, 0, 0,
+                                                            in_req.dims[0] * in_req.dims[1] * sizeof (gfloat),
+                                                            0, NULL, &priv->tiles[i].copied));
+    }
+
+    /* The tile queues wait for these copies, they must be submitted */
+    UFO_RESOURCES_CHECK_CLERR (clFlush (queue));
+
+    for (guint i = 0; i < priv->n_tiles; i++) {
+        Tile *tile = &priv->tiles[i];
+        gsize global_work_size[2] = {requisition->dims[0], tile->n_rows};
+
+        launch (priv, profiler, tile->queue, kernel, tile->in_mem, tile->out_mem,
+                priv->roi_y + tile->first_row, axis_pos, 2, global_work_size, tile->copied);
+
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (tile->queue, tile->out_mem, out_mem,
+                                                        0, tile->first_row * row_size,
+                                                        tile->n_rows * row_size,
+                                                        0, NULL, &tile->gathered));
+        UFO_RESOURCES_CHECK_CLERR (clFlush (tile->queue));
+    }
+
+    wait_for_tiles (priv);
+}
+
 static gboolean
 ufo_backproject_task_process (UfoTask *task,
                               UfoBuffer **inputs,
@@ -108,18 +334,7 @@ ufo_backproject_task_process (UfoTask *task,
     gfloat axis_pos;
 
     priv = UFO_BACKPROJECT_TASK (task)->priv;
-    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
-    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
-    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
-
-    if (priv->mode == MODE_TEXTURE) {
-        in_mem = ufo_buffer_get_device_image (inputs[0], cmd_queue);
-        kernel = priv->texture_kernel;
-    }
-    else {
-        in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
-        kernel = priv->nearest_kernel;
-    }
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
 
     /* Guess axis position if they are not provided by the user. */
     if (priv->axis_pos <= 0.0) {
@@ -132,18 +347,28 @@ ufo_backproject_task_process (UfoTask *task,
         axis_pos = priv->axis_pos;
     }
 
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &in_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &out_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->sin_lut));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), &priv->cos_lut));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (guint),  &priv->roi_x));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 5, sizeof (guint),  &priv->roi_y));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 6, sizeof (guint),  &priv->offset));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (guint),  &priv->burst_projections));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (gfloat), &axis_pos));
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
 
-    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-    ufo_profiler_call (profiler, cmd_queue, kernel, 2, requisition->dims, NULL);
+    /* Batches of sinograms are already spread over the third dimension */
+    if (priv->tiled && requisition->n_dims == 2) {
+        process_tiled (priv, profiler, cmd_queue, inputs[0], output, requisition, axis_pos);
+        return TRUE;
+    }
+
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    if (priv->mode == MODE_TEXTURE) {
+        in_mem = ufo_buffer_get_device_image (inputs[0], cmd_queue);
+        kernel = requisition->n_dims == 3 ? priv->texture_3d_kernel : priv->texture_kernel;
+    }
+    else {
+        in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+        kernel = priv->nearest_kernel;
+    }
+
+    launch (priv, profiler, cmd_queue, kernel, in_mem, out_mem, priv->roi_y, axis_pos,
+            requisition->n_dims, requisition->dims, NULL);
 
     return TRUE;
 }
@@ -158,16 +383,23 @@ ufo_backproject_task_setup (UfoTask *task,
     priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (task);
 
     priv->context = ufo_resources_get_context (resources);
-    priv->nearest_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "backproject_nearest", error);
-    priv->texture_kernel = ufo_resources_get_kernel (resources, "backproject.cl", "backproject_tex", error);
+    priv->nearest_kernel = ufo_kernel_cache_get_kernel (resources, "backproject.cl", "backproject_nearest", NULL, error);
+    priv->texture_kernel = ufo_kernel_cache_get_kernel (resources, "backproject.cl", "backproject_tex", NULL, error);
+    priv->texture_3d_kernel = ufo_kernel_cache_get_kernel (resources, "backproject.cl", "backproject_tex3d", NULL, error);
 
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
 
+    if (priv->tiled)
+        priv->queues = ufo_resources_get_cmd_queues (resources);
+
     if (priv->nearest_kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->nearest_kernel));
 
     if (priv->texture_kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->texture_kernel));
+
+    if (priv->texture_3d_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->texture_3d_kernel));
 }
 
 static cl_mem
@@ -231,7 +463,9 @@ ufo_backproject_task_get_requisition (UfoTask *task,
                 "or equal to sinogram height (%u)", priv->n_projections, priv->burst_projections);
     }
 
-    requisition->n_dims = 2;
+    /* A batch of sinograms yields a stack of as many slices */
+    requisition->n_dims = in_req.n_dims == 3 ? 3 : 2;
+    requisition->dims[2] = in_req.n_dims == 3 ? in_req.dims[2] : 1;
 
     /* TODO: we should check here, that we might access data outside the
      * projections */
@@ -297,6 +531,8 @@ ufo_backproject_task_finalize (GObject *object)
     priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (object);
 
     release_lut_mems (priv);
+    release_tiles (priv);
+    g_list_free (priv->queues);
 
     g_free (priv->host_sin_lut);
     g_free (priv->host_cos_lut);
@@ -311,6 +547,11 @@ ufo_backproject_task_finalize (GObject *object)
         priv->texture_kernel = NULL;
     }
 
+    if (priv->texture_3d_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->texture_3d_kernel));
+        priv->texture_3d_kernel = NULL;
+    }
+
     if (priv->context) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
         priv->context = NULL;
@@ -358,6 +599,9 @@ ufo_backproject_task_set_property (GObject *object,
         case PROP_MODE:
             priv->mode = g_value_get_enum (value);
             break;
+        case PROP_TILED:
+            priv->tiled = g_value_get_boolean (value);
+            break;
         case PROP_ROI_X:
             priv->roi_x = g_value_get_uint (value);
             break;
@@ -403,6 +647,9 @@ ufo_backproject_task_get_property (GObject *object,
         case PROP_MODE:
             g_value_set_enum (value, priv->mode);
             break;
+        case PROP_TILED:
+            g_value_set_boolean (value, priv->tiled);
+            break;
         case PROP_ROI_X:
             g_value_set_uint (value, priv->roi_x);
             break;
@@ -505,6 +752,13 @@ ufo_backproject_task_class_init (UfoBackprojectTaskClass *klass)
                            0, G_MAXUINT, 0,
                            G_PARAM_READWRITE);
 
+    properties[PROP_TILED] =
+        g_param_spec_boolean ("tiled",
+                              "Split the slice across all devices",
+                              "Split the slice into bands reconstructed on all devices and gather the result",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -520,6 +774,7 @@ ufo_backproject_task_init (UfoBackprojectTask *self)
     self->priv = priv = UFO_BACKPROJECT_TASK_GET_PRIVATE (self);
     priv->nearest_kernel = NULL;
     priv->texture_kernel = NULL;
+    priv->texture_3d_kernel = NULL;
     priv->n_projections = 0;
     priv->offset = 0;
     priv->axis_pos = -1.0;
@@ -534,4 +789,8 @@ ufo_backproject_task_init (UfoBackprojectTask *self)
     priv->luts_changed = TRUE;
     priv->roi_x = priv->roi_y = 0;
     priv->roi_width = priv->roi_height = 0;
+    priv->tiled = FALSE;
+    priv->queues = NULL;
+    priv->tiles = NULL;
+    priv->n_tiles = 0;
 }
@@ -24,6 +24,7 @@
 #endif
 
 #include "ufo-bin-task.h"
+#include "common/ufo-kernel-cache.h"
 
 
 struct _UfoBinTaskPrivate {
@@ -62,7 +63,7 @@ ufo_bin_task_setup (UfoTask *task,
 
     priv = UFO_BIN_TASK_GET_PRIVATE (task);
 
-    priv->kernel = ufo_resources_get_kernel (resources, "bin.cl", "binning", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "bin.cl", "binning", NULL, error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
@@ -23,15 +23,24 @@
 #include <CL/cl.h>
 #endif
 #include <math.h>
+#include <string.h>
 #include "ufo-blur-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-transpose.h"
 
+/* Columns filtered at once by the host recursive filter */
+#define COLUMN_BLOCK 256
 
 struct _UfoBlurTaskPrivate {
     guint       size;
     gfloat      sigma;
+    gfloat      iir_threshold;
+    gboolean    use_gpu;
     cl_context  context;
     cl_kernel   h_kernel;
     cl_kernel   v_kernel;
+    cl_kernel   iir_kernel;
+    cl_kernel   transpose_kernel;
     cl_mem      weights_mem;
     cl_mem      intermediate_mem;
 };
@@ -48,6 +57,8 @@ enum {
     PROP_0,
     PROP_SIZE,
     PROP_SIGMA,
+    PROP_IIR_THRESHOLD,
+    PROP_USE_GPU,
     N_PROPERTIES
 };
 
@@ -59,6 +70,101 @@ ufo_blur_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_BLUR_TASK, NULL));
 }
 
+static gboolean
+use_iir (UfoBlurTaskPrivate *priv)
+{
+    return priv->sigma >= priv->iir_threshold;
+}
+
+/* Normalized weights of a 2 * (size / 2) + 1 long kernel */
+static gfloat *
+make_weights (UfoBlurTaskPrivate *priv)
+{
+    const guint kernel_size_2 = priv->size / 2;
+    const guint kernel_size = 2 * kernel_size_2 + 1;
+    gfloat *weights;
+    gfloat sum = 0.0f;
+
+    weights = g_malloc0 (kernel_size * sizeof(gfloat));
+
+    for (guint i = 0; i < kernel_size_2 + 1; i++) {
+        gfloat x = (gfloat) (kernel_size_2 - i);
+        weights[i] = (gfloat) (1.0 / (priv->sigma * sqrt(2*G_PI)) * exp((x * x) / (-2.0 * priv->sigma * priv->sigma)));
+        weights[kernel_size-i-1] = weights[i];
+    }
+
+    for (guint i = 0; i < kernel_size; i++)
+        sum += weights[i];
+
+    for (guint i = 0; i < kernel_size; i++)
+        weights[i] /= sum;
+
+    return weights;
+}
+
+/*
+ * Poles of the third order recursive Gaussian for sigma = 2 from Young, van
+ * Vliet and van Ginkel, "Recursive Gabor filtering", IEEE Transactions on
+ * Signal Processing 50, 2002. Poles for other sigmas are their 1/q-th powers.
+ */
+#define IIR_POLE_RE     1.41650
+#define IIR_POLE_IM     1.00829
+#define IIR_POLE_REAL   1.86543
+
+static void
+scale_poles (gdouble q, gdouble *re, gdouble *im, gdouble *real)
+{
+    const gdouble magnitude = pow (hypot (IIR_POLE_RE, IIR_POLE_IM), 1.0 / q);
+    const gdouble angle = atan2 (IIR_POLE_IM, IIR_POLE_RE) / q;
+
+    *re = magnitude * cos (angle);
+    *im = magnitude * sin (angle);
+    *real = pow (IIR_POLE_REAL, 1.0 / q);
+}
+
+/* Variance of the causal and anti-causal passes, 2 d / (d - 1)^2 summed over the poles */
+static gdouble
+iir_variance (gdouble q)
+{
+    gdouble re, im, real, c, d;
+
+    scale_poles (q, &re, &im, &real);
+    c = (re - 1.0) * (re - 1.0) - im * im;
+    d = 2.0 * (re - 1.0) * im;
+
+    return 4.0 * (re * c + im * d) / (c * c + d * d) + 2.0 * real / ((real - 1.0) * (real - 1.0));
+}
+
+/*
+ * The scale q is chosen so that the variance matches sigma exactly. The
+ * feedback coefficients are normalized, so that the filter is
+ * w[n] = b * x[n] + b1 * w[n - 1] + b2 * w[n - 2] + b3 * w[n - 3].
+ */
+static void
+make_iir_coefficients (gfloat sigma, gfloat coefficients[4])
+{
+    gdouble low = 0.01;
+    gdouble high = 1000.0;
+    gdouble re, im, real, magnitude;
+
+    for (guint i = 0; i < 64; i++) {
+        const gdouble q = (low + high) / 2.0;
+
+        if (iir_variance (q) < (gdouble) sigma * sigma)
+            low = q;
+        else
+            high = q;
+    }
+
+    scale_poles ((low + high) / 2.0, &re, &im, &real);
+    magnitude = re * re + im * im;
+
+    coefficients[1] = (gfloat) (2.0 * re / magnitude + 1.0 / real);
+    coefficients[2] = (gfloat) (-(1.0 / magnitude + 2.0 * re / (magnitude * real)));
+    coefficients[3] = (gfloat) (1.0 / (magnitude * real));
+    coefficients[0] = 1.0f - coefficients[1] - coefficients[2] - coefficients[3];
+}
+
 static void
 ufo_blur_task_setup (UfoTask *task,
                               UfoResources *resources,
@@ -68,18 +174,37 @@ ufo_blur_task_setup (UfoTask *task,
 
     priv = UFO_BLUR_TASK_GET_PRIVATE (task);
 
-    priv->h_kernel = ufo_resources_get_kernel (resources, "gaussian.cl", "h_gaussian", error);
-
-    if (error && *error)
+    if (!priv->use_gpu)
         return;
 
-    priv->v_kernel = ufo_resources_get_kernel (resources, "gaussian.cl", "v_gaussian", error);
+    if (use_iir (priv)) {
+        priv->iir_kernel = ufo_kernel_cache_get_kernel (resources, "gaussian.cl", "iir_columns", NULL, error);
 
-    if (error && *error)
-        return;
+        if (error && *error)
+            return;
+
+        priv->transpose_kernel = ufo_kernel_cache_get_kernel (resources, "transpose.cl", "transpose", NULL, error);
 
-    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->h_kernel));
-    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->v_kernel));
+        if (error && *error)
+            return;
+
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->iir_kernel));
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->transpose_kernel));
+    }
+    else {
+        priv->h_kernel = ufo_kernel_cache_get_kernel (resources, "gaussian.cl", "h_gaussian", NULL, error);
+
+        if (error && *error)
+            return;
+
+        priv->v_kernel = ufo_kernel_cache_get_kernel (resources, "gaussian.cl", "v_gaussian", NULL, error);
+
+        if (error && *error)
+            return;
+
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->h_kernel));
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->v_kernel));
+    }
 
     priv->context = ufo_resources_get_context (resources);
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
@@ -95,33 +220,20 @@ ufo_blur_task_get_requisition (UfoTask *task,
     priv = UFO_BLUR_TASK_GET_PRIVATE (task);
     ufo_buffer_get_requisition (inputs[0], requisition);
 
-    if (priv->weights_mem == NULL) {
-        guint kernel_size;
+    if (!priv->use_gpu)
+        return;
+
+    if (!use_iir (priv) && priv->weights_mem == NULL) {
         guint kernel_size_2;
         gfloat *weights;
-        gfloat sum;
         cl_int err;
 
-        kernel_size = priv->size;
-        kernel_size_2 = kernel_size / 2;
-        sum = 0.0;
-        weights = g_malloc0 (kernel_size * sizeof(gfloat));
-
-        for (guint i = 0; i < kernel_size_2 + 1; i++) {
-            gfloat x = (gfloat) (kernel_size_2 - i);
-            weights[i] = (gfloat) (1.0 / (priv->sigma * sqrt(2*G_PI)) * exp((x * x) / (-2.0 * priv->sigma * priv->sigma)));
-            weights[kernel_size-i-1] = weights[i];
-        }
-
-        for (guint i = 0; i < kernel_size; i++)
-            sum += weights[i];
-
-        for (guint i = 0; i < kernel_size; i++)
-            weights[i] /= sum;
+        kernel_size_2 = priv->size / 2;
+        weights = make_weights (priv);
 
         priv->weights_mem = clCreateBuffer (priv->context,
                                             CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                            kernel_size * sizeof(gfloat), weights, &err);
+                                            (2 * kernel_size_2 + 1) * sizeof(gfloat), weights, &err);
         UFO_RESOURCES_CHECK_CLERR (err);
 
         UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->h_kernel, 2, sizeof(cl_mem), &priv->weights_mem));
@@ -135,7 +247,7 @@ ufo_blur_task_get_requisition (UfoTask *task,
     if (priv->intermediate_mem == NULL) {
         gsize size;
         cl_int err;
-        
+
         size = requisition->dims[0] * requisition->dims[1] * sizeof (gfloat);
         priv->intermediate_mem = clCreateBuffer (priv->context,
                                                  CL_MEM_READ_WRITE,
@@ -161,7 +273,182 @@ ufo_blur_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_blur_task_get_mode (UfoTask *task)
 {
-    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+    if (UFO_BLUR_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+}
+
+/*
+ * Recursive filter along the columns of a width x height frame, COLUMN_BLOCK
+ * columns at once so that every step is a vector operation on neighbouring
+ * pixels. Works in place.
+ */
+static void
+iir_columns (const gfloat *src, gfloat *dst, gint width, gint height, const gfloat coefficients[4])
+{
+    const gfloat b = coefficients[0];
+    const gfloat b1 = coefficients[1];
+    const gfloat b2 = coefficients[2];
+    const gfloat b3 = coefficients[3];
+
+#pragma omp parallel for schedule(static)
+    for (gint x0 = 0; x0 < width; x0 += COLUMN_BLOCK) {
+        const gint n = MIN (COLUMN_BLOCK, width - x0);
+
+        /* The causal pass starts from the steady state of the first pixel */
+        memmove (dst + x0, src + x0, n * sizeof (gfloat));
+
+        for (gint y = 1; y < height; y++) {
+            const gfloat *in = src + y * width + x0;
+            const gfloat *w1 = dst + (y - 1) * width + x0;
+            const gfloat *w2 = dst + MAX (y - 2, 0) * width + x0;
+            const gfloat *w3 = dst + MAX (y - 3, 0) * width + x0;
+            gfloat *out = dst + y * width + x0;
+
+#pragma omp simd
+            for (gint i = 0; i < n; i++)
+                out[i] = b * in[i] + b1 * w1[i] + b2 * w2[i] + b3 * w3[i];
+        }
+
+        /* The anti-causal pass starts from the steady state of the last one */
+        for (gint y = height - 2; y >= 0; y--) {
+            const gfloat *w1 = dst + (y + 1) * width + x0;
+            const gfloat *w2 = dst + MIN (y + 2, height - 1) * width + x0;
+            const gfloat *w3 = dst + MIN (y + 3, height - 1) * width + x0;
+            gfloat *out = dst + y * width + x0;
+
+#pragma omp simd
+            for (gint i = 0; i < n; i++)
+                out[i] = b * out[i] + b1 * w1[i] + b2 * w2[i] + b3 * w3[i];
+        }
+    }
+}
+
+static void
+blur_iir_host (UfoBlurTaskPrivate *priv, const gfloat *input, gfloat *output,
+               gint width, gint height)
+{
+    gfloat coefficients[4];
+    gfloat *transposed;
+
+    make_iir_coefficients (priv->sigma, coefficients);
+    transposed = g_malloc ((gsize) width * height * sizeof (gfloat));
+
+    iir_columns (input, output, width, height, coefficients);
+    ufo_transpose (output, transposed, width, height);
+    iir_columns (transposed, transposed, height, width, coefficients);
+    ufo_transpose (transposed, output, height, width);
+
+    g_free (transposed);
+}
+
+static void
+blur_fir_host (UfoBlurTaskPrivate *priv, const gfloat *input, gfloat *output,
+               gint width, gint height)
+{
+    const gint half = (gint) priv->size / 2;
+    gfloat *weights;
+    gfloat *rows;
+
+    weights = make_weights (priv);
+    rows = g_malloc ((gsize) width * height * sizeof (gfloat));
+
+#pragma omp parallel
+    {
+        gfloat *padded = g_malloc ((width + 2 * half) * sizeof (gfloat));
+
+#pragma omp for schedule(static)
+        for (gint y = 0; y < height; y++) {
+            const gfloat *row = input + y * width;
+            gfloat *out = rows + y * width;
+
+            for (gint x = -half; x < width + half; x++)
+                padded[x + half] = row[CLAMP (x, 0, width - 1)];
+
+            memset (out, 0, width * sizeof (gfloat));
+
+            for (gint k = 0; k <= 2 * half; k++) {
+                const gfloat weight = weights[k];
+                const gfloat *src = padded + k;
+
+#pragma omp simd
+                for (gint x = 0; x < width; x++)
+                    out[x] += weight * src[x];
+            }
+        }
+
+        g_free (padded);
+
+#pragma omp for schedule(static)
+        for (gint y = 0; y < height; y++) {
+            gfloat *out = output + y * width;
+
+            memset (out, 0, width * sizeof (gfloat));
+
+            for (gint k = -half; k <= half; k++) {
+                const gfloat weight = weights[k + half];
+                const gfloat *src = rows + CLAMP (y + k, 0, height - 1) * width;
+
+#pragma omp simd
+                for (gint x = 0; x < width; x++)
+                    out[x] += weight * src[x];
+            }
+        }
+    }
+
+    g_free (rows);
+    g_free (weights);
+}
+
+static void
+transpose_device (UfoBlurTaskPrivate *priv, cl_command_queue cmd_queue, UfoProfiler *profiler,
+                  cl_mem in_mem, cl_mem out_mem, cl_int width, cl_int height)
+{
+    gsize global_work_size[2];
+    gsize local_work_size[2] = {16, 16};
+
+    global_work_size[0] = (width + 15) / 16 * 16;
+    global_work_size[1] = (height + 15) / 16 * 16;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->transpose_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->transpose_kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->transpose_kernel, 2, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->transpose_kernel, 3, sizeof (cl_int), &height));
+    ufo_profiler_call (profiler, cmd_queue, priv->transpose_kernel, 2, global_work_size, local_work_size);
+}
+
+static void
+iir_columns_device (UfoBlurTaskPrivate *priv, cl_command_queue cmd_queue, UfoProfiler *profiler,
+                    cl_mem in_mem, cl_mem out_mem, cl_int width, cl_int height)
+{
+    gsize global_work_size = (gsize) width;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->iir_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->iir_kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->iir_kernel, 2, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->iir_kernel, 3, sizeof (cl_int), &height));
+    ufo_profiler_call (profiler, cmd_queue, priv->iir_kernel, 1, &global_work_size, NULL);
+}
+
+/* Filter the columns, then the rows by filtering the columns of the transposed frame */
+static void
+blur_iir_device (UfoBlurTaskPrivate *priv, cl_command_queue cmd_queue, UfoProfiler *profiler,
+                 cl_mem in_mem, cl_mem out_mem, UfoRequisition *requisition)
+{
+    const cl_int width = (cl_int) requisition->dims[0];
+    const cl_int height = (cl_int) requisition->dims[1];
+    gfloat coefficients[4];
+
+    make_iir_coefficients (priv->sigma, coefficients);
+
+    for (guint i = 0; i < 4; i++)
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->iir_kernel, 4 + i, sizeof (cl_float), &coefficients[i]));
+
+    iir_columns_device (priv, cmd_queue, profiler, in_mem, priv->intermediate_mem, width, height);
+    transpose_device (priv, cmd_queue, profiler, priv->intermediate_mem, out_mem, width, height);
+    iir_columns_device (priv, cmd_queue, profiler, out_mem, priv->intermediate_mem, height, width);
+    transpose_device (priv, cmd_queue, profiler, priv->intermediate_mem, out_mem, height, width);
 }
 
 static gboolean
@@ -177,10 +464,33 @@ ufo_blur_task_process (UfoTask *task,
     cl_mem out_mem;
 
     priv = UFO_BLUR_TASK_GET_PRIVATE (task);
+
+    if (!priv->use_gpu) {
+        const gfloat *host_in = ufo_buffer_get_host_array (inputs[0], NULL);
+        gfloat *host_out = ufo_buffer_get_host_array (output, NULL);
+        const gint width = (gint) requisition->dims[0];
+        const gint height = (gint) requisition->dims[1];
+
+        if (use_iir (priv))
+            blur_iir_host (priv, host_in, host_out, width, height);
+        else
+            blur_fir_host (priv, host_in, host_out, width, height);
+
+        return TRUE;
+    }
+
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
 
     in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    if (use_iir (priv)) {
+        blur_iir_device (priv, cmd_queue, ufo_task_node_get_profiler (UFO_TASK_NODE (task)),
+                         in_mem, out_mem, requisition);
+        return TRUE;
+    }
+
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->h_kernel, 0, sizeof(cl_mem), &in_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->h_kernel, 1, sizeof(cl_mem), &priv->intermediate_mem));
 
@@ -189,7 +499,6 @@ ufo_blur_task_process (UfoTask *task,
                                                        2, NULL, requisition->dims, NULL,
                                                        0, NULL, NULL));
 
-    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->v_kernel, 0, sizeof(cl_mem), &priv->intermediate_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->v_kernel, 1, sizeof(cl_mem), &out_mem));
 
@@ -215,6 +524,12 @@ ufo_blur_task_set_property (GObject *object,
         case PROP_SIGMA:
             priv->sigma = g_value_get_float(value);
             break;
+        case PROP_IIR_THRESHOLD:
+            priv->iir_threshold = g_value_get_float(value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -236,6 +551,12 @@ ufo_blur_task_get_property (GObject *object,
         case PROP_SIGMA:
             g_value_set_float(value, priv->sigma);
             break;
+        case PROP_IIR_THRESHOLD:
+            g_value_set_float(value, priv->iir_threshold);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean(value, priv->use_gpu);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -259,6 +580,16 @@ ufo_blur_task_finalize (GObject *object)
         priv->v_kernel = NULL;
     }
 
+    if (priv->iir_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->iir_kernel));
+        priv->iir_kernel = NULL;
+    }
+
+    if (priv->transpose_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->transpose_kernel));
+        priv->transpose_kernel = NULL;
+    }
+
     if (priv->weights_mem) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->weights_mem));
         priv->weights_mem = NULL;
@@ -311,6 +642,20 @@ ufo_blur_task_class_init (UfoBlurTaskClass *klass)
                            1.0f, 1000.0f, 1.0f,
                            G_PARAM_READWRITE);
 
+    properties[PROP_IIR_THRESHOLD] =
+        g_param_spec_float("iir-threshold",
+                           "Sigma from which on a recursive filter is used",
+                           "Sigma from which on a recursive filter is used, whose cost does not depend on sigma and size",
+                           1.0f, G_MAXFLOAT, 4.0f,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean("use-gpu",
+                             "Blur on the GPU",
+                             "Blur on the GPU",
+                             TRUE,
+                             G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -324,6 +669,8 @@ ufo_blur_task_init(UfoBlurTask *self)
 
     self->priv->size = 5;
     self->priv->sigma = 1.0f;
+    self->priv->iir_threshold = 4.0f;
+    self->priv->use_gpu = TRUE;
     self->priv->weights_mem = NULL;
     self->priv->intermediate_mem = NULL;
 }
@@ -16,9 +16,8 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <string.h> 
+#include <string.h>
 #include <glib.h>
-#include <glib/gprintf.h>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -27,13 +26,31 @@
 #endif
 
 #include "ufo-calculate-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-expr.h"
 
+/* Inputs are named a, b, c, ... */
+#define MAX_INPUTS 8
+
+/* Launch configuration of calculate_reduce in kernels/calculate.cl */
+#define REDUCE_GROUPS 64
+#define REDUCE_LOCAL_SIZE 256
+
+/* Scalars of every input available as <reduction>_<input>, e.g. mean_a */
+static const gchar *reductions[] = {"sum", "mean", "min", "max"};
+
+#define N_REDUCTIONS G_N_ELEMENTS (reductions)
 
 struct _UfoCalculateTaskPrivate {
     cl_context context;
-    cl_program program;
     cl_kernel kernel;
+    cl_kernel reduce_kernel;
+    cl_mem partials_mem;
+    UfoExpr *expr;
     gchar *expression;
+    guint n_inputs;
+    gboolean use_gpu;
+    gboolean reduce[MAX_INPUTS];
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -47,40 +64,187 @@ G_DEFINE_TYPE_WITH_CODE (UfoCalculateTask, ufo_calculate_task, UFO_TYPE_TASK_NOD
 enum {
     PROP_0,
     PROP_EXPRESSION,
+    PROP_NUM_INPUTS,
+    PROP_USE_GPU,
     N_PROPERTIES
 };
 
 static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
+static gboolean
+is_identifier_char (gchar c)
+{
+    return g_ascii_isalnum (c) || c == '_';
+}
+
+static gboolean
+uses_identifier (const gchar *expression, const gchar *name)
+{
+    const gsize length = strlen (name);
+
+    for (const gchar *p = strstr (expression, name); p != NULL; p = strstr (p + 1, name)) {
+        if ((p == expression || !(is_identifier_char (p[-1]) || p[-1] == '.')) &&
+            !is_identifier_char (p[length]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Name of the variable assigned to by @statement or NULL */
+static gchar *
+get_assignment_target (const gchar *statement)
+{
+    const gchar *p = statement;
+    const gchar *end;
+
+    if (!(g_ascii_isalpha (*p) || *p == '_'))
+        return NULL;
+
+    while (is_identifier_char (*p))
+        p++;
+
+    end = p;
+
+    while (g_ascii_isspace (*p))
+        p++;
+
+    if (p[0] != '=' || p[1] == '=')
+        return NULL;
+
+    return g_strndup (statement, end - statement);
+}
+
+/*
+ * The expression is a list of statements separated by semicolons, the last
+ * one is the result. Statements assigning to a new name declare a float
+ * temporary. The inputs are bound to a, b, ... (v is the first input), the
+ * pixel coordinates to x, y and z and the linear index to i. Like in the host
+ * evaluator, all of them are 32-bit ints, only addressing uses size_t.
+ */
+static gchar *
+make_source (UfoCalculateTaskPrivate *priv)
+{
+    GString *source;
+    GHashTable *declared;
+    gchar **statements;
+    const gchar *result = "0.0f";
+    gint last = -1;
+
+    source = g_string_new ("kernel void calculate (");
+
+    for (guint k = 0; k < priv->n_inputs; k++)
+        g_string_append_printf (source, "global const float *in_%c, ", 'a' + k);
+
+    g_string_append (source, "global float *output");
+
+    for (guint k = 0; k < priv->n_inputs; k++) {
+        for (guint r = 0; r < N_REDUCTIONS; r++)
+            g_string_append_printf (source, ", const float %s_%c", reductions[r], 'a' + k);
+    }
+
+    g_string_append (source, ")\n{\n"
+                     "const int x = get_global_id (0);\n"
+                     "const int y = get_global_id (1);\n"
+                     "const int z = get_global_id (2);\n"
+                     "const size_t linear_index = ((size_t) z * get_global_size (1) + y) * get_global_size (0) + x;\n"
+                     "const int i = (int) linear_index;\n");
+
+    for (guint k = 0; k < priv->n_inputs; k++)
+        g_string_append_printf (source, "const float %c = in_%c[linear_index];\n", 'a' + k, 'a' + k);
+
+    g_string_append (source, "const float v = a;\n");
+
+    statements = g_strsplit (priv->expression != NULL ? priv->expression : "", ";", -1);
+    declared = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (gint j = 0; statements[j] != NULL; j++) {
+        if (*g_strstrip (statements[j]) != '\0')
+            last = j;
+    }
+
+    for (gint j = 0; j < last; j++) {
+        gchar *target;
+
+        if (*statements[j] == '\0')
+            continue;
+
+        target = get_assignment_target (statements[j]);
+
+        if (target != NULL && !g_hash_table_contains (declared, target)) {
+            g_string_append_printf (source, "float %s;\n", statements[j]);
+            g_hash_table_add (declared, target);
+        }
+        else {
+            g_string_append_printf (source, "%s;\n", statements[j]);
+            g_free (target);
+        }
+    }
+
+    if (last >= 0)
+        result = statements[last];
+
+    g_string_append_printf (source, "output[linear_index] = %s;\n}\n", result);
+
+    g_hash_table_destroy (declared);
+    g_strfreev (statements);
+
+    return g_string_free (source, FALSE);
+}
+
 static void
 make_kernel (UfoCalculateTaskPrivate *priv, UfoResources *resources, GError **error)
 {
-    const gchar *template = "kernel void calculate (global float *input, "\
-                            "global float *output) {int x = get_global_id (0); "\
-                            "float v = input[x]; output[x] = %s;}";
-    gchar default_expression[] = "0.0f";
-    gchar *source, *expression;
-        
-    expression = priv->expression == NULL ? default_expression : priv->expression;
-    source = (gchar *) g_try_malloc (strlen (template) + strlen (expression));
-
-    if (source == NULL) {
-        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
-                     "Error allocating kernel string memory");
-        return;
-    }
+    gchar *source;
 
     if (priv->kernel) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
     }
 
-    if ((gsize) g_sprintf (source, template, expression) != strlen (source)) {
-        g_warning ("Error writing kernel source");
+    /* The kernel cache keys binaries by source, i.e. by expression */
+    source = make_source (priv);
+    priv->kernel = ufo_kernel_cache_get_kernel_from_source (resources, source, "calculate", NULL, error);
+    g_free (source);
+
+    if (priv->kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+}
+
+/*
+ * Host version of the expression with the same names as the kernel, the
+ * scalars are ordered by input and then by reduction.
+ */
+static UfoExpr *
+make_expr (UfoCalculateTaskPrivate *priv, GError **error)
+{
+    gchar *input_names[MAX_INPUTS + 2];
+    gchar *scalar_names[MAX_INPUTS * N_REDUCTIONS + 1];
+    UfoExpr *expr;
+    guint n_scalars = 0;
+
+    for (guint k = 0; k < priv->n_inputs; k++) {
+        input_names[k] = g_strdup_printf ("%c", 'a' + k);
+
+        for (guint r = 0; r < N_REDUCTIONS; r++)
+            scalar_names[n_scalars++] = g_strdup_printf ("%s_%c", reductions[r], 'a' + k);
     }
 
-    priv->kernel = ufo_resources_get_kernel_from_source(resources, source, "calculate", error);
-    UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
-    g_free (source);
+    input_names[priv->n_inputs] = g_strdup ("v");
+    input_names[priv->n_inputs + 1] = NULL;
+    scalar_names[n_scalars] = NULL;
+
+    expr = ufo_expr_new (priv->expression != NULL ? priv->expression : "0.0f",
+                         (const gchar * const *) input_names,
+                         (const gchar * const *) scalar_names, error);
+
+    for (guint k = 0; input_names[k] != NULL; k++)
+        g_free (input_names[k]);
+
+    for (guint k = 0; k < n_scalars; k++)
+        g_free (scalar_names[k]);
+
+    return expr;
 }
 
 UfoNode *
@@ -95,12 +259,50 @@ ufo_calculate_task_setup (UfoTask *task,
                           GError **error)
 {
     UfoCalculateTaskPrivate *priv;
+    gboolean any_reduction = FALSE;
 
     priv = UFO_CALCULATE_TASK_GET_PRIVATE (task);
 
+    for (guint k = 0; k < priv->n_inputs; k++) {
+        priv->reduce[k] = FALSE;
+
+        for (guint r = 0; r < N_REDUCTIONS && priv->expression != NULL; r++) {
+            gchar *name = g_strdup_printf ("%s_%c", reductions[r], 'a' + k);
+
+            priv->reduce[k] |= uses_identifier (priv->expression, name);
+            g_free (name);
+        }
+
+        any_reduction |= priv->reduce[k];
+    }
+
+    /*
+     * Without a GPU the expression must be understood by the host evaluator,
+     * otherwise it is only used for inputs that are already on the host.
+     */
+    ufo_expr_free (priv->expr);
+    priv->expr = make_expr (priv, priv->use_gpu ? NULL : error);
+
+    if (!priv->use_gpu)
+        return;
+
     priv->context = ufo_resources_get_context (resources);
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
     make_kernel (priv, resources, error);
+
+    if (any_reduction && priv->reduce_kernel == NULL) {
+        cl_int errcode;
+
+        priv->reduce_kernel = ufo_kernel_cache_get_kernel (resources, "calculate.cl", "calculate_reduce", NULL, error);
+
+        if (priv->reduce_kernel == NULL)
+            return;
+
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->reduce_kernel));
+        priv->partials_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                             3 * REDUCE_GROUPS * sizeof (cl_float), NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+    }
 }
 
 static void
@@ -114,21 +316,120 @@ ufo_calculate_task_get_requisition (UfoTask *task,
 static guint
 ufo_calculate_task_get_num_inputs (UfoTask *task)
 {
-    return 1;
+    return UFO_CALCULATE_TASK_GET_PRIVATE (task)->n_inputs;
 }
 
 static guint
 ufo_calculate_task_get_num_dimensions (UfoTask *task,
                                        guint input)
 {
-    g_return_val_if_fail (input == 0, 0);
+    g_return_val_if_fail (input < UFO_CALCULATE_TASK_GET_PRIVATE (task)->n_inputs, 0);
     return 2;
 }
 
 static UfoTaskMode
 ufo_calculate_task_get_mode (UfoTask *task)
 {
-    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+    if (UFO_CALCULATE_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+}
+
+/* Sum, mean, minimum and maximum of the @n values of @in_mem */
+static void
+reduce_device (UfoCalculateTaskPrivate *priv, cl_command_queue cmd_queue, UfoProfiler *profiler,
+               cl_mem in_mem, gsize n, cl_float result[N_REDUCTIONS])
+{
+    gsize global_work_size = REDUCE_GROUPS * REDUCE_LOCAL_SIZE;
+    gsize local_work_size = REDUCE_LOCAL_SIZE;
+    cl_float partials[3 * REDUCE_GROUPS];
+    cl_ulong count = n;
+    gdouble sum = 0.0;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->reduce_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->reduce_kernel, 1, sizeof (cl_mem), &priv->partials_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->reduce_kernel, 2, sizeof (cl_ulong), &count));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->reduce_kernel, 3, 3 * REDUCE_LOCAL_SIZE * sizeof (cl_float), NULL));
+    ufo_profiler_call (profiler, cmd_queue, priv->reduce_kernel, 1, &global_work_size, &local_work_size);
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBuffer (cmd_queue, priv->partials_mem, CL_TRUE,
+                                                    0, sizeof (partials), partials, 0, NULL, NULL));
+
+    result[2] = partials[1];
+    result[3] = partials[2];
+
+    for (guint g = 0; g < REDUCE_GROUPS; g++) {
+        sum += partials[3 * g];
+        result[2] = MIN (result[2], partials[3 * g + 1]);
+        result[3] = MAX (result[3], partials[3 * g + 2]);
+    }
+
+    result[0] = (cl_float) sum;
+    result[1] = (cl_float) (sum / n);
+}
+
+/* Host version of reduce_device */
+static void
+reduce_host (const gfloat *data, gsize n, gfloat result[N_REDUCTIONS])
+{
+    const gint64 size = (gint64) n;
+    gfloat low = data[0];
+    gfloat high = data[0];
+    gdouble sum = 0.0;
+
+#pragma omp parallel for simd reduction(+:sum) reduction(min:low) reduction(max:high)
+    for (gint64 i = 0; i < size; i++) {
+        sum += data[i];
+        low = MIN (low, data[i]);
+        high = MAX (high, data[i]);
+    }
+
+    result[0] = (gfloat) sum;
+    result[1] = (gfloat) (sum / n);
+    result[2] = low;
+    result[3] = high;
+}
+
+static gboolean
+inputs_on_host (UfoCalculateTaskPrivate *priv, UfoBuffer **inputs)
+{
+    for (guint k = 0; k < priv->n_inputs; k++) {
+        if (ufo_buffer_get_location (inputs[k]) != UFO_BUFFER_LOCATION_HOST)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+process_host (UfoCalculateTaskPrivate *priv,
+              UfoBuffer **inputs,
+              UfoBuffer *output,
+              UfoRequisition *requisition)
+{
+    const gfloat *arrays[MAX_INPUTS + 1];
+    gfloat scalars[MAX_INPUTS * N_REDUCTIONS] = { 0.0f };
+    gsize dims[3] = { 1, 1, 1 };
+    gsize n_pixels = 1;
+
+    for (guint i = 0; i < requisition->n_dims; i++) {
+        dims[i] = requisition->dims[i];
+        n_pixels *= dims[i];
+    }
+
+    for (guint k = 0; k < priv->n_inputs; k++) {
+        arrays[k] = ufo_buffer_get_host_array (inputs[k], NULL);
+
+        if (priv->reduce[k])
+            reduce_host (arrays[k], n_pixels, &scalars[k * N_REDUCTIONS]);
+    }
+
+    /* v is the first input */
+    arrays[priv->n_inputs] = arrays[0];
+
+    ufo_expr_evaluate (priv->expr, arrays, scalars, ufo_buffer_get_host_array (output, NULL),
+                       dims[0], dims[1], dims[2]);
 }
 
 static gboolean
@@ -138,30 +439,45 @@ ufo_calculate_task_process (UfoTask *task,
                             UfoRequisition *requisition)
 {
     UfoCalculateTaskPrivate *priv;
-    UfoRequisition in_req;
     UfoGpuNode *node;
     UfoProfiler *profiler;
-    cl_command_queue *cmd_queue;
-    cl_mem in_mem;
+    cl_command_queue cmd_queue;
     cl_mem out_mem;
-    gsize global_work_size = 1;
-    guint i;
+    gsize n_pixels = 1;
 
     priv = UFO_CALCULATE_TASK_GET_PRIVATE (task);
-    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    /* Saves the transfers to and from the device for data already on the host */
+    if (!priv->use_gpu || (priv->expr != NULL && inputs_on_host (priv, inputs))) {
+        process_host (priv, inputs, output, requisition);
+        return TRUE;
+    }
+
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE(task)));
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
-    in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
     out_mem = ufo_buffer_get_device_array (output, cmd_queue);
 
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
+    for (guint i = 0; i < requisition->n_dims; i++)
+        n_pixels *= requisition->dims[i];
+
+    for (guint k = 0; k < priv->n_inputs; k++) {
+        cl_mem in_mem = ufo_buffer_get_device_array (inputs[k], cmd_queue);
+        cl_float scalars[N_REDUCTIONS] = { 0.0f };
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, k, sizeof (cl_mem), &in_mem));
 
-    for (i = 0; i < in_req.n_dims; i++) {
-        global_work_size *= in_req.dims[i];
+        if (priv->reduce[k])
+            reduce_device (priv, cmd_queue, profiler, in_mem, n_pixels, scalars);
+
+        for (guint r = 0; r < N_REDUCTIONS; r++) {
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, priv->n_inputs + 1 + k * N_REDUCTIONS + r,
+                                                       sizeof (cl_float), &scalars[r]));
+        }
     }
-    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 1, &global_work_size, NULL);
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, priv->n_inputs, sizeof (cl_mem), &out_mem));
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, requisition->n_dims, requisition->dims, NULL);
 
     return TRUE;
 }
@@ -176,8 +492,15 @@ ufo_calculate_task_set_property (GObject *object,
 
     switch (property_id) {
         case PROP_EXPRESSION:
+            g_free (priv->expression);
             priv->expression = g_value_dup_string (value);
             break;
+        case PROP_NUM_INPUTS:
+            priv->n_inputs = g_value_get_uint (value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -196,6 +519,12 @@ ufo_calculate_task_get_property (GObject *object,
         case PROP_EXPRESSION:
             g_value_set_string (value, priv->expression);
             break;
+        case PROP_NUM_INPUTS:
+            g_value_set_uint (value, priv->n_inputs);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -211,11 +540,20 @@ ufo_calculate_task_finalize (GObject *object)
         clReleaseKernel (priv->kernel);
         priv->kernel = NULL;
     }
+    if (priv->reduce_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->reduce_kernel));
+        priv->reduce_kernel = NULL;
+    }
+    if (priv->partials_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->partials_mem));
+        priv->partials_mem = NULL;
+    }
     if (priv->context) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
         priv->context = NULL;
     }
 
+    ufo_expr_free (priv->expr);
     g_free (priv->expression);
 
     G_OBJECT_CLASS (ufo_calculate_task_parent_class)->finalize (object);
@@ -244,12 +582,27 @@ ufo_calculate_task_class_init (UfoCalculateTaskClass *klass)
     properties[PROP_EXPRESSION] =
         g_param_spec_string ("expression",
                              "Arithmetic expression to calculate",
-                             "Arithmetic expression to calculate, you can use \"v\""\
-                             "to access the values in the input and \"x\""\
-                             "to access the indices of the input values",
+                             "Arithmetic expression to calculate, statements separated by \";\", "\
+                             "the last one is the result. Use \"a\", \"b\", ... (or \"v\") to "\
+                             "access the input values, \"x\", \"y\", \"z\" for the pixel "\
+                             "coordinates and \"i\" for the linear index",
                              "0.0f",
                              G_PARAM_READWRITE);
 
+    properties[PROP_NUM_INPUTS] =
+        g_param_spec_uint ("num-inputs",
+                           "Number of inputs",
+                           "Number of inputs, named a, b, c, ... in the expression",
+                           1, MAX_INPUTS, 1,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+                              "Calculate on the GPU",
+                              "Calculate on the GPU, otherwise the expression is evaluated on the host",
+                              TRUE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -261,4 +614,10 @@ ufo_calculate_task_init(UfoCalculateTask *self)
 {
     self->priv = UFO_CALCULATE_TASK_GET_PRIVATE(self);
     self->priv->expression = NULL;
+    self->priv->n_inputs = 1;
+    self->priv->use_gpu = TRUE;
+    self->priv->expr = NULL;
+    self->priv->kernel = NULL;
+    self->priv->reduce_kernel = NULL;
+    self->priv->partials_mem = NULL;
 }
@@ -17,18 +17,52 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <math.h>
+#include <stdlib.h>
 #include "ufo-center-of-rotation-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-fft.h"
+
+/* Must match center-of-rotation.cl */
+#define BLOCK_SIZE 128
 
 /**
  * SECTION:ufo-center-of-rotation-task
  * @Short_description: Compute the center of rotation
  * @Title: center_of_rotation
  *
+ * Every sinogram row is cross-correlated with the mirrored row 180 degrees
+ * later using FFTs. The peak is refined to sub-pixel precision with a
+ * parabola fit and the median over all row pairs gives the center of the
+ * sinogram. The #UfoCenterOfRotationTask:center property holds the median
+ * over all sinograms seen so far, #UfoCenterOfRotationTask:centers the
+ * individual values, which can be used to detect a tilted axis.
  */
 
 struct _UfoCenterOfRotationTaskPrivate {
     gdouble angle_step;
     gdouble center;
+    GArray *centers;
+
+    cl_context context;
+    cl_kernel pack_kernel;
+    cl_kernel cross_kernel;
+    cl_kernel peak_kernel;
+    cl_mem packed_mem;
+    cl_mem spectrum_mem;
+    cl_mem peaks_mem;
+    UfoFft *fft;
+    UfoFftParameter param;
+    gsize n_pairs;
+    gfloat *peaks;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -43,6 +77,7 @@ enum {
     PROP_0,
     PROP_ANGLE_STEP,
     PROP_CENTER,
+    PROP_CENTERS,
     N_PROPERTIES
 };
 
@@ -54,11 +89,34 @@ ufo_center_of_rotation_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_CENTER_OF_ROTATION_TASK, NULL));
 }
 
+static cl_kernel
+get_kernel (UfoResources *resources, const gchar *name, GError **error)
+{
+    cl_kernel kernel;
+
+    kernel = ufo_kernel_cache_get_kernel (resources, "center-of-rotation.cl", name, NULL, error);
+
+    if (kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (kernel));
+
+    return kernel;
+}
+
 static void
 ufo_center_of_rotation_task_setup (UfoTask *task,
                                    UfoResources *resources,
                                    GError **error)
 {
+    UfoCenterOfRotationTaskPrivate *priv;
+
+    priv = UFO_CENTER_OF_ROTATION_TASK_GET_PRIVATE (task);
+
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    priv->pack_kernel = get_kernel (resources, "cor_pack", error);
+    priv->cross_kernel = get_kernel (resources, "cor_cross_spectrum", error);
+    priv->peak_kernel = get_kernel (resources, "cor_peak", error);
 }
 
 static void
@@ -85,26 +143,100 @@ ufo_center_of_rotation_task_get_num_dimensions (UfoTask *task, guint input)
 static UfoTaskMode
 ufo_center_of_rotation_task_get_mode (UfoTask *task)
 {
-    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
 }
 
-static guint
-minimum_index (gfloat *data, guint n_elements)
+static void
+release_buffers (UfoCenterOfRotationTaskPrivate *priv)
 {
-    guint index;
-    gfloat min;
+    if (priv->packed_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->packed_mem));
+        priv->packed_mem = NULL;
+    }
 
-    index = 0;
-    min = data[index];
+    if (priv->spectrum_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->spectrum_mem));
+        priv->spectrum_mem = NULL;
+    }
 
-    for (guint i = 1; i < n_elements; i++) {
-        if (data[i] < min) {
-            index = i;
-            min = data[i];
-        }
+    if (priv->peaks_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->peaks_mem));
+        priv->peaks_mem = NULL;
     }
 
-    return index;
+    g_free (priv->peaks);
+    priv->peaks = NULL;
+}
+
+static void
+update_buffers (UfoCenterOfRotationTaskPrivate *priv,
+                cl_command_queue queue,
+                gsize padded_width,
+                gsize n_pairs)
+{
+    gsize size;
+    cl_int errcode;
+
+    if (priv->packed_mem != NULL && priv->param.size[0] == padded_width && priv->n_pairs == n_pairs)
+        return;
+
+    release_buffers (priv);
+
+    priv->n_pairs = n_pairs;
+    priv->param.dimensions = UFO_FFT_1D;
+    priv->param.size[0] = padded_width;
+    priv->param.size[1] = 1;
+    priv->param.size[2] = 1;
+    priv->param.batch = n_pairs;
+    priv->param.zeropad = FALSE;
+    UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft, priv->context, queue, &priv->param));
+
+    size = padded_width * n_pairs * 2 * sizeof (gfloat);
+    priv->packed_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    priv->spectrum_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    priv->peaks_mem = clCreateBuffer (priv->context, CL_MEM_WRITE_ONLY, n_pairs * 4 * sizeof (gfloat), NULL, &errcode);
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    priv->peaks = g_malloc (n_pairs * 4 * sizeof (gfloat));
+}
+
+static gint
+compare_doubles (gconstpointer a, gconstpointer b)
+{
+    const gdouble x = *((const gdouble *) a);
+    const gdouble y = *((const gdouble *) b);
+
+    return (x > y) - (x < y);
+}
+
+static gdouble
+median (const gdouble *values, guint n_values)
+{
+    gdouble *sorted;
+    gdouble result;
+
+    sorted = g_memdup (values, n_values * sizeof (gdouble));
+    qsort (sorted, n_values, sizeof (gdouble), compare_doubles);
+    result = n_values % 2 ? sorted[n_values / 2] : (sorted[n_values / 2 - 1] + sorted[n_values / 2]) / 2.0;
+    g_free (sorted);
+
+    return result;
+}
+
+/*
+ * Sub-pixel position of the peak at @index with neighbours @left and @right
+ * from a parabola through the three values.
+ */
+static gdouble
+refine_peak (gdouble index, gdouble left, gdouble peak, gdouble right)
+{
+    const gdouble denominator = left - 2.0 * peak + right;
+
+    if (denominator >= 0.0)
+        return index;
+
+    return index + CLAMP (0.5 * (left - right) / denominator, -0.5, 0.5);
 }
 
 static gboolean
@@ -114,52 +246,106 @@ ufo_center_of_rotation_task_process (UfoTask *task,
                                      UfoRequisition *requisition)
 {
     UfoCenterOfRotationTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
     UfoRequisition in_req;
-    guint width;
-    guint height;
-    gfloat *proj_0;
-    gfloat *proj_180;
-    guint max_displacement;
-    guint N;
-    guint score_index;
-    gfloat *scores;
+    cl_command_queue queue;
+    cl_mem in_mem;
+    gint width, height, offset, padded_width, max_shift;
+    gsize n_pairs;
+    gsize global_work_size[2];
+    gsize local_work_size[2] = {BLOCK_SIZE, 1};
+    gdouble *centers;
+    gdouble center;
 
     priv = UFO_CENTER_OF_ROTATION_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
 
     ufo_buffer_get_requisition (inputs[0], &in_req);
-    width = (guint) in_req.dims[0];
-    height = (guint) in_req.dims[1];
+    width = (gint) in_req.dims[0];
+    height = (gint) in_req.dims[1];
 
-    proj_0 = ufo_buffer_get_host_array (inputs[0], NULL);
-    proj_180 = proj_0 + (height - 1) * width;
+    if (height < 2) {
+        g_warning ("center-of-rotation: sinogram needs at least two rows");
+        return TRUE;
+    }
 
-    max_displacement = width / 2;
-    N = max_displacement * 2 - 1;
-    scores = g_malloc0 (N * sizeof(gfloat));
+    /* Pair every row with the one 180 degrees later, if the sinogram does not
+     * cover 180 degrees use the first and the last row */
+    offset = (gint) round (G_PI / priv->angle_step);
 
-    for (gint displacement = (-((gint) max_displacement) + 1); displacement < 0; displacement++) {
-        const guint index = (guint) displacement + max_displacement - 1;
-        const guint max_x = width - ((guint) ABS (displacement));
+    if (offset < 1 || offset >= height)
+        offset = height - 1;
 
-        for (guint x = 0; x < max_x; x++) {
-            gfloat diff = proj_0[x] - proj_180[(max_x - x + 1)];
-            scores[index] += diff * diff;
-        }
-    }
+    n_pairs = height - offset;
+    max_shift = width - 1;
+
+    /* Large enough to avoid wrap-around of the correlation */
+    for (padded_width = 1; padded_width < 2 * width; padded_width *= 2)
+        ;
+
+    update_buffers (priv, queue, padded_width, n_pairs);
+    in_mem = ufo_buffer_get_device_array (inputs[0], queue);
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 1, sizeof (cl_mem), &priv->packed_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 2, sizeof (gint), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 3, sizeof (gint), &offset));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->pack_kernel, 4, sizeof (gint), &padded_width));
+    global_work_size[0] = BLOCK_SIZE;
+    global_work_size[1] = n_pairs;
+    ufo_profiler_call (profiler, queue, priv->pack_kernel, 2, global_work_size, local_work_size);
+
+    UFO_RESOURCES_CHECK_CLERR (ufo_fft_execute (priv->fft, queue, profiler,
+                                                priv->packed_mem, priv->spectrum_mem, UFO_FFT_FORWARD,
+                                                0, NULL, NULL));
 
-    for (guint displacement = 0; displacement < max_displacement; displacement++) {
-        const guint index = displacement + max_displacement - 1;
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->cross_kernel, 0, sizeof (cl_mem), &priv->spectrum_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->cross_kernel, 1, sizeof (cl_mem), &priv->packed_mem));
+    global_work_size[0] = padded_width;
+    ufo_profiler_call (profiler, queue, priv->cross_kernel, 2, global_work_size, NULL);
 
-        for (guint x = 0; x < width-displacement; x++) {
-            gfloat diff = proj_0[x+displacement] - proj_180[(width-x+1)];
-            scores[index] += diff * diff;
-        }
+    UFO_RESOURCES_CHECK_CLERR (ufo_fft_execute (priv->fft, queue, profiler,
+                                                priv->packed_mem, priv->spectrum_mem, UFO_FFT_BACKWARD,
+                                                0, NULL, NULL));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->peak_kernel, 0, sizeof (cl_mem), &priv->spectrum_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->peak_kernel, 1, sizeof (cl_mem), &priv->peaks_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->peak_kernel, 2, sizeof (gint), &max_shift));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->peak_kernel, 3, sizeof (gint), &padded_width));
+    global_work_size[0] = BLOCK_SIZE;
+    ufo_profiler_call (profiler, queue, priv->peak_kernel, 2, global_work_size, local_work_size);
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBuffer (queue, priv->peaks_mem, CL_TRUE,
+                                                    0, n_pairs * 4 * sizeof (gfloat), priv->peaks,
+                                                    0, NULL, NULL));
+
+    centers = g_malloc (n_pairs * sizeof (gdouble));
+
+    for (gsize i = 0; i < n_pairs; i++) {
+        const gfloat *peak = priv->peaks + 4 * i;
+        gdouble shift = refine_peak (peak[0], peak[1], peak[2], peak[3]);
+
+        if (shift >= padded_width / 2)
+            shift -= padded_width;
+
+        /* The mirrored row matches the first one shifted by 2 * center - width */
+        centers[i] = (width + shift) / 2.0;
     }
 
-    score_index = minimum_index (scores, N);
-    priv->center = (width + score_index - max_displacement + 1) / 2.0;
+    center = median (centers, n_pairs);
+    g_array_append_val (priv->centers, center);
+    g_free (centers);
+
+    priv->center = median ((gdouble *) priv->centers->data, priv->centers->len);
+    g_debug ("center-of-rotation: %f (sinogram %u), %f (median)",
+             center, priv->centers->len - 1, priv->center);
+
+    g_object_notify_by_pspec (G_OBJECT (task), properties[PROP_CENTERS]);
     g_object_notify_by_pspec (G_OBJECT (task), properties[PROP_CENTER]);
-    g_free (scores);
+
     return TRUE;
 }
 
@@ -196,6 +382,23 @@ ufo_center_of_rotation_task_get_property (GObject *object,
         case PROP_CENTER:
             g_value_set_double (value, priv->center);
             break;
+        case PROP_CENTERS:
+            {
+                GValueArray *array;
+                GValue element = G_VALUE_INIT;
+
+                array = g_value_array_new (priv->centers->len);
+                g_value_init (&element, G_TYPE_DOUBLE);
+
+                for (guint i = 0; i < priv->centers->len; i++) {
+                    g_value_set_double (&element, g_array_index (priv->centers, gdouble, i));
+                    g_value_array_append (array, &element);
+                }
+
+                g_value_unset (&element);
+                g_value_take_boxed (value, array);
+            }
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -205,6 +408,39 @@ ufo_center_of_rotation_task_get_property (GObject *object,
 static void
 ufo_center_of_rotation_task_finalize (GObject *object)
 {
+    UfoCenterOfRotationTaskPrivate *priv;
+
+    priv = UFO_CENTER_OF_ROTATION_TASK_GET_PRIVATE (object);
+
+    release_buffers (priv);
+
+    if (priv->pack_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->pack_kernel));
+        priv->pack_kernel = NULL;
+    }
+
+    if (priv->cross_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->cross_kernel));
+        priv->cross_kernel = NULL;
+    }
+
+    if (priv->peak_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->peak_kernel));
+        priv->peak_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    if (priv->fft) {
+        ufo_fft_destroy (priv->fft);
+        priv->fft = NULL;
+    }
+
+    g_array_free (priv->centers, TRUE);
+
     G_OBJECT_CLASS (ufo_center_of_rotation_task_parent_class)->finalize (object);
 }
 
@@ -242,6 +478,17 @@ ufo_center_of_rotation_task_class_init (UfoCenterOfRotationTaskClass *klass)
                             -G_MAXDOUBLE, G_MAXDOUBLE, 0.0,
                             G_PARAM_READABLE);
 
+    properties[PROP_CENTERS] =
+        g_param_spec_value_array ("centers",
+                                  "Centers of rotation of all sinograms",
+                                  "Centers of rotation of all sinograms in the order of arrival",
+                                  g_param_spec_double ("center-value",
+                                                       "Center value",
+                                                       "Center of rotation of one sinogram",
+                                                       -G_MAXDOUBLE, G_MAXDOUBLE, 0.0,
+                                                       G_PARAM_READABLE),
+                                  G_PARAM_READABLE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -254,4 +501,6 @@ ufo_center_of_rotation_task_init(UfoCenterOfRotationTask *self)
     self->priv = UFO_CENTER_OF_ROTATION_TASK_GET_PRIVATE(self);
     self->priv->angle_step = G_PI / 180.0;
     self->priv->center = 0.0;
+    self->priv->centers = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    self->priv->fft = ufo_fft_new ();
 }
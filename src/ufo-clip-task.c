@@ -24,6 +24,7 @@
 #endif
 
 #include "ufo-clip-task.h"
+#include "common/ufo-kernel-cache.h"
 
 
 struct _UfoClipTaskPrivate {
@@ -71,7 +72,7 @@ ufo_clip_task_setup (UfoTask *task,
         return;
     }
 
-    priv->kernel = ufo_resources_get_kernel (resources, "clip.cl", "clip", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "clip.cl", "clip", NULL, error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
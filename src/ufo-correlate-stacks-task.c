@@ -25,6 +25,7 @@
 
 #include <string.h>
 #include "ufo-correlate-stacks-task.h"
+#include "common/ufo-kernel-cache.h"
 
 
 #define USE_GPU  0
@@ -81,8 +82,8 @@ ufo_correlate_stacks_task_setup (UfoTask *task,
     }
 
 #if USE_GPU
-    priv->diff_kernel = ufo_resources_get_kernel (resources, "correlate.cl", "diff", error);
-    priv->sum_kernel = ufo_resources_get_kernel (resources, "correlate.cl", "sum", error);
+    priv->diff_kernel = ufo_kernel_cache_get_kernel (resources, "correlate.cl", "diff", NULL, error);
+    priv->sum_kernel = ufo_kernel_cache_get_kernel (resources, "correlate.cl", "sum", NULL, error);
 
     if (priv->diff_kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->diff_kernel));
@@ -24,6 +24,7 @@
 #endif
 
 #include "ufo-cut-task.h"
+#include "common/ufo-kernel-cache.h"
 
 
 struct _UfoCutTaskPrivate {
@@ -61,7 +62,7 @@ ufo_cut_task_setup (UfoTask *task,
     UfoCutTaskPrivate *priv;
 
     priv = UFO_CUT_TASK_GET_PRIVATE (task);
-    priv->kernel = ufo_resources_get_kernel (resources, "cut.cl", "cut", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "cut.cl", "cut", NULL, error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
@@ -0,0 +1,1072 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <math.h>
+#include "ufo-fdk-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-fft.h"
+#include "common/ufo-ramp.h"
+
+/**
+ * SECTION:ufo-fdk-task
+ * @Short_description: Cone-beam reconstruction with the FDK algorithm
+ * @Title: fdk
+ *
+ * Reconstructs a volume from cone-beam projections acquired on a circular
+ * trajectory. Every projection is cosine weighted, ramp filtered row by row
+ * and backprojected voxel by voxel, #UfoFdkTask:burst projections per kernel
+ * launch. With #UfoFdkTask:slab-mode the volume is reconstructed in slabs and
+ * output slice by slice.
+ */
+
+#define EXTRACT_INT(region, index) g_value_get_int (g_value_array_get_nth ((region), (index)))
+#define EXTRACT_FLOAT(array, index) g_value_get_float (g_value_array_get_nth ((array), (index)))
+
+struct _UfoFdkTaskPrivate {
+    /* geometry */
+    gfloat source_distance;
+    gfloat detector_distance;
+    gfloat pixel_size;
+    gfloat voxel_size;
+    gfloat center_x;
+    gfloat center_y;
+    GValueArray *angles;
+    guint num_projections;
+    gfloat overall_angle;
+    GValueArray *x_region;
+    GValueArray *y_region;
+    GValueArray *z_region;
+    guint burst;
+    gboolean slab_mode;
+    guint slab_size;
+
+    /* OpenCL */
+    cl_context context;
+    cl_kernel weight_kernel;
+    cl_kernel filter_kernel;
+    cl_kernel store_kernel;
+    cl_kernel backproject_kernel;
+    cl_sampler sampler;
+    UfoFft *fft;
+    UfoFftParameter param;
+    cl_mem padded_mem;
+    cl_mem coefficients_mem;
+    cl_mem filtered_mem;
+    cl_mem trig_mem;
+    cl_mem projections;
+    cl_mem slab_mem;
+
+    /* state */
+    gsize width;
+    gsize height;
+    gsize padded_width;
+    gfloat center[2];
+    gint size[3];
+    gfloat regions[3][2];
+    gfloat *trig;
+    guint count;
+    guint pending;
+    gboolean cumulate;
+    gboolean generated;
+    guint slab_depth;
+    guint slab_start;
+    guint slice;
+    gfloat *cache;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoFdkTask, ufo_fdk_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_FDK_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_FDK_TASK, UfoFdkTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_SOURCE_DISTANCE,
+    PROP_DETECTOR_DISTANCE,
+    PROP_PIXEL_SIZE,
+    PROP_VOXEL_SIZE,
+    PROP_CENTER_X,
+    PROP_CENTER_Y,
+    PROP_ANGLES,
+    PROP_NUM_PROJECTIONS,
+    PROP_OVERALL_ANGLE,
+    PROP_X_REGION,
+    PROP_Y_REGION,
+    PROP_Z_REGION,
+    PROP_BURST,
+    PROP_SLAB_MODE,
+    PROP_SLAB_SIZE,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_fdk_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_FDK_TASK, NULL));
+}
+
+static guint
+get_num_projections (UfoFdkTaskPrivate *priv)
+{
+    return priv->angles->n_values ? priv->angles->n_values : priv->num_projections;
+}
+
+static gfloat
+get_angle (UfoFdkTaskPrivate *priv, guint index)
+{
+    if (priv->angles->n_values)
+        return EXTRACT_FLOAT (priv->angles, index);
+
+    return priv->overall_angle * index / priv->num_projections;
+}
+
+static gfloat
+get_voxel_size (UfoFdkTaskPrivate *priv)
+{
+    /* Default to the detector pixel size demagnified to the rotation axis */
+    if (priv->voxel_size > 0.0f)
+        return priv->voxel_size;
+
+    return priv->pixel_size * priv->source_distance / (priv->source_distance + priv->detector_distance);
+}
+
+static void
+ufo_fdk_task_setup (UfoTask *task,
+                    UfoResources *resources,
+                    GError **error)
+{
+    UfoFdkTaskPrivate *priv;
+    cl_int cl_error;
+
+    priv = UFO_FDK_TASK_GET_PRIVATE (task);
+
+    if (priv->source_distance <= 0.0f) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Property ::source-distance must be set");
+        return;
+    }
+
+    if (get_num_projections (priv) == 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Either ::angles or ::num-projections must be set");
+        return;
+    }
+
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    priv->weight_kernel = ufo_kernel_cache_get_kernel (resources, "fdk.cl", "fdk_weight", NULL, error);
+    priv->filter_kernel = ufo_kernel_cache_get_kernel (resources, "filter.cl", "filter", NULL, error);
+    priv->store_kernel = ufo_kernel_cache_get_kernel (resources, "fdk.cl", "fdk_store", NULL, error);
+    priv->backproject_kernel = ufo_kernel_cache_get_kernel (resources, "fdk.cl", "fdk_backproject", NULL, error);
+
+    if (priv->weight_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->weight_kernel));
+
+    if (priv->filter_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->filter_kernel));
+
+    if (priv->store_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->store_kernel));
+
+    if (priv->backproject_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->backproject_kernel));
+
+    priv->sampler = clCreateSampler (priv->context, CL_FALSE, CL_ADDRESS_CLAMP, CL_FILTER_LINEAR, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+
+    priv->trig = g_malloc0 (2 * priv->burst * sizeof (gfloat));
+    priv->count = 0;
+    priv->pending = 0;
+    priv->cumulate = FALSE;
+    priv->generated = FALSE;
+    priv->slab_start = 0;
+    priv->slice = 0;
+}
+
+/*
+ * Turn a (from, to, step) region into the start and step of the voxel grid.
+ * An empty region covers @extent voxels centered around the axis.
+ */
+static gint
+resolve_region (GValueArray *region, gint extent, gfloat result[2])
+{
+    gint from = EXTRACT_INT (region, 0);
+    gint to = EXTRACT_INT (region, 1);
+    gint step = EXTRACT_INT (region, 2);
+
+    if (from == to) {
+        from = -extent / 2;
+        to = from + extent;
+        step = 1;
+    }
+
+    result[0] = (gfloat) from;
+    result[1] = (gfloat) step;
+
+    return (to - from - 1) / step + 1;
+}
+
+static void
+ufo_fdk_task_get_requisition (UfoTask *task,
+                              UfoBuffer **inputs,
+                              UfoRequisition *requisition)
+{
+    UfoFdkTaskPrivate *priv;
+    UfoRequisition in_req;
+    gfloat scale;
+
+    priv = UFO_FDK_TASK_GET_PRIVATE (task);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    /* By default reconstruct what the detector sees at the axis */
+    scale = priv->pixel_size * priv->source_distance /
+            ((priv->source_distance + priv->detector_distance) * get_voxel_size (priv));
+    priv->size[0] = resolve_region (priv->x_region, (gint) (in_req.dims[0] * scale), priv->regions[0]);
+    priv->size[1] = resolve_region (priv->y_region, (gint) (in_req.dims[0] * scale), priv->regions[1]);
+    priv->size[2] = resolve_region (priv->z_region, (gint) (in_req.dims[1] * scale), priv->regions[2]);
+
+    requisition->n_dims = priv->slab_mode ? 2 : 3;
+    requisition->dims[0] = priv->size[0];
+    requisition->dims[1] = priv->size[1];
+    requisition->dims[2] = priv->size[2];
+}
+
+static guint
+ufo_fdk_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_fdk_task_get_num_dimensions (UfoTask *task,
+                                 guint input)
+{
+    g_return_val_if_fail (input == 0, 0);
+    return 2;
+}
+
+static UfoTaskMode
+ufo_fdk_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_GPU;
+}
+
+static guint
+get_auto_slab_depth (UfoFdkTaskPrivate *priv, UfoGpuNode *node)
+{
+    GValue *value;
+    gsize global_mem_size;
+    gsize max_alloc_size;
+    gsize slice_size;
+    gsize used;
+    gsize budget;
+
+    value = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_GLOBAL_MEM_SIZE);
+    global_mem_size = g_value_get_ulong (value);
+    g_value_unset (value);
+
+    value = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_MEM_ALLOC_SIZE);
+    max_alloc_size = g_value_get_ulong (value);
+    g_value_unset (value);
+
+    /* Leave half of the memory for the projection buffers and other tasks */
+    slice_size = (gsize) priv->size[0] * priv->size[1] * sizeof (gfloat);
+    used = (priv->padded_width * 2 + priv->width * (priv->burst + 1)) * priv->height * sizeof (gfloat);
+    budget = global_mem_size / 2 > used ? global_mem_size / 2 - used : slice_size;
+    budget = MIN (budget, max_alloc_size);
+
+    return (guint) CLAMP (budget / slice_size, 1, (gsize) priv->size[2]);
+}
+
+static gboolean
+create_buffers (UfoFdkTaskPrivate *priv,
+                UfoGpuNode *node,
+                cl_command_queue queue,
+                UfoRequisition *in_req,
+                GError **error)
+{
+    cl_image_format format;
+    gfloat *coefficients;
+    gfloat *zeros;
+    cl_device_id device;
+    gsize max_height;
+    cl_int cl_error;
+
+    priv->width = in_req->dims[0];
+    priv->height = in_req->dims[1];
+
+    /* All projections of a burst must fit into one image */
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (queue, CL_QUEUE_DEVICE, sizeof (cl_device_id), &device, NULL));
+    UFO_RESOURCES_CHECK_CLERR (clGetDeviceInfo (device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof (gsize), &max_height, NULL));
+
+    if (priv->burst * (priv->height + 1) > max_height) {
+        priv->burst = MAX (1, max_height / (priv->height + 1));
+        g_debug ("fdk: reducing burst to %u to fit the image height limit", priv->burst);
+    }
+
+    /* Pad to avoid wrap-around of the filtered rows */
+    for (priv->padded_width = 1; priv->padded_width < 2 * priv->width; priv->padded_width *= 2)
+        ;
+
+    priv->param.dimensions = UFO_FFT_1D;
+    priv->param.size[0] = priv->padded_width;
+    priv->param.size[1] = 1;
+    priv->param.size[2] = 1;
+    priv->param.batch = priv->height;
+    priv->param.zeropad = TRUE;
+    UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft, priv->context, queue, &priv->param));
+
+    priv->padded_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                       priv->padded_width * priv->height * 2 * sizeof (gfloat),
+                                       NULL, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+
+    coefficients = ufo_ramp_new (2 * priv->padded_width, 1.0);
+    priv->coefficients_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                             2 * priv->padded_width * sizeof (gfloat),
+                                             coefficients, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+    g_free (coefficients);
+
+    priv->filtered_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                         priv->width * priv->height * sizeof (gfloat),
+                                         NULL, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+
+    priv->trig_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY,
+                                     2 * priv->burst * sizeof (gfloat), NULL, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+
+    /* The rows between the stacked projections must stay zero */
+    format.image_channel_order = CL_INTENSITY;
+    format.image_channel_data_type = CL_FLOAT;
+    zeros = g_malloc0 (priv->width * (priv->height + 1) * priv->burst * sizeof (gfloat));
+    priv->projections = clCreateImage2D (priv->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &format,
+                                         priv->width, (priv->height + 1) * priv->burst,
+                                         0, zeros, &cl_error);
+    UFO_RESOURCES_CHECK_CLERR (cl_error);
+    g_free (zeros);
+
+    if (priv->slab_mode) {
+        gsize slice_size = (gsize) priv->size[0] * priv->size[1] * sizeof (gfloat);
+
+        priv->slab_depth = priv->slab_size ? MIN (priv->slab_size, (guint) priv->size[2]) :
+                                             get_auto_slab_depth (priv, node);
+
+        if (priv->slab_depth < (guint) priv->size[2]) {
+            gsize cache_size = get_num_projections (priv) * priv->width * priv->height * sizeof (gfloat);
+
+            priv->cache = g_try_malloc (cache_size);
+
+            /* Without the cache all slices have to be reconstructed at once */
+            if (priv->cache == NULL) {
+                g_debug ("fdk: could not allocate %zu bytes for the projection cache, using a single slab",
+                         cache_size);
+                priv->slab_depth = priv->size[2];
+            }
+        }
+
+        priv->slab_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                         slice_size * priv->slab_depth, NULL, &cl_error);
+
+        if (cl_error != CL_SUCCESS) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                         "Could not allocate a slab of %u slices: %s",
+                         priv->slab_depth, ufo_resources_clerr (cl_error));
+            return FALSE;
+        }
+
+        g_debug ("fdk: reconstructing %i slices in slabs of %u", priv->size[2], priv->slab_depth);
+    }
+
+    return TRUE;
+}
+
+/* Weight and filter one projection into priv->filtered_mem */
+static void
+filter_projection (UfoFdkTaskPrivate *priv,
+                   UfoProfiler *profiler,
+                   cl_command_queue queue,
+                   cl_mem in_mem)
+{
+    gsize work_size[2];
+    gint width = (gint) priv->width;
+    gint padded_width = (gint) priv->padded_width;
+    gfloat focal_length;
+    gfloat source_distance;
+    gfloat scale;
+    gfloat range;
+    guint n_projections;
+
+    focal_length = (priv->source_distance + priv->detector_distance) / priv->pixel_size;
+    source_distance = priv->source_distance / get_voxel_size (priv);
+    n_projections = get_num_projections (priv);
+
+    if (priv->angles->n_values > 1) {
+        range = fabs (get_angle (priv, n_projections - 1) - get_angle (priv, 0)) *
+                n_projections / (n_projections - 1);
+    }
+    else {
+        range = fabs (priv->overall_angle);
+    }
+
+    /* Half the angular step because every ray is measured twice in a full
+     * scan, the pixel size at the axis in voxels and the IFFT normalization */
+    scale = 0.5f * range / n_projections * focal_length / source_distance / priv->padded_width;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->weight_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->weight_kernel, 1, sizeof (cl_mem), &priv->padded_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->weight_kernel, 2, sizeof (gint), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->weight_kernel, 3, sizeof (cl_float2), priv->center));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->weight_kernel, 4, sizeof (gfloat), &focal_length));
+    work_size[0] = priv->padded_width;
+    work_size[1] = priv->height;
+    ufo_profiler_call (profiler, queue, priv->weight_kernel, 2, work_size, NULL);
+
+    UFO_RESOURCES_CHECK_CLERR (ufo_fft_execute (priv->fft, queue, profiler,
+                                                priv->padded_mem, priv->padded_mem, UFO_FFT_FORWARD,
+                                                0, NULL, NULL));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 0, sizeof (cl_mem), &priv->padded_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 1, sizeof (cl_mem), &priv->padded_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 2, sizeof (cl_mem), &priv->coefficients_mem));
+    work_size[0] = 2 * priv->padded_width;
+    ufo_profiler_call (profiler, queue, priv->filter_kernel, 2, work_size, NULL);
+
+    UFO_RESOURCES_CHECK_CLERR (ufo_fft_execute (priv->fft, queue, profiler,
+                                                priv->padded_mem, priv->padded_mem, UFO_FFT_BACKWARD,
+                                                0, NULL, NULL));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->store_kernel, 0, sizeof (cl_mem), &priv->padded_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->store_kernel, 1, sizeof (cl_mem), &priv->filtered_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->store_kernel, 2, sizeof (gint), &padded_width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->store_kernel, 3, sizeof (gfloat), &scale));
+    work_size[0] = priv->width;
+    ufo_profiler_call (profiler, queue, priv->store_kernel, 2, work_size, NULL);
+}
+
+/* Backproject the pending projections into @depth slices starting at @first */
+static void
+backproject (UfoFdkTaskPrivate *priv,
+             UfoProfiler *profiler,
+             cl_command_queue queue,
+             cl_mem out_mem,
+             guint first,
+             guint depth)
+{
+    static const gsize local_work_size[3] = {16, 8, 1};
+    gsize global_work_size[3];
+    gint size[4] = {priv->size[0], priv->size[1], (gint) depth, 0};
+    gfloat z_region[2] = {priv->regions[2][0] + first * priv->regions[2][1], priv->regions[2][1]};
+    gfloat focal_length;
+    gfloat source_distance;
+    gint burst = (gint) priv->pending;
+    gint block_height = (gint) priv->height + 1;
+    gint cumulate = priv->cumulate ? 1 : 0;
+
+    if (priv->pending == 0)
+        return;
+
+    focal_length = (priv->source_distance + priv->detector_distance) / priv->pixel_size;
+    source_distance = priv->source_distance / get_voxel_size (priv);
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteBuffer (queue, priv->trig_mem, CL_TRUE, 0,
+                                                     2 * priv->pending * sizeof (gfloat), priv->trig,
+                                                     0, NULL, NULL));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 0, sizeof (cl_mem), &priv->projections));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 1, sizeof (cl_sampler), &priv->sampler));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 2, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 3, sizeof (cl_int3), size));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 4, sizeof (cl_float2), priv->regions[0]));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 5, sizeof (cl_float2), priv->regions[1]));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 6, sizeof (cl_float2), z_region));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 7, sizeof (cl_mem), &priv->trig_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 8, sizeof (gint), &burst));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 9, sizeof (gint), &block_height));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 10, sizeof (gfloat), &source_distance));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 11, sizeof (gfloat), &focal_length));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 12, sizeof (cl_float2), priv->center));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backproject_kernel, 13, sizeof (gint), &cumulate));
+
+    for (guint i = 0; i < 3; i++) {
+        global_work_size[i] = (size[i] + local_work_size[i] - 1) / local_work_size[i] * local_work_size[i];
+    }
+
+    ufo_profiler_call (profiler, queue, priv->backproject_kernel, 3, global_work_size, (gsize *) local_work_size);
+
+    priv->pending = 0;
+    priv->cumulate = TRUE;
+}
+
+/* Store the filtered projection @index in the next free burst slot */
+static void
+add_projection (UfoFdkTaskPrivate *priv, cl_command_queue queue, guint index, const gfloat *cached)
+{
+    gsize origin[3] = {0, priv->pending * (priv->height + 1), 0};
+    gsize region[3] = {priv->width, priv->height, 1};
+    gfloat angle = get_angle (priv, index);
+
+    if (cached != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteImage (queue, priv->projections, CL_FALSE, origin, region,
+                                                        0, 0, cached, 0, NULL, NULL));
+    }
+    else {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBufferToImage (queue, priv->filtered_mem, priv->projections,
+                                                               0, origin, region, 0, NULL, NULL));
+    }
+
+    priv->trig[2 * priv->pending] = cos (angle);
+    priv->trig[2 * priv->pending + 1] = sin (angle);
+    priv->pending++;
+}
+
+static gboolean
+ufo_fdk_task_process (UfoTask *task,
+                      UfoBuffer **inputs,
+                      UfoBuffer *output,
+                      UfoRequisition *requisition)
+{
+    UfoFdkTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    UfoRequisition in_req;
+    cl_command_queue queue;
+    cl_mem out_mem;
+    guint depth;
+    GError *error = NULL;
+
+    priv = UFO_FDK_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+
+    if (priv->count >= get_num_projections (priv)) {
+        g_warning ("fdk: ignoring projection %u, expected only %u", priv->count, get_num_projections (priv));
+        return TRUE;
+    }
+
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    if (priv->padded_mem == NULL) {
+        priv->center[0] = priv->center_x == -G_MAXFLOAT ? in_req.dims[0] / 2.0f : priv->center_x;
+        priv->center[1] = priv->center_y == -G_MAXFLOAT ? in_req.dims[1] / 2.0f : priv->center_y;
+
+        /* process() cannot return the error, stop instead of emitting garbage */
+        if (!create_buffers (priv, node, queue, &in_req, &error)) {
+            g_warning ("fdk: %s", error->message);
+            g_error_free (error);
+            return FALSE;
+        }
+    }
+
+    if (priv->slab_mode) {
+        out_mem = priv->slab_mem;
+        depth = priv->slab_depth;
+    }
+    else {
+        out_mem = ufo_buffer_get_device_array (output, queue);
+        depth = priv->size[2];
+    }
+
+    filter_projection (priv, profiler, queue, ufo_buffer_get_device_array (inputs[0], queue));
+
+    if (priv->cache != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBuffer (queue, priv->filtered_mem, CL_TRUE, 0,
+                                                        priv->width * priv->height * sizeof (gfloat),
+                                                        priv->cache + priv->count * priv->width * priv->height,
+                                                        0, NULL, NULL));
+    }
+
+    add_projection (priv, queue, priv->count, NULL);
+    priv->count++;
+
+    if (priv->pending == priv->burst)
+        backproject (priv, profiler, queue, out_mem, 0, depth);
+
+    return TRUE;
+}
+
+/* Reconstruct the slab starting at priv->slab_start from the cached projections */
+static void
+reconstruct_slab (UfoFdkTaskPrivate *priv, UfoProfiler *profiler, cl_command_queue queue)
+{
+    guint depth = MIN (priv->slab_depth, priv->size[2] - priv->slab_start);
+
+    priv->cumulate = FALSE;
+
+    for (guint i = 0; i < priv->count; i++) {
+        add_projection (priv, queue, i, priv->cache + i * priv->width * priv->height);
+
+        if (priv->pending == priv->burst)
+            backproject (priv, profiler, queue, priv->slab_mem, priv->slab_start, depth);
+    }
+
+    backproject (priv, profiler, queue, priv->slab_mem, priv->slab_start, depth);
+}
+
+static gboolean
+ufo_fdk_task_generate (UfoTask *task,
+                       UfoBuffer *output,
+                       UfoRequisition *requisition)
+{
+    UfoFdkTaskPrivate *priv;
+    UfoProfiler *profiler;
+    cl_command_queue queue;
+    gsize slice_size;
+
+    priv = UFO_FDK_TASK_GET_PRIVATE (task);
+
+    if (priv->padded_mem == NULL || (priv->slab_mode && priv->slab_mem == NULL))
+        return FALSE;
+
+    queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+
+    if (!priv->slab_mode) {
+        if (priv->generated)
+            return FALSE;
+
+        backproject (priv, profiler, queue, ufo_buffer_get_device_array (output, queue), 0, priv->size[2]);
+        priv->generated = TRUE;
+
+        return TRUE;
+    }
+
+    if (priv->slice >= (guint) priv->size[2])
+        return FALSE;
+
+    if (priv->slice == 0)
+        backproject (priv, profiler, queue, priv->slab_mem, 0, priv->slab_depth);
+
+    if (priv->slice == priv->slab_start + priv->slab_depth) {
+        priv->slab_start += priv->slab_depth;
+        reconstruct_slab (priv, profiler, queue);
+    }
+
+    slice_size = requisition->dims[0] * requisition->dims[1] * sizeof (gfloat);
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (queue, priv->slab_mem, ufo_buffer_get_device_array (output, queue),
+                                                    (priv->slice - priv->slab_start) * slice_size, 0, slice_size,
+                                                    0, NULL, NULL));
+    priv->slice++;
+
+    return TRUE;
+}
+
+static void
+set_region (GValueArray *src, GValueArray **dst)
+{
+    if (EXTRACT_INT (src, 0) > EXTRACT_INT (src, 1) || EXTRACT_INT (src, 2) <= 0) {
+        g_warning ("Invalid region [\"from\", \"to\", \"step\"]: [%d, %d, %d], "\
+                   "\"from\" has to be less than or equal to \"to\" and \"step\" positive",
+                   EXTRACT_INT (src, 0), EXTRACT_INT (src, 1), EXTRACT_INT (src, 2));
+    }
+    else {
+        g_value_array_free (*dst);
+        *dst = g_value_array_copy (src);
+    }
+}
+
+static void
+ufo_fdk_task_set_property (GObject *object,
+                           guint property_id,
+                           const GValue *value,
+                           GParamSpec *pspec)
+{
+    UfoFdkTaskPrivate *priv = UFO_FDK_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_SOURCE_DISTANCE:
+            priv->source_distance = g_value_get_float (value);
+            break;
+        case PROP_DETECTOR_DISTANCE:
+            priv->detector_distance = g_value_get_float (value);
+            break;
+        case PROP_PIXEL_SIZE:
+            priv->pixel_size = g_value_get_float (value);
+            break;
+        case PROP_VOXEL_SIZE:
+            priv->voxel_size = g_value_get_float (value);
+            break;
+        case PROP_CENTER_X:
+            priv->center_x = g_value_get_float (value);
+            break;
+        case PROP_CENTER_Y:
+            priv->center_y = g_value_get_float (value);
+            break;
+        case PROP_ANGLES:
+            g_value_array_free (priv->angles);
+            priv->angles = g_value_array_copy (g_value_get_boxed (value));
+            break;
+        case PROP_NUM_PROJECTIONS:
+            priv->num_projections = g_value_get_uint (value);
+            break;
+        case PROP_OVERALL_ANGLE:
+            priv->overall_angle = g_value_get_float (value);
+            break;
+        case PROP_X_REGION:
+            set_region (g_value_get_boxed (value), &priv->x_region);
+            break;
+        case PROP_Y_REGION:
+            set_region (g_value_get_boxed (value), &priv->y_region);
+            break;
+        case PROP_Z_REGION:
+            set_region (g_value_get_boxed (value), &priv->z_region);
+            break;
+        case PROP_BURST:
+            priv->burst = g_value_get_uint (value);
+            break;
+        case PROP_SLAB_MODE:
+            priv->slab_mode = g_value_get_boolean (value);
+            break;
+        case PROP_SLAB_SIZE:
+            priv->slab_size = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_fdk_task_get_property (GObject *object,
+                           guint property_id,
+                           GValue *value,
+                           GParamSpec *pspec)
+{
+    UfoFdkTaskPrivate *priv = UFO_FDK_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_SOURCE_DISTANCE:
+            g_value_set_float (value, priv->source_distance);
+            break;
+        case PROP_DETECTOR_DISTANCE:
+            g_value_set_float (value, priv->detector_distance);
+            break;
+        case PROP_PIXEL_SIZE:
+            g_value_set_float (value, priv->pixel_size);
+            break;
+        case PROP_VOXEL_SIZE:
+            g_value_set_float (value, priv->voxel_size);
+            break;
+        case PROP_CENTER_X:
+            g_value_set_float (value, priv->center_x);
+            break;
+        case PROP_CENTER_Y:
+            g_value_set_float (value, priv->center_y);
+            break;
+        case PROP_ANGLES:
+            g_value_set_boxed (value, priv->angles);
+            break;
+        case PROP_NUM_PROJECTIONS:
+            g_value_set_uint (value, priv->num_projections);
+            break;
+        case PROP_OVERALL_ANGLE:
+            g_value_set_float (value, priv->overall_angle);
+            break;
+        case PROP_X_REGION:
+            g_value_set_boxed (value, priv->x_region);
+            break;
+        case PROP_Y_REGION:
+            g_value_set_boxed (value, priv->y_region);
+            break;
+        case PROP_Z_REGION:
+            g_value_set_boxed (value, priv->z_region);
+            break;
+        case PROP_BURST:
+            g_value_set_uint (value, priv->burst);
+            break;
+        case PROP_SLAB_MODE:
+            g_value_set_boolean (value, priv->slab_mode);
+            break;
+        case PROP_SLAB_SIZE:
+            g_value_set_uint (value, priv->slab_size);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+release_mem (cl_mem *mem)
+{
+    if (*mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (*mem));
+        *mem = NULL;
+    }
+}
+
+static void
+release_kernel (cl_kernel *kernel)
+{
+    if (*kernel != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (*kernel));
+        *kernel = NULL;
+    }
+}
+
+static void
+ufo_fdk_task_finalize (GObject *object)
+{
+    UfoFdkTaskPrivate *priv;
+
+    priv = UFO_FDK_TASK_GET_PRIVATE (object);
+
+    release_mem (&priv->padded_mem);
+    release_mem (&priv->coefficients_mem);
+    release_mem (&priv->filtered_mem);
+    release_mem (&priv->trig_mem);
+    release_mem (&priv->projections);
+    release_mem (&priv->slab_mem);
+
+    release_kernel (&priv->weight_kernel);
+    release_kernel (&priv->filter_kernel);
+    release_kernel (&priv->store_kernel);
+    release_kernel (&priv->backproject_kernel);
+
+    if (priv->sampler) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseSampler (priv->sampler));
+        priv->sampler = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    if (priv->fft) {
+        ufo_fft_destroy (priv->fft);
+        priv->fft = NULL;
+    }
+
+    g_value_array_free (priv->angles);
+    g_value_array_free (priv->x_region);
+    g_value_array_free (priv->y_region);
+    g_value_array_free (priv->z_region);
+    g_free (priv->trig);
+    g_free (priv->cache);
+
+    G_OBJECT_CLASS (ufo_fdk_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_fdk_task_setup;
+    iface->get_num_inputs = ufo_fdk_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_fdk_task_get_num_dimensions;
+    iface->get_mode = ufo_fdk_task_get_mode;
+    iface->get_requisition = ufo_fdk_task_get_requisition;
+    iface->process = ufo_fdk_task_process;
+    iface->generate = ufo_fdk_task_generate;
+}
+
+static void
+ufo_fdk_task_class_init (UfoFdkTaskClass *klass)
+{
+    GObjectClass *oclass = G_OBJECT_CLASS (klass);
+
+    oclass->set_property = ufo_fdk_task_set_property;
+    oclass->get_property = ufo_fdk_task_get_property;
+    oclass->finalize = ufo_fdk_task_finalize;
+
+    GParamSpec *region_vals = g_param_spec_int ("region-values",
+                                                "Region values",
+                                                "Elements in regions",
+                                                G_MININT,
+                                                G_MAXINT,
+                                                (gint) 0,
+                                                G_PARAM_READWRITE);
+
+    GParamSpec *angle_vals = g_param_spec_float ("angle-values",
+                                                 "Angle values",
+                                                 "Elements in the angle list",
+                                                 -G_MAXFLOAT,
+                                                 G_MAXFLOAT,
+                                                 0.0f,
+                                                 G_PARAM_READWRITE);
+
+    properties[PROP_SOURCE_DISTANCE] =
+        g_param_spec_float ("source-distance",
+                            "Distance between source and rotation axis",
+                            "Distance between source and rotation axis in the units of pixel-size",
+                            0.0f, G_MAXFLOAT, 0.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_DETECTOR_DISTANCE] =
+        g_param_spec_float ("detector-distance",
+                            "Distance between rotation axis and detector",
+                            "Distance between rotation axis and detector in the units of pixel-size",
+                            0.0f, G_MAXFLOAT, 0.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_PIXEL_SIZE] =
+        g_param_spec_float ("pixel-size",
+                            "Detector pixel size",
+                            "Detector pixel size",
+                            G_MINFLOAT, G_MAXFLOAT, 1.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_VOXEL_SIZE] =
+        g_param_spec_float ("voxel-size",
+                            "Voxel size",
+                            "Voxel size, 0 uses the pixel size at the rotation axis",
+                            0.0f, G_MAXFLOAT, 0.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_CENTER_X] =
+        g_param_spec_float ("center-x",
+                            "Horizontal detector position of the central ray",
+                            "Horizontal detector position of the central ray in pixels, the middle if not set",
+                            -G_MAXFLOAT, G_MAXFLOAT, -G_MAXFLOAT,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_CENTER_Y] =
+        g_param_spec_float ("center-y",
+                            "Vertical detector position of the central ray",
+                            "Vertical detector position of the central ray in pixels, the middle if not set",
+                            -G_MAXFLOAT, G_MAXFLOAT, -G_MAXFLOAT,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_ANGLES] =
+        g_param_spec_value_array ("angles",
+                                  "Projection angles in radians",
+                                  "Projection angles in radians, overrides num-projections and overall-angle",
+                                  angle_vals,
+                                  G_PARAM_READWRITE);
+
+    properties[PROP_NUM_PROJECTIONS] =
+        g_param_spec_uint ("num-projections",
+                           "Number of projections",
+                           "Number of projections evenly spaced over overall-angle",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_OVERALL_ANGLE] =
+        g_param_spec_float ("overall-angle",
+                            "Angle covered by all projections",
+                            "Angle covered by all projections in radians",
+                            -G_MAXFLOAT, G_MAXFLOAT, 2 * G_PI,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_X_REGION] =
+        g_param_spec_value_array ("x-region",
+                                  "X region for reconstruction as (from, to, step)",
+                                  "X region for reconstruction as (from, to, step) in voxels",
+                                  region_vals,
+                                  G_PARAM_READWRITE);
+
+    properties[PROP_Y_REGION] =
+        g_param_spec_value_array ("y-region",
+                                  "Y region for reconstruction as (from, to, step)",
+                                  "Y region for reconstruction as (from, to, step) in voxels",
+                                  region_vals,
+                                  G_PARAM_READWRITE);
+
+    properties[PROP_Z_REGION] =
+        g_param_spec_value_array ("z-region",
+                                  "Z region for reconstruction as (from, to, step)",
+                                  "Z region for reconstruction as (from, to, step) in voxels",
+                                  region_vals,
+                                  G_PARAM_READWRITE);
+
+    properties[PROP_BURST] =
+        g_param_spec_uint ("burst",
+                           "Number of projections backprojected by one kernel launch",
+                           "Number of projections backprojected by one kernel launch",
+                           1, 64, 8,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_SLAB_MODE] =
+        g_param_spec_boolean ("slab-mode",
+                              "Reconstruct the volume in slabs and output it slice by slice",
+                              "Reconstruct the volume in slabs along z from cached projections "
+                              "and output it slice by slice",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_SLAB_SIZE] =
+        g_param_spec_uint ("slab-size",
+                           "Number of slices in one slab",
+                           "Number of slices in one slab, 0 chooses it from the device memory size",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    g_type_class_add_private (oclass, sizeof(UfoFdkTaskPrivate));
+}
+
+static GValueArray *
+make_region (void)
+{
+    GValueArray *region;
+    GValue value = G_VALUE_INIT;
+
+    region = g_value_array_new (3);
+    g_value_init (&value, G_TYPE_INT);
+
+    /* (0, 0, 1) means the detector footprint */
+    for (guint i = 0; i < 3; i++) {
+        g_value_set_int (&value, i == 2 ? 1 : 0);
+        g_value_array_append (region, &value);
+    }
+
+    g_value_unset (&value);
+
+    return region;
+}
+
+static void
+ufo_fdk_task_init(UfoFdkTask *self)
+{
+    self->priv = UFO_FDK_TASK_GET_PRIVATE(self);
+    self->priv->source_distance = 0.0f;
+    self->priv->detector_distance = 0.0f;
+    self->priv->pixel_size = 1.0f;
+    self->priv->voxel_size = 0.0f;
+    self->priv->center_x = -G_MAXFLOAT;
+    self->priv->center_y = -G_MAXFLOAT;
+    self->priv->angles = g_value_array_new (0);
+    self->priv->num_projections = 0;
+    self->priv->overall_angle = 2 * G_PI;
+    self->priv->x_region = make_region ();
+    self->priv->y_region = make_region ();
+    self->priv->z_region = make_region ();
+    self->priv->burst = 8;
+    self->priv->slab_mode = FALSE;
+    self->priv->slab_size = 0;
+    self->priv->fft = ufo_fft_new ();
+}
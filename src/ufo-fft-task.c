@@ -17,6 +17,8 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
 #include <string.h>
 
 #ifdef __APPLE__
@@ -26,6 +28,7 @@
 #endif
 
 #include "ufo-fft-task.h"
+#include "common/ufo-kernel-cache.h"
 #include "common/ufo-fft.h"
 
 
@@ -37,6 +40,7 @@ struct _UfoFftTaskPrivate {
     cl_kernel kernel;
 
     gboolean zeropad;
+    gboolean use_fftw;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -54,6 +58,7 @@ enum {
     PROP_SIZE_X,
     PROP_SIZE_Y,
     PROP_SIZE_Z,
+    PROP_USE_FFTW,
     N_PROPERTIES
 };
 
@@ -86,8 +91,16 @@ ufo_fft_task_setup (UfoTask *task,
 
     priv = UFO_FFT_TASK_GET_PRIVATE (task);
 
+    if (priv->use_fftw) {
+#ifndef HAVE_FFTW
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "::use-fftw set but ufo-filters was built without FFTW");
+#endif
+        return;
+    }
+
     if (priv->zeropad) {
-        priv->kernel = ufo_resources_get_kernel (resources, "fft.cl", "fft_spread", error);
+        priv->kernel = ufo_kernel_cache_get_kernel (resources, "fft.cl", "fft_spread", NULL, error);
     }
 
     priv->context = ufo_resources_get_context (resources);
@@ -115,7 +128,9 @@ ufo_fft_task_get_requisition (UfoTask *task,
 
     switch (priv->param.dimensions) {
         case UFO_FFT_1D:
-            priv->param.batch = in_req.n_dims == 2 ? in_req.dims[1] : 1;
+            /* rows of stacked sinograms are contiguous, transform them all at once */
+            priv->param.batch = in_req.n_dims >= 2 ? in_req.dims[1] : 1;
+            priv->param.batch *= in_req.n_dims == 3 ? in_req.dims[2] : 1;
             break;
 
         case UFO_FFT_2D:
@@ -127,8 +142,15 @@ ufo_fft_task_get_requisition (UfoTask *task,
             break;
     }
 
-    queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
-    UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft, priv->context, queue, &priv->param));
+#ifdef HAVE_FFTW
+    if (priv->use_fftw)
+        ufo_fft_update_host (priv->fft, &priv->param);
+#endif
+
+    if (!priv->use_fftw) {
+        queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+        UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft, priv->context, queue, &priv->param));
+    }
 
     *requisition = in_req;  /* keep third dimension for 2D batching */
     requisition->dims[0] = 2 * priv->param.size[0];
@@ -152,6 +174,9 @@ ufo_fft_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_fft_task_get_mode (UfoTask *task)
 {
+    if (UFO_FFT_TASK_GET_PRIVATE (task)->use_fftw)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+
     return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
 }
 
@@ -163,6 +188,25 @@ ufo_fft_task_equal_real (UfoNode *n1,
     return UFO_FFT_TASK (n1)->priv->kernel == UFO_FFT_TASK (n2)->priv->kernel;
 }
 
+#ifdef HAVE_FFTW
+static void
+process_host (UfoFftTaskPrivate *priv, UfoBuffer *input, UfoBuffer *output)
+{
+    UfoRequisition in_req;
+    gfloat *in_data;
+    gfloat *out_data;
+
+    ufo_buffer_get_requisition (input, &in_req);
+    in_data = ufo_buffer_get_host_array (input, NULL);
+    out_data = ufo_buffer_get_host_array (output, NULL);
+
+    if (priv->zeropad)
+        ufo_fft_execute_host_r2c (priv->fft, in_data, in_req.dims[0], in_req.dims[1], out_data);
+    else
+        ufo_fft_execute_host (priv->fft, in_data, out_data, UFO_FFT_FORWARD);
+}
+#endif
+
 static gboolean
 ufo_fft_task_process (UfoTask *task,
                       UfoBuffer **inputs,
@@ -180,6 +224,14 @@ ufo_fft_task_process (UfoTask *task,
     gsize global_work_size[3];
 
     priv = UFO_FFT_TASK_GET_PRIVATE (task);
+
+#ifdef HAVE_FFTW
+    if (priv->use_fftw) {
+        process_host (priv, inputs[0], output);
+        return TRUE;
+    }
+#endif
+
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
     queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
     in_mem = ufo_buffer_get_device_array (inputs[0], queue);
@@ -273,6 +325,9 @@ ufo_fft_task_set_property (GObject *object,
         case PROP_SIZE_Z:
             priv->param.size[2] = g_value_get_uint (value);
             break;
+        case PROP_USE_FFTW:
+            priv->use_fftw = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -303,6 +358,9 @@ ufo_fft_task_get_property (GObject *object,
         case PROP_SIZE_Z:
             g_value_set_uint (value, priv->param.size[2]);
             break;
+        case PROP_USE_FFTW:
+            g_value_set_boolean (value, priv->use_fftw);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -357,6 +415,13 @@ ufo_fft_task_class_init (UfoFftTaskClass *klass)
             1, 8192, 1,
             G_PARAM_READWRITE);
 
+    properties[PROP_USE_FFTW] =
+        g_param_spec_boolean("use-fftw",
+            "Compute the transform on the host with FFTW",
+            "Compute the transform on the host with FFTW",
+            FALSE,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -374,6 +439,7 @@ ufo_fft_task_init (UfoFftTask *self)
 
     priv->kernel = NULL;
     priv->zeropad = TRUE;
+    priv->use_fftw = FALSE;
     priv->fft = ufo_fft_new ();
     priv->param.dimensions = UFO_FFT_1D;
     priv->param.size[0] = 1;
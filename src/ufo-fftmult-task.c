@@ -27,6 +27,7 @@
 
 #include <math.h>
 #include "ufo-fftmult-task.h"
+#include "common/ufo-kernel-cache.h"
 #include "ufo-priv.h"
 
 struct _UfoFftmultTaskPrivate {
@@ -58,7 +59,7 @@ ufo_fftmult_task_setup (UfoTask *task,
     priv = UFO_FFTMULT_TASK_GET_PRIVATE (task);
     priv->resources = resources;
 
-    priv->k_fftmult = ufo_resources_get_kernel (resources, "fftmult.cl", "mult", error);
+    priv->k_fftmult = ufo_kernel_cache_get_kernel (resources, "fftmult.cl", "mult", NULL, error);
 
     if (priv->k_fftmult != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->k_fftmult));
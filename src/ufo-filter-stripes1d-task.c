@@ -25,6 +25,7 @@
 #include <math.h>
 
 #include "ufo-filter-stripes1d-task.h"
+#include "common/ufo-kernel-cache.h"
 
 
 struct _UfoFilterStripes1dTaskPrivate {
@@ -113,7 +114,7 @@ ufo_filter_stripes1d_task_setup (UfoTask *task,
 
     priv = UFO_FILTER_STRIPES1D_TASK_GET_PRIVATE (task);
     priv->context = ufo_resources_get_context (resources);
-    priv->kernel = ufo_resources_get_kernel (resources, "complex.cl", "c_mul_real_sym", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "complex.cl", "c_mul_real_sym", NULL, error);
     priv->filter_mem = NULL;
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
     if (priv->kernel) {
@@ -17,15 +17,21 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
 #include <CL/cl.h>
 #endif
 #include <math.h>
+#include <string.h>
 
 #include "ufo-filter-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-tuner.h"
 #include "common/ufo-fft.h"
+#include "common/ufo-ramp.h"
 
 /**
  * SECTION:ufo-filter-task
@@ -82,6 +88,8 @@ struct _UfoFilterTaskPrivate {
     gfloat scale;
     Filter filter;
     UfoFft *fft;
+    gboolean use_fftw;
+    gfloat *filter_host;
 };
 
 G_DEFINE_TYPE_WITH_CODE (UfoFilterTask, ufo_filter_task, UFO_TYPE_TASK_NODE,
@@ -98,6 +106,7 @@ enum {
     PROP_FB_TAU,
     PROP_FB_THETA,
     PROP_SCALE,
+    PROP_USE_FFTW,
     N_PROPERTIES
 };
 
@@ -121,8 +130,29 @@ ufo_filter_task_process (UfoTask *task,
     cl_command_queue cmd_queue;
     cl_mem in_mem;
     cl_mem out_mem;
+    gsize work_size[2];
 
     priv = UFO_FILTER_TASK (task)->priv;
+
+    /* All rows of a batch of sinograms are filtered alike */
+    work_size[0] = requisition->dims[0];
+    work_size[1] = requisition->dims[1] * (requisition->n_dims == 3 ? requisition->dims[2] : 1);
+
+    if (priv->use_fftw) {
+        gfloat *in_data = ufo_buffer_get_host_array (inputs[0], NULL);
+        gfloat *out_data = ufo_buffer_get_host_array (output, NULL);
+        const gsize width = work_size[0];
+        const gsize height = work_size[1];
+
+#pragma omp parallel for
+        for (gsize y = 0; y < height; y++) {
+            for (gsize x = 0; x < width; x++)
+                out_data[y * width + x] = in_data[y * width + x] * priv->filter_host[x];
+        }
+
+        return TRUE;
+    }
+
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
     in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
@@ -133,7 +163,7 @@ ufo_filter_task_process (UfoTask *task,
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_mem), &priv->filter_mem));
 
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
+    ufo_tuner_call (profiler, cmd_queue, priv->kernel, 2, work_size);
 
     return TRUE;
 }
@@ -147,33 +177,27 @@ ufo_filter_task_setup (UfoTask *task,
 
     priv = UFO_FILTER_TASK_GET_PRIVATE (task);
 
+    if (priv->use_fftw) {
+#ifndef HAVE_FFTW
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "::use-fftw set but ufo-filters was built without FFTW");
+#endif
+        return;
+    }
+
     priv->context = ufo_resources_get_context (resources);
-    priv->kernel = ufo_resources_get_kernel (resources, "filter.cl", "filter", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "filter.cl", "filter", NULL, error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
 }
 
-static void
-mirror_coefficients (gfloat *filter, guint width)
-{
-    for (guint k = width/2 + 2; k < width; k += 2) {
-        filter[k] = filter[width - k];
-        filter[k + 1] = filter[width - k + 1];
-    }
-}
-
 static void
 compute_ramp_coefficients (UfoFilterTaskPrivate *priv,
                            gfloat *filter,
                            guint width)
 {
-    const gdouble step = 2.0 / width;
-
-    for (guint k = 1; k < width / 4 + 1; k++) {
-        filter[2*k] = k * step * priv->scale;
-        filter[2*k + 1] = filter[2*k];
-    }
+    ufo_ramp_fill (filter, width, priv->scale);
 }
 
 static void
@@ -264,7 +288,36 @@ ufo_filter_task_get_requisition (UfoTask *task,
     priv = UFO_FILTER_TASK_GET_PRIVATE (task);
     ufo_buffer_get_requisition (inputs[0], requisition);
 
-    if (priv->filter_mem == NULL) {
+    if (priv->use_fftw && priv->filter_host == NULL) {
+        guint width;
+
+        width = (guint) requisition->dims[0];
+        priv->filter_host = g_malloc0 (width * sizeof (gfloat));
+        priv->filter_host[0] = 0.5 / width;
+        priv->filter_host[1] = priv->filter_host[0];
+
+        filter_funcs[priv->filter] (priv, priv->filter_host, width);
+        ufo_ramp_mirror (priv->filter_host, width);
+
+#ifdef HAVE_FFTW
+        if (priv->filter == FILTER_RAMP_FROMREAL) {
+            UfoFftParameter param;
+
+            memset (&param, 0, sizeof (UfoFftParameter));
+            param.dimensions = UFO_FFT_1D;
+            param.size[0] = requisition->dims[0] / 2;
+            param.size[1] = 1;
+            param.size[2] = 1;
+            param.batch = 1;
+
+            priv->fft = ufo_fft_new ();
+            ufo_fft_update_host (priv->fft, &param);
+            ufo_fft_execute_host (priv->fft, priv->filter_host, priv->filter_host, UFO_FFT_FORWARD);
+        }
+#endif
+    }
+
+    if (!priv->use_fftw && priv->filter_mem == NULL) {
         cl_int cl_err;
         guint width;
         gfloat *coefficients;
@@ -276,7 +329,7 @@ ufo_filter_task_get_requisition (UfoTask *task,
         coefficients[1] = coefficients[0];
 
         filter_funcs[priv->filter] (priv, coefficients, width);
-        mirror_coefficients (coefficients, width);
+        ufo_ramp_mirror (coefficients, width);
 
         priv->filter_mem = clCreateBuffer (priv->context,
                                            CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
@@ -324,6 +377,9 @@ ufo_filter_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_filter_task_get_mode (UfoTask *task)
 {
+    if (UFO_FILTER_TASK_GET_PRIVATE (task)->use_fftw)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+
     return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
 }
 
@@ -357,6 +413,9 @@ ufo_filter_task_finalize (GObject *object)
         priv->fft = NULL;
     }
 
+    g_free (priv->filter_host);
+    priv->filter_host = NULL;
+
     G_OBJECT_CLASS (ufo_filter_task_parent_class)->finalize (object);
 }
 
@@ -398,6 +457,9 @@ ufo_filter_task_set_property (GObject *object,
         case PROP_SCALE:
             priv->scale = g_value_get_float (value);
             break;
+        case PROP_USE_FFTW:
+            priv->use_fftw = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -431,6 +493,9 @@ ufo_filter_task_get_property (GObject *object,
         case PROP_SCALE:
             g_value_set_float (value, priv->scale);
             break;
+        case PROP_USE_FFTW:
+            g_value_set_boolean (value, priv->use_fftw);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -492,6 +557,13 @@ ufo_filter_task_class_init (UfoFilterTaskClass *klass)
             -G_MAXFLOAT, G_MAXFLOAT, 1.0f,
             G_PARAM_READWRITE);
 
+    properties[PROP_USE_FFTW] =
+        g_param_spec_boolean ("use-fftw",
+            "Filter on the host and use FFTW for the filter computation",
+            "Filter on the host and use FFTW for the filter computation",
+            FALSE,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -514,4 +586,6 @@ ufo_filter_task_init (UfoFilterTask *self)
     priv->fb_theta = 1.0f;
     priv->scale = 1.0f;
     priv->fft = NULL;
+    priv->use_fftw = FALSE;
+    priv->filter_host = NULL;
 }
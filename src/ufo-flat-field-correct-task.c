@@ -24,6 +24,8 @@
 #endif
 #include <math.h>
 #include "ufo-flat-field-correct-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-tuner.h"
 
 
 struct _UfoFlatFieldCorrectTaskPrivate {
@@ -67,7 +69,7 @@ ufo_flat_field_correct_task_setup (UfoTask *task,
     UfoFlatFieldCorrectTaskPrivate *priv;
 
     priv = UFO_FLAT_FIELD_CORRECT_TASK_GET_PRIVATE (task);
-    priv->kernel = ufo_resources_get_kernel (resources, "ffc.cl", "flat_correct", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "ffc.cl", "flat_correct", NULL, error);
 
     if (priv->kernel) {
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
@@ -149,7 +151,7 @@ ufo_flat_field_correct_task_process (UfoTask *task,
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 7, sizeof (cl_float), &priv->dark_scale));
 
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
+    ufo_tuner_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims);
 
     return TRUE;
 }
@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+#include <math.h>
+
+#include "ufo-flat-field-sinograms-task.h"
+#include "common/ufo-kernel-cache.h"
+
+/**
+ * SECTION:ufo-flat-field-sinograms-task
+ * @Short_description: Flat-field correct projections into sinograms
+ * @Title: flat-field-sinograms
+ *
+ * Fuses flat-field-correct and transpose-projections: every incoming
+ * projection is corrected and its rows are written straight into the
+ * sinogram stack, which is kept in host memory or on the device.
+ */
+
+struct _UfoFlatFieldSinogramsTaskPrivate {
+    guint n_projections;
+    gboolean absorptivity;
+    gboolean fix_nan_and_inf;
+    gfloat dark_scale;
+    guint input_bitdepth;
+    gboolean use_gpu;
+
+    guint width;
+    guint n_sinos;
+    guint projection;
+    guint current_sino;
+
+    /* host path */
+    gfloat *sinograms;
+    gfloat *dark;
+    gfloat *norm;
+
+    /* device path */
+    cl_context context;
+    cl_kernel kernel;
+    cl_mem sinograms_mem;
+    cl_mem raw_mem;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoFlatFieldSinogramsTask, ufo_flat_field_sinograms_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_FLAT_FIELD_SINOGRAMS_TASK, UfoFlatFieldSinogramsTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_NUM_PROJECTIONS,
+    PROP_ABSORPTIVITY,
+    PROP_FIX_NAN_AND_INF,
+    PROP_DARK_SCALE,
+    PROP_INPUT_BITDEPTH,
+    PROP_USE_GPU,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_flat_field_sinograms_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_FLAT_FIELD_SINOGRAMS_TASK, NULL));
+}
+
+static void
+free_stack (UfoFlatFieldSinogramsTaskPrivate *priv)
+{
+    g_free (priv->sinograms);
+    g_free (priv->dark);
+    g_free (priv->norm);
+    priv->sinograms = NULL;
+    priv->dark = NULL;
+    priv->norm = NULL;
+
+    if (priv->sinograms_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->sinograms_mem));
+        priv->sinograms_mem = NULL;
+    }
+
+    if (priv->raw_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->raw_mem));
+        priv->raw_mem = NULL;
+    }
+}
+
+static void
+ufo_flat_field_sinograms_task_setup (UfoTask *task,
+                                     UfoResources *resources,
+                                     GError **error)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv;
+
+    priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (task);
+
+    if (priv->input_bitdepth != 16 && priv->input_bitdepth != 32) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "::input-bitdepth must be 16 or 32");
+        return;
+    }
+
+    free_stack (priv);
+
+    if (priv->use_gpu) {
+        priv->context = ufo_resources_get_context (resources);
+        UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+        priv->kernel = ufo_kernel_cache_get_kernel (resources, "ffc-sinograms.cl",
+                                                    priv->input_bitdepth == 16 ? "ffc_sinograms_16" : "ffc_sinograms",
+                                                    NULL, error);
+
+        if (priv->kernel != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+    }
+}
+
+static void
+ufo_flat_field_sinograms_task_get_requisition (UfoTask *task,
+                                               UfoBuffer **inputs,
+                                               UfoRequisition *requisition)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv;
+    UfoRequisition in_req;
+
+    priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (task);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    requisition->n_dims = 2;
+    requisition->dims[0] = in_req.dims[0];
+    requisition->dims[1] = priv->n_projections;
+
+    if (priv->sinograms == NULL && priv->sinograms_mem == NULL) {
+        priv->width = (guint) in_req.dims[0];
+        priv->n_sinos = (guint) in_req.dims[1];
+        priv->projection = 0;
+        priv->current_sino = 0;
+
+        if (!priv->use_gpu)
+            priv->sinograms = g_malloc0 (sizeof (gfloat) * priv->n_projections * priv->width * priv->n_sinos);
+        else {
+            cl_int errcode;
+
+            priv->sinograms_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                                  sizeof (gfloat) * priv->n_projections * priv->width * priv->n_sinos,
+                                                  NULL, &errcode);
+            UFO_RESOURCES_CHECK_CLERR (errcode);
+
+            if (priv->input_bitdepth == 16) {
+                priv->raw_mem = clCreateBuffer (priv->context, CL_MEM_READ_ONLY,
+                                                sizeof (guint16) * priv->width * priv->n_sinos, NULL, &errcode);
+                UFO_RESOURCES_CHECK_CLERR (errcode);
+            }
+        }
+    }
+}
+
+static guint
+ufo_flat_field_sinograms_task_get_num_inputs (UfoTask *task)
+{
+    return 3;
+}
+
+static guint
+ufo_flat_field_sinograms_task_get_num_dimensions (UfoTask *task,
+                                                  guint input)
+{
+    return 2;
+}
+
+static UfoTaskMode
+ufo_flat_field_sinograms_task_get_mode (UfoTask *task)
+{
+    if (UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_GPU;
+
+    return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_CPU;
+}
+
+/*
+ * The dark and flat fields are constant over the scan, so the per-pixel dark
+ * and flat - dark are computed once and the inner loop is a plain stream.
+ */
+static void
+prepare_host_fields (UfoFlatFieldSinogramsTaskPrivate *priv,
+                     UfoBuffer *dark,
+                     UfoBuffer *flat)
+{
+    gfloat *dark_array;
+    gfloat *flat_array;
+    gsize n_pixels;
+
+    n_pixels = (gsize) priv->width * priv->n_sinos;
+    dark_array = ufo_buffer_get_host_array (dark, NULL);
+    flat_array = ufo_buffer_get_host_array (flat, NULL);
+    priv->dark = g_malloc (n_pixels * sizeof (gfloat));
+    priv->norm = g_malloc (n_pixels * sizeof (gfloat));
+
+    for (gsize i = 0; i < n_pixels; i++) {
+        priv->dark[i] = dark_array[i] * priv->dark_scale;
+        priv->norm[i] = flat_array[i] - priv->dark[i];
+    }
+}
+
+static void
+correct_row (UfoFlatFieldSinogramsTaskPrivate *priv,
+             const gfloat *restrict input,
+             const gfloat *restrict dark,
+             const gfloat *restrict norm,
+             gfloat *restrict output)
+{
+    const gboolean absorptivity = priv->absorptivity;
+    const gboolean fix = priv->fix_nan_and_inf;
+
+#pragma omp simd
+    for (guint x = 0; x < priv->width; x++) {
+        gfloat value = input[x] - dark[x];
+        gfloat result = absorptivity ? logf (norm[x] / value) : value / norm[x];
+
+        output[x] = fix && !isfinite (result) ? 0.0f : result;
+    }
+}
+
+static void
+process_host (UfoFlatFieldSinogramsTaskPrivate *priv,
+              UfoBuffer **inputs)
+{
+    gfloat *sinograms;
+    gsize sino_size;
+    gpointer host_array;
+
+    if (priv->dark == NULL)
+        prepare_host_fields (priv, inputs[1], inputs[2]);
+
+    host_array = ufo_buffer_get_host_array (inputs[0], NULL);
+    sinograms = priv->sinograms + (gsize) priv->projection * priv->width;
+    sino_size = (gsize) priv->width * priv->n_projections;
+
+    if (priv->input_bitdepth == 16) {
+        const guint16 *raw = host_array;
+
+#pragma omp parallel for
+        for (guint y = 0; y < priv->n_sinos; y++) {
+            gfloat row[priv->width];
+            gsize offset = (gsize) y * priv->width;
+
+            for (guint x = 0; x < priv->width; x++)
+                row[x] = (gfloat) raw[offset + x];
+
+            correct_row (priv, row, priv->dark + offset, priv->norm + offset, sinograms + y * sino_size);
+        }
+    }
+    else {
+        const gfloat *projection = host_array;
+
+#pragma omp parallel for
+        for (guint y = 0; y < priv->n_sinos; y++) {
+            gsize offset = (gsize) y * priv->width;
+
+            correct_row (priv, projection + offset, priv->dark + offset, priv->norm + offset,
+                         sinograms + y * sino_size);
+        }
+    }
+}
+
+static void
+process_device (UfoFlatFieldSinogramsTaskPrivate *priv,
+                UfoTask *task,
+                UfoBuffer **inputs,
+                UfoRequisition *in_req)
+{
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem;
+    cl_mem dark_mem;
+    cl_mem flat_mem;
+    cl_int index, n_projections, absorptivity, fix_nan_and_inf;
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+
+    if (priv->input_bitdepth == 16) {
+        /* Upload the packed 16-bit data as is, which halves the transfer */
+        in_mem = priv->raw_mem;
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteBuffer (cmd_queue, in_mem, CL_FALSE, 0,
+                                                         sizeof (guint16) * priv->width * priv->n_sinos,
+                                                         ufo_buffer_get_host_array (inputs[0], NULL),
+                                                         0, NULL, NULL));
+    }
+    else {
+        in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
+    }
+
+    dark_mem = ufo_buffer_get_device_array (inputs[1], cmd_queue);
+    flat_mem = ufo_buffer_get_device_array (inputs[2], cmd_queue);
+    index = (cl_int) priv->projection;
+    n_projections = (cl_int) priv->n_projections;
+    absorptivity = (cl_int) priv->absorptivity;
+    fix_nan_and_inf = (cl_int) priv->fix_nan_and_inf;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &dark_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_mem), &flat_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (cl_mem), &priv->sinograms_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 4, sizeof (cl_int), &index));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 5, sizeof (cl_int), &n_projections));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 6, sizeof (cl_int), &absorptivity));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 7, sizeof (cl_int), &fix_nan_and_inf));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 8, sizeof (cl_float), &priv->dark_scale));
+
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, in_req->dims, NULL);
+
+    /* The raw buffer is reused for the next projection */
+    if (priv->input_bitdepth == 16)
+        UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+}
+
+static gboolean
+ufo_flat_field_sinograms_task_process (UfoTask *task,
+                                       UfoBuffer **inputs,
+                                       UfoBuffer *output,
+                                       UfoRequisition *requisition)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv;
+    UfoRequisition in_req;
+
+    priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (task);
+
+    if (priv->projection >= priv->n_projections)
+        return FALSE;
+
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    if (priv->use_gpu)
+        process_device (priv, task, inputs, &in_req);
+    else
+        process_host (priv, inputs);
+
+    priv->projection++;
+    return TRUE;
+}
+
+static gboolean
+ufo_flat_field_sinograms_task_generate (UfoTask *task,
+                                        UfoBuffer *output,
+                                        UfoRequisition *requisition)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv;
+    gsize sino_size;
+
+    priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (task);
+
+    if (priv->current_sino == priv->n_sinos)
+        return FALSE;
+
+    sino_size = (gsize) priv->width * priv->n_projections;
+
+    if (priv->use_gpu) {
+        UfoGpuNode *node;
+        cl_command_queue cmd_queue;
+        cl_mem out_mem;
+
+        node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+        cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+        out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, priv->sinograms_mem, out_mem,
+                                                        priv->current_sino * sino_size * sizeof (gfloat), 0,
+                                                        sino_size * sizeof (gfloat), 0, NULL, NULL));
+    }
+    else {
+        ufo_buffer_set_host_array (output, priv->sinograms + priv->current_sino * sino_size, FALSE);
+    }
+
+    priv->current_sino++;
+    return TRUE;
+}
+
+static void
+ufo_flat_field_sinograms_task_set_property (GObject *object,
+                                            guint property_id,
+                                            const GValue *value,
+                                            GParamSpec *pspec)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_NUM_PROJECTIONS:
+            priv->n_projections = g_value_get_uint (value);
+            break;
+        case PROP_ABSORPTIVITY:
+            priv->absorptivity = g_value_get_boolean (value);
+            break;
+        case PROP_FIX_NAN_AND_INF:
+            priv->fix_nan_and_inf = g_value_get_boolean (value);
+            break;
+        case PROP_DARK_SCALE:
+            priv->dark_scale = g_value_get_float (value);
+            break;
+        case PROP_INPUT_BITDEPTH:
+            priv->input_bitdepth = g_value_get_uint (value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_flat_field_sinograms_task_get_property (GObject *object,
+                                            guint property_id,
+                                            GValue *value,
+                                            GParamSpec *pspec)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_NUM_PROJECTIONS:
+            g_value_set_uint (value, priv->n_projections);
+            break;
+        case PROP_ABSORPTIVITY:
+            g_value_set_boolean (value, priv->absorptivity);
+            break;
+        case PROP_FIX_NAN_AND_INF:
+            g_value_set_boolean (value, priv->fix_nan_and_inf);
+            break;
+        case PROP_DARK_SCALE:
+            g_value_set_float (value, priv->dark_scale);
+            break;
+        case PROP_INPUT_BITDEPTH:
+            g_value_set_uint (value, priv->input_bitdepth);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_flat_field_sinograms_task_finalize (GObject *object)
+{
+    UfoFlatFieldSinogramsTaskPrivate *priv;
+
+    priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE (object);
+    free_stack (priv);
+
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_flat_field_sinograms_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_flat_field_sinograms_task_setup;
+    iface->get_num_inputs = ufo_flat_field_sinograms_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_flat_field_sinograms_task_get_num_dimensions;
+    iface->get_mode = ufo_flat_field_sinograms_task_get_mode;
+    iface->get_requisition = ufo_flat_field_sinograms_task_get_requisition;
+    iface->process = ufo_flat_field_sinograms_task_process;
+    iface->generate = ufo_flat_field_sinograms_task_generate;
+}
+
+static void
+ufo_flat_field_sinograms_task_class_init (UfoFlatFieldSinogramsTaskClass *klass)
+{
+    GObjectClass *oclass = G_OBJECT_CLASS (klass);
+
+    oclass->set_property = ufo_flat_field_sinograms_task_set_property;
+    oclass->get_property = ufo_flat_field_sinograms_task_get_property;
+    oclass->finalize = ufo_flat_field_sinograms_task_finalize;
+
+    properties[PROP_NUM_PROJECTIONS] =
+        g_param_spec_uint ("number",
+                           "Number of projections",
+                           "Number of projections",
+                           1, G_MAXUINT, 1,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_ABSORPTIVITY] =
+        g_param_spec_boolean ("absorption-correct",
+                              "Absorption correct",
+                              "Absorption correct",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_FIX_NAN_AND_INF] =
+        g_param_spec_boolean ("fix-nan-and-inf",
+                              "Replace NAN and INF values with 0.0",
+                              "Replace NAN and INF values with 0.0",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_DARK_SCALE] =
+        g_param_spec_float ("dark-scale",
+                            "Scale the dark field prior to the flat field correct",
+                            "Scale the dark field prior to the flat field correct",
+                            -G_MAXFLOAT, G_MAXFLOAT, 1.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_INPUT_BITDEPTH] =
+        g_param_spec_uint ("input-bitdepth",
+                           "Bit depth of the projections, 16 expects unconverted 16-bit data",
+                           "Bit depth of the projections, 16 expects unconverted 16-bit data",
+                           16, 32, 32,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+                              "Keep the sinogram stack on the device",
+                              "Keep the sinogram stack on the device",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    g_type_class_add_private (oclass, sizeof(UfoFlatFieldSinogramsTaskPrivate));
+}
+
+static void
+ufo_flat_field_sinograms_task_init(UfoFlatFieldSinogramsTask *self)
+{
+    self->priv = UFO_FLAT_FIELD_SINOGRAMS_TASK_GET_PRIVATE(self);
+    self->priv->n_projections = 1;
+    self->priv->absorptivity = FALSE;
+    self->priv->fix_nan_and_inf = FALSE;
+    self->priv->dark_scale = 1.0f;
+    self->priv->input_bitdepth = 32;
+    self->priv->use_gpu = FALSE;
+    self->priv->sinograms = NULL;
+    self->priv->dark = NULL;
+    self->priv->norm = NULL;
+    self->priv->context = NULL;
+    self->priv->kernel = NULL;
+    self->priv->sinograms_mem = NULL;
+    self->priv->raw_mem = NULL;
+}
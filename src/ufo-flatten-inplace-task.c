@@ -17,7 +17,16 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+#include <string.h>
+
 #include "ufo-flatten-inplace-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-reduce.h"
 
 typedef enum {
     MODE_SUM,
@@ -35,6 +44,15 @@ static GEnumValue mode_values[] = {
 struct _UfoFlattenInplaceTaskPrivate {
     Mode mode;
     gboolean generated;
+    gboolean compensated;
+    gboolean use_gpu;
+    gboolean first;
+
+    /* Kahan compensation of the sum, on the device it is always used */
+    gfloat *compensation;
+    cl_context context;
+    cl_kernel kernel;
+    cl_mem compensation_mem;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -48,6 +66,8 @@ G_DEFINE_TYPE_WITH_CODE (UfoFlattenInplaceTask, ufo_flatten_inplace_task, UFO_TY
 enum {
     PROP_0,
     PROP_MODE,
+    PROP_COMPENSATED,
+    PROP_USE_GPU,
     N_PROPERTIES
 };
 
@@ -64,6 +84,18 @@ ufo_flatten_inplace_task_setup (UfoTask *task,
                                 UfoResources *resources,
                                 GError **error)
 {
+    UfoFlattenInplaceTaskPrivate *priv = UFO_FLATTEN_INPLACE_TASK_GET_PRIVATE (task);
+    const gchar *names[] = {"accumulate_add", "accumulate_min", "accumulate_max"};
+
+    if (priv->use_gpu) {
+        priv->context = ufo_resources_get_context (resources);
+        UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+        priv->kernel = ufo_kernel_cache_get_kernel (resources, "accumulate.cl", names[priv->mode], NULL, error);
+
+        if (priv->kernel != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+    }
 }
 
 static void
@@ -90,9 +122,48 @@ ufo_flatten_inplace_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_flatten_inplace_task_get_mode (UfoTask *task)
 {
+    if (UFO_FLATTEN_INPLACE_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_GPU;
+
     return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_CPU;
 }
 
+static void
+process_device (UfoFlattenInplaceTaskPrivate *priv,
+                UfoTask *task,
+                UfoBuffer *input,
+                UfoBuffer *output,
+                UfoRequisition *requisition)
+{
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem, out_mem;
+    cl_int first = priv->first;
+    guint arg = 0;
+
+    cmd_queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    in_mem = ufo_buffer_get_device_array (input, cmd_queue);
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    if (priv->mode == MODE_SUM && priv->compensation_mem == NULL) {
+        cl_int errcode;
+
+        priv->compensation_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                                 ufo_buffer_get_size (output), NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, arg++, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, arg++, sizeof (cl_mem), &out_mem));
+
+    if (priv->mode == MODE_SUM)
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, arg++, sizeof (cl_mem), &priv->compensation_mem));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, arg++, sizeof (cl_int), &first));
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
+}
+
 static gboolean
 ufo_flatten_inplace_task_process (UfoTask *task,
                                   UfoBuffer **inputs,
@@ -105,28 +176,36 @@ ufo_flatten_inplace_task_process (UfoTask *task,
     gsize n_pixels;
 
     priv = UFO_FLATTEN_INPLACE_TASK_GET_PRIVATE (task);
+
+    if (priv->use_gpu) {
+        process_device (priv, task, inputs[0], output, requisition);
+        priv->first = FALSE;
+        return TRUE;
+    }
+
     n_pixels = requisition->dims[0] * requisition->dims[1];
     in_array = ufo_buffer_get_host_array (inputs[0], NULL);
     out_array = ufo_buffer_get_host_array (output, NULL);
 
+    if (priv->first) {
+        memcpy (out_array, in_array, n_pixels * sizeof (gfloat));
+
+        if (priv->mode == MODE_SUM && priv->compensated)
+            priv->compensation = g_malloc0 (n_pixels * sizeof (gfloat));
+
+        priv->first = FALSE;
+        return TRUE;
+    }
+
     switch (priv->mode) {
         case MODE_SUM:
-            for (gsize i = 0; i < n_pixels; i++)
-                out_array[i] += in_array[i];
+            ufo_reduce_add (out_array, priv->compensation, in_array, n_pixels);
             break;
-
         case MODE_MIN:
-            for (gsize i = 0; i < n_pixels; i++) {
-                if (in_array[i] < out_array[i])
-                    out_array[i] = in_array[i];
-            }
+            ufo_reduce_min (out_array, in_array, n_pixels);
             break;
-
         case MODE_MAX:
-            for (gsize i = 0; i < n_pixels; i++) {
-                if (in_array[i] > out_array[i])
-                    out_array[i] = in_array[i];
-            }
+            ufo_reduce_max (out_array, in_array, n_pixels);
             break;
         default:
             break;
@@ -163,6 +242,12 @@ ufo_flatten_inplace_task_set_property (GObject *object,
         case PROP_MODE:
             priv->mode = g_value_get_enum (value);
             break;
+        case PROP_COMPENSATED:
+            priv->compensated = g_value_get_boolean (value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -181,6 +266,12 @@ ufo_flatten_inplace_task_get_property (GObject *object,
         case PROP_MODE:
             g_value_set_enum (value, priv->mode);
             break;
+        case PROP_COMPENSATED:
+            g_value_set_boolean (value, priv->compensated);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -190,6 +281,26 @@ ufo_flatten_inplace_task_get_property (GObject *object,
 static void
 ufo_flatten_inplace_task_finalize (GObject *object)
 {
+    UfoFlattenInplaceTaskPrivate *priv = UFO_FLATTEN_INPLACE_TASK_GET_PRIVATE (object);
+
+    g_free (priv->compensation);
+    priv->compensation = NULL;
+
+    if (priv->compensation_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->compensation_mem));
+        priv->compensation_mem = NULL;
+    }
+
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
     G_OBJECT_CLASS (ufo_flatten_inplace_task_parent_class)->finalize (object);
 }
 
@@ -221,6 +332,20 @@ ufo_flatten_inplace_task_class_init (UfoFlattenInplaceTaskClass *klass)
                            g_enum_register_static ("mode", mode_values),
                            MODE_SUM, G_PARAM_READWRITE);
 
+    properties[PROP_COMPENSATED] =
+        g_param_spec_boolean ("compensated",
+                              "Use compensated summation on the host",
+                              "Use compensated (Kahan) summation on the host in sum mode",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+                              "Accumulate on the GPU",
+                              "Accumulate on the GPU, so that only the result leaves the device",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -233,4 +358,11 @@ ufo_flatten_inplace_task_init(UfoFlattenInplaceTask *self)
     self->priv = UFO_FLATTEN_INPLACE_TASK_GET_PRIVATE(self);
     self->priv->mode = MODE_SUM;
     self->priv->generated = FALSE;
+    self->priv->compensated = FALSE;
+    self->priv->use_gpu = FALSE;
+    self->priv->first = TRUE;
+    self->priv->compensation = NULL;
+    self->priv->context = NULL;
+    self->priv->kernel = NULL;
+    self->priv->compensation_mem = NULL;
 }
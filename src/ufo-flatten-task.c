@@ -17,19 +17,45 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <stdlib.h>
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
 #include "ufo-flatten-task.h"
+#include "common/ufo-kernel-cache.h"
+
+/* Pixels gathered from the stack at once */
+#define TILE_SIZE 64
 
+/* Depths up to which a column is sorted instead of selected from */
+#define SORT_DEPTH 16
+
+/* Also used by kernels/flatten.cl */
 typedef enum {
     M_0,
+    M_MIN,
+    M_MAX,
+    M_SUM,
     M_MEDIAN,
+    M_PERCENTILE,
+    M_TRIMMED_MEAN,
     M_LAST
 } Mode;
 
-static const gchar *modes[] = {"median"};
+static const gchar *modes[] = {"min", "max", "sum", "median", "percentile", "trimmed-mean"};
 
 struct _UfoFlattenTaskPrivate {
     Mode mode;
+    gfloat percentile;
+    gfloat trim;
+    gboolean use_gpu;
+
+    cl_context context;
+    cl_kernel kernel;
+    cl_mem scratch;
+    gsize scratch_size;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -43,6 +69,9 @@ G_DEFINE_TYPE_WITH_CODE (UfoFlattenTask, ufo_flatten_task, UFO_TYPE_TASK_NODE,
 enum {
     PROP_0,
     PROP_MODE,
+    PROP_PERCENTILE,
+    PROP_TRIM,
+    PROP_USE_GPU,
     N_PROPERTIES
 };
 
@@ -70,6 +99,17 @@ ufo_flatten_task_setup (UfoTask *task,
                         UfoResources *resources,
                         GError **error)
 {
+    UfoFlattenTaskPrivate *priv = UFO_FLATTEN_TASK_GET_PRIVATE (task);
+
+    if (priv->use_gpu) {
+        priv->context = ufo_resources_get_context (resources);
+        UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+        priv->kernel = ufo_kernel_cache_get_kernel (resources, "flatten.cl", "flatten", NULL, error);
+
+        if (priv->kernel != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+    }
 }
 
 static void
@@ -97,13 +137,241 @@ ufo_flatten_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_flatten_task_get_mode (UfoTask *task)
 {
+    if (UFO_FLATTEN_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+
     return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
 }
 
-static int
-cmp_float (gconstpointer p1, gconstpointer p2)
+static void
+sort (gfloat *values, gint n)
+{
+    for (gint i = 1; i < n; i++) {
+        const gfloat value = values[i];
+        gint j = i - 1;
+
+        for (; j >= 0 && values[j] > value; j--)
+            values[j + 1] = values[j];
+
+        values[j + 1] = value;
+    }
+}
+
+/*
+ * Move the k-th smallest value to values[k], with nothing larger before and
+ * nothing smaller after it.
+ */
+static gfloat
+select_kth (gfloat *values, gint n, gint k)
+{
+    gint left = 0;
+    gint right = n - 1;
+
+    while (left < right) {
+        const gfloat pivot = values[(left + right) / 2];
+        gint i = left;
+        gint j = right;
+
+        do {
+            while (values[i] < pivot)
+                i++;
+
+            while (pivot < values[j])
+                j--;
+
+            if (i <= j) {
+                const gfloat tmp = values[i];
+
+                values[i] = values[j];
+                values[j] = tmp;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+
+        if (j < k)
+            left = i;
+
+        if (k < i)
+            right = j;
+    }
+
+    return values[k];
+}
+
+static gfloat
+reduce_percentile (gfloat *values, gint n, gfloat percentile)
+{
+    const gfloat rank = percentile / 100.0f * (n - 1);
+    const gint k = (gint) rank;
+    const gfloat fraction = rank - k;
+    gfloat result;
+    gfloat next;
+
+    if (n <= SORT_DEPTH) {
+        sort (values, n);
+        return k + 1 < n ? values[k] + fraction * (values[k + 1] - values[k]) : values[k];
+    }
+
+    result = select_kth (values, n, k);
+
+    if (fraction == 0.0f || k + 1 >= n)
+        return result;
+
+    /* Everything above k is not smaller, its minimum is the next value */
+    next = values[k + 1];
+
+    for (gint i = k + 2; i < n; i++)
+        next = MIN (next, values[i]);
+
+    return result + fraction * (next - result);
+}
+
+/* The upper of the two middle values for an even @n, as flatten always did */
+static gfloat
+reduce_median (gfloat *values, gint n)
+{
+    if (n <= SORT_DEPTH) {
+        sort (values, n);
+        return values[n / 2];
+    }
+
+    return select_kth (values, n, n / 2);
+}
+
+static gfloat
+reduce_trimmed_mean (gfloat *values, gint n, gfloat trim)
+{
+    const gint k = MIN ((gint) (trim * n), (n - 1) / 2);
+    gdouble sum = 0.0;
+
+    if (n <= SORT_DEPTH)
+        sort (values, n);
+    else if (k > 0) {
+        select_kth (values, n, k);
+        select_kth (values + k, n - k, n - 1 - 2 * k);
+    }
+
+    for (gint i = k; i < n - k; i++)
+        sum += values[i];
+
+    return (gfloat) (sum / (n - 2 * k));
+}
+
+static gfloat
+reduce (UfoFlattenTaskPrivate *priv, gfloat *values, gint n)
 {
-    return (int) (*((const gfloat *) p1) - *((const gfloat *) p2));
+    gfloat result = values[0];
+
+    switch (priv->mode) {
+        case M_MIN:
+            for (gint i = 1; i < n; i++)
+                result = MIN (result, values[i]);
+            return result;
+        case M_MAX:
+            for (gint i = 1; i < n; i++)
+                result = MAX (result, values[i]);
+            return result;
+        case M_SUM:
+            for (gint i = 1; i < n; i++)
+                result += values[i];
+            return result;
+        case M_MEDIAN:
+            return reduce_median (values, n);
+        case M_PERCENTILE:
+            return reduce_percentile (values, n, priv->percentile);
+        case M_TRIMMED_MEAN:
+            return reduce_trimmed_mean (values, n, priv->trim);
+        default:
+            return result;
+    }
+}
+
+/*
+ * Gather the columns of TILE_SIZE neighbouring pixels at once, which reads
+ * contiguous runs from every frame, and reduce them one after the other.
+ */
+static void
+flatten_host (UfoFlattenTaskPrivate *priv,
+              const gfloat *in_mem,
+              gfloat *out_mem,
+              gsize n_pixels,
+              gsize depth)
+{
+    const gint n_tiles = (gint) ((n_pixels + TILE_SIZE - 1) / TILE_SIZE);
+
+#pragma omp parallel
+    {
+        gfloat *columns = g_malloc (sizeof (gfloat) * TILE_SIZE * depth);
+
+#pragma omp for schedule(dynamic)
+        for (gint tile = 0; tile < n_tiles; tile++) {
+            const gsize first = (gsize) tile * TILE_SIZE;
+            const gsize count = MIN (TILE_SIZE, n_pixels - first);
+
+            for (gsize i = 0; i < depth; i++) {
+                const gfloat *frame = in_mem + i * n_pixels + first;
+
+                for (gsize p = 0; p < count; p++)
+                    columns[p * depth + i] = frame[p];
+            }
+
+            for (gsize p = 0; p < count; p++)
+                out_mem[first + p] = reduce (priv, columns + p * depth, (gint) depth);
+        }
+
+        g_free (columns);
+    }
+}
+
+static void
+flatten_device (UfoFlattenTaskPrivate *priv,
+                UfoTask *task,
+                UfoBuffer *input,
+                UfoBuffer *output,
+                UfoRequisition *requisition)
+{
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem, out_mem;
+    cl_int n, mode;
+    gsize size;
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    in_mem = ufo_buffer_get_device_array (input, cmd_queue);
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+    size = ufo_buffer_get_size (input);
+
+    /* Selecting reorders the stack, so work on a copy of it */
+    if (priv->mode >= M_MEDIAN) {
+        if (priv->scratch_size != size) {
+            cl_int errcode;
+
+            if (priv->scratch != NULL)
+                UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->scratch));
+
+            priv->scratch = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+            UFO_RESOURCES_CHECK_CLERR (errcode);
+            priv->scratch_size = size;
+        }
+
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, in_mem, priv->scratch, 0, 0, size, 0, NULL, NULL));
+        in_mem = priv->scratch;
+    }
+
+    n = (cl_int) (requisition->n_dims == 3 ? requisition->dims[2] : 1);
+    mode = (cl_int) priv->mode;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_int), &n));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (cl_int), &mode));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 4, sizeof (cl_float), &priv->percentile));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 5, sizeof (cl_float), &priv->trim));
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
 }
 
 static gboolean
@@ -112,34 +380,22 @@ ufo_flatten_task_process (UfoTask *task,
                           UfoBuffer *output,
                           UfoRequisition *requisition)
 {
-    gfloat *in_mem;
-    gfloat *out_mem;
-    gfloat *tmp;
-    gsize width, height, depth;
-
-    in_mem = ufo_buffer_get_host_array (inputs[0], NULL);
-    out_mem = ufo_buffer_get_host_array (output, NULL);
-    width = requisition->dims[0];
-    height = requisition->dims[1];
-    depth = requisition->dims[2];
-    tmp = g_malloc (sizeof (gfloat) * depth);
-
-    /*
-     * For now, only median is necessary to flatten in a "fat" way, i.e. not
-     * doing in-place. In fact we should replace the averager with a "thin"
-     * flattener that can also determine the sum, min and max.
-     */
-    for (gsize x = 0; x < width; x++) {
-        for (gsize y = 0; y < height; y++) {
-            for (gsize i = 0; i < depth; i++)
-                tmp[i] = in_mem[i * width * height + y * width + x];
-
-            qsort ((gpointer) tmp, depth, sizeof(gfloat), cmp_float);
-            out_mem[y * width + x] = tmp[depth / 2];
-        }
+    UfoFlattenTaskPrivate *priv;
+    UfoRequisition in_req;
+
+    priv = UFO_FLATTEN_TASK_GET_PRIVATE (task);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    if (priv->use_gpu) {
+        flatten_device (priv, task, inputs[0], output, &in_req);
+        return TRUE;
     }
 
-    g_free (tmp);
+    flatten_host (priv,
+                  ufo_buffer_get_host_array (inputs[0], NULL),
+                  ufo_buffer_get_host_array (output, NULL),
+                  in_req.dims[0] * in_req.dims[1], in_req.n_dims == 3 ? in_req.dims[2] : 1);
+
     return TRUE;
 }
 
@@ -158,8 +414,19 @@ ufo_flatten_task_set_property (GObject *object,
 
                 if (mode != M_0)
                     priv->mode = mode;
+                else
+                    g_warning ("Unknown flatten mode `%s'", g_value_get_string (value));
             }
             break;
+        case PROP_PERCENTILE:
+            priv->percentile = g_value_get_float (value);
+            break;
+        case PROP_TRIM:
+            priv->trim = g_value_get_float (value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
 
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -177,7 +444,16 @@ ufo_flatten_task_get_property (GObject *object,
 
     switch (property_id) {
         case PROP_MODE:
-            g_value_set_string (value, modes[priv->mode]);
+            g_value_set_string (value, modes[priv->mode - 1]);
+            break;
+        case PROP_PERCENTILE:
+            g_value_set_float (value, priv->percentile);
+            break;
+        case PROP_TRIM:
+            g_value_set_float (value, priv->trim);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
             break;
 
         default:
@@ -189,6 +465,23 @@ ufo_flatten_task_get_property (GObject *object,
 static void
 ufo_flatten_task_finalize (GObject *object)
 {
+    UfoFlattenTaskPrivate *priv = UFO_FLATTEN_TASK_GET_PRIVATE (object);
+
+    if (priv->scratch) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->scratch));
+        priv->scratch = NULL;
+    }
+
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
     G_OBJECT_CLASS (ufo_flatten_task_parent_class)->finalize (object);
 }
 
@@ -214,9 +507,30 @@ ufo_flatten_task_class_init (UfoFlattenTaskClass *klass)
 
     properties[PROP_MODE] =
         g_param_spec_string ("mode",
-            "Mode (min, max, sum, median)",
-            "Mode (min, max, sum, median)",
-            "",
+            "Mode (min, max, sum, median, percentile, trimmed-mean)",
+            "Mode (min, max, sum, median, percentile, trimmed-mean)",
+            "median",
+            G_PARAM_READWRITE);
+
+    properties[PROP_PERCENTILE] =
+        g_param_spec_float ("percentile",
+            "Percentile in percentile mode",
+            "Percentile in percentile mode, values between ranks are interpolated linearly",
+            0.0f, 100.0f, 50.0f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_TRIM] =
+        g_param_spec_float ("trim",
+            "Fraction of values discarded at each end in trimmed-mean mode",
+            "Fraction of values discarded at each end in trimmed-mean mode",
+            0.0f, 0.5f, 0.1f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+            "Flatten on the GPU",
+            "Flatten on the GPU, which avoids a download if the stack is on the device",
+            FALSE,
             G_PARAM_READWRITE);
 
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
@@ -230,4 +544,11 @@ ufo_flatten_task_init(UfoFlattenTask *self)
 {
     self->priv = UFO_FLATTEN_TASK_GET_PRIVATE(self);
     self->priv->mode = M_MEDIAN;
+    self->priv->percentile = 50.0f;
+    self->priv->trim = 0.1f;
+    self->priv->use_gpu = FALSE;
+    self->priv->context = NULL;
+    self->priv->kernel = NULL;
+    self->priv->scratch = NULL;
+    self->priv->scratch_size = 0;
 }
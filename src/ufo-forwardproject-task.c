@@ -23,14 +23,24 @@
 #include <CL/cl.h>
 #endif
 
+#include <math.h>
 #include "ufo-forwardproject-task.h"
+#include "common/ufo-kernel-cache.h"
 
+/* Angles computed by one work item, see forwardproject.cl */
+#define ANGLES_PER_ITEM 8
+#define LOCAL_SIZE      64
 
 struct _UfoForwardprojectTaskPrivate {
+    cl_context context;
     cl_kernel kernel;
-    cl_mem slice_mem;
+    cl_mem sin_lut;
+    cl_mem cos_lut;
     gfloat angle_step;
+    gfloat angle_offset;
+    gdouble axis_pos;
     guint num_projections;
+    guint detector_width;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -44,7 +54,10 @@ G_DEFINE_TYPE_WITH_CODE (UfoForwardprojectTask, ufo_forwardproject_task, UFO_TYP
 enum {
     PROP_0,
     PROP_ANGLE_STEP,
+    PROP_ANGLE_OFFSET,
     PROP_NUM_PROJECTIONS,
+    PROP_AXIS_POSITION,
+    PROP_DETECTOR_WIDTH,
     N_PROPERTIES
 };
 
@@ -56,22 +69,55 @@ ufo_forwardproject_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_FORWARDPROJECT_TASK, NULL));
 }
 
+static cl_mem
+create_lut_buffer (UfoForwardprojectTaskPrivate *priv,
+                   double (*func)(double))
+{
+    cl_int errcode;
+    gsize size = priv->num_projections * sizeof (gfloat);
+    gfloat *host_mem;
+    cl_mem mem = NULL;
+
+    host_mem = g_malloc (size);
+
+    for (guint i = 0; i < priv->num_projections; i++)
+        host_mem[i] = (gfloat) func (priv->angle_offset + i * priv->angle_step);
+
+    mem = clCreateBuffer (priv->context,
+                          CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                          size, host_mem,
+                          &errcode);
+
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    g_free (host_mem);
+    return mem;
+}
+
 static void
 ufo_forwardproject_task_setup (UfoTask *task,
                                UfoResources *resources,
                                GError **error)
 {
     UfoForwardprojectTaskPrivate *priv;
+    gchar *option;
 
     priv = UFO_FORWARDPROJECT_TASK (task)->priv;
 
-    priv->kernel = ufo_resources_get_kernel (resources, "forwardproject.cl", "forwardproject", error);
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    option = g_strdup_printf (" -DANGLES_PER_ITEM=%i ", ANGLES_PER_ITEM);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "forwardproject.cl", "forwardproject", option, error);
+    g_free (option);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
 
     if (priv->angle_step == 0) 
         priv->angle_step = G_PI / priv->num_projections;
+
+    priv->sin_lut = create_lut_buffer (priv, sin);
+    priv->cos_lut = create_lut_buffer (priv, cos);
 }
 
 static void
@@ -87,7 +133,7 @@ ufo_forwardproject_task_get_requisition (UfoTask *task,
     ufo_buffer_get_requisition (inputs[0], &in_req);
 
     requisition->n_dims = 2;
-    requisition->dims[0] = in_req.dims[0];
+    requisition->dims[0] = priv->detector_width > 0 ? priv->detector_width : in_req.dims[0];
     requisition->dims[1] = priv->num_projections;
 }
 
@@ -121,8 +167,16 @@ ufo_forwardproject_task_process (UfoTask *task,
     UfoGpuNode *node;
     UfoProfiler *profiler;
     cl_command_queue cmd_queue;
+    UfoRequisition in_req;
     cl_mem in_mem;
     cl_mem out_mem;
+    cl_int n_angles;
+    cl_int det_width;
+    gfloat axis_pos;
+    gfloat center_x;
+    gfloat center_y;
+    gsize global_work_size[2];
+    gsize local_work_size[2];
 
     priv = UFO_FORWARDPROJECT_TASK (task)->priv;
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
@@ -131,11 +185,36 @@ ufo_forwardproject_task_process (UfoTask *task,
     out_mem = ufo_buffer_get_device_array (output, cmd_queue);
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
 
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+    n_angles = (cl_int) requisition->dims[1];
+    det_width = (cl_int) requisition->dims[0];
+
+    /* Guess axis position if it is not provided by the user. */
+    axis_pos = priv->axis_pos <= 0.0 ? det_width / 2.0f : (gfloat) priv->axis_pos;
+
+    /*
+     * The axis keeps its offset to the center when detector and slice differ.
+     * The detector may be wider than the slice, so subtract in floating point.
+     */
+    center_x = axis_pos + ((gfloat) in_req.dims[0] - (gfloat) det_width) / 2.0f;
+    center_y = axis_pos + ((gfloat) in_req.dims[1] - (gfloat) det_width) / 2.0f;
+
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
     UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (gfloat), &priv->angle_step));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 4, sizeof (cl_int), &n_angles));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 5, sizeof (cl_int), &det_width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 6, sizeof (gfloat), &axis_pos));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 7, sizeof (gfloat), &center_x));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 8, sizeof (gfloat), &center_y));
+
+    local_work_size[0] = LOCAL_SIZE;
+    local_work_size[1] = 1;
+    global_work_size[0] = ((requisition->dims[0] + LOCAL_SIZE - 1) / LOCAL_SIZE) * LOCAL_SIZE;
+    global_work_size[1] = (requisition->dims[1] + ANGLES_PER_ITEM - 1) / ANGLES_PER_ITEM;
 
-    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims, NULL);
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, global_work_size, local_work_size);
 
     return TRUE;
 }
@@ -152,9 +231,18 @@ ufo_forwardproject_task_set_property (GObject *object,
         case PROP_ANGLE_STEP:
             priv->angle_step = g_value_get_float(value);
             break;
+        case PROP_ANGLE_OFFSET:
+            priv->angle_offset = g_value_get_float(value);
+            break;
         case PROP_NUM_PROJECTIONS:
             priv->num_projections = g_value_get_uint(value);
             break;
+        case PROP_AXIS_POSITION:
+            priv->axis_pos = g_value_get_double(value);
+            break;
+        case PROP_DETECTOR_WIDTH:
+            priv->detector_width = g_value_get_uint(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -173,9 +261,18 @@ ufo_forwardproject_task_get_property (GObject *object,
         case PROP_ANGLE_STEP:
             g_value_set_float(value, priv->angle_step);
             break;
+        case PROP_ANGLE_OFFSET:
+            g_value_set_float(value, priv->angle_offset);
+            break;
         case PROP_NUM_PROJECTIONS:
             g_value_set_uint(value, priv->num_projections);
             break;
+        case PROP_AXIS_POSITION:
+            g_value_set_double(value, priv->axis_pos);
+            break;
+        case PROP_DETECTOR_WIDTH:
+            g_value_set_uint(value, priv->detector_width);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -194,6 +291,21 @@ ufo_forwardproject_task_finalize (GObject *object)
         priv->kernel = NULL;
     }
 
+    if (priv->sin_lut) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->sin_lut));
+        priv->sin_lut = NULL;
+    }
+
+    if (priv->cos_lut) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->cos_lut));
+        priv->cos_lut = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
     G_OBJECT_CLASS (ufo_forwardproject_task_parent_class)->finalize (object);
 }
 
@@ -226,6 +338,15 @@ ufo_forwardproject_task_class_init (UfoForwardprojectTaskClass *klass)
                            0.0f,
                            G_PARAM_READWRITE);
 
+    properties[PROP_ANGLE_OFFSET] =
+        g_param_spec_float("angle-offset",
+                           "Angle offset in radians",
+                           "Angle offset in radians determining the first angle position",
+                           0.0f,
+                           +4.0f * ((gfloat) G_PI),
+                           0.0f,
+                           G_PARAM_READWRITE);
+
     properties[PROP_NUM_PROJECTIONS] =
         g_param_spec_uint("number",
                           "Number of projections",
@@ -233,6 +354,20 @@ ufo_forwardproject_task_class_init (UfoForwardprojectTaskClass *klass)
                           1, 8192, 256,
                           G_PARAM_READWRITE);
 
+    properties[PROP_AXIS_POSITION] =
+        g_param_spec_double("axis-pos",
+                            "Position of rotation axis on the detector",
+                            "Position of rotation axis on the detector",
+                            -1.0, +8192.0, 0.0,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_DETECTOR_WIDTH] =
+        g_param_spec_uint("detector-width",
+                          "Number of detector pixels, 0 for the slice width",
+                          "Number of detector pixels, 0 for the slice width",
+                          0, 16384, 0,
+                          G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -246,4 +381,11 @@ ufo_forwardproject_task_init(UfoForwardprojectTask *self)
 
     self->priv->num_projections = 256;
     self->priv->angle_step = 0;
+    self->priv->angle_offset = 0;
+    self->priv->axis_pos = -1.0;
+    self->priv->detector_width = 0;
+    self->priv->context = NULL;
+    self->priv->kernel = NULL;
+    self->priv->sin_lut = NULL;
+    self->priv->cos_lut = NULL;
 }
@@ -0,0 +1,663 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <math.h>
+#include "ufo-gridrec-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-fft.h"
+
+/* Number of samples of the gridding kernel between 0 and its half width */
+#define KERNEL_LUT_SIZE 1024
+
+
+struct _UfoGridrecTaskPrivate {
+    UfoFft *fft_1d;
+    UfoFft *fft_2d;
+    UfoFftParameter param_1d;
+    UfoFftParameter param_2d;
+
+    cl_context context;
+    cl_kernel spread_kernel;
+    cl_kernel filter_kernel;
+    cl_kernel grid_kernel;
+    cl_kernel crop_kernel;
+
+    cl_mem projections;
+    cl_mem grid;
+    cl_mem sin_lut;
+    cl_mem cos_lut;
+    cl_mem kernel_lut;
+    cl_mem deapodization;
+
+    gsize width;
+    gsize n_angles;
+    gsize size;
+    gfloat real_axis_pos;
+    gdouble real_angle_step;
+
+    gdouble axis_pos;
+    gdouble angle_step;
+    gdouble angle_offset;
+    gfloat oversampling;
+    gfloat kernel_width;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoGridrecTask, ufo_gridrec_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_GRIDREC_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_GRIDREC_TASK, UfoGridrecTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_AXIS_POSITION,
+    PROP_ANGLE_STEP,
+    PROP_ANGLE_OFFSET,
+    PROP_OVERSAMPLING,
+    PROP_KERNEL_WIDTH,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_gridrec_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_GRIDREC_TASK, NULL));
+}
+
+static guint32
+pow2round (guint32 x)
+{
+    --x;
+    x |= x >> 1;
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+    return x+1;
+}
+
+static gdouble
+bessel_i0 (gdouble x)
+{
+    gdouble sum = 1.0;
+    gdouble term = 1.0;
+
+    for (guint k = 1; k < 50 && term > 1e-12 * sum; k++) {
+        term *= (x * x) / (4.0 * k * k);
+        sum += term;
+    }
+
+    return sum;
+}
+
+/*
+ * Kaiser-Bessel window of half width @half_width. The shape parameter is the
+ * one suggested by Beatty et al. for a given oversampling ratio.
+ */
+static gdouble
+kaiser_bessel (gdouble t, gdouble half_width, gdouble beta)
+{
+    gdouble r = t / half_width;
+
+    if (r >= 1.0)
+        return 0.0;
+
+    return bessel_i0 (beta * sqrt (1.0 - r * r)) / bessel_i0 (beta);
+}
+
+static void
+release_mem (cl_mem *mem)
+{
+    if (*mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (*mem));
+        *mem = NULL;
+    }
+}
+
+static cl_mem
+create_buffer (UfoGridrecTaskPrivate *priv, gsize size, gfloat *host_mem)
+{
+    cl_int errcode;
+    cl_mem mem;
+
+    if (host_mem != NULL)
+        mem = clCreateBuffer (priv->context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                              size, host_mem, &errcode);
+    else
+        mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE, size, NULL, &errcode);
+
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    return mem;
+}
+
+static void
+release_buffers (UfoGridrecTaskPrivate *priv)
+{
+    release_mem (&priv->projections);
+    release_mem (&priv->grid);
+    release_mem (&priv->sin_lut);
+    release_mem (&priv->cos_lut);
+    release_mem (&priv->kernel_lut);
+    release_mem (&priv->deapodization);
+}
+
+static void
+create_buffers (UfoGridrecTaskPrivate *priv)
+{
+    gfloat *sin_lut;
+    gfloat *cos_lut;
+    gfloat *kernel_lut;
+    gfloat *deapodization;
+    gdouble half_width;
+    gdouble beta;
+    gdouble shift;
+    gdouble dt;
+
+    half_width = priv->kernel_width / 2.0;
+    beta = G_PI * sqrt (priv->kernel_width * priv->kernel_width / (priv->oversampling * priv->oversampling) *
+                        (priv->oversampling - 0.5) * (priv->oversampling - 0.5) - 0.8);
+
+    sin_lut = g_malloc (priv->n_angles * sizeof (gfloat));
+    cos_lut = g_malloc (priv->n_angles * sizeof (gfloat));
+    kernel_lut = g_malloc ((KERNEL_LUT_SIZE + 1) * sizeof (gfloat));
+    deapodization = g_malloc (priv->width * sizeof (gfloat));
+
+    for (gsize i = 0; i < priv->n_angles; i++) {
+        sin_lut[i] = (gfloat) sin (priv->angle_offset + i * priv->real_angle_step);
+        cos_lut[i] = (gfloat) cos (priv->angle_offset + i * priv->real_angle_step);
+    }
+
+    for (guint i = 0; i <= KERNEL_LUT_SIZE; i++)
+        kernel_lut[i] = (gfloat) kaiser_bessel (i * half_width / KERNEL_LUT_SIZE, half_width, beta);
+
+    /*
+     * The image is multiplied with the Fourier transform of the gridding
+     * kernel, which we undo by dividing by it. It is evaluated at the same
+     * shifted pixel positions that the grid kernel moves the image to.
+     */
+    shift = priv->width / 2.0 - priv->real_axis_pos + 0.5;
+    dt = half_width / KERNEL_LUT_SIZE;
+
+    for (gsize i = 0; i < priv->width; i++) {
+        gdouble x = (gdouble) i - priv->width / 2.0 + shift;
+        gdouble sum = 0.0;
+
+        /* Simpson's rule on the tabulated kernel */
+        for (guint j = 0; j <= KERNEL_LUT_SIZE; j++) {
+            gdouble weight = (j == 0 || j == KERNEL_LUT_SIZE) ? 1.0 : (j % 2 ? 4.0 : 2.0);
+            sum += weight * kernel_lut[j] * cos (2.0 * G_PI * j * dt * x / priv->size);
+        }
+
+        deapodization[i] = (gfloat) (1.0 / (2.0 * sum * dt / 3.0));
+    }
+
+    priv->projections = create_buffer (priv, 2 * priv->size * priv->n_angles * sizeof (gfloat), NULL);
+    priv->grid = create_buffer (priv, 2 * priv->size * priv->size * sizeof (gfloat), NULL);
+    priv->sin_lut = create_buffer (priv, priv->n_angles * sizeof (gfloat), sin_lut);
+    priv->cos_lut = create_buffer (priv, priv->n_angles * sizeof (gfloat), cos_lut);
+    priv->kernel_lut = create_buffer (priv, (KERNEL_LUT_SIZE + 1) * sizeof (gfloat), kernel_lut);
+    priv->deapodization = create_buffer (priv, priv->width * sizeof (gfloat), deapodization);
+
+    g_free (sin_lut);
+    g_free (cos_lut);
+    g_free (kernel_lut);
+    g_free (deapodization);
+}
+
+static void
+ufo_gridrec_task_setup (UfoTask *task,
+                        UfoResources *resources,
+                        GError **error)
+{
+    UfoGridrecTaskPrivate *priv;
+
+    priv = UFO_GRIDREC_TASK_GET_PRIVATE (task);
+
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    priv->spread_kernel = ufo_kernel_cache_get_kernel (resources, "gridrec.cl", "gridrec_spread", NULL, error);
+    priv->filter_kernel = ufo_kernel_cache_get_kernel (resources, "gridrec.cl", "gridrec_filter", NULL, error);
+    priv->grid_kernel = ufo_kernel_cache_get_kernel (resources, "gridrec.cl", "gridrec_grid", NULL, error);
+    priv->crop_kernel = ufo_kernel_cache_get_kernel (resources, "gridrec.cl", "gridrec_crop", NULL, error);
+
+    if (priv->spread_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->spread_kernel));
+
+    if (priv->filter_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->filter_kernel));
+
+    if (priv->grid_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->grid_kernel));
+
+    if (priv->crop_kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->crop_kernel));
+}
+
+static void
+ufo_gridrec_task_get_requisition (UfoTask *task,
+                                  UfoBuffer **inputs,
+                                  UfoRequisition *requisition)
+{
+    UfoGridrecTaskPrivate *priv;
+    UfoRequisition in_req;
+    cl_command_queue queue;
+    gfloat axis_pos;
+
+    priv = UFO_GRIDREC_TASK_GET_PRIVATE (task);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    axis_pos = priv->axis_pos <= 0.0 ? in_req.dims[0] / 2.0f : (gfloat) priv->axis_pos;
+
+    if (in_req.dims[0] != priv->width || in_req.dims[1] != priv->n_angles || axis_pos != priv->real_axis_pos) {
+        priv->width = in_req.dims[0];
+        priv->n_angles = in_req.dims[1];
+        priv->real_axis_pos = axis_pos;
+        priv->real_angle_step = priv->angle_step <= 0.0 ? G_PI / priv->n_angles : priv->angle_step;
+        priv->size = pow2round ((guint32) ceil (priv->oversampling * priv->width));
+
+        priv->param_1d.size[0] = priv->size;
+        priv->param_1d.batch = priv->n_angles;
+        priv->param_2d.size[0] = priv->size;
+        priv->param_2d.size[1] = priv->size;
+
+        queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+        UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft_1d, priv->context, queue, &priv->param_1d));
+        UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft_2d, priv->context, queue, &priv->param_2d));
+
+        release_buffers (priv);
+        create_buffers (priv);
+    }
+
+    *requisition = in_req;  /* keep third dimension for slice stacks */
+    requisition->dims[1] = in_req.dims[0];
+}
+
+static guint
+ufo_gridrec_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_gridrec_task_get_num_dimensions (UfoTask *task,
+                                     guint input)
+{
+    g_return_val_if_fail (input == 0, 0);
+    return 2;
+}
+
+static UfoTaskMode
+ufo_gridrec_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+}
+
+static gboolean
+ufo_gridrec_task_equal_real (UfoNode *n1,
+                             UfoNode *n2)
+{
+    g_return_val_if_fail (UFO_IS_GRIDREC_TASK (n1) && UFO_IS_GRIDREC_TASK (n2), FALSE);
+    return UFO_GRIDREC_TASK (n1)->priv->grid_kernel == UFO_GRIDREC_TASK (n2)->priv->grid_kernel;
+}
+
+static gboolean
+ufo_gridrec_task_process (UfoTask *task,
+                          UfoBuffer **inputs,
+                          UfoBuffer *output,
+                          UfoRequisition *requisition)
+{
+    UfoGridrecTaskPrivate *priv;
+    UfoRequisition in_req;
+    UfoProfiler *profiler;
+    cl_command_queue queue;
+    cl_mem in_mem;
+    cl_mem out_mem;
+    cl_int width;
+    cl_int size;
+    cl_int n_angles;
+    cl_int center;
+    cl_float detector_shift;
+    cl_float image_shift;
+    cl_float filter_scale;
+    cl_float lut_scale;
+    cl_float half_width;
+    cl_float angle_step;
+    cl_float angle_offset;
+    gsize n_slices;
+    gsize projections_work_size[2];
+    gsize grid_work_size[2];
+    gsize crop_work_size[2];
+
+    priv = UFO_GRIDREC_TASK_GET_PRIVATE (task);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+    in_mem = ufo_buffer_get_device_array (inputs[0], queue);
+    out_mem = ufo_buffer_get_device_array (output, queue);
+
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+    n_slices = in_req.n_dims == 3 ? in_req.dims[2] : 1;
+
+    width = (cl_int) priv->width;
+    size = (cl_int) priv->size;
+    n_angles = (cl_int) priv->n_angles;
+
+    /* Detector pixel centers are at t + 0.5, center them on the axis */
+    center = (cl_int) floor (priv->real_axis_pos);
+    detector_shift = priv->real_axis_pos - 0.5f - center;
+    image_shift = priv->width / 2.0f - priv->real_axis_pos + 0.5f;
+
+    filter_scale = (cl_float) priv->real_angle_step;
+    half_width = priv->kernel_width / 2.0f;
+    lut_scale = KERNEL_LUT_SIZE / half_width;
+    angle_step = (cl_float) priv->real_angle_step;
+    angle_offset = (cl_float) priv->angle_offset;
+
+    projections_work_size[0] = priv->size;
+    projections_work_size[1] = priv->n_angles;
+    grid_work_size[0] = grid_work_size[1] = priv->size;
+    crop_work_size[0] = crop_work_size[1] = priv->width;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 1, sizeof (cl_mem), &priv->projections));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 2, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 5, sizeof (cl_int), &center));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 0, sizeof (cl_mem), &priv->projections));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 1, sizeof (cl_float), &detector_shift));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->filter_kernel, 2, sizeof (cl_float), &filter_scale));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 0, sizeof (cl_mem), &priv->projections));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 1, sizeof (cl_mem), &priv->grid));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 2, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 3, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 4, sizeof (cl_mem), &priv->kernel_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 5, sizeof (cl_float), &lut_scale));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 6, sizeof (cl_float), &half_width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 7, sizeof (cl_int), &n_angles));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 8, sizeof (cl_float), &angle_step));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 9, sizeof (cl_float), &angle_offset));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->grid_kernel, 10, sizeof (cl_float), &image_shift));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->crop_kernel, 0, sizeof (cl_mem), &priv->grid));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->crop_kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->crop_kernel, 2, sizeof (cl_mem), &priv->deapodization));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->crop_kernel, 3, sizeof (cl_int), &size));
+
+    /* Two slices are reconstructed at once as real and imaginary part */
+    for (gsize i = 0; i < n_slices; i += 2) {
+        /* Offsets of stacks exceed the int range, e.g. 2048^2 x 512 slices */
+        cl_ulong in_offset = (cl_ulong) i * priv->width * priv->n_angles;
+        cl_ulong out_offset = (cl_ulong) i * priv->width * priv->width;
+        cl_int pair = i + 1 < n_slices;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 3, sizeof (cl_ulong), &in_offset));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->spread_kernel, 4, sizeof (cl_int), &pair));
+        ufo_profiler_call (profiler, queue, priv->spread_kernel, 2, projections_work_size, NULL);
+
+        UFO_RESOURCES_CHECK_CLERR (ufo_fft_execute (priv->fft_1d, queue, profiler,
+                                                    priv->projections, priv->projections,
+                                                    UFO_FFT_FORWARD, 0, NULL, NULL));
+
+        ufo_profiler_call (profiler, queue, priv->filter_kernel, 2, projections_work_size, NULL);
+        ufo_profiler_call (profiler, queue, priv->grid_kernel, 2, grid_work_size, NULL);
+
+        UFO_RESOURCES_CHECK_CLERR (ufo_fft_execute (priv->fft_2d, queue, profiler,
+                                                    priv->grid, priv->grid,
+                                                    UFO_FFT_BACKWARD, 0, NULL, NULL));
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->crop_kernel, 4, sizeof (cl_ulong), &out_offset));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->crop_kernel, 5, sizeof (cl_int), &pair));
+        ufo_profiler_call (profiler, queue, priv->crop_kernel, 2, crop_work_size, NULL);
+    }
+
+    return TRUE;
+}
+
+static void
+ufo_gridrec_task_finalize (GObject *object)
+{
+    UfoGridrecTaskPrivate *priv;
+
+    priv = UFO_GRIDREC_TASK_GET_PRIVATE (object);
+
+    release_buffers (priv);
+
+    if (priv->spread_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->spread_kernel));
+        priv->spread_kernel = NULL;
+    }
+
+    if (priv->filter_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->filter_kernel));
+        priv->filter_kernel = NULL;
+    }
+
+    if (priv->grid_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->grid_kernel));
+        priv->grid_kernel = NULL;
+    }
+
+    if (priv->crop_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->crop_kernel));
+        priv->crop_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    if (priv->fft_1d) {
+        ufo_fft_destroy (priv->fft_1d);
+        priv->fft_1d = NULL;
+    }
+
+    if (priv->fft_2d) {
+        ufo_fft_destroy (priv->fft_2d);
+        priv->fft_2d = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_gridrec_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_gridrec_task_setup;
+    iface->get_requisition = ufo_gridrec_task_get_requisition;
+    iface->get_num_inputs = ufo_gridrec_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_gridrec_task_get_num_dimensions;
+    iface->get_mode = ufo_gridrec_task_get_mode;
+    iface->process = ufo_gridrec_task_process;
+}
+
+static void
+ufo_gridrec_task_set_property (GObject *object,
+                               guint property_id,
+                               const GValue *value,
+                               GParamSpec *pspec)
+{
+    UfoGridrecTaskPrivate *priv = UFO_GRIDREC_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_AXIS_POSITION:
+            priv->axis_pos = g_value_get_double (value);
+            break;
+        case PROP_ANGLE_STEP:
+            priv->angle_step = g_value_get_double (value);
+            priv->width = 0;
+            break;
+        case PROP_ANGLE_OFFSET:
+            priv->angle_offset = g_value_get_double (value);
+            priv->width = 0;
+            break;
+        case PROP_OVERSAMPLING:
+            priv->oversampling = g_value_get_float (value);
+            priv->width = 0;
+            break;
+        case PROP_KERNEL_WIDTH:
+            priv->kernel_width = g_value_get_float (value);
+            priv->width = 0;
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_gridrec_task_get_property (GObject *object,
+                               guint property_id,
+                               GValue *value,
+                               GParamSpec *pspec)
+{
+    UfoGridrecTaskPrivate *priv = UFO_GRIDREC_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_AXIS_POSITION:
+            g_value_set_double (value, priv->axis_pos);
+            break;
+        case PROP_ANGLE_STEP:
+            g_value_set_double (value, priv->angle_step);
+            break;
+        case PROP_ANGLE_OFFSET:
+            g_value_set_double (value, priv->angle_offset);
+            break;
+        case PROP_OVERSAMPLING:
+            g_value_set_float (value, priv->oversampling);
+            break;
+        case PROP_KERNEL_WIDTH:
+            g_value_set_float (value, priv->kernel_width);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_gridrec_task_class_init (UfoGridrecTaskClass *klass)
+{
+    GObjectClass *oclass;
+    UfoNodeClass *node_class;
+    gdouble limit = G_PI * 4.0;
+
+    oclass = G_OBJECT_CLASS (klass);
+    node_class = UFO_NODE_CLASS (klass);
+
+    oclass->finalize = ufo_gridrec_task_finalize;
+    oclass->set_property = ufo_gridrec_task_set_property;
+    oclass->get_property = ufo_gridrec_task_get_property;
+
+    properties[PROP_AXIS_POSITION] =
+        g_param_spec_double ("axis-pos",
+                             "Position of rotation axis",
+                             "Position of rotation axis",
+                             -1.0, +8192.0, 0.0,
+                             G_PARAM_READWRITE);
+
+    properties[PROP_ANGLE_STEP] =
+        g_param_spec_double ("angle-step",
+                             "Increment of angle in radians",
+                             "Increment of angle in radians",
+                             -limit, +limit, 0.0,
+                             G_PARAM_READWRITE);
+
+    properties[PROP_ANGLE_OFFSET] =
+        g_param_spec_double ("angle-offset",
+                             "Angle offset in radians",
+                             "Angle offset in radians determining the first angle position",
+                             0.0, +limit, 0.0,
+                             G_PARAM_READWRITE);
+
+    properties[PROP_OVERSAMPLING] =
+        g_param_spec_float ("oversampling",
+                            "Oversampling ratio of the Fourier grid",
+                            "Oversampling ratio of the Fourier grid",
+                            1.25f, 4.0f, 2.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_KERNEL_WIDTH] =
+        g_param_spec_float ("kernel-width",
+                            "Width of the Kaiser-Bessel gridding kernel in grid points",
+                            "Width of the Kaiser-Bessel gridding kernel in grid points",
+                            2.0f, 16.0f, 6.0f,
+                            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    node_class->equal = ufo_gridrec_task_equal_real;
+
+    g_type_class_add_private(klass, sizeof(UfoGridrecTaskPrivate));
+}
+
+static void
+ufo_gridrec_task_init (UfoGridrecTask *self)
+{
+    UfoGridrecTaskPrivate *priv;
+
+    self->priv = priv = UFO_GRIDREC_TASK_GET_PRIVATE (self);
+
+    priv->context = NULL;
+    priv->spread_kernel = NULL;
+    priv->filter_kernel = NULL;
+    priv->grid_kernel = NULL;
+    priv->crop_kernel = NULL;
+    priv->projections = NULL;
+    priv->grid = NULL;
+    priv->sin_lut = NULL;
+    priv->cos_lut = NULL;
+    priv->kernel_lut = NULL;
+    priv->deapodization = NULL;
+    priv->width = 0;
+    priv->n_angles = 0;
+    priv->size = 0;
+    priv->real_axis_pos = -1.0f;
+    priv->axis_pos = -1.0;
+    priv->angle_step = 0.0;
+    priv->angle_offset = 0.0;
+    priv->oversampling = 2.0f;
+    priv->kernel_width = 6.0f;
+
+    priv->fft_1d = ufo_fft_new ();
+    priv->param_1d.dimensions = UFO_FFT_1D;
+    priv->param_1d.size[0] = priv->param_1d.size[1] = priv->param_1d.size[2] = 1;
+    priv->param_1d.batch = 1;
+    priv->param_1d.zeropad = TRUE;
+
+    priv->fft_2d = ufo_fft_new ();
+    priv->param_2d.dimensions = UFO_FFT_2D;
+    priv->param_2d.size[0] = priv->param_2d.size[1] = priv->param_2d.size[2] = 1;
+    priv->param_2d.batch = 1;
+    priv->param_2d.zeropad = TRUE;
+}
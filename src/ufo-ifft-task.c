@@ -17,6 +17,8 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
@@ -24,6 +26,7 @@
 #endif
 
 #include "ufo-ifft-task.h"
+#include "common/ufo-kernel-cache.h"
 #include "common/ufo-fft.h"
 
 
@@ -36,6 +39,7 @@ struct _UfoIfftTaskPrivate {
 
     gint crop_width;
     gint crop_height;
+    gboolean use_fftw;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -51,6 +55,7 @@ enum {
     PROP_DIMENSIONS,
     PROP_CROP_WIDTH,
     PROP_CROP_HEIGHT,
+    PROP_USE_FFTW,
     N_PROPERTIES
 };
 
@@ -70,7 +75,16 @@ ufo_ifft_task_setup (UfoTask *task,
     UfoIfftTaskPrivate *priv;
 
     priv = UFO_IFFT_TASK_GET_PRIVATE (task);
-    priv->kernel = ufo_resources_get_kernel (resources, "fft.cl", "fft_pack", error);
+
+    if (priv->use_fftw) {
+#ifndef HAVE_FFTW
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "::use-fftw set but ufo-filters was built without FFTW");
+#endif
+        return;
+    }
+
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "fft.cl", "fft_pack", NULL, error);
     priv->context = ufo_resources_get_context (resources);
 
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
@@ -97,7 +111,9 @@ ufo_ifft_task_get_requisition (UfoTask *task,
 
     switch (priv->param.dimensions) {
         case UFO_FFT_1D:
-            priv->param.batch = in_req.n_dims == 2 ? in_req.dims[1] : 1;
+            /* rows of stacked sinograms are contiguous, transform them all at once */
+            priv->param.batch = in_req.n_dims >= 2 ? in_req.dims[1] : 1;
+            priv->param.batch *= in_req.n_dims == 3 ? in_req.dims[2] : 1;
             break;
 
         case UFO_FFT_2D:
@@ -109,8 +125,15 @@ ufo_ifft_task_get_requisition (UfoTask *task,
             break;
     }
 
-    queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
-    UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft, priv->context, queue, &priv->param));
+#ifdef HAVE_FFTW
+    if (priv->use_fftw)
+        ufo_fft_update_host (priv->fft, &priv->param);
+#endif
+
+    if (!priv->use_fftw) {
+        queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+        UFO_RESOURCES_CHECK_CLERR (ufo_fft_update (priv->fft, priv->context, queue, &priv->param));
+    }
 
     *requisition = in_req;  /* keep third dimension for 2-D batching */
     requisition->dims[0] = priv->crop_width > 0 ? (gsize) priv->crop_width : priv->param.size[0];
@@ -134,6 +157,9 @@ ufo_ifft_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_ifft_task_get_mode (UfoTask *task)
 {
+    if (UFO_IFFT_TASK_GET_PRIVATE (task)->use_fftw)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+
     return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
 }
 
@@ -145,6 +171,50 @@ ufo_ifft_task_equal_real (UfoNode *n1,
     return TRUE;
 }
 
+#ifdef HAVE_FFTW
+static void
+process_host (UfoIfftTaskPrivate *priv, UfoBuffer *input, UfoBuffer *output, UfoRequisition *requisition)
+{
+    UfoRequisition in_req;
+    gfloat *in_data;
+    gfloat *out_data;
+    gfloat scale;
+    gsize width, height, depth;
+    gsize in_width, in_height;
+
+    ufo_buffer_get_requisition (input, &in_req);
+    in_data = ufo_buffer_get_host_array (input, NULL);
+    out_data = ufo_buffer_get_host_array (output, NULL);
+
+    /* In-place IFFT like on the device */
+    ufo_fft_execute_host (priv->fft, in_data, in_data, UFO_FFT_BACKWARD);
+
+    scale = 1.0f / ((gfloat) requisition->dims[0]);
+
+    if (priv->param.dimensions == UFO_FFT_2D)
+        scale /= (gfloat) requisition->dims[1];
+
+    width = requisition->dims[0];
+    height = requisition->dims[1];
+    depth = requisition->n_dims == 3 ? in_req.dims[2] : 1;
+    in_width = in_req.dims[0] >> 1;
+    in_height = in_req.dims[1];
+    width = MIN (width, in_width);
+    height = MIN (height, in_height);
+
+#pragma omp parallel for collapse(2)
+    for (gsize z = 0; z < depth; z++) {
+        for (gsize y = 0; y < height; y++) {
+            gfloat *src = in_data + 2 * (z * in_height + y) * in_width;
+            gfloat *dst = out_data + (z * requisition->dims[1] + y) * requisition->dims[0];
+
+            for (gsize x = 0; x < width; x++)
+                dst[x] = src[2 * x] * scale;
+        }
+    }
+}
+#endif
+
 static gboolean
 ufo_ifft_task_process (UfoTask *task,
                        UfoBuffer **inputs,
@@ -163,6 +233,14 @@ ufo_ifft_task_process (UfoTask *task,
     gsize global_work_size[3];
 
     priv = UFO_IFFT_TASK_GET_PRIVATE (task);
+
+#ifdef HAVE_FFTW
+    if (priv->use_fftw) {
+        process_host (priv, inputs[0], output, requisition);
+        return TRUE;
+    }
+#endif
+
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
     queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
     in_mem = ufo_buffer_get_device_array (inputs[0], queue);
@@ -254,6 +332,9 @@ ufo_ifft_task_set_property (GObject *object,
         case PROP_CROP_HEIGHT:
             priv->crop_height = g_value_get_int (value);
             break;
+        case PROP_USE_FFTW:
+            priv->use_fftw = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -278,6 +359,9 @@ ufo_ifft_task_get_property (GObject *object,
         case PROP_CROP_HEIGHT:
             g_value_set_int (value, priv->crop_height);
             break;
+        case PROP_USE_FFTW:
+            g_value_set_boolean (value, priv->use_fftw);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -318,6 +402,13 @@ ufo_ifft_task_class_init (UfoIfftTaskClass *klass)
                           -1, G_MAXINT, -1,
                           G_PARAM_READWRITE);
 
+    properties[PROP_USE_FFTW] =
+        g_param_spec_boolean ("use-fftw",
+                              "Compute the transform on the host with FFTW",
+                              "Compute the transform on the host with FFTW",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -333,6 +424,7 @@ ufo_ifft_task_init (UfoIfftTask *self)
     self->priv = priv = UFO_IFFT_TASK_GET_PRIVATE (self);
     priv->crop_width = -1;
     priv->crop_height = -1;
+    priv->use_fftw = FALSE;
     priv->kernel = NULL;
     priv->context = NULL;
     priv->fft = ufo_fft_new ();
@@ -0,0 +1,906 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <math.h>
+#include "ufo-iterative-reconstruct-task.h"
+#include "common/ufo-kernel-cache.h"
+
+/* Work layout of the dot product reduction */
+#define DOT_GROUPS      64
+#define DOT_LOCAL_SIZE  128
+
+
+typedef enum {
+    METHOD_SIRT,
+    METHOD_SART,
+    METHOD_CGLS
+} Method;
+
+static GEnumValue method_values[] = {
+    { METHOD_SIRT, "METHOD_SIRT", "sirt" },
+    { METHOD_SART, "METHOD_SART", "sart" },
+    { METHOD_CGLS, "METHOD_CGLS", "cgls" },
+    { 0, NULL, NULL}
+};
+
+struct _UfoIterativeReconstructTaskPrivate {
+    cl_context context;
+    cl_kernel forward_kernel;
+    cl_kernel backward_kernel;
+    cl_kernel set_kernel;
+    cl_kernel invert_kernel;
+    cl_kernel residual_kernel;
+    cl_kernel multiply_kernel;
+    cl_kernel update_kernel;
+    cl_kernel axpy_kernel;
+    cl_kernel xpby_kernel;
+    cl_kernel dot_kernel;
+    cl_kernel sart_residual_kernel;
+    cl_kernel sart_update_kernel;
+
+    /* sinogram-sized */
+    cl_mem projected;
+    cl_mem residual;
+    cl_mem row_weights;
+    /* slice-sized */
+    cl_mem correction;
+    cl_mem column_weights;
+    cl_mem direction;
+
+    cl_mem sin_lut;
+    cl_mem cos_lut;
+    cl_mem partial;
+    guint *order;
+
+    gsize width;
+    gsize n_angles;
+    gfloat real_axis_pos;
+    gdouble real_angle_step;
+    gboolean weights_valid;
+
+    Method method;
+    guint num_iterations;
+    gfloat relaxation;
+    gboolean positivity;
+    gdouble stop_threshold;
+    gdouble axis_pos;
+    gdouble angle_step;
+    gdouble angle_offset;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoIterativeReconstructTask, ufo_iterative_reconstruct_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK, UfoIterativeReconstructTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_METHOD,
+    PROP_NUM_ITERATIONS,
+    PROP_RELAXATION_FACTOR,
+    PROP_POSITIVITY,
+    PROP_STOP_THRESHOLD,
+    PROP_AXIS_POSITION,
+    PROP_ANGLE_STEP,
+    PROP_ANGLE_OFFSET,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_iterative_reconstruct_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK, NULL));
+}
+
+static cl_kernel
+get_kernel (UfoResources *resources, const gchar *name, GError **error)
+{
+    cl_kernel kernel;
+
+    kernel = ufo_kernel_cache_get_kernel (resources, "iterative.cl", name, NULL, error);
+
+    if (kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (kernel));
+
+    return kernel;
+}
+
+static void
+release_kernel (cl_kernel *kernel)
+{
+    if (*kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (*kernel));
+        *kernel = NULL;
+    }
+}
+
+static void
+release_mem (cl_mem *mem)
+{
+    if (*mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (*mem));
+        *mem = NULL;
+    }
+}
+
+static cl_mem
+create_buffer (UfoIterativeReconstructTaskPrivate *priv, gsize n_elements, gfloat *host_mem)
+{
+    cl_int errcode;
+    cl_mem mem;
+
+    if (host_mem != NULL)
+        mem = clCreateBuffer (priv->context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY,
+                              n_elements * sizeof (gfloat), host_mem, &errcode);
+    else
+        mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                              n_elements * sizeof (gfloat), NULL, &errcode);
+
+    UFO_RESOURCES_CHECK_CLERR (errcode);
+    return mem;
+}
+
+static void
+release_buffers (UfoIterativeReconstructTaskPrivate *priv)
+{
+    release_mem (&priv->projected);
+    release_mem (&priv->residual);
+    release_mem (&priv->row_weights);
+    release_mem (&priv->correction);
+    release_mem (&priv->column_weights);
+    release_mem (&priv->direction);
+    release_mem (&priv->sin_lut);
+    release_mem (&priv->cos_lut);
+    release_mem (&priv->partial);
+    g_free (priv->order);
+    priv->order = NULL;
+}
+
+static void
+create_buffers (UfoIterativeReconstructTaskPrivate *priv)
+{
+    gsize n_sino = priv->width * priv->n_angles;
+    gsize n_slice = priv->width * priv->width;
+    gfloat *sin_lut;
+    gfloat *cos_lut;
+    guint stride;
+
+    sin_lut = g_malloc (priv->n_angles * sizeof (gfloat));
+    cos_lut = g_malloc (priv->n_angles * sizeof (gfloat));
+
+    for (gsize i = 0; i < priv->n_angles; i++) {
+        sin_lut[i] = (gfloat) sin (priv->angle_offset + i * priv->real_angle_step);
+        cos_lut[i] = (gfloat) cos (priv->angle_offset + i * priv->real_angle_step);
+    }
+
+    priv->projected = create_buffer (priv, n_sino, NULL);
+    priv->residual = create_buffer (priv, n_sino, NULL);
+    priv->row_weights = create_buffer (priv, n_sino, NULL);
+    priv->correction = create_buffer (priv, n_slice, NULL);
+    priv->column_weights = create_buffer (priv, n_slice, NULL);
+    priv->direction = priv->method == METHOD_CGLS ? create_buffer (priv, n_slice, NULL) : NULL;
+    priv->sin_lut = create_buffer (priv, priv->n_angles, sin_lut);
+    priv->cos_lut = create_buffer (priv, priv->n_angles, cos_lut);
+    priv->partial = create_buffer (priv, DOT_GROUPS, NULL);
+
+    /*
+     * SART converges much faster if subsequent projections are far apart, so
+     * step through them with a stride close to the golden ratio that is
+     * coprime to the number of projections.
+     */
+    priv->order = g_malloc (priv->n_angles * sizeof (guint));
+    stride = MAX (1, (guint) (priv->n_angles * 0.618));
+
+    while (stride > 1) {
+        guint a = (guint) priv->n_angles;
+        guint b = stride;
+
+        while (b) {
+            guint t = a % b;
+            a = b;
+            b = t;
+        }
+
+        if (a == 1)
+            break;
+
+        stride--;
+    }
+
+    for (gsize i = 0; i < priv->n_angles; i++)
+        priv->order[i] = (guint) ((i * stride) % priv->n_angles);
+
+    priv->weights_valid = FALSE;
+
+    g_free (sin_lut);
+    g_free (cos_lut);
+}
+
+static void
+ufo_iterative_reconstruct_task_setup (UfoTask *task,
+                                      UfoResources *resources,
+                                      GError **error)
+{
+    UfoIterativeReconstructTaskPrivate *priv;
+
+    priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (task);
+
+    priv->context = ufo_resources_get_context (resources);
+    UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+    priv->forward_kernel = get_kernel (resources, "ir_forward", error);
+    priv->backward_kernel = get_kernel (resources, "ir_backward", error);
+    priv->set_kernel = get_kernel (resources, "ir_set", error);
+    priv->invert_kernel = get_kernel (resources, "ir_invert", error);
+    priv->residual_kernel = get_kernel (resources, "ir_residual", error);
+    priv->multiply_kernel = get_kernel (resources, "ir_multiply", error);
+    priv->update_kernel = get_kernel (resources, "ir_update", error);
+    priv->axpy_kernel = get_kernel (resources, "ir_axpy", error);
+    priv->xpby_kernel = get_kernel (resources, "ir_xpby", error);
+    priv->dot_kernel = get_kernel (resources, "ir_dot", error);
+    priv->sart_residual_kernel = get_kernel (resources, "ir_sart_residual", error);
+    priv->sart_update_kernel = get_kernel (resources, "ir_sart_update", error);
+}
+
+static void
+ufo_iterative_reconstruct_task_get_requisition (UfoTask *task,
+                                                UfoBuffer **inputs,
+                                                UfoRequisition *requisition)
+{
+    UfoIterativeReconstructTaskPrivate *priv;
+    UfoRequisition in_req;
+    gfloat axis_pos;
+
+    priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (task);
+    ufo_buffer_get_requisition (inputs[0], &in_req);
+
+    axis_pos = priv->axis_pos <= 0.0 ? in_req.dims[0] / 2.0f : (gfloat) priv->axis_pos;
+
+    if (in_req.dims[0] != priv->width || in_req.dims[1] != priv->n_angles || axis_pos != priv->real_axis_pos) {
+        priv->width = in_req.dims[0];
+        priv->n_angles = in_req.dims[1];
+        priv->real_axis_pos = axis_pos;
+        priv->real_angle_step = priv->angle_step <= 0.0 ? G_PI / priv->n_angles : priv->angle_step;
+
+        release_buffers (priv);
+        create_buffers (priv);
+    }
+
+    requisition->n_dims = 2;
+    requisition->dims[0] = in_req.dims[0];
+    requisition->dims[1] = in_req.dims[0];
+}
+
+static guint
+ufo_iterative_reconstruct_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_iterative_reconstruct_task_get_num_dimensions (UfoTask *task,
+                                                   guint input)
+{
+    g_return_val_if_fail (input == 0, 0);
+    return 2;
+}
+
+static UfoTaskMode
+ufo_iterative_reconstruct_task_get_mode (UfoTask *task)
+{
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+}
+
+static gboolean
+ufo_iterative_reconstruct_task_equal_real (UfoNode *n1,
+                                           UfoNode *n2)
+{
+    g_return_val_if_fail (UFO_IS_ITERATIVE_RECONSTRUCT_TASK (n1) && UFO_IS_ITERATIVE_RECONSTRUCT_TASK (n2), FALSE);
+    return UFO_ITERATIVE_RECONSTRUCT_TASK (n1)->priv->forward_kernel == UFO_ITERATIVE_RECONSTRUCT_TASK (n2)->priv->forward_kernel;
+}
+
+static void
+forward (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+         cl_mem volume, cl_mem sinogram, guint angle_start, guint n_angles)
+{
+    cl_int width = (cl_int) priv->width;
+    cl_int start = (cl_int) angle_start;
+    gsize work_size[2] = { priv->width, n_angles };
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 0, sizeof (cl_mem), &volume));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 1, sizeof (cl_mem), &sinogram));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 2, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 3, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 4, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 5, sizeof (cl_int), &start));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->forward_kernel, 6, sizeof (cl_float), &priv->real_axis_pos));
+    ufo_profiler_call (profiler, queue, priv->forward_kernel, 2, work_size, NULL);
+}
+
+static void
+backward (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+          cl_mem sinogram, cl_mem volume, guint angle_start, guint n_angles)
+{
+    cl_int width = (cl_int) priv->width;
+    cl_int start = (cl_int) angle_start;
+    cl_int count = (cl_int) n_angles;
+    gsize work_size[2] = { priv->width, priv->width };
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 0, sizeof (cl_mem), &sinogram));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 1, sizeof (cl_mem), &volume));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 2, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 3, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 4, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 5, sizeof (cl_int), &start));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 6, sizeof (cl_int), &count));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->backward_kernel, 7, sizeof (cl_float), &priv->real_axis_pos));
+    ufo_profiler_call (profiler, queue, priv->backward_kernel, 2, work_size, NULL);
+}
+
+static void
+set (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+     cl_mem mem, gsize n, gfloat value)
+{
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->set_kernel, 0, sizeof (cl_mem), &mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->set_kernel, 1, sizeof (cl_float), &value));
+    ufo_profiler_call (profiler, queue, priv->set_kernel, 1, &n, NULL);
+}
+
+static void
+invert (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+        cl_mem mem, gsize n)
+{
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->invert_kernel, 0, sizeof (cl_mem), &mem));
+    ufo_profiler_call (profiler, queue, priv->invert_kernel, 1, &n, NULL);
+}
+
+/* Computes residual = measured - projected for n elements starting at offset */
+static void
+residual (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+          cl_mem measured, gsize offset, gsize n)
+{
+    cl_int start = (cl_int) offset;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->residual_kernel, 0, sizeof (cl_mem), &measured));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->residual_kernel, 1, sizeof (cl_mem), &priv->projected));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->residual_kernel, 2, sizeof (cl_mem), &priv->residual));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->residual_kernel, 3, sizeof (cl_int), &start));
+    ufo_profiler_call (profiler, queue, priv->residual_kernel, 1, &n, NULL);
+}
+
+static void
+weigh_residual (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+                gsize offset, gsize n)
+{
+    cl_int start = (cl_int) offset;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->multiply_kernel, 0, sizeof (cl_mem), &priv->residual));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->multiply_kernel, 1, sizeof (cl_mem), &priv->row_weights));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->multiply_kernel, 2, sizeof (cl_int), &start));
+    ufo_profiler_call (profiler, queue, priv->multiply_kernel, 1, &n, NULL);
+}
+
+static void
+update (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+        cl_mem volume)
+{
+    cl_int positivity = priv->positivity ? 1 : 0;
+    gsize n = priv->width * priv->width;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->update_kernel, 0, sizeof (cl_mem), &volume));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->update_kernel, 1, sizeof (cl_mem), &priv->correction));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->update_kernel, 2, sizeof (cl_mem), &priv->column_weights));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->update_kernel, 3, sizeof (cl_float), &priv->relaxation));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->update_kernel, 4, sizeof (cl_int), &positivity));
+    ufo_profiler_call (profiler, queue, priv->update_kernel, 1, &n, NULL);
+}
+
+static void
+axpy (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+      cl_mem y, cl_mem x, gsize n, gfloat a)
+{
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->axpy_kernel, 0, sizeof (cl_mem), &y));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->axpy_kernel, 1, sizeof (cl_mem), &x));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->axpy_kernel, 2, sizeof (cl_float), &a));
+    ufo_profiler_call (profiler, queue, priv->axpy_kernel, 1, &n, NULL);
+}
+
+static void
+xpby (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+      cl_mem y, cl_mem x, gsize n, gfloat b)
+{
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->xpby_kernel, 0, sizeof (cl_mem), &y));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->xpby_kernel, 1, sizeof (cl_mem), &x));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->xpby_kernel, 2, sizeof (cl_float), &b));
+    ufo_profiler_call (profiler, queue, priv->xpby_kernel, 1, &n, NULL);
+}
+
+static gdouble
+dot (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+     cl_mem a, cl_mem b, gsize n)
+{
+    gfloat partial[DOT_GROUPS];
+    gsize global_work_size = DOT_GROUPS * DOT_LOCAL_SIZE;
+    gsize local_work_size = DOT_LOCAL_SIZE;
+    cl_int count = (cl_int) n;
+    gdouble sum = 0.0;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->dot_kernel, 0, sizeof (cl_mem), &a));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->dot_kernel, 1, sizeof (cl_mem), &b));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->dot_kernel, 2, sizeof (cl_mem), &priv->partial));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->dot_kernel, 3, DOT_LOCAL_SIZE * sizeof (cl_float), NULL));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->dot_kernel, 4, sizeof (cl_int), &count));
+    ufo_profiler_call (profiler, queue, priv->dot_kernel, 1, &global_work_size, &local_work_size);
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueReadBuffer (queue, priv->partial, CL_TRUE,
+                                                    0, sizeof (partial), partial,
+                                                    0, NULL, NULL));
+
+    for (guint i = 0; i < DOT_GROUPS; i++)
+        sum += partial[i];
+
+    return sum;
+}
+
+/*
+ * SIRT and SART weigh the residual with the inverse ray lengths (row sums of
+ * the system matrix) and SIRT the correction with the inverse column sums.
+ * SART updates from single projections whose column sums are one inside the
+ * field of view, so it needs no column weights.
+ */
+static void
+compute_weights (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler)
+{
+    gsize n_sino = priv->width * priv->n_angles;
+    gsize n_slice = priv->width * priv->width;
+
+    set (priv, queue, profiler, priv->correction, n_slice, 1.0f);
+    forward (priv, queue, profiler, priv->correction, priv->row_weights, 0, priv->n_angles);
+    invert (priv, queue, profiler, priv->row_weights, n_sino);
+
+    if (priv->method == METHOD_SIRT) {
+        set (priv, queue, profiler, priv->residual, n_sino, 1.0f);
+        backward (priv, queue, profiler, priv->residual, priv->column_weights, 0, priv->n_angles);
+        invert (priv, queue, profiler, priv->column_weights, n_slice);
+    }
+
+    priv->weights_valid = TRUE;
+}
+
+static gboolean
+converged (UfoIterativeReconstructTaskPrivate *priv, gdouble residual_norm, gdouble measured_norm, guint iteration)
+{
+    if (priv->stop_threshold <= 0.0 || measured_norm <= 0.0)
+        return FALSE;
+
+    if (sqrt (residual_norm / measured_norm) < priv->stop_threshold) {
+        g_debug ("iterative-reconstruct: converged after %u iterations", iteration + 1);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+run_sirt (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+          cl_mem measured, cl_mem volume, gdouble measured_norm)
+{
+    gsize n_sino = priv->width * priv->n_angles;
+
+    for (guint i = 0; i < priv->num_iterations; i++) {
+        forward (priv, queue, profiler, volume, priv->projected, 0, priv->n_angles);
+        residual (priv, queue, profiler, measured, 0, n_sino);
+
+        if (priv->stop_threshold > 0.0 &&
+            converged (priv, dot (priv, queue, profiler, priv->residual, priv->residual, n_sino), measured_norm, i))
+            break;
+
+        weigh_residual (priv, queue, profiler, 0, n_sino);
+        backward (priv, queue, profiler, priv->residual, priv->correction, 0, priv->n_angles);
+        update (priv, queue, profiler, volume);
+    }
+}
+
+/* One SART step for a single projection, fused into two kernels */
+static void
+sart_step (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+           cl_mem measured, cl_mem volume, guint angle)
+{
+    cl_int width = (cl_int) priv->width;
+    cl_int index = (cl_int) angle;
+    cl_int positivity = priv->positivity ? 1 : 0;
+    gsize residual_work_size = priv->width;
+    gsize update_work_size[2] = { priv->width, priv->width };
+    cl_kernel kernel;
+
+    kernel = priv->sart_residual_kernel;
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &volume));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &measured));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->row_weights));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), &priv->residual));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 5, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 6, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (cl_int), &index));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (cl_float), &priv->real_axis_pos));
+    ufo_profiler_call (profiler, queue, kernel, 1, &residual_work_size, NULL);
+
+    kernel = priv->sart_update_kernel;
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &volume));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &priv->residual));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &priv->sin_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 3, sizeof (cl_mem), &priv->cos_lut));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 4, sizeof (cl_int), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 5, sizeof (cl_int), &index));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 6, sizeof (cl_float), &priv->real_axis_pos));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 7, sizeof (cl_float), &priv->relaxation));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 8, sizeof (cl_int), &positivity));
+    ufo_profiler_call (profiler, queue, kernel, 2, update_work_size, NULL);
+}
+
+static void
+run_sart (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+          cl_mem measured, cl_mem volume, gdouble measured_norm)
+{
+    gsize n_sino = priv->width * priv->n_angles;
+
+    for (guint i = 0; i < priv->num_iterations; i++) {
+        for (gsize j = 0; j < priv->n_angles; j++)
+            sart_step (priv, queue, profiler, measured, volume, priv->order[j]);
+
+        if (priv->stop_threshold > 0.0) {
+            forward (priv, queue, profiler, volume, priv->projected, 0, priv->n_angles);
+            residual (priv, queue, profiler, measured, 0, n_sino);
+
+            if (converged (priv, dot (priv, queue, profiler, priv->residual, priv->residual, n_sino), measured_norm, i))
+                break;
+        }
+    }
+}
+
+static void
+run_cgls (UfoIterativeReconstructTaskPrivate *priv, cl_command_queue queue, UfoProfiler *profiler,
+          cl_mem measured, cl_mem volume, gdouble measured_norm)
+{
+    gsize n_sino = priv->width * priv->n_angles;
+    gsize n_slice = priv->width * priv->width;
+    gdouble gamma;
+    gdouble gamma_new;
+    gdouble alpha;
+
+    /* The volume starts at zero, so the initial residual is the measurement */
+    set (priv, queue, profiler, priv->projected, n_sino, 0.0f);
+    residual (priv, queue, profiler, measured, 0, n_sino);
+    backward (priv, queue, profiler, priv->residual, priv->direction, 0, priv->n_angles);
+    gamma = dot (priv, queue, profiler, priv->direction, priv->direction, n_slice);
+
+    for (guint i = 0; i < priv->num_iterations && gamma > 0.0; i++) {
+        /* projected holds q = A p, correction holds s = A^T r */
+        forward (priv, queue, profiler, priv->direction, priv->projected, 0, priv->n_angles);
+        alpha = gamma / dot (priv, queue, profiler, priv->projected, priv->projected, n_sino);
+
+        axpy (priv, queue, profiler, volume, priv->direction, n_slice, (gfloat) alpha);
+        axpy (priv, queue, profiler, priv->residual, priv->projected, n_sino, (gfloat) -alpha);
+
+        if (priv->stop_threshold > 0.0 &&
+            converged (priv, dot (priv, queue, profiler, priv->residual, priv->residual, n_sino), measured_norm, i))
+            break;
+
+        backward (priv, queue, profiler, priv->residual, priv->correction, 0, priv->n_angles);
+        gamma_new = dot (priv, queue, profiler, priv->correction, priv->correction, n_slice);
+        xpby (priv, queue, profiler, priv->direction, priv->correction, n_slice, (gfloat) (gamma_new / gamma));
+        gamma = gamma_new;
+    }
+}
+
+static gboolean
+ufo_iterative_reconstruct_task_process (UfoTask *task,
+                                        UfoBuffer **inputs,
+                                        UfoBuffer *output,
+                                        UfoRequisition *requisition)
+{
+    UfoIterativeReconstructTaskPrivate *priv;
+    UfoProfiler *profiler;
+    cl_command_queue queue;
+    cl_mem in_mem;
+    cl_mem out_mem;
+    gdouble measured_norm = 0.0;
+
+    priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (task);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    queue = ufo_gpu_node_get_cmd_queue (UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task))));
+    in_mem = ufo_buffer_get_device_array (inputs[0], queue);
+    out_mem = ufo_buffer_get_device_array (output, queue);
+
+    if (priv->method != METHOD_CGLS && !priv->weights_valid)
+        compute_weights (priv, queue, profiler);
+
+    if (priv->stop_threshold > 0.0)
+        measured_norm = dot (priv, queue, profiler, in_mem, in_mem, priv->width * priv->n_angles);
+
+    set (priv, queue, profiler, out_mem, priv->width * priv->width, 0.0f);
+
+    switch (priv->method) {
+        case METHOD_SIRT:
+            run_sirt (priv, queue, profiler, in_mem, out_mem, measured_norm);
+            break;
+        case METHOD_SART:
+            run_sart (priv, queue, profiler, in_mem, out_mem, measured_norm);
+            break;
+        case METHOD_CGLS:
+            run_cgls (priv, queue, profiler, in_mem, out_mem, measured_norm);
+            break;
+    }
+
+    return TRUE;
+}
+
+static void
+ufo_iterative_reconstruct_task_finalize (GObject *object)
+{
+    UfoIterativeReconstructTaskPrivate *priv;
+
+    priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (object);
+
+    release_buffers (priv);
+
+    release_kernel (&priv->forward_kernel);
+    release_kernel (&priv->backward_kernel);
+    release_kernel (&priv->set_kernel);
+    release_kernel (&priv->invert_kernel);
+    release_kernel (&priv->residual_kernel);
+    release_kernel (&priv->multiply_kernel);
+    release_kernel (&priv->update_kernel);
+    release_kernel (&priv->axpy_kernel);
+    release_kernel (&priv->xpby_kernel);
+    release_kernel (&priv->dot_kernel);
+    release_kernel (&priv->sart_residual_kernel);
+    release_kernel (&priv->sart_update_kernel);
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_iterative_reconstruct_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_iterative_reconstruct_task_setup;
+    iface->get_requisition = ufo_iterative_reconstruct_task_get_requisition;
+    iface->get_num_inputs = ufo_iterative_reconstruct_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_iterative_reconstruct_task_get_num_dimensions;
+    iface->get_mode = ufo_iterative_reconstruct_task_get_mode;
+    iface->process = ufo_iterative_reconstruct_task_process;
+}
+
+static void
+ufo_iterative_reconstruct_task_set_property (GObject *object,
+                                             guint property_id,
+                                             const GValue *value,
+                                             GParamSpec *pspec)
+{
+    UfoIterativeReconstructTaskPrivate *priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_METHOD:
+            priv->method = g_value_get_enum (value);
+            priv->width = 0;
+            break;
+        case PROP_NUM_ITERATIONS:
+            priv->num_iterations = g_value_get_uint (value);
+            break;
+        case PROP_RELAXATION_FACTOR:
+            priv->relaxation = g_value_get_float (value);
+            break;
+        case PROP_POSITIVITY:
+            priv->positivity = g_value_get_boolean (value);
+            break;
+        case PROP_STOP_THRESHOLD:
+            priv->stop_threshold = g_value_get_double (value);
+            break;
+        case PROP_AXIS_POSITION:
+            priv->axis_pos = g_value_get_double (value);
+            break;
+        case PROP_ANGLE_STEP:
+            priv->angle_step = g_value_get_double (value);
+            priv->width = 0;
+            break;
+        case PROP_ANGLE_OFFSET:
+            priv->angle_offset = g_value_get_double (value);
+            priv->width = 0;
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_iterative_reconstruct_task_get_property (GObject *object,
+                                             guint property_id,
+                                             GValue *value,
+                                             GParamSpec *pspec)
+{
+    UfoIterativeReconstructTaskPrivate *priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_METHOD:
+            g_value_set_enum (value, priv->method);
+            break;
+        case PROP_NUM_ITERATIONS:
+            g_value_set_uint (value, priv->num_iterations);
+            break;
+        case PROP_RELAXATION_FACTOR:
+            g_value_set_float (value, priv->relaxation);
+            break;
+        case PROP_POSITIVITY:
+            g_value_set_boolean (value, priv->positivity);
+            break;
+        case PROP_STOP_THRESHOLD:
+            g_value_set_double (value, priv->stop_threshold);
+            break;
+        case PROP_AXIS_POSITION:
+            g_value_set_double (value, priv->axis_pos);
+            break;
+        case PROP_ANGLE_STEP:
+            g_value_set_double (value, priv->angle_step);
+            break;
+        case PROP_ANGLE_OFFSET:
+            g_value_set_double (value, priv->angle_offset);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_iterative_reconstruct_task_class_init (UfoIterativeReconstructTaskClass *klass)
+{
+    GObjectClass *oclass;
+    UfoNodeClass *node_class;
+    gdouble limit = G_PI * 4.0;
+
+    oclass = G_OBJECT_CLASS (klass);
+    node_class = UFO_NODE_CLASS (klass);
+
+    oclass->finalize = ufo_iterative_reconstruct_task_finalize;
+    oclass->set_property = ufo_iterative_reconstruct_task_set_property;
+    oclass->get_property = ufo_iterative_reconstruct_task_get_property;
+
+    properties[PROP_METHOD] =
+        g_param_spec_enum ("method",
+                           "Reconstruction method (\"sirt\", \"sart\", \"cgls\")",
+                           "Reconstruction method (\"sirt\", \"sart\", \"cgls\")",
+                           g_enum_register_static ("ufo_iterative_reconstruct_method", method_values),
+                           METHOD_SIRT, G_PARAM_READWRITE);
+
+    properties[PROP_NUM_ITERATIONS] =
+        g_param_spec_uint ("num-iterations",
+                           "Maximum number of iterations",
+                           "Maximum number of iterations",
+                           1, G_MAXUINT, 10,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_RELAXATION_FACTOR] =
+        g_param_spec_float ("relaxation-factor",
+                            "Relaxation factor of SIRT and SART updates",
+                            "Relaxation factor of SIRT and SART updates",
+                            0.0f, 2.0f, 1.0f,
+                            G_PARAM_READWRITE);
+
+    properties[PROP_POSITIVITY] =
+        g_param_spec_boolean ("positivity",
+                              "Clamp negative values after SIRT and SART updates",
+                              "Clamp negative values after SIRT and SART updates",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_STOP_THRESHOLD] =
+        g_param_spec_double ("stop-threshold",
+                             "Relative residual norm at which to stop iterating",
+                             "Relative residual norm at which to stop iterating, 0 disables early stopping",
+                             0.0, 1.0, 0.0,
+                             G_PARAM_READWRITE);
+
+    properties[PROP_AXIS_POSITION] =
+        g_param_spec_double ("axis-pos",
+                             "Position of rotation axis",
+                             "Position of rotation axis",
+                             -1.0, +8192.0, 0.0,
+                             G_PARAM_READWRITE);
+
+    properties[PROP_ANGLE_STEP] =
+        g_param_spec_double ("angle-step",
+                             "Increment of angle in radians",
+                             "Increment of angle in radians",
+                             -limit, +limit, 0.0,
+                             G_PARAM_READWRITE);
+
+    properties[PROP_ANGLE_OFFSET] =
+        g_param_spec_double ("angle-offset",
+                             "Angle offset in radians",
+                             "Angle offset in radians determining the first angle position",
+                             0.0, +limit, 0.0,
+                             G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    node_class->equal = ufo_iterative_reconstruct_task_equal_real;
+
+    g_type_class_add_private(klass, sizeof(UfoIterativeReconstructTaskPrivate));
+}
+
+static void
+ufo_iterative_reconstruct_task_init (UfoIterativeReconstructTask *self)
+{
+    UfoIterativeReconstructTaskPrivate *priv;
+
+    self->priv = priv = UFO_ITERATIVE_RECONSTRUCT_TASK_GET_PRIVATE (self);
+
+    priv->context = NULL;
+    priv->forward_kernel = NULL;
+    priv->backward_kernel = NULL;
+    priv->set_kernel = NULL;
+    priv->invert_kernel = NULL;
+    priv->residual_kernel = NULL;
+    priv->multiply_kernel = NULL;
+    priv->update_kernel = NULL;
+    priv->axpy_kernel = NULL;
+    priv->xpby_kernel = NULL;
+    priv->dot_kernel = NULL;
+    priv->projected = NULL;
+    priv->residual = NULL;
+    priv->row_weights = NULL;
+    priv->correction = NULL;
+    priv->column_weights = NULL;
+    priv->direction = NULL;
+    priv->sin_lut = NULL;
+    priv->cos_lut = NULL;
+    priv->partial = NULL;
+    priv->order = NULL;
+    priv->width = 0;
+    priv->n_angles = 0;
+    priv->real_axis_pos = -1.0f;
+    priv->weights_valid = FALSE;
+
+    priv->method = METHOD_SIRT;
+    priv->num_iterations = 10;
+    priv->relaxation = 1.0f;
+    priv->positivity = FALSE;
+    priv->stop_threshold = 0.0;
+    priv->axis_pos = -1.0;
+    priv->angle_step = -1.0;
+    priv->angle_offset = 0.0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __UFO_ITERATIVE_RECONSTRUCT_TASK_H
+#define __UFO_ITERATIVE_RECONSTRUCT_TASK_H
+
+#include <ufo/ufo.h>
+
+G_BEGIN_DECLS
+
+#define UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK             (ufo_iterative_reconstruct_task_get_type())
+#define UFO_ITERATIVE_RECONSTRUCT_TASK(obj)             (G_TYPE_CHECK_INSTANCE_CAST((obj), UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK, UfoIterativeReconstructTask))
+#define UFO_IS_ITERATIVE_RECONSTRUCT_TASK(obj)          (G_TYPE_CHECK_INSTANCE_TYPE((obj), UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK))
+#define UFO_ITERATIVE_RECONSTRUCT_TASK_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST((klass), UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK, UfoIterativeReconstructTaskClass))
+#define UFO_IS_ITERATIVE_RECONSTRUCT_TASK_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE((klass), UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK))
+#define UFO_ITERATIVE_RECONSTRUCT_TASK_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS((obj), UFO_TYPE_ITERATIVE_RECONSTRUCT_TASK, UfoIterativeReconstructTaskClass))
+
+typedef struct _UfoIterativeReconstructTask           UfoIterativeReconstructTask;
+typedef struct _UfoIterativeReconstructTaskClass      UfoIterativeReconstructTaskClass;
+typedef struct _UfoIterativeReconstructTaskPrivate    UfoIterativeReconstructTaskPrivate;
+
+/**
+ * UfoIterativeReconstructTask:
+ *
+ * Main object for organizing filters. The contents of the #UfoIterativeReconstructTask structure
+ * are private and should only be accessed via the provided API.
+ */
+struct _UfoIterativeReconstructTask {
+    /*< private >*/
+    UfoTaskNode parent_instance;
+
+    UfoIterativeReconstructTaskPrivate *priv;
+};
+
+/**
+ * UfoIterativeReconstructTaskClass:
+ *
+ * #UfoIterativeReconstructTask class
+ */
+struct _UfoIterativeReconstructTaskClass {
+    /*< private >*/
+    UfoTaskNodeClass parent_class;
+};
+
+UfoNode  *ufo_iterative_reconstruct_task_new       (void);
+GType     ufo_iterative_reconstruct_task_get_type  (void);
+
+G_END_DECLS
+
+#endif
@@ -17,10 +17,18 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* ftruncate and mmap are not part of C99 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <errno.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -29,19 +37,46 @@
 #endif
 
 #include "ufo-lamino-backproject-task.h"
+#include "common/ufo-kernel-cache.h"
 #include "lamino-roi.h"
 #include "common/ufo-addressing.h"
 
-/* Copy only neccessary projection region */
-/* TODO: make this a parameter? */
-/* Wait with enabling this until sync issues in ufo-core have been solved */
-#define COPY_PROJECTION_REGION 0
 #define EXTRACT_FLOAT(region, index) g_value_get_float (g_value_array_get_nth ((region), (index)))
-#define REGION_SIZE(region) ((EXTRACT_INT ((region), 2)) == 0) ? 0 : \
+#define REGION_SIZE(region) (((EXTRACT_INT ((region), 2)) == 0) ? 0 : \
                             ((EXTRACT_INT ((region), 1) - EXTRACT_INT ((region), 0) - 1) /\
-                            EXTRACT_INT ((region), 2) + 1)
+                            EXTRACT_INT ((region), 2) + 1))
 #define PAD_TO_DIVIDE(dividend, divisor) ((dividend) + (divisor) - (dividend) % (divisor))
 
+/* Default burst width, 0 selects the fastest one at run time */
+#ifndef BURST
+#define BURST 16
+#endif
+
+/* Widest generated burst kernel, kernels exist for all powers of two up to it */
+#define MAX_BURST 16
+#define NUM_BURST_KERNELS 5
+
+
+typedef struct {
+    cl_int real_size[4];
+    gfloat x_center[2];
+    gfloat y_center;
+    gfloat x_region[2];
+    gfloat y_region[2];
+    gfloat z_region[2];
+    gfloat lamino_angles[2];
+    gfloat roll_angles[2];
+    gfloat sin_lamino;
+    gfloat cos_lamino;
+    gfloat norm_factor;
+    gfloat sin_roll;
+    gfloat cos_roll;
+} Geometry;
+
+typedef struct {
+    guint burst;
+    gsize local_work_size[3];
+} TuningResult;
 
 typedef enum {
     PARAMETER_Z,
@@ -62,18 +97,40 @@ struct _UfoLaminoBackprojectTaskPrivate {
     /* private */
     gboolean generated;
     guint count;
-    /* sine and cosine table size based on BURST */
-    gsize table_size;
+    /* burst width and local work size in use, burst is 0 until tuned */
+    guint burst;
+    gsize local_work_size[3];
 
     /* OpenCL */
     cl_context context;
-    cl_kernel vector_kernel;
-    cl_kernel scalar_kernel;
+    /* backproject_burst_1, _2, _4, _8 and _16 */
+    cl_kernel kernels[NUM_BURST_KERNELS];
     cl_sampler sampler;
-    /* Buffered images for invoking backprojection on BURST projections at once.
+    /* Buffered images for invoking backprojection on burst projections at once.
      * We potentially don't need to copy the last image and can use the one from
      * framework directly but it seems to have no performance effects. */
-    cl_mem images[BURST];
+    cl_mem images[MAX_BURST];
+    /* Backprojection runs on its own queue, so that the copies of the next
+     * projections on the node queue overlap the running burst */
+    cl_command_queue queue;
+    /* pending copy into each image and the last backprojection reading it */
+    cl_event copy_events[MAX_BURST];
+    cl_event burst_events[MAX_BURST];
+
+    /* slab mode: the volume is reconstructed slab by slab from cached
+     * projections and streamed out slice by slice */
+    cl_mem slab_mem;
+    guint slab_depth;
+    guint slab_start;
+    guint total_depth;
+    guint slice;
+    gfloat *cache;
+    gsize cache_size;
+    gboolean cache_mapped;
+    /* the last pending read of a projection into the cache */
+    cl_event cache_event;
+    gfloat *angles;
+    gsize projection_size[2];
 
     /* properties */
     GValueArray *x_region;
@@ -81,7 +138,11 @@ struct _UfoLaminoBackprojectTaskPrivate {
     GValueArray *region;
     GValueArray *center;
     GValueArray *projection_offset;
-    float sines[BURST], cosines[BURST];
+    float sines[MAX_BURST], cosines[MAX_BURST];
+    guint requested_burst;
+    gboolean slab_mode;
+    guint slab_size;
+    gchar *cache_directory;
     guint num_projections;
     gfloat overall_angle;
     gfloat tomo_angle;
@@ -115,11 +176,19 @@ enum {
     PROP_PARAMETER,
     PROP_ROLL_ANGLE,
     PROP_ADDRESSING_MODE,
+    PROP_BURST,
+    PROP_SLAB_MODE,
+    PROP_SLAB_SIZE,
+    PROP_CACHE_DIRECTORY,
     N_PROPERTIES
 };
 
 static GParamSpec *properties[N_PROPERTIES] = { NULL, };
 
+/* Tuning results per device and geometry, shared by all instances */
+static GMutex tuning_mutex;
+static GHashTable *tuning_cache = NULL;
+
 static void
 set_region (GValueArray *src, GValueArray **dst)
 {
@@ -134,24 +203,101 @@ set_region (GValueArray *src, GValueArray **dst)
     }
 }
 
+/*
+ * Enqueue the copy of @region from @input into images[@slot] on the node queue,
+ * behind the work of the task producing @input. The copy is not waited for,
+ * the backprojection reading the slot depends on its event instead. The host
+ * only blocks if the slot is still read by an unfinished burst.
+ */
 static void
-copy_to_image (UfoBuffer *input,
-               cl_mem output_image,
+copy_to_image (UfoLaminoBackprojectTaskPrivate *priv,
+               UfoBuffer *input,
+               guint slot,
                cl_command_queue cmd_queue,
                size_t origin[3],
-               size_t region[3],
-               gint in_width)
+               size_t region[3])
 {
     cl_mem input_data;
-    cl_event event;
+
+    if (priv->burst_events[slot] != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (1, &priv->burst_events[slot]));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->burst_events[slot]));
+        priv->burst_events[slot] = NULL;
+    }
+
+    if (priv->copy_events[slot] != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->copy_events[slot]));
 
     input_data = ufo_buffer_get_device_image (input, cmd_queue);
-    UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyImage (cmd_queue, input_data, output_image,
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyImage (cmd_queue, input_data, priv->images[slot],
                                                    origin, origin, region,
-                                                   0, NULL, &event));
+                                                   0, NULL, &priv->copy_events[slot]));
+}
 
-    UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (1, &event));
-    UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (event));
+/*
+ * Determine the part of a projection at @tomo_angle which is read when
+ * reconstructing @geom with @depth slices. Returns FALSE if the whole
+ * projection must be copied because the footprint cannot be bounded.
+ */
+static gboolean
+determine_copy_region (UfoLaminoBackprojectTaskPrivate *priv,
+                       Geometry *geom,
+                       guint depth,
+                       gfloat tomo_angle,
+                       UfoRequisition *in_req,
+                       size_t origin[3],
+                       size_t region[3])
+{
+    gint x_copy_region[2], y_copy_region[2], other[2];
+    gfloat z_ends[2];
+    gfloat x_center_last;
+
+    /* lamino-roi.c does not take tilted detectors or varying tilts into account */
+    if (priv->parameter == PARAMETER_LAMINO_ANGLE || priv->parameter == PARAMETER_ROLL_ANGLE ||
+        priv->roll_angle != 0.0f)
+        return FALSE;
+
+    z_ends[0] = geom->z_region[0];
+    z_ends[1] = geom->z_region[0] + (depth - 1) * geom->z_region[1];
+
+    if (z_ends[0] > z_ends[1]) {
+        gfloat tmp = z_ends[0];
+        z_ends[0] = z_ends[1];
+        z_ends[1] = tmp;
+    }
+
+    /* The footprint must hold for every center if the center is varied */
+    x_center_last = priv->parameter == PARAMETER_X_CENTER ?
+                    geom->x_center[0] + (depth - 1) * geom->x_center[1] : geom->x_center[0];
+
+    determine_x_region (x_copy_region, priv->x_region, priv->y_region, tomo_angle,
+                        geom->x_center[0], in_req->dims[0]);
+    determine_x_region (other, priv->x_region, priv->y_region, tomo_angle,
+                        x_center_last, in_req->dims[0]);
+    x_copy_region[0] = MIN (x_copy_region[0], other[0]);
+    x_copy_region[1] = MAX (x_copy_region[1], other[1]);
+
+    /* The order of the z extrema in the projection depends on the sign of the tilt */
+    determine_y_region (y_copy_region, priv->x_region, priv->y_region, z_ends,
+                        tomo_angle, priv->lamino_angle, geom->y_center, in_req->dims[1]);
+
+    if (sinf (priv->lamino_angle) < 0.0f) {
+        gfloat swapped[2] = {z_ends[1], z_ends[0]};
+
+        determine_y_region (other, priv->x_region, priv->y_region, swapped,
+                            tomo_angle, priv->lamino_angle, geom->y_center, in_req->dims[1]);
+        y_copy_region[0] = MIN (y_copy_region[0], other[0]);
+        y_copy_region[1] = MAX (y_copy_region[1], other[1]);
+    }
+
+    origin[0] = x_copy_region[0];
+    origin[1] = y_copy_region[0];
+    origin[2] = 0;
+    region[0] = x_copy_region[1] - x_copy_region[0];
+    region[1] = y_copy_region[1] - y_copy_region[0];
+    region[2] = 1;
+
+    return TRUE;
 }
 
 UfoNode *
@@ -168,7 +314,7 @@ ufo_lamino_backproject_task_setup (UfoTask *task,
     UfoLaminoBackprojectTaskPrivate *priv;
     cl_int cl_error;
     gint i;
-    gchar *vector_kernel_name;
+    gchar *kernel_name;
     gchar *kernel_filename;
 
     priv = UFO_LAMINO_BACKPROJECT_TASK_GET_PRIVATE (task);
@@ -183,10 +329,16 @@ ufo_lamino_backproject_task_setup (UfoTask *task,
         return;
     }
 
-    vector_kernel_name = g_strdup_printf ("backproject_burst_%d", BURST);
+    if (priv->requested_burst & (priv->requested_burst - 1)) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Burst %u is not a power of two", priv->requested_burst);
+        return;
+    }
 
-    if (!vector_kernel_name) {
-        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP, "Unable to create burst kernel name");
+    if (priv->slab_mode && priv->cache_directory != NULL &&
+        !g_file_test (priv->cache_directory, G_FILE_TEST_IS_DIR)) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Cache directory `%s' does not exist", priv->cache_directory);
         return;
     }
 
@@ -210,35 +362,27 @@ ufo_lamino_backproject_task_setup (UfoTask *task,
             return;
     }
 
-    priv->vector_kernel = ufo_resources_get_kernel (resources, kernel_filename, vector_kernel_name, error);
-    priv->scalar_kernel = ufo_resources_get_kernel (resources, kernel_filename, "backproject_burst_1", error);
+    for (i = 0; i < NUM_BURST_KERNELS; i++) {
+        kernel_name = g_strdup_printf ("backproject_burst_%d", 1 << i);
+        priv->kernels[i] = ufo_kernel_cache_get_kernel (resources, kernel_filename, kernel_name, NULL, error);
+        g_free (kernel_name);
+
+        if (priv->kernels[i]) {
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernels[i]));
+        }
+    }
+
     priv->sampler = clCreateSampler (priv->context, (cl_bool) FALSE, priv->addressing_mode, CL_FILTER_LINEAR, &cl_error);
 
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
     UFO_RESOURCES_CHECK_CLERR (cl_error);
 
-    if (priv->vector_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->vector_kernel));
-    }
-
-    if (priv->scalar_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->scalar_kernel));
-    }
-
-    for (i = 0; i < BURST; i++) {
+    for (i = 0; i < MAX_BURST; i++) {
         priv->images[i] = NULL;
     }
 
-    switch (BURST) {
-        case 1: priv->table_size = sizeof (cl_float); break;
-        case 2: priv->table_size = sizeof (cl_float2); break;
-        case 4: priv->table_size = sizeof (cl_float4); break;
-        case 8: priv->table_size = sizeof (cl_float8); break;
-        case 16: priv->table_size = sizeof (cl_float16); break;
-        default: g_warning ("Unsupported vector size"); break;
-    }
+    priv->burst = priv->requested_burst;
 
-    g_free (vector_kernel_name);
     g_free (kernel_filename);
 }
 
@@ -255,10 +399,13 @@ ufo_lamino_backproject_task_get_requisition (UfoTask *task,
     stop = EXTRACT_FLOAT (priv->region, 1);
     step = EXTRACT_FLOAT (priv->region, 2);
 
-    requisition->n_dims = 3;
+    priv->total_depth = (guint) ceil ((stop - start) / step);
+
+    /* Slabs are streamed out slice by slice */
+    requisition->n_dims = priv->slab_mode ? 2 : 3;
     requisition->dims[0] = REGION_SIZE (priv->x_region);
     requisition->dims[1] = REGION_SIZE (priv->y_region);
-    requisition->dims[2] = (gint) ceil ((stop - start) / step);
+    requisition->dims[2] = priv->total_depth;
 }
 
 static guint
@@ -282,6 +429,468 @@ ufo_lamino_backproject_task_get_mode (UfoTask *task)
     return UFO_TASK_MODE_REDUCTOR | UFO_TASK_MODE_GPU;
 }
 
+static guint
+get_kernel_index (guint burst)
+{
+    guint i = 0;
+
+    while ((1U << i) < burst)
+        i++;
+
+    return i;
+}
+
+static gboolean
+get_local_work_size (UfoGpuNode *node, gsize x, gsize y, gsize local_work_size[3])
+{
+    GValue *work_group_size;
+    gsize max_work_group_size;
+
+    work_group_size = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_WORK_GROUP_SIZE);
+    max_work_group_size = g_value_get_ulong (work_group_size);
+    g_value_unset (work_group_size);
+
+    if (x * y > max_work_group_size)
+        return FALSE;
+
+    /* Let last axis depend on maximum work group size */
+    local_work_size[0] = x;
+    local_work_size[1] = y;
+    local_work_size[2] = MAX (1, max_work_group_size / (x * y));
+
+    return TRUE;
+}
+
+/*
+ * Compute kernel arguments for @depth slices along the varied parameter,
+ * starting at slice @first.
+ */
+static void
+compute_geometry (UfoLaminoBackprojectTaskPrivate *priv,
+                  guint first,
+                  guint depth,
+                  Geometry *geom)
+{
+    geom->real_size[0] = REGION_SIZE (priv->x_region);
+    geom->real_size[1] = REGION_SIZE (priv->y_region);
+    geom->real_size[2] = depth;
+    geom->real_size[3] = 0;
+    geom->norm_factor = fabs (priv->overall_angle) / priv->num_projections;
+    geom->x_region[0] = (gfloat) EXTRACT_INT (priv->x_region, 0);
+    geom->x_region[1] = (gfloat) EXTRACT_INT (priv->x_region, 2);
+    geom->y_region[0] = (gfloat) EXTRACT_INT (priv->y_region, 0);
+    geom->y_region[1] = (gfloat) EXTRACT_INT (priv->y_region, 2);
+
+    if (priv->parameter == PARAMETER_Z) {
+        geom->z_region[0] = EXTRACT_FLOAT (priv->region, 0);
+        geom->z_region[1] = EXTRACT_FLOAT (priv->region, 2);
+    } else {
+        geom->z_region[0] = priv->z;
+        geom->z_region[1] = 0.0f;
+    }
+
+    if (priv->parameter == PARAMETER_X_CENTER) {
+        geom->x_center[0] = EXTRACT_FLOAT (priv->region, 0) - EXTRACT_INT (priv->projection_offset, 0);
+        geom->x_center[1] = EXTRACT_FLOAT (priv->region, 2);
+    } else {
+        geom->x_center[0] = geom->x_center[1] = EXTRACT_FLOAT (priv->center, 0) - EXTRACT_INT (priv->projection_offset, 0);
+    }
+
+    if (priv->parameter == PARAMETER_LAMINO_ANGLE) {
+        geom->lamino_angles[0] = EXTRACT_FLOAT (priv->region, 0);
+        geom->lamino_angles[1] = EXTRACT_FLOAT (priv->region, 2);
+    } else {
+        geom->lamino_angles[0] = geom->lamino_angles[1] = priv->lamino_angle;
+    }
+
+    if (priv->parameter == PARAMETER_ROLL_ANGLE) {
+        geom->roll_angles[0] = EXTRACT_FLOAT (priv->region, 0);
+        geom->roll_angles[1] = EXTRACT_FLOAT (priv->region, 2);
+    } else {
+        geom->roll_angles[0] = geom->roll_angles[1] = priv->roll_angle;
+    }
+
+    switch (priv->parameter) {
+        case PARAMETER_Z:
+            geom->z_region[0] += first * geom->z_region[1];
+            break;
+        case PARAMETER_X_CENTER:
+            geom->x_center[0] += first * geom->x_center[1];
+            break;
+        case PARAMETER_LAMINO_ANGLE:
+            geom->lamino_angles[0] += first * geom->lamino_angles[1];
+            break;
+        case PARAMETER_ROLL_ANGLE:
+            geom->roll_angles[0] += first * geom->roll_angles[1];
+            break;
+    }
+
+    geom->y_center = EXTRACT_FLOAT (priv->center, 1) - EXTRACT_INT (priv->projection_offset, 1);
+    geom->sin_lamino = sinf (priv->lamino_angle);
+    geom->cos_lamino = cosf (priv->lamino_angle);
+    /* Minus the value because we are rotating back */
+    geom->sin_roll = sinf (-priv->roll_angle);
+    geom->cos_roll = cosf (-priv->roll_angle);
+}
+
+/*
+ * Backproject the @burst images starting at slot @first on priv->queue once
+ * their copies have finished.
+ */
+static void
+launch (UfoLaminoBackprojectTaskPrivate *priv,
+        guint burst,
+        guint first,
+        cl_mem out_mem,
+        Geometry *geom,
+        gint cumulate,
+        gsize local_work_size[3])
+{
+    cl_kernel kernel;
+    cl_event wait_list[MAX_BURST];
+    cl_event event;
+    gsize table_size;
+    gsize global_work_size[3];
+    guint n_wait = 0;
+    guint i;
+
+    kernel = priv->kernels[get_kernel_index (burst)];
+    table_size = burst * sizeof (cl_float);
+
+    for (i = 0; i < 3; i++) {
+        global_work_size[i] = geom->real_size[i] % local_work_size[i] ?
+                              PAD_TO_DIVIDE (geom->real_size[i], local_work_size[i]) :
+                              (gsize) geom->real_size[i];
+    }
+
+    for (i = 0; i < burst; i++) {
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i, sizeof (cl_mem), &priv->images[first + i]));
+
+        if (priv->copy_events[first + i] != NULL)
+            wait_list[n_wait++] = priv->copy_events[first + i];
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_sampler), &priv->sampler));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_int3), geom->real_size));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), geom->x_center));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &geom->y_center));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), geom->x_region));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), geom->y_region));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), geom->z_region));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), geom->lamino_angles));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), geom->roll_angles));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &geom->sin_lamino));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &geom->cos_lamino));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, table_size, &priv->sines[first]));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, table_size, &priv->cosines[first]));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &geom->norm_factor));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &geom->sin_roll));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &geom->cos_roll));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i, sizeof (cl_int), (cl_int *) &cumulate));
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueNDRangeKernel (priv->queue, kernel,
+                                                       3, NULL, global_work_size, local_work_size,
+                                                       n_wait, n_wait ? wait_list : NULL, &event));
+
+    for (i = first; i < first + burst; i++) {
+        if (priv->burst_events[i] != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->burst_events[i]));
+
+        UFO_RESOURCES_CHECK_CLERR (clRetainEvent (event));
+        priv->burst_events[i] = event;
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (event));
+}
+
+/*
+ * Backproject after projection @count has been stored in images[@slot]. We
+ * execute the kernel after burst images have arrived, i.e. we use more
+ * projections at one invocation, so the number of read/writes to the result is
+ * reduced by a factor of burst. If there are not enough projections left,
+ * execute the scalar kernel.
+ */
+static void
+dispatch (UfoLaminoBackprojectTaskPrivate *priv,
+          cl_mem out_mem,
+          Geometry *geom,
+          guint count,
+          guint slot)
+{
+    guint index = count % priv->burst;
+    guint first = slot - index;
+
+    if (count >= priv->num_projections / priv->burst * priv->burst) {
+        launch (priv, 1, slot, out_mem, geom, count, priv->local_work_size);
+    }
+    else if (index == priv->burst - 1) {
+        launch (priv, priv->burst, first, out_mem, geom, count + 1 == priv->burst ? 0 : 1,
+                priv->local_work_size);
+    }
+}
+
+/*
+ * Time all burst widths and a few local work sizes on the first @n_buffered
+ * projections. The timing runs overwrite the volume, which is fine because the
+ * first real backprojection does not cumulate.
+ */
+static void
+tune (UfoLaminoBackprojectTaskPrivate *priv,
+      UfoGpuNode *node,
+      cl_mem out_mem,
+      Geometry *geom,
+      guint n_buffered)
+{
+    static const gsize candidates[][2] = {{16, 8}, {32, 4}, {8, 8}};
+    TuningResult *result;
+    cl_device_id device;
+    GTimer *timer;
+    gchar *key;
+    gdouble best = G_MAXDOUBLE;
+    gsize local_work_size[3];
+
+    UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (priv->queue, CL_QUEUE_DEVICE, sizeof (cl_device_id), &device, NULL));
+    key = g_strdup_printf ("%p:%d:%dx%dx%d:%u", (gpointer) device, priv->parameter,
+                           geom->real_size[0], geom->real_size[1], geom->real_size[2], n_buffered);
+
+    g_mutex_lock (&tuning_mutex);
+
+    if (tuning_cache == NULL)
+        tuning_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    result = g_hash_table_lookup (tuning_cache, key);
+
+    if (result != NULL) {
+        priv->burst = result->burst;
+        memcpy (priv->local_work_size, result->local_work_size, sizeof (priv->local_work_size));
+        g_mutex_unlock (&tuning_mutex);
+        g_free (key);
+        return;
+    }
+
+    g_mutex_unlock (&tuning_mutex);
+    timer = g_timer_new ();
+
+    for (guint burst = 1; burst <= MIN (MAX_BURST, n_buffered); burst *= 2) {
+        gboolean warm = FALSE;
+
+        for (guint i = 0; i < G_N_ELEMENTS (candidates); i++) {
+            gdouble elapsed;
+
+            if (!get_local_work_size (node, candidates[i][0], candidates[i][1], local_work_size))
+                continue;
+
+            /* The first call of a kernel includes setup costs we do not want to measure */
+            if (!warm) {
+                launch (priv, burst, 0, out_mem, geom, 0, local_work_size);
+                UFO_RESOURCES_CHECK_CLERR (clFinish (priv->queue));
+                warm = TRUE;
+            }
+
+            g_timer_start (timer);
+            launch (priv, burst, 0, out_mem, geom, 0, local_work_size);
+            UFO_RESOURCES_CHECK_CLERR (clFinish (priv->queue));
+            g_timer_stop (timer);
+            elapsed = g_timer_elapsed (timer, NULL) / burst;
+
+            if (elapsed < best) {
+                best = elapsed;
+                priv->burst = burst;
+                memcpy (priv->local_work_size, local_work_size, sizeof (local_work_size));
+            }
+        }
+    }
+
+    g_timer_destroy (timer);
+    g_debug ("lamino-backproject: using burst %u with local work size %zu x %zu x %zu",
+             priv->burst, priv->local_work_size[0], priv->local_work_size[1], priv->local_work_size[2]);
+
+    result = g_new0 (TuningResult, 1);
+    result->burst = priv->burst;
+    memcpy (result->local_work_size, priv->local_work_size, sizeof (priv->local_work_size));
+
+    g_mutex_lock (&tuning_mutex);
+    g_hash_table_replace (tuning_cache, key, result);
+    g_mutex_unlock (&tuning_mutex);
+}
+
+static guint
+get_auto_slab_depth (UfoLaminoBackprojectTaskPrivate *priv,
+                     UfoGpuNode *node,
+                     UfoRequisition *in_req)
+{
+    GValue *value;
+    gsize global_mem_size;
+    gsize max_alloc_size;
+    gsize slice_size;
+    gsize images_size;
+    gsize budget;
+
+    value = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_GLOBAL_MEM_SIZE);
+    global_mem_size = g_value_get_ulong (value);
+    g_value_unset (value);
+
+    value = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_MEM_ALLOC_SIZE);
+    max_alloc_size = g_value_get_ulong (value);
+    g_value_unset (value);
+
+    /* Leave half of the memory for the burst images, the input buffers and
+     * other tasks on the same device */
+    slice_size = REGION_SIZE (priv->x_region) * REGION_SIZE (priv->y_region) * sizeof (gfloat);
+    images_size = MAX_BURST * in_req->dims[0] * in_req->dims[1] * sizeof (gfloat);
+    budget = global_mem_size / 2 > images_size ? global_mem_size / 2 - images_size : slice_size;
+    budget = MIN (budget, max_alloc_size);
+
+    return (guint) CLAMP (budget / slice_size, 1, priv->total_depth);
+}
+
+static gboolean
+allocate_cache (UfoLaminoBackprojectTaskPrivate *priv, UfoRequisition *in_req, GError **error)
+{
+    gchar *filename;
+    gint fd;
+
+    priv->projection_size[0] = in_req->dims[0];
+    priv->projection_size[1] = in_req->dims[1];
+    priv->cache_size = priv->num_projections * in_req->dims[0] * in_req->dims[1] * sizeof (gfloat);
+    priv->angles = g_malloc0 (priv->num_projections * sizeof (gfloat));
+
+    if (priv->cache_directory == NULL) {
+        priv->cache = g_try_malloc (priv->cache_size);
+        priv->cache_mapped = FALSE;
+
+        if (priv->cache == NULL) {
+            g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                         "Could not allocate %zu bytes for the projection cache, "
+                         "consider setting cache-directory", priv->cache_size);
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    /* The file is unlinked right away, the mapping keeps it alive */
+    filename = g_build_filename (priv->cache_directory, "ufo-lamino-XXXXXX", NULL);
+    fd = g_mkstemp (filename);
+
+    if (fd < 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Could not create `%s': %s", filename, g_strerror (errno));
+        g_free (filename);
+        return FALSE;
+    }
+
+    g_unlink (filename);
+    g_free (filename);
+
+    if (ftruncate (fd, (off_t) priv->cache_size) != 0) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Could not resize the projection cache to %zu bytes: %s",
+                     priv->cache_size, g_strerror (errno));
+        close (fd);
+        return FALSE;
+    }
+
+    priv->cache = mmap (NULL, priv->cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (priv->cache == MAP_FAILED) {
+        g_set_error (error, UFO_TASK_ERROR, UFO_TASK_ERROR_SETUP,
+                     "Could not map %zu bytes of projection cache: %s",
+                     priv->cache_size, g_strerror (errno));
+        priv->cache = NULL;
+        return FALSE;
+    }
+
+    priv->cache_mapped = TRUE;
+    return TRUE;
+}
+
+static void
+wait_for_cache (UfoLaminoBackprojectTaskPrivate *priv)
+{
+    if (priv->cache_event != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (1, &priv->cache_event));
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->cache_event));
+        priv->cache_event = NULL;
+    }
+}
+
+static void
+free_cache (UfoLaminoBackprojectTaskPrivate *priv)
+{
+    wait_for_cache (priv);
+
+    if (priv->cache != NULL) {
+        if (priv->cache_mapped)
+            munmap (priv->cache, priv->cache_size);
+        else
+            g_free (priv->cache);
+
+        priv->cache = NULL;
+    }
+
+    g_free (priv->angles);
+    priv->angles = NULL;
+}
+
+/*
+ * Enqueue the read of @input into the cache without blocking. It is enqueued
+ * before the copy into the burst image on the same in-order queue, so waiting
+ * for that copy also covers the read.
+ */
+static void
+cache_projection (UfoLaminoBackprojectTaskPrivate *priv,
+                  UfoBuffer *input,
+                  cl_command_queue cmd_queue,
+                  gfloat tomo_angle)
+{
+    gsize origin[3] = {0, 0, 0};
+    gsize region[3] = {priv->projection_size[0], priv->projection_size[1], 1};
+    gsize size = priv->projection_size[0] * priv->projection_size[1];
+
+    if (priv->count >= priv->num_projections)
+        return;
+
+    if (priv->cache_event != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->cache_event));
+
+    priv->angles[priv->count] = tomo_angle;
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueReadImage (cmd_queue, ufo_buffer_get_device_image (input, cmd_queue),
+                                                   CL_FALSE, origin, region, 0, 0,
+                                                   priv->cache + priv->count * size,
+                                                   0, NULL, &priv->cache_event));
+}
+
+/*
+ * Reconstruct the slab starting at priv->slab_start from the cached
+ * projections. The images are written on priv->queue, which orders them with
+ * the bursts reading them.
+ */
+static void
+reconstruct_slab (UfoLaminoBackprojectTaskPrivate *priv)
+{
+    Geometry geom;
+    gsize origin[3] = {0, 0, 0};
+    gsize region[3] = {priv->projection_size[0], priv->projection_size[1], 1};
+    gsize size = priv->projection_size[0] * priv->projection_size[1];
+    guint n_cached = MIN (priv->count, priv->num_projections);
+
+    compute_geometry (priv, priv->slab_start, MIN (priv->slab_depth, priv->total_depth - priv->slab_start), &geom);
+
+    for (guint i = 0; i < n_cached; i++) {
+        guint slot = i % priv->burst;
+
+        priv->sines[slot] = sin (priv->angles[i]);
+        priv->cosines[slot] = cos (priv->angles[i]);
+        UFO_RESOURCES_CHECK_CLERR (clEnqueueWriteImage (priv->queue, priv->images[slot], CL_FALSE,
+                                                        origin, region, 0, 0, priv->cache + i * size,
+                                                        0, NULL, NULL));
+        dispatch (priv, priv->slab_mem, &geom, i, slot);
+    }
+}
+
 static gboolean
 ufo_lamino_backproject_task_process (UfoTask *task,
                                      UfoBuffer **inputs,
@@ -291,187 +900,127 @@ ufo_lamino_backproject_task_process (UfoTask *task,
     UfoLaminoBackprojectTaskPrivate *priv;
     UfoRequisition in_req;
     UfoGpuNode *node;
-    UfoProfiler *profiler;
-    gfloat tomo_angle, *sines, *cosines;
-    gint i, index;
-    gint cumulate;
-    gsize table_size;
-    gboolean scalar;
-    /* regions stripped off the "to" value */
-    gfloat x_region[2], y_region[2], z_region[2], x_center[2], z_ends[2], lamino_angles[2], roll_angles[2],
-           y_center, sin_lamino, cos_lamino, norm_factor, sin_roll, cos_roll;
-    gint x_copy_region[2], y_copy_region[2];
-    cl_kernel kernel;
+    Geometry geom;
+    gfloat tomo_angle;
+    guint slot;
+    guint depth;
     cl_command_queue cmd_queue;
     cl_mem out_mem;
     cl_int cl_error;
+    GError *error = NULL;
     /* image creation and copying */
     cl_image_format image_fmt;
     size_t origin[3];
     size_t region[3];
-    /* keep the warp size satisfied but make sure the local grid is localized
-     * around a point in 3D for efficient caching */
-    const gint real_size[4] = {requisition->dims[0], requisition->dims[1], requisition->dims[2], 0};
-    gsize local_work_size[3] = {16, 8, 8};
-    gsize global_work_size[3];
-    GValue *work_group_size;
 
     priv = UFO_LAMINO_BACKPROJECT_TASK (task)->priv;
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
-    work_group_size = ufo_gpu_node_get_info (node, UFO_GPU_NODE_INFO_MAX_WORK_GROUP_SIZE);
-
-    /* Let last axis depend on maximum work group size */
-    local_work_size[2] = g_value_get_ulong (work_group_size) / 128;
-    g_value_unset (work_group_size);
 
-    global_work_size[0] = requisition->dims[0] % local_work_size[0] ?
-                          PAD_TO_DIVIDE (requisition->dims[0], local_work_size[0]) :
-                          requisition->dims[0];
-    global_work_size[1] = requisition->dims[1] % local_work_size[1] ?
-                          PAD_TO_DIVIDE (requisition->dims[1], local_work_size[1]) :
-                          requisition->dims[1];
-    global_work_size[2] = requisition->dims[2] % local_work_size[2] ?
-                          PAD_TO_DIVIDE (requisition->dims[2], local_work_size[2]) :
-                          requisition->dims[2];
+    /* keep the warp size satisfied but make sure the local grid is localized
+     * around a point in 3D for efficient caching */
+    if (priv->burst && priv->local_work_size[0] == 0)
+        get_local_work_size (node, 16, 8, priv->local_work_size);
 
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
-    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
     ufo_buffer_get_requisition (inputs[0], &in_req);
 
-    index = priv->count % BURST;
-    tomo_angle = priv->tomo_angle > -G_MAXFLOAT ? priv->tomo_angle :
-                 priv->overall_angle * priv->count / priv->num_projections;
-    norm_factor = fabs (priv->overall_angle) / priv->num_projections;
-    priv->sines[index] = sin (tomo_angle);
-    priv->cosines[index] = cos (tomo_angle);
-    x_region[0] = (gfloat) EXTRACT_INT (priv->x_region, 0);
-    x_region[1] = (gfloat) EXTRACT_INT (priv->x_region, 2);
-    y_region[0] = (gfloat) EXTRACT_INT (priv->y_region, 0);
-    y_region[1] = (gfloat) EXTRACT_INT (priv->y_region, 2);
+    if (priv->queue == NULL) {
+        cl_device_id device;
 
-    if (priv->parameter == PARAMETER_Z) {
-        z_ends[0] = z_region[0] = EXTRACT_FLOAT (priv->region, 0);
-        z_region[1] = EXTRACT_FLOAT (priv->region, 2);
-        z_ends[1] = EXTRACT_FLOAT (priv->region, 1);
-    } else {
-        z_ends[0] = z_region[0] = priv->z;
-        z_ends[1] = priv->z + 1.0f;
+        UFO_RESOURCES_CHECK_CLERR (clGetCommandQueueInfo (cmd_queue, CL_QUEUE_DEVICE,
+                                                          sizeof (cl_device_id), &device, NULL));
+        priv->queue = clCreateCommandQueue (priv->context, device, 0, &cl_error);
+        UFO_RESOURCES_CHECK_CLERR (cl_error);
     }
 
-    if (priv->parameter == PARAMETER_X_CENTER) {
-        x_center[0] = EXTRACT_FLOAT (priv->region, 0) - EXTRACT_INT (priv->projection_offset, 0);
-        x_center[1] = EXTRACT_FLOAT (priv->region, 2);
-    } else {
-        x_center[0] = x_center[1] = EXTRACT_FLOAT (priv->center, 0) - EXTRACT_INT (priv->projection_offset, 0);
-    }
+    if (priv->slab_mode) {
+        /* Reconstruct the first slab right away and keep the projections for
+         * the others */
+        if (priv->slab_mem == NULL) {
+            priv->slab_depth = priv->slab_size ? MIN (priv->slab_size, priv->total_depth) :
+                                                 get_auto_slab_depth (priv, node, &in_req);
+            priv->slab_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                             REGION_SIZE (priv->x_region) * REGION_SIZE (priv->y_region) *
+                                             priv->slab_depth * sizeof (gfloat),
+                                             NULL, &cl_error);
+            UFO_RESOURCES_CHECK_CLERR (cl_error);
+
+            /* process() cannot return the error, stop reconstructing instead
+             * of emitting a volume without the later slabs */
+            if (priv->slab_depth < priv->total_depth && !allocate_cache (priv, &in_req, &error)) {
+                g_warning ("lamino-backproject: %s", error->message);
+                g_error_free (error);
+                UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->slab_mem));
+                priv->slab_mem = NULL;
+                return FALSE;
+            }
+
+            g_debug ("lamino-backproject: reconstructing %u slices in slabs of %u",
+                     priv->total_depth, priv->slab_depth);
+        }
 
-    if (priv->parameter == PARAMETER_LAMINO_ANGLE) {
-        lamino_angles[0] = EXTRACT_FLOAT (priv->region, 0);
-        lamino_angles[1] = EXTRACT_FLOAT (priv->region, 2);
-    } else {
-        lamino_angles[0] = lamino_angles[1] = priv->lamino_angle;
+        out_mem = priv->slab_mem;
+        depth = priv->slab_depth;
     }
-
-    if (priv->parameter == PARAMETER_ROLL_ANGLE) {
-        roll_angles[0] = EXTRACT_FLOAT (priv->region, 0);
-        roll_angles[1] = EXTRACT_FLOAT (priv->region, 2);
-    } else {
-        roll_angles[0] = roll_angles[1] = priv->roll_angle;
+    else {
+        out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+        depth = priv->total_depth;
     }
 
-    y_center = EXTRACT_FLOAT (priv->center, 1) - EXTRACT_INT (priv->projection_offset, 1);
-    sin_lamino = sinf (priv->lamino_angle);
-    cos_lamino = cosf (priv->lamino_angle);
-    /* Minus the value because we are rotating back */
-    sin_roll = sinf (-priv->roll_angle);
-    cos_roll = cosf (-priv->roll_angle);
-    scalar = priv->count >= priv->num_projections / BURST * BURST ? 1 : 0;
-
-    /* If COPY_PROJECTION_REGION is True we copy only the part necessary  */
-    /* for a given tomographic and laminographic angle */
-    /* TODO: Extend the region determination to be able to handle PARAMETER_LAMINO_ANGLE */
-    if (COPY_PROJECTION_REGION && priv->parameter != PARAMETER_LAMINO_ANGLE) {
-        determine_x_region (x_copy_region, priv->x_region, priv->y_region, tomo_angle,
-                            EXTRACT_FLOAT (priv->center, 0), in_req.dims[0]);
-        determine_y_region (y_copy_region, priv->x_region, priv->y_region, z_ends,
-                            tomo_angle, priv->lamino_angle, EXTRACT_FLOAT (priv->center, 1),
-                            in_req.dims[1]);
-        origin[0] = x_copy_region[0];
-        origin[1] = y_copy_region[0];
-        origin[2] = 0;
-        region[0] = x_copy_region[1] - x_copy_region[0];
-        region[1] = y_copy_region[1] - y_copy_region[0];
-    } else {
+    compute_geometry (priv, 0, depth, &geom);
+
+    /* Until the burst is known, projections are buffered in arrival order */
+    slot = priv->burst ? priv->count % priv->burst : priv->count;
+    tomo_angle = priv->tomo_angle > -G_MAXFLOAT ? priv->tomo_angle :
+                 priv->overall_angle * priv->count / priv->num_projections;
+    priv->sines[slot] = sin (tomo_angle);
+    priv->cosines[slot] = cos (tomo_angle);
+
+    /* Copy only the footprint of the reconstructed region, which pays off for
+     * small regions of interest on large detectors */
+    if (!determine_copy_region (priv, &geom, depth, tomo_angle, &in_req, origin, region)) {
         origin[0] = origin[1] = origin[2] = 0;
         region[0] = in_req.dims[0];
         region[1] = in_req.dims[1];
+        region[2] = 1;
     }
-    region[2] = 1;
 
-    if (priv->images[index] == NULL) {
+    if (priv->images[slot] == NULL) {
         /* TODO: dangerous, don't rely on the ufo-buffer */
         image_fmt.image_channel_order = CL_INTENSITY;
         image_fmt.image_channel_data_type = CL_FLOAT;
         /* TODO: what with the "other" API? */
-        priv->images[index] = clCreateImage2D (priv->context,
-                                               CL_MEM_READ_ONLY,
-                                               &image_fmt,
-                                               in_req.dims[0],
-                                               in_req.dims[1],
-                                               0,
-                                               NULL,
-                                               &cl_error);
+        priv->images[slot] = clCreateImage2D (priv->context,
+                                              CL_MEM_READ_ONLY,
+                                              &image_fmt,
+                                              in_req.dims[0],
+                                              in_req.dims[1],
+                                              0,
+                                              NULL,
+                                              &cl_error);
         UFO_RESOURCES_CHECK_CLERR (cl_error);
     }
 
-    copy_to_image (inputs[0], priv->images[index], cmd_queue, origin, region, in_req.dims[0]);
+    if (priv->cache != NULL)
+        cache_projection (priv, inputs[0], cmd_queue, tomo_angle);
 
-    if (scalar) {
-        kernel = priv->scalar_kernel;
-        cumulate = priv->count;
-        table_size = sizeof (cl_float);
-        sines = &priv->sines[index];
-        cosines = &priv->cosines[index];
-        i = 1;
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &priv->images[index]));
-    } else {
-        kernel = priv->vector_kernel;
-        cumulate = priv->count + 1 == BURST ? 0 : 1;
-        table_size = priv->table_size;
-        sines = priv->sines;
-        cosines = priv->cosines;
-        i = BURST;
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, index, sizeof (cl_mem), &priv->images[index]));
-    }
-
-    if (scalar || index == BURST - 1) {
-        /* Execute the kernel after BURST images have arrived, i.e. we use more
-         * projections at one invocation, so the number of read/writes to the
-         * result is reduced by a factor of BURST. If there are not enough
-         * projecttions left, execute the scalar kernel */
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_mem), &out_mem));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_sampler), &priv->sampler));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_int3), real_size));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), x_center));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), (cl_float *) &y_center));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), x_region));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), y_region));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), z_region));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), lamino_angles));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float2), roll_angles));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &sin_lamino));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &cos_lamino));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, table_size, sines));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, table_size, cosines));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &norm_factor));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &sin_roll));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i++, sizeof (cl_float), &cos_roll));
-        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (kernel, i, sizeof (cl_int), (cl_int *) &cumulate));
-
-        profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
-        ufo_profiler_call (profiler, cmd_queue, kernel, 3, global_work_size, local_work_size);
+    copy_to_image (priv, inputs[0], slot, cmd_queue, origin, region);
+
+    if (priv->burst) {
+        dispatch (priv, out_mem, &geom, priv->count, slot);
     }
+    else if (priv->count + 1 == MIN (MAX_BURST, priv->num_projections)) {
+        /* All burst widths can be tried now, then catch up with the buffered
+         * projections */
+        tune (priv, node, out_mem, &geom, priv->count + 1);
 
+        for (guint i = 0; i <= priv->count; i++)
+            dispatch (priv, out_mem, &geom, i, i);
+    }
+
+    /* The input is handed back upstream when we return, so its copy has to be
+     * done by then. The burst enqueued above keeps running meanwhile. */
+    UFO_RESOURCES_CHECK_CLERR (clWaitForEvents (1, &priv->copy_events[slot]));
     priv->count++;
 
     return TRUE;
@@ -484,13 +1033,50 @@ ufo_lamino_backproject_task_generate (UfoTask *task,
 {
     UfoLaminoBackprojectTaskPrivate *priv;
 
+    UfoGpuNode *node;
+    cl_command_queue cmd_queue;
+    gsize slice_size;
+
     priv = UFO_LAMINO_BACKPROJECT_TASK_GET_PRIVATE (task);
 
-    if (priv->generated) {
+    if (!priv->slab_mode) {
+        if (priv->generated) {
+            return FALSE;
+        }
+
+        /* The volume is read from the node queue downstream */
+        if (priv->queue != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clFinish (priv->queue));
+
+        priv->generated = TRUE;
+
+        return TRUE;
+    }
+
+    if (priv->slice >= priv->total_depth || priv->slab_mem == NULL)
         return FALSE;
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    slice_size = requisition->dims[0] * requisition->dims[1] * sizeof (gfloat);
+
+    if (priv->slice == priv->slab_start + priv->slab_depth) {
+        /* The slices of the previous slab must be copied out before it is
+         * overwritten */
+        UFO_RESOURCES_CHECK_CLERR (clFinish (cmd_queue));
+        wait_for_cache (priv);
+        priv->slab_start += priv->slab_depth;
+        reconstruct_slab (priv);
     }
 
-    priv->generated = TRUE;
+    if (priv->slice == priv->slab_start)
+        UFO_RESOURCES_CHECK_CLERR (clFinish (priv->queue));
+
+    UFO_RESOURCES_CHECK_CLERR (clEnqueueCopyBuffer (cmd_queue, priv->slab_mem,
+                                                    ufo_buffer_get_device_array (output, cmd_queue),
+                                                    (priv->slice - priv->slab_start) * slice_size, 0, slice_size,
+                                                    0, NULL, NULL));
+    priv->slice++;
 
     return TRUE;
 }
@@ -552,6 +1138,19 @@ ufo_lamino_backproject_task_set_property (GObject *object,
         case PROP_ADDRESSING_MODE:
             priv->addressing_mode = g_value_get_enum (value);
             break;
+        case PROP_BURST:
+            priv->requested_burst = g_value_get_uint (value);
+            break;
+        case PROP_SLAB_MODE:
+            priv->slab_mode = g_value_get_boolean (value);
+            break;
+        case PROP_SLAB_SIZE:
+            priv->slab_size = g_value_get_uint (value);
+            break;
+        case PROP_CACHE_DIRECTORY:
+            g_free (priv->cache_directory);
+            priv->cache_directory = g_value_dup_string (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -606,6 +1205,18 @@ ufo_lamino_backproject_task_get_property (GObject *object,
         case PROP_ADDRESSING_MODE:
             g_value_set_enum (value, priv->addressing_mode);
             break;
+        case PROP_BURST:
+            g_value_set_uint (value, priv->requested_burst);
+            break;
+        case PROP_SLAB_MODE:
+            g_value_set_boolean (value, priv->slab_mode);
+            break;
+        case PROP_SLAB_SIZE:
+            g_value_set_uint (value, priv->slab_size);
+            break;
+        case PROP_CACHE_DIRECTORY:
+            g_value_set_string (value, priv->cache_directory);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -625,13 +1236,11 @@ ufo_lamino_backproject_task_finalize (GObject *object)
     g_value_array_free (priv->projection_offset);
     g_value_array_free (priv->center);
 
-    if (priv->vector_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->vector_kernel));
-        priv->vector_kernel = NULL;
-    }
-    if (priv->scalar_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->scalar_kernel));
-        priv->scalar_kernel = NULL;
+    for (i = 0; i < NUM_BURST_KERNELS; i++) {
+        if (priv->kernels[i]) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernels[i]));
+            priv->kernels[i] = NULL;
+        }
     }
     if (priv->context) {
         UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
@@ -642,13 +1251,34 @@ ufo_lamino_backproject_task_finalize (GObject *object)
         priv->sampler = NULL;
     }
 
-    for (i = 0; i < BURST; i++) {
+    if (priv->slab_mem != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->slab_mem));
+        priv->slab_mem = NULL;
+    }
+
+    free_cache (priv);
+    g_free (priv->cache_directory);
+
+    for (i = 0; i < MAX_BURST; i++) {
+        if (priv->copy_events[i] != NULL) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->copy_events[i]));
+            priv->copy_events[i] = NULL;
+        }
+        if (priv->burst_events[i] != NULL) {
+            UFO_RESOURCES_CHECK_CLERR (clReleaseEvent (priv->burst_events[i]));
+            priv->burst_events[i] = NULL;
+        }
         if (priv->images[i] != NULL) {
             UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->images[i]));
             priv->images[i] = NULL;
         }
     }
 
+    if (priv->queue != NULL) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseCommandQueue (priv->queue));
+        priv->queue = NULL;
+    }
+
     G_OBJECT_CLASS (ufo_lamino_backproject_task_parent_class)->finalize (object);
 }
 
@@ -797,6 +1427,41 @@ ufo_lamino_backproject_task_class_init (UfoLaminoBackprojectTaskClass *klass)
                            CL_ADDRESS_CLAMP,
                            G_PARAM_READWRITE);
 
+    properties[PROP_BURST] =
+        g_param_spec_uint ("burst",
+                           "Number of projections processed by one kernel invocation",
+                           "Number of projections processed by one kernel invocation (1, 2, 4, 8 or 16), "
+                           "0 selects the fastest one on the first projections",
+                           0,
+                           MAX_BURST,
+                           BURST,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_SLAB_MODE] =
+        g_param_spec_boolean ("slab-mode",
+                              "Reconstruct the volume in slabs and output it slice by slice",
+                              "Reconstruct the volume in slabs along the varied parameter from cached projections "
+                              "and output it slice by slice",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    properties[PROP_SLAB_SIZE] =
+        g_param_spec_uint ("slab-size",
+                           "Number of slices in one slab",
+                           "Number of slices in one slab, 0 chooses it from the device memory size",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_CACHE_DIRECTORY] =
+        g_param_spec_string ("cache-directory",
+                             "Directory for the memory-mapped projection cache",
+                             "Directory for the memory-mapped projection cache, projections are kept in "
+                             "host memory if not set",
+                             NULL,
+                             G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -841,4 +1506,27 @@ ufo_lamino_backproject_task_init(UfoLaminoBackprojectTask *self)
     self->priv->count = 0;
     self->priv->addressing_mode = CL_ADDRESS_CLAMP;
     self->priv->generated = FALSE;
+    self->priv->requested_burst = BURST;
+    self->priv->slab_mode = FALSE;
+    self->priv->slab_size = 0;
+    self->priv->cache_directory = NULL;
+    self->priv->slab_mem = NULL;
+    self->priv->slab_start = 0;
+    self->priv->slice = 0;
+    self->priv->cache = NULL;
+    self->priv->cache_event = NULL;
+    self->priv->angles = NULL;
+    self->priv->burst = BURST;
+    self->priv->queue = NULL;
+
+    for (i = 0; i < NUM_BURST_KERNELS; i++)
+        self->priv->kernels[i] = NULL;
+
+    for (i = 0; i < MAX_BURST; i++) {
+        self->priv->copy_events[i] = NULL;
+        self->priv->burst_events[i] = NULL;
+    }
+
+    for (i = 0; i < 3; i++)
+        self->priv->local_work_size[i] = 0;
 }
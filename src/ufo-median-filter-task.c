@@ -23,19 +23,38 @@
 #include <CL/cl.h>
 #endif
 
+#include <string.h>
+
 #include "ufo-median-filter-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-tuner.h"
 
 /**
  * SECTION:ufo-median-filter-task
- * @Short_description: Write TIFF files
+ * @Short_description: Filter with a median window
  * @Title: median_filter
  *
  */
 
+/* Largest window handled by median_small in kernels/median.cl */
+#define SMALL_MAX_SIZE 7
+
+/* Work group edge of median_large */
+#define LOCAL_SIZE 16
+
+/* Largest window selected with a sorting network on the host */
+#define NETWORK_MAX_SIZE 15
+
+/* Pixels of a row filtered at once on the host */
+#define BLOCK_SIZE 16
+
 struct _UfoMedianFilterTaskPrivate {
-    cl_kernel inner_kernel;
-    cl_kernel fill_kernel;
     guint size;
+    gboolean use_gpu;
+
+    cl_kernel kernel;
+    guint16 *network;
+    guint n_comparators;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -49,6 +68,7 @@ G_DEFINE_TYPE_WITH_CODE (UfoMedianFilterTask, ufo_median_filter_task, UFO_TYPE_T
 enum {
     PROP_0,
     PROP_SIZE,
+    PROP_USE_GPU,
     N_PROPERTIES
 };
 
@@ -60,30 +80,61 @@ ufo_median_filter_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_MEDIAN_FILTER_TASK, NULL));
 }
 
+/*
+ * Batcher's odd-even merge sort for @n values. The network is built for the
+ * next power of two as if the missing values were infinite, comparators
+ * touching those never swap and are left out.
+ */
+static guint16 *
+make_network (guint n, guint *n_comparators)
+{
+    GArray *pairs;
+    guint padded = 1;
+
+    pairs = g_array_new (FALSE, FALSE, sizeof (guint16));
+
+    while (padded < n)
+        padded <<= 1;
+
+    for (guint p = 1; p < padded; p <<= 1) {
+        for (guint k = p; k > 0; k >>= 1) {
+            for (guint j = k % p; j + k < padded; j += 2 * k) {
+                for (guint i = 0; i < k && i + j + k < n; i++) {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) {
+                        guint16 pair[2] = { (guint16) (i + j), (guint16) (i + j + k) };
+
+                        g_array_append_vals (pairs, pair, 2);
+                    }
+                }
+            }
+        }
+    }
+
+    *n_comparators = pairs->len / 2;
+
+    return (guint16 *) g_array_free (pairs, FALSE);
+}
+
 static void
 ufo_median_filter_task_setup (UfoTask *task,
                               UfoResources *resources,
                               GError **error)
 {
     UfoMedianFilterTaskPrivate *priv;
-    gchar *option;
 
     priv = UFO_MEDIAN_FILTER_TASK_GET_PRIVATE (task);
-    option = g_strdup_printf (" -DMEDIAN_BOX_SIZE=%i ", priv->size);
-
-    priv->inner_kernel = ufo_resources_get_kernel_with_opts (resources, "median.cl",
-            "filter_inner", option, error);
-
-    priv->fill_kernel = ufo_resources_get_kernel_with_opts (resources, "median.cl",
-            "fill", option, error);
 
-    if (priv->inner_kernel != NULL)
-        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->inner_kernel));
+    if (priv->use_gpu) {
+        priv->kernel = ufo_kernel_cache_get_kernel (resources, "median.cl",
+                priv->size <= SMALL_MAX_SIZE ? "median_small" : "median_large", NULL, error);
 
-    if (priv->fill_kernel != NULL)
-        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->fill_kernel));
-
-    g_free (option);
+        if (priv->kernel != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+    }
+    else if (priv->size <= NETWORK_MAX_SIZE) {
+        g_free (priv->network);
+        priv->network = make_network (priv->size * priv->size, &priv->n_comparators);
+    }
 }
 
 static void
@@ -110,7 +161,162 @@ ufo_median_filter_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_median_filter_task_get_mode (UfoTask *task)
 {
-    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+    if (UFO_MEDIAN_FILTER_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+}
+
+/* Map floats to unsigned integers with the same order, as in kernels/median.cl */
+static inline guint32
+to_key (gfloat value)
+{
+    guint32 bits;
+
+    memcpy (&bits, &value, sizeof (bits));
+
+    return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
+}
+
+static inline gfloat
+from_key (guint32 key)
+{
+    const guint32 bits = (key & 0x80000000) ? key & 0x7fffffff : ~key;
+    gfloat value;
+
+    memcpy (&value, &bits, sizeof (value));
+
+    return value;
+}
+
+/*
+ * Gather the windows of BLOCK_SIZE neighbouring pixels starting at (x, y), so
+ * that window element e of pixel p is stored at e * BLOCK_SIZE + p.
+ */
+static void
+gather (const gfloat *input, gfloat *window, gint x, gint y,
+        gint width, gint height, gint size)
+{
+    const gint half = size / 2;
+
+    for (gint dy = 0; dy < size; dy++) {
+        const gfloat *row = input + CLAMP (y + dy - half, 0, height - 1) * width;
+
+        for (gint dx = 0; dx < size; dx++) {
+            gfloat *dst = window + (dy * size + dx) * BLOCK_SIZE;
+            const gint left = x + dx - half;
+
+            if (left >= 0 && left + BLOCK_SIZE <= width) {
+                memcpy (dst, row + left, BLOCK_SIZE * sizeof (gfloat));
+            }
+            else {
+                for (gint p = 0; p < BLOCK_SIZE; p++)
+                    dst[p] = row[CLAMP (left + p, 0, width - 1)];
+            }
+        }
+    }
+}
+
+/* Run the comparators on all pixels of the block at once */
+static void
+sort_network (gfloat *window, const guint16 *network, guint n_comparators)
+{
+    for (guint c = 0; c < n_comparators; c++) {
+        gfloat *a = window + network[2 * c] * BLOCK_SIZE;
+        gfloat *b = window + network[2 * c + 1] * BLOCK_SIZE;
+
+#pragma omp simd
+        for (gint p = 0; p < BLOCK_SIZE; p++) {
+            const gfloat low = MIN (a[p], b[p]);
+            const gfloat high = MAX (a[p], b[p]);
+
+            a[p] = low;
+            b[p] = high;
+        }
+    }
+}
+
+/*
+ * Determine the medians of the block bit by bit from the most significant one
+ * by counting the keys below the candidate, 32 branch-free passes per window.
+ */
+static void
+select_radix (const gfloat *window, guint32 *keys, gfloat *result, gint n)
+{
+    guint32 prefix[BLOCK_SIZE];
+    guint32 rank[BLOCK_SIZE];
+    guint32 mask = 0;
+
+    for (gint i = 0; i < n * BLOCK_SIZE; i++)
+        keys[i] = to_key (window[i]);
+
+    for (gint p = 0; p < BLOCK_SIZE; p++) {
+        prefix[p] = 0;
+        rank[p] = n / 2;
+    }
+
+    for (gint bit = 31; bit >= 0; bit--) {
+        const guint32 candidate = 1u << bit;
+        guint32 count[BLOCK_SIZE] = { 0 };
+
+        for (gint e = 0; e < n; e++) {
+            const guint32 *row = keys + e * BLOCK_SIZE;
+
+#pragma omp simd
+            for (gint p = 0; p < BLOCK_SIZE; p++)
+                count[p] += (row[p] & mask) == prefix[p] && !(row[p] & candidate);
+        }
+
+#pragma omp simd
+        for (gint p = 0; p < BLOCK_SIZE; p++) {
+            const guint32 above = rank[p] >= count[p];
+
+            rank[p] -= above ? count[p] : 0;
+            prefix[p] |= above ? candidate : 0;
+        }
+
+        mask |= candidate;
+    }
+
+    for (gint p = 0; p < BLOCK_SIZE; p++)
+        result[p] = from_key (prefix[p]);
+}
+
+static void
+filter_host (UfoMedianFilterTaskPrivate *priv, const gfloat *input, gfloat *output,
+             gint width, gint height)
+{
+    const gint size = (gint) priv->size;
+    const gint n = size * size;
+
+#pragma omp parallel
+    {
+        gfloat *window = g_malloc (n * BLOCK_SIZE * sizeof (gfloat));
+        guint32 *keys = priv->network == NULL ? g_malloc (n * BLOCK_SIZE * sizeof (guint32)) : NULL;
+        gfloat result[BLOCK_SIZE];
+
+#pragma omp for schedule(static)
+        for (gint y = 0; y < height; y++) {
+            for (gint x = 0; x < width; x += BLOCK_SIZE) {
+                const gfloat *median = result;
+
+                gather (input, window, x, y, width, height, size);
+
+                if (priv->network != NULL) {
+                    sort_network (window, priv->network, priv->n_comparators);
+                    median = window + (n / 2) * BLOCK_SIZE;
+                }
+                else {
+                    select_radix (window, keys, result, n);
+                }
+
+                memcpy (output + y * width + x, median, MIN (BLOCK_SIZE, width - x) * sizeof (gfloat));
+            }
+        }
+
+        g_free (keys);
+        g_free (window);
+    }
 }
 
 static gboolean
@@ -125,29 +331,48 @@ ufo_median_filter_task_process (UfoTask *task,
     cl_command_queue cmd_queue;
     cl_mem in_mem;
     cl_mem out_mem;
-
-    size_t inner_size[2];
+    cl_int size;
 
     priv = UFO_MEDIAN_FILTER_TASK_GET_PRIVATE (task);
 
+    if (!priv->use_gpu) {
+        filter_host (priv, ufo_buffer_get_host_array (inputs[0], NULL),
+                     ufo_buffer_get_host_array (output, NULL),
+                     (gint) requisition->dims[0], (gint) requisition->dims[1]);
+        return TRUE;
+    }
+
     node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
     cmd_queue = ufo_gpu_node_get_cmd_queue (node);
     in_mem = ufo_buffer_get_device_array (inputs[0], cmd_queue);
     out_mem = ufo_buffer_get_device_array (output, cmd_queue);
     profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    size = (cl_int) priv->size;
 
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->fill_kernel, 0, sizeof (cl_mem), &in_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->fill_kernel, 1, sizeof (cl_mem), &out_mem));
-
-    ufo_profiler_call (profiler, cmd_queue, priv->fill_kernel, 2, requisition->dims, NULL);
-
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->inner_kernel, 0, sizeof (cl_mem), &in_mem));
-    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->inner_kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (cl_int), &size));
 
-    inner_size[0] = requisition->dims[0] - (priv->size - 1);
-    inner_size[1] = requisition->dims[1] - (priv->size - 1);
-
-    ufo_profiler_call (profiler, cmd_queue, priv->inner_kernel, 2, inner_size, NULL);
+    if (priv->size <= SMALL_MAX_SIZE) {
+        ufo_tuner_call (profiler, cmd_queue, priv->kernel, 2, requisition->dims);
+    }
+    else {
+        /* The tile size depends on the work group, which must therefore be fixed */
+        const cl_int width = (cl_int) requisition->dims[0];
+        const cl_int height = (cl_int) requisition->dims[1];
+        const gsize tile_edge = LOCAL_SIZE + priv->size - 1;
+        gsize local_size[2] = { LOCAL_SIZE, LOCAL_SIZE };
+        gsize global_size[2];
+
+        global_size[0] = (requisition->dims[0] + LOCAL_SIZE - 1) / LOCAL_SIZE * LOCAL_SIZE;
+        global_size[1] = (requisition->dims[1] + LOCAL_SIZE - 1) / LOCAL_SIZE * LOCAL_SIZE;
+
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (cl_int), &width));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 4, sizeof (cl_int), &height));
+        UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 5, tile_edge * tile_edge * sizeof (cl_float), NULL));
+
+        ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, global_size, local_size);
+    }
 
     return TRUE;
 }
@@ -175,6 +400,9 @@ ufo_median_filter_task_set_property (GObject *object,
                     priv->size = new_size;
             }
             break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -195,6 +423,9 @@ ufo_median_filter_task_get_property (GObject *object,
         case PROP_SIZE:
             g_value_set_uint (value, priv->size);
             break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -208,15 +439,13 @@ ufo_median_filter_task_finalize (GObject *object)
 
     priv = UFO_MEDIAN_FILTER_TASK_GET_PRIVATE (object);
 
-    if (priv->inner_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->inner_kernel));
-        priv->inner_kernel = NULL;
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
     }
 
-    if (priv->fill_kernel) {
-        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->fill_kernel));
-        priv->fill_kernel = NULL;
-    }
+    g_free (priv->network);
+    priv->network = NULL;
 
     G_OBJECT_CLASS (ufo_median_filter_task_parent_class)->finalize (object);
 }
@@ -248,6 +477,13 @@ ufo_median_filter_task_class_init (UfoMedianFilterTaskClass *klass)
             3, 33, 3,
             G_PARAM_READWRITE);
 
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+            "Filter on the GPU",
+            "Filter on the GPU",
+            TRUE,
+            G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (gobject_class, i, properties[i]);
 
@@ -259,4 +495,5 @@ ufo_median_filter_task_init(UfoMedianFilterTask *self)
 {
     self->priv = UFO_MEDIAN_FILTER_TASK_GET_PRIVATE(self);
     self->priv->size = 3;
+    self->priv->use_gpu = TRUE;
 }
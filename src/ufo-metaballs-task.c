@@ -24,6 +24,7 @@
 #endif
 
 #include "ufo-metaballs-task.h"
+#include "common/ufo-kernel-cache.h"
 
 typedef struct {
     gfloat x;
@@ -85,7 +86,7 @@ ufo_metaballs_task_setup (UfoTask *task,
     priv = UFO_METABALLS_TASK_GET_PRIVATE (task);
     context = ufo_resources_get_context (resources);
 
-    priv->kernel = ufo_resources_get_kernel (resources, "metaballs.cl", "draw_metaballs", error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources, "metaballs.cl", "draw_metaballs", NULL, error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
@@ -0,0 +1,539 @@
+/*
+ * Copyright (C) 2011-2013 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+#include <math.h>
+#include <string.h>
+
+#include "ufo-nlm-task.h"
+#include "common/ufo-kernel-cache.h"
+
+/**
+ * SECTION:ufo-nlm-task
+ * @Short_description: Denoise with non-local means
+ * @Title: nlm
+ *
+ */
+
+/* Columns summed at once on the host */
+#define COLUMN_BLOCK 256
+
+struct _UfoNlmTaskPrivate {
+    guint search_radius;
+    guint patch_radius;
+    gfloat h;
+    gfloat sigma;
+    gboolean use_gpu;
+
+    cl_context context;
+    cl_kernel rows_kernel;
+    cl_kernel columns_kernel;
+    cl_kernel normalize_kernel;
+    cl_mem row_sums_mem;
+    cl_mem weights_mem;
+    gsize scratch_size;
+};
+
+static void ufo_task_interface_init (UfoTaskIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (UfoNlmTask, ufo_nlm_task, UFO_TYPE_TASK_NODE,
+                         G_IMPLEMENT_INTERFACE (UFO_TYPE_TASK,
+                                                ufo_task_interface_init))
+
+#define UFO_NLM_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_NLM_TASK, UfoNlmTaskPrivate))
+
+enum {
+    PROP_0,
+    PROP_SEARCH_RADIUS,
+    PROP_PATCH_RADIUS,
+    PROP_H,
+    PROP_SIGMA,
+    PROP_USE_GPU,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
+UfoNode *
+ufo_nlm_task_new (void)
+{
+    return UFO_NODE (g_object_new (UFO_TYPE_NLM_TASK, NULL));
+}
+
+static void
+release_scratch (UfoNlmTaskPrivate *priv)
+{
+    if (priv->row_sums_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->row_sums_mem));
+        priv->row_sums_mem = NULL;
+    }
+
+    if (priv->weights_mem) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseMemObject (priv->weights_mem));
+        priv->weights_mem = NULL;
+    }
+
+    priv->scratch_size = 0;
+}
+
+static cl_kernel
+get_kernel (UfoResources *resources, const gchar *name, GError **error)
+{
+    cl_kernel kernel;
+
+    kernel = ufo_kernel_cache_get_kernel (resources, "nlm.cl", name, NULL, error);
+
+    if (kernel != NULL)
+        UFO_RESOURCES_CHECK_CLERR (clRetainKernel (kernel));
+
+    return kernel;
+}
+
+static void
+ufo_nlm_task_setup (UfoTask *task,
+                    UfoResources *resources,
+                    GError **error)
+{
+    UfoNlmTaskPrivate *priv;
+
+    priv = UFO_NLM_TASK_GET_PRIVATE (task);
+
+    if (priv->use_gpu) {
+        priv->context = ufo_resources_get_context (resources);
+        UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
+
+        priv->rows_kernel = get_kernel (resources, "nlm_rows", error);
+        priv->columns_kernel = get_kernel (resources, "nlm_columns", error);
+        priv->normalize_kernel = get_kernel (resources, "nlm_normalize", error);
+    }
+}
+
+static void
+ufo_nlm_task_get_requisition (UfoTask *task,
+                              UfoBuffer **inputs,
+                              UfoRequisition *requisition)
+{
+    ufo_buffer_get_requisition (inputs[0], requisition);
+}
+
+static guint
+ufo_nlm_task_get_num_inputs (UfoTask *task)
+{
+    return 1;
+}
+
+static guint
+ufo_nlm_task_get_num_dimensions (UfoTask *task,
+                                 guint input)
+{
+    g_return_val_if_fail (input == 0, 0);
+    return 2;
+}
+
+static UfoTaskMode
+ufo_nlm_task_get_mode (UfoTask *task)
+{
+    if (UFO_NLM_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+
+    return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_CPU;
+}
+
+static inline gfloat
+squared_difference (const gfloat *row, const gfloat *shifted, gint x, gint dx, gint width)
+{
+    const gint cx = CLAMP (x, 0, width - 1);
+    const gfloat difference = row[cx] - shifted[CLAMP (cx + dx, 0, width - 1)];
+
+    return difference * difference;
+}
+
+/*
+ * Accumulate the weighted pixels of one search offset: running sums along the
+ * rows give the row sums of the squared differences, running sums along the
+ * columns, COLUMN_BLOCK columns at once, the patch distances.
+ */
+static void
+accumulate_offset (UfoNlmTaskPrivate *priv, const gfloat *frame, gfloat *output,
+                   gfloat *row_sums, gfloat *weights, gint dx, gint dy,
+                   gint width, gint height, gboolean first)
+{
+    const gint radius = (gint) priv->patch_radius;
+    const gint n_patch = (2 * radius + 1) * (2 * radius + 1);
+    const gfloat scale = 1.0f / (n_patch * priv->h * priv->h);
+    const gfloat bias = 2.0f * priv->sigma * priv->sigma / (priv->h * priv->h);
+
+#pragma omp parallel for schedule(static)
+    for (gint y = 0; y < height; y++) {
+        const gfloat *row = frame + y * width;
+        const gfloat *shifted = frame + CLAMP (y + dy, 0, height - 1) * width;
+        gfloat *sums = row_sums + y * width;
+        gfloat sum = 0.0f;
+
+        for (gint k = -radius; k <= radius; k++)
+            sum += squared_difference (row, shifted, k, dx, width);
+
+        for (gint x = 0; x < width; x++) {
+            sums[x] = sum;
+            sum += squared_difference (row, shifted, x + radius + 1, dx, width) -
+                   squared_difference (row, shifted, x - radius, dx, width);
+        }
+    }
+
+#pragma omp parallel for schedule(static)
+    for (gint x0 = 0; x0 < width; x0 += COLUMN_BLOCK) {
+        const gint n = MIN (COLUMN_BLOCK, width - x0);
+        gfloat sums[COLUMN_BLOCK];
+        gint sx[COLUMN_BLOCK];
+
+        for (gint i = 0; i < n; i++) {
+            sums[i] = 0.0f;
+            sx[i] = CLAMP (x0 + i + dx, 0, width - 1);
+        }
+
+        for (gint k = -radius; k <= radius; k++) {
+            const gfloat *src = row_sums + CLAMP (k, 0, height - 1) * width + x0;
+
+            for (gint i = 0; i < n; i++)
+                sums[i] += src[i];
+        }
+
+        for (gint y = 0; y < height; y++) {
+            const gfloat *shifted = frame + CLAMP (y + dy, 0, height - 1) * width;
+            const gfloat *add = row_sums + MIN (y + radius + 1, height - 1) * width + x0;
+            const gfloat *sub = row_sums + MAX (y - radius, 0) * width + x0;
+            gfloat *dst_weights = weights + y * width + x0;
+            gfloat *dst = output + y * width + x0;
+
+#pragma omp simd
+            for (gint i = 0; i < n; i++) {
+                const gfloat weight = expf (-MAX (sums[i] * scale - bias, 0.0f));
+                const gfloat value = weight * shifted[sx[i]];
+
+                dst_weights[i] = first ? weight : dst_weights[i] + weight;
+                dst[i] = first ? value : dst[i] + value;
+                sums[i] += add[i] - sub[i];
+            }
+        }
+    }
+}
+
+static void
+denoise_host (UfoNlmTaskPrivate *priv, const gfloat *input, gfloat *output,
+              gint width, gint height, gint depth)
+{
+    const gint radius = (gint) priv->search_radius;
+    const gsize frame_size = (gsize) width * height;
+    gfloat *row_sums;
+    gfloat *weights;
+
+    row_sums = g_malloc (frame_size * sizeof (gfloat));
+    weights = g_malloc (frame_size * sizeof (gfloat));
+
+    for (gint z = 0; z < depth; z++) {
+        const gfloat *frame = input + z * frame_size;
+        gfloat *dst = output + z * frame_size;
+        gboolean first = TRUE;
+
+        for (gint dy = -radius; dy <= radius; dy++) {
+            for (gint dx = -radius; dx <= radius; dx++) {
+                accumulate_offset (priv, frame, dst, row_sums, weights, dx, dy, width, height, first);
+                first = FALSE;
+            }
+        }
+
+#pragma omp parallel for simd
+        for (gsize i = 0; i < frame_size; i++)
+            dst[i] /= weights[i];
+    }
+
+    g_free (weights);
+    g_free (row_sums);
+}
+
+static void
+denoise_gpu (UfoNlmTaskPrivate *priv, cl_command_queue cmd_queue, UfoProfiler *profiler,
+             cl_mem in_mem, cl_mem out_mem, UfoRequisition *requisition)
+{
+    const gint search_radius = (gint) priv->search_radius;
+    const cl_int patch_radius = (cl_int) priv->patch_radius;
+    const cl_int height = (cl_int) requisition->dims[1];
+    const gint n_patch = (2 * patch_radius + 1) * (2 * patch_radius + 1);
+    const cl_float scale = 1.0f / (n_patch * priv->h * priv->h);
+    const cl_float bias = 2.0f * priv->sigma * priv->sigma / (priv->h * priv->h);
+    gsize rows_size[3];
+    gsize columns_size[2];
+    gsize n_pixels;
+    cl_int first = 1;
+
+    rows_size[0] = requisition->dims[0];
+    rows_size[1] = requisition->dims[1];
+    rows_size[2] = requisition->n_dims == 3 ? requisition->dims[2] : 1;
+    columns_size[0] = rows_size[0];
+    columns_size[1] = rows_size[2];
+    n_pixels = rows_size[0] * rows_size[1] * rows_size[2];
+
+    if (priv->scratch_size != n_pixels * sizeof (cl_float)) {
+        cl_int errcode;
+
+        release_scratch (priv);
+        priv->row_sums_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                             n_pixels * sizeof (cl_float), NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        priv->weights_mem = clCreateBuffer (priv->context, CL_MEM_READ_WRITE,
+                                            n_pixels * sizeof (cl_float), NULL, &errcode);
+        UFO_RESOURCES_CHECK_CLERR (errcode);
+        priv->scratch_size = n_pixels * sizeof (cl_float);
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->rows_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->rows_kernel, 1, sizeof (cl_mem), &priv->row_sums_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->rows_kernel, 4, sizeof (cl_int), &patch_radius));
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 1, sizeof (cl_mem), &priv->row_sums_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 2, sizeof (cl_mem), &priv->weights_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 3, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 6, sizeof (cl_int), &patch_radius));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 7, sizeof (cl_int), &height));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 8, sizeof (cl_float), &scale));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 9, sizeof (cl_float), &bias));
+
+    for (cl_int dy = -search_radius; dy <= search_radius; dy++) {
+        for (cl_int dx = -search_radius; dx <= search_radius; dx++) {
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->rows_kernel, 2, sizeof (cl_int), &dx));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->rows_kernel, 3, sizeof (cl_int), &dy));
+            ufo_profiler_call (profiler, cmd_queue, priv->rows_kernel, 3, rows_size, NULL);
+
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 4, sizeof (cl_int), &dx));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 5, sizeof (cl_int), &dy));
+            UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->columns_kernel, 10, sizeof (cl_int), &first));
+            ufo_profiler_call (profiler, cmd_queue, priv->columns_kernel, 2, columns_size, NULL);
+            first = 0;
+        }
+    }
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->normalize_kernel, 0, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->normalize_kernel, 1, sizeof (cl_mem), &priv->weights_mem));
+    ufo_profiler_call (profiler, cmd_queue, priv->normalize_kernel, 1, &n_pixels, NULL);
+}
+
+static gboolean
+ufo_nlm_task_process (UfoTask *task,
+                      UfoBuffer **inputs,
+                      UfoBuffer *output,
+                      UfoRequisition *requisition)
+{
+    UfoNlmTaskPrivate *priv;
+    UfoGpuNode *node;
+    cl_command_queue cmd_queue;
+
+    priv = UFO_NLM_TASK_GET_PRIVATE (task);
+
+    if (!priv->use_gpu) {
+        denoise_host (priv, ufo_buffer_get_host_array (inputs[0], NULL),
+                      ufo_buffer_get_host_array (output, NULL),
+                      (gint) requisition->dims[0], (gint) requisition->dims[1],
+                      requisition->n_dims == 3 ? (gint) requisition->dims[2] : 1);
+        return TRUE;
+    }
+
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+
+    denoise_gpu (priv, cmd_queue, ufo_task_node_get_profiler (UFO_TASK_NODE (task)),
+                 ufo_buffer_get_device_array (inputs[0], cmd_queue),
+                 ufo_buffer_get_device_array (output, cmd_queue),
+                 requisition);
+
+    return TRUE;
+}
+
+static void
+ufo_nlm_task_set_property (GObject *object,
+                           guint property_id,
+                           const GValue *value,
+                           GParamSpec *pspec)
+{
+    UfoNlmTaskPrivate *priv = UFO_NLM_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_SEARCH_RADIUS:
+            priv->search_radius = g_value_get_uint (value);
+            break;
+        case PROP_PATCH_RADIUS:
+            priv->patch_radius = g_value_get_uint (value);
+            break;
+        case PROP_H:
+            priv->h = g_value_get_float (value);
+            break;
+        case PROP_SIGMA:
+            priv->sigma = g_value_get_float (value);
+            break;
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_nlm_task_get_property (GObject *object,
+                           guint property_id,
+                           GValue *value,
+                           GParamSpec *pspec)
+{
+    UfoNlmTaskPrivate *priv = UFO_NLM_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_SEARCH_RADIUS:
+            g_value_set_uint (value, priv->search_radius);
+            break;
+        case PROP_PATCH_RADIUS:
+            g_value_set_uint (value, priv->patch_radius);
+            break;
+        case PROP_H:
+            g_value_set_float (value, priv->h);
+            break;
+        case PROP_SIGMA:
+            g_value_set_float (value, priv->sigma);
+            break;
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_nlm_task_finalize (GObject *object)
+{
+    UfoNlmTaskPrivate *priv = UFO_NLM_TASK_GET_PRIVATE (object);
+
+    release_scratch (priv);
+
+    if (priv->rows_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->rows_kernel));
+        priv->rows_kernel = NULL;
+    }
+
+    if (priv->columns_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->columns_kernel));
+        priv->columns_kernel = NULL;
+    }
+
+    if (priv->normalize_kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->normalize_kernel));
+        priv->normalize_kernel = NULL;
+    }
+
+    if (priv->context) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseContext (priv->context));
+        priv->context = NULL;
+    }
+
+    G_OBJECT_CLASS (ufo_nlm_task_parent_class)->finalize (object);
+}
+
+static void
+ufo_task_interface_init (UfoTaskIface *iface)
+{
+    iface->setup = ufo_nlm_task_setup;
+    iface->get_num_inputs = ufo_nlm_task_get_num_inputs;
+    iface->get_num_dimensions = ufo_nlm_task_get_num_dimensions;
+    iface->get_mode = ufo_nlm_task_get_mode;
+    iface->get_requisition = ufo_nlm_task_get_requisition;
+    iface->process = ufo_nlm_task_process;
+}
+
+static void
+ufo_nlm_task_class_init (UfoNlmTaskClass *klass)
+{
+    GObjectClass *oclass = G_OBJECT_CLASS (klass);
+
+    oclass->set_property = ufo_nlm_task_set_property;
+    oclass->get_property = ufo_nlm_task_get_property;
+    oclass->finalize = ufo_nlm_task_finalize;
+
+    properties[PROP_SEARCH_RADIUS] =
+        g_param_spec_uint ("search-radius",
+            "Radius of the window searched for similar patches",
+            "Radius of the window searched for similar patches",
+            0, 100, 10,
+            G_PARAM_READWRITE);
+
+    properties[PROP_PATCH_RADIUS] =
+        g_param_spec_uint ("patch-radius",
+            "Radius of the compared patches",
+            "Radius of the compared patches",
+            0, 100, 3,
+            G_PARAM_READWRITE);
+
+    properties[PROP_H] =
+        g_param_spec_float ("h",
+            "Filtering strength",
+            "Filtering strength, larger values average more dissimilar patches",
+            1e-6f, G_MAXFLOAT, 0.1f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_SIGMA] =
+        g_param_spec_float ("sigma",
+            "Noise standard deviation",
+            "Noise standard deviation, patch distances below twice its square get full weight",
+            0.0f, G_MAXFLOAT, 0.0f,
+            G_PARAM_READWRITE);
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+            "Denoise on the GPU",
+            "Denoise on the GPU",
+            TRUE,
+            G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    g_type_class_add_private (oclass, sizeof(UfoNlmTaskPrivate));
+}
+
+static void
+ufo_nlm_task_init(UfoNlmTask *self)
+{
+    self->priv = UFO_NLM_TASK_GET_PRIVATE(self);
+    self->priv->search_radius = 10;
+    self->priv->patch_radius = 3;
+    self->priv->h = 0.1f;
+    self->priv->sigma = 0.0f;
+    self->priv->use_gpu = TRUE;
+    self->priv->context = NULL;
+    self->priv->rows_kernel = NULL;
+    self->priv->columns_kernel = NULL;
+    self->priv->normalize_kernel = NULL;
+    self->priv->row_sums_mem = NULL;
+    self->priv->weights_mem = NULL;
+    self->priv->scratch_size = 0;
+}
@@ -24,6 +24,7 @@
 #endif
 
 #include "ufo-opencl-task.h"
+#include "common/ufo-kernel-cache.h"
 
 
 struct _UfoOpenCLTaskPrivate {
@@ -115,20 +116,22 @@ ufo_opencl_task_setup (UfoTask *task,
     }
 
     if (priv->source != NULL) {
-        priv->kernel = ufo_resources_get_kernel_from_source (resources,
-                                                             priv->source,
-                                                             priv->funcname,
-                                                             error);
+        priv->kernel = ufo_kernel_cache_get_kernel_from_source (resources,
+                                                                priv->source,
+                                                                priv->funcname,
+                                                                NULL,
+                                                                error);
     }
     else {
         const gchar *filename;
 
         filename = priv->filename != NULL ? priv->filename : "default.cl";
 
-        priv->kernel = ufo_resources_get_kernel (resources,
-                                                 filename,
-                                                 priv->funcname,
-                                                 error);
+        priv->kernel = ufo_kernel_cache_get_kernel (resources,
+                                                    filename,
+                                                    priv->funcname,
+                                                    NULL,
+                                                    error);
     }
 
     if (priv->kernel != NULL) {
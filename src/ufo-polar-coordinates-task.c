@@ -25,6 +25,7 @@
 
 #include <math.h>
 #include "ufo-polar-coordinates-task.h"
+#include "common/ufo-kernel-cache.h"
 
 /**
  * SECTION:ufo-polar-coordinates-task
@@ -87,8 +88,8 @@ ufo_polar_coordinates_task_setup (UfoTask *task,
 
     priv = UFO_POLAR_COORDINATES_TASK_GET_PRIVATE (task);
     priv->context = ufo_resources_get_context (resources);
-    priv->populate_polar_kernel = ufo_resources_get_kernel (resources, "polar.cl", "populate_polar_space", error);
-    priv->populate_cartesian_kernel = ufo_resources_get_kernel (resources, "polar.cl", "populate_cartesian_space", error);
+    priv->populate_polar_kernel = ufo_kernel_cache_get_kernel (resources, "polar.cl", "populate_polar_space", NULL, error);
+    priv->populate_cartesian_kernel = ufo_kernel_cache_get_kernel (resources, "polar.cl", "populate_cartesian_space", NULL, error);
 
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
     if (priv->populate_polar_kernel) {
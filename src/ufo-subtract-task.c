@@ -24,6 +24,7 @@
 #endif
 
 #include "ufo-subtract-task.h"
+#include "common/ufo-kernel-cache.h"
 
 /**
  * SECTION:ufo-subtract-task
@@ -63,10 +64,11 @@ ufo_subtract_task_setup (UfoTask *task,
     UfoSubtractTaskPrivate *priv;
 
     priv = UFO_SUBTRACT_TASK_GET_PRIVATE (task);
-    priv->kernel = ufo_resources_get_kernel (resources,
-                                             "arithmetics.cl",
-                                             "subtract",
-                                             error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources,
+                                                "arithmetics.cl",
+                                                "subtract",
+                                                NULL,
+                                                error);
 
     if (priv->kernel != NULL)
         UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
@@ -27,6 +27,7 @@
 #include <math.h>
 
 #include "ufo-swap-quadrants-task.h"
+#include "common/ufo-kernel-cache.h"
 
 /**
  * SECTION:ufo-swap_quadrants-task
@@ -69,8 +70,8 @@ ufo_swap_quadrants_task_setup (UfoTask *task,
 {
     UfoSwapQuadrantsTaskPrivate *priv = UFO_SWAP_QUADRANTS_TASK_GET_PRIVATE (task);
     priv->resources = resources;
-    priv->swap_quadrants_kernel_real = ufo_resources_get_kernel(resources, "swap-quadrants.cl", "swap_quadrants_kernel_real", error);
-    priv->swap_quadrants_kernel_complex = ufo_resources_get_kernel(resources, "swap-quadrants.cl", "swap_quadrants_kernel_complex", error);
+    priv->swap_quadrants_kernel_real = ufo_kernel_cache_get_kernel(resources, "swap-quadrants.cl", "swap_quadrants_kernel_real", NULL, error);
+    priv->swap_quadrants_kernel_complex = ufo_kernel_cache_get_kernel(resources, "swap-quadrants.cl", "swap_quadrants_kernel_complex", NULL, error);
 }
 
 static void
@@ -17,12 +17,18 @@
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* ftruncate and posix_madvise are not part of C99 */
+#define _POSIX_C_SOURCE 200809L
+
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
 #include <CL/cl.h>
 #endif
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glib/gstdio.h>
 
 #include "ufo-transpose-projections-task.h"
 
@@ -35,6 +41,19 @@ struct _UfoTransposeProjectionsTaskPrivate {
     guint current_sino;
     guint n_sinos;
     guint sino_width;
+    guint batch;
+    guint range[2];
+    guint first_sino;
+    guint memory_budget;
+    gchar *spill_directory;
+
+    /* spill mode: sinograms live in a mapped scratch file and projections are
+     * staged in blocks of stage_depth rows per sinogram before scattering */
+    gsize sinograms_size;
+    gboolean mapped;
+    gfloat *stage;
+    guint stage_depth;
+    guint staged;
 };
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
@@ -48,6 +67,10 @@ G_DEFINE_TYPE_WITH_CODE (UfoTransposeProjectionsTask, ufo_transpose_projections_
 enum {
     PROP_0,
     PROP_NUM_PROJECTIONS,
+    PROP_BATCH,
+    PROP_SINOGRAM_RANGE,
+    PROP_MEMORY_BUDGET,
+    PROP_SPILL_DIRECTORY,
     N_PROPERTIES
 };
 
@@ -59,6 +82,108 @@ ufo_transpose_projections_task_new (void)
     return UFO_NODE (g_object_new (UFO_TYPE_TRANSPOSE_PROJECTIONS_TASK, NULL));
 }
 
+static gfloat *
+map_scratch_file (const gchar *directory, gsize size)
+{
+    gchar *filename;
+    gpointer data;
+    gint fd;
+
+    /* The file is unlinked right away, the mapping keeps it alive */
+    filename = g_build_filename (directory, "ufo-transpose-XXXXXX", NULL);
+    fd = g_mkstemp (filename);
+
+    if (fd < 0) {
+        g_free (filename);
+        return NULL;
+    }
+
+    g_unlink (filename);
+    g_free (filename);
+
+    if (ftruncate (fd, (off_t) size) != 0) {
+        close (fd);
+        return NULL;
+    }
+
+    data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    return data == MAP_FAILED ? NULL : data;
+}
+
+static void
+allocate_sinograms (UfoTransposeProjectionsTaskPrivate *priv)
+{
+    const gsize projection_size = sizeof (gfloat) * priv->sino_width * priv->n_sinos;
+    const gsize budget = (gsize) priv->memory_budget << 20;
+    const gchar *directory;
+
+    priv->sinograms_size = sizeof (gfloat) * priv->sino_width * priv->n_projections * priv->n_sinos;
+    priv->mapped = budget > 0 && priv->sinograms_size > budget;
+
+    if (!priv->mapped) {
+        priv->sinograms = g_malloc0 (priv->sinograms_size);
+        return;
+    }
+
+    directory = priv->spill_directory != NULL ? priv->spill_directory : g_get_tmp_dir ();
+    priv->sinograms = map_scratch_file (directory, priv->sinograms_size);
+
+    if (priv->sinograms == NULL)
+        g_error ("Could not map %zu bytes of sinograms in `%s'", priv->sinograms_size, directory);
+
+    /*
+     * Writing a single row into every sinogram touches one page per sinogram
+     * and projection. Staging a block of projections lets each sinogram
+     * receive a contiguous run of rows instead, a quarter of the budget is
+     * used for that.
+     */
+    priv->stage_depth = (guint) CLAMP (budget / 4 / projection_size, 1, MIN (priv->n_projections, 256));
+    priv->stage = g_malloc (projection_size * priv->stage_depth);
+    priv->staged = 0;
+
+    g_debug ("transpose-projections: spilling %zu bytes to `%s' in blocks of %u projections",
+             priv->sinograms_size, directory, priv->stage_depth);
+}
+
+static void
+free_sinograms (UfoTransposeProjectionsTaskPrivate *priv)
+{
+    if (priv->sinograms != NULL) {
+        if (priv->mapped)
+            munmap (priv->sinograms, priv->sinograms_size);
+        else
+            g_free (priv->sinograms);
+
+        priv->sinograms = NULL;
+    }
+
+    g_free (priv->stage);
+    priv->stage = NULL;
+}
+
+/* Scatter the staged block of projections, the last one being priv->projection - 1 */
+static void
+flush_stage (UfoTransposeProjectionsTaskPrivate *priv)
+{
+    const gsize block_size = (gsize) priv->staged * priv->sino_width;
+    const gsize first_row = priv->projection - 1 - priv->staged;
+    guint i;
+
+    if (priv->staged == 0)
+        return;
+
+#pragma omp parallel for
+    for (i = 0; i < priv->n_sinos; i++) {
+        memcpy (priv->sinograms + i * priv->sino_offset + first_row * priv->sino_width,
+                priv->stage + (gsize) i * priv->stage_depth * priv->sino_width,
+                sizeof (gfloat) * block_size);
+    }
+
+    priv->staged = 0;
+}
+
 static gboolean
 ufo_transpose_projections_task_process (UfoTask *task,
                                  UfoBuffer **inputs,
@@ -79,9 +204,29 @@ ufo_transpose_projections_task_process (UfoTask *task,
 
     sino_index = (priv->projection - 1) * priv->sino_width;
     host_array = ufo_buffer_get_host_array (inputs[0], NULL);
+    host_array += priv->first_sino * priv->sino_width;
     row_mem_offset = priv->sino_width;
     sino_mem_offset = row_mem_offset * priv->n_projections;
 
+    if (priv->mapped) {
+        gfloat *stage = priv->stage + priv->staged * priv->sino_width;
+
+#pragma omp parallel for
+        for (i = 0; i < priv->n_sinos; i++) {
+            memcpy (stage + (gsize) i * priv->stage_depth * priv->sino_width,
+                    host_array + i * row_mem_offset,
+                    sizeof (float) * priv->sino_width);
+        }
+
+        priv->staged++;
+        priv->projection++;
+
+        if (priv->staged == priv->stage_depth)
+            flush_stage (priv);
+
+        return TRUE;
+    }
+
 #pragma omp parallel
     {
 #pragma omp for
@@ -106,13 +251,26 @@ ufo_transpose_projections_task_generate (UfoTask *task,
 
     priv = UFO_TRANSPOSE_PROJECTIONS_TASK_GET_PRIVATE (task);
 
-    if (priv->current_sino == priv->n_sinos)
+    if (priv->current_sino >= priv->n_sinos)
         return FALSE;
 
+    if (priv->mapped && priv->current_sino == 0) {
+        flush_stage (priv);
+        posix_madvise (priv->sinograms, priv->sinograms_size, POSIX_MADV_SEQUENTIAL);
+    }
+
+    /* Trim the last batch instead of sending empty sinograms downstream */
+    if (priv->current_sino + priv->batch > priv->n_sinos) {
+        UfoRequisition last = *requisition;
+
+        last.dims[2] = priv->n_sinos - priv->current_sino;
+        ufo_buffer_resize (output, &last);
+    }
+
     index = priv->current_sino * priv->sino_offset;
     ufo_buffer_set_host_array (output, priv->sinograms + index, FALSE);
 
-    priv->current_sino++;
+    priv->current_sino += priv->batch;
     return TRUE;
 }
 
@@ -133,14 +291,27 @@ ufo_transpose_projections_task_get_requisition (UfoTask *task,
 
     priv = UFO_TRANSPOSE_PROJECTIONS_TASK_GET_PRIVATE (task);
     ufo_buffer_get_requisition (inputs[0], &in_req);
-    requisition->n_dims = 2;
+    requisition->n_dims = priv->batch > 1 ? 3 : 2;
     requisition->dims[0] = in_req.dims[0];
     requisition->dims[1] = priv->n_projections;
+    requisition->dims[2] = priv->batch;
 
     if (priv->sinograms == NULL) {
+        guint height = (guint) in_req.dims[1];
+        guint last = priv->range[1] == 0 ? height : MIN (priv->range[1], height);
+
+        priv->first_sino = MIN (priv->range[0], height);
+
+        if (priv->first_sino >= last) {
+            g_warning ("transpose-projections: sinogram-range [%u, %u) is outside of %u rows, keeping all",
+                       priv->range[0], priv->range[1], height);
+            priv->first_sino = 0;
+            last = height;
+        }
+
         priv->sino_width = (guint) in_req.dims[0];
-        priv->n_sinos = (guint) in_req.dims[1];
-        priv->sinograms = g_malloc0 (sizeof (gfloat) * priv->n_projections * priv->sino_width * priv->n_sinos);
+        priv->n_sinos = last - priv->first_sino;
+        allocate_sinograms (priv);
         priv->sino_offset = priv->sino_width * priv->n_projections;
         priv->current_sino = 0;
         priv->projection = 1;
@@ -182,11 +353,10 @@ ufo_transpose_projections_task_finalize (GObject *object)
     UfoTransposeProjectionsTaskPrivate *priv;
 
     priv = UFO_TRANSPOSE_PROJECTIONS_TASK_GET_PRIVATE (object);
+    free_sinograms (priv);
+    g_free (priv->spill_directory);
 
-    if (priv->sinograms) {
-        g_free (priv->sinograms);
-        priv->sinograms = NULL;
-    }
+    G_OBJECT_CLASS (ufo_transpose_projections_task_parent_class)->finalize (object);
 }
 
 static void
@@ -213,6 +383,29 @@ ufo_transpose_projections_task_set_property (GObject *object,
         case PROP_NUM_PROJECTIONS:
             priv->n_projections = g_value_get_uint (value);
             break;
+        case PROP_BATCH:
+            priv->batch = g_value_get_uint (value);
+            break;
+        case PROP_SINOGRAM_RANGE:
+            {
+                GValueArray *array = g_value_get_boxed (value);
+
+                if (array->n_values != 2) {
+                    g_warning ("sinogram-range must be [from, to]");
+                    break;
+                }
+
+                priv->range[0] = g_value_get_uint (g_value_array_get_nth (array, 0));
+                priv->range[1] = g_value_get_uint (g_value_array_get_nth (array, 1));
+            }
+            break;
+        case PROP_MEMORY_BUDGET:
+            priv->memory_budget = g_value_get_uint (value);
+            break;
+        case PROP_SPILL_DIRECTORY:
+            g_free (priv->spill_directory);
+            priv->spill_directory = g_value_dup_string (value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
             break;
@@ -231,6 +424,31 @@ ufo_transpose_projections_task_get_property (GObject *object,
         case PROP_NUM_PROJECTIONS:
             g_value_set_uint (value, priv->n_projections);
             break;
+        case PROP_BATCH:
+            g_value_set_uint (value, priv->batch);
+            break;
+        case PROP_SINOGRAM_RANGE:
+            {
+                GValueArray *array = g_value_array_new (2);
+                GValue item = G_VALUE_INIT;
+
+                g_value_init (&item, G_TYPE_UINT);
+
+                for (guint i = 0; i < 2; i++) {
+                    g_value_set_uint (&item, priv->range[i]);
+                    g_value_array_append (array, &item);
+                }
+
+                g_value_unset (&item);
+                g_value_take_boxed (value, array);
+            }
+            break;
+        case PROP_MEMORY_BUDGET:
+            g_value_set_uint (value, priv->memory_budget);
+            break;
+        case PROP_SPILL_DIRECTORY:
+            g_value_set_string (value, priv->spill_directory);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
             break;
@@ -257,6 +475,39 @@ ufo_transpose_projections_task_class_init (UfoTransposeProjectionsTaskClass *kla
                            1, G_MAXUINT, 1,
                            G_PARAM_READWRITE);
 
+    properties[PROP_BATCH] =
+        g_param_spec_uint ("batch",
+                           "Number of sinograms emitted at once",
+                           "Number of sinograms emitted at once as one three-dimensional buffer",
+                           1, G_MAXUINT, 1,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_SINOGRAM_RANGE] =
+        g_param_spec_value_array ("sinogram-range",
+                                  "Range of kept sinograms as [from, to]",
+                                  "Range of kept sinograms as [from, to), [0, 0] keeps all",
+                                  g_param_spec_uint ("sinogram-range-values",
+                                                     "Sinogram range values",
+                                                     "Sinogram range values",
+                                                     0, G_MAXUINT, 0,
+                                                     G_PARAM_READWRITE),
+                                  G_PARAM_READWRITE);
+
+    properties[PROP_MEMORY_BUDGET] =
+        g_param_spec_uint ("memory-budget",
+                           "Host memory budget in MiB",
+                           "Host memory budget in MiB, larger sinogram stacks are spilled to a "
+                           "memory-mapped scratch file, 0 keeps everything in memory",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE);
+
+    properties[PROP_SPILL_DIRECTORY] =
+        g_param_spec_string ("spill-directory",
+                             "Directory for the scratch file",
+                             "Directory for the scratch file, the system temporary directory if not set",
+                             NULL,
+                             G_PARAM_READWRITE);
+
     for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
         g_object_class_install_property (oclass, i, properties[i]);
 
@@ -272,4 +523,12 @@ ufo_transpose_projections_task_init (UfoTransposeProjectionsTask *self)
     self->priv = priv = UFO_TRANSPOSE_PROJECTIONS_TASK_GET_PRIVATE (self);
     priv->sinograms = NULL;
     priv->n_projections = 1;
+    priv->batch = 1;
+    priv->range[0] = 0;
+    priv->range[1] = 0;
+    priv->memory_budget = 0;
+    priv->spill_directory = NULL;
+    priv->mapped = FALSE;
+    priv->stage = NULL;
+    priv->staged = 0;
 }
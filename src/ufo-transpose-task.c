@@ -16,11 +16,21 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
-#ifdef __SSE__
-#include <xmmintrin.h>
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
 #endif
+
 #include "ufo-transpose-task.h"
+#include "common/ufo-kernel-cache.h"
+#include "common/ufo-transpose.h"
+
 
+struct _UfoTransposeTaskPrivate {
+    gboolean use_gpu;
+    cl_kernel kernel;
+};
 
 static void ufo_task_interface_init (UfoTaskIface *iface);
 
@@ -30,6 +40,14 @@ G_DEFINE_TYPE_WITH_CODE (UfoTransposeTask, ufo_transpose_task, UFO_TYPE_TASK_NOD
 
 #define UFO_TRANSPOSE_TASK_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), UFO_TYPE_TRANSPOSE_TASK, UfoTransposeTaskPrivate))
 
+enum {
+    PROP_0,
+    PROP_USE_GPU,
+    N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES] = { NULL, };
+
 UfoNode *
 ufo_transpose_task_new (void)
 {
@@ -41,6 +59,17 @@ ufo_transpose_task_setup (UfoTask *task,
                           UfoResources *resources,
                           GError **error)
 {
+    UfoTransposeTaskPrivate *priv = UFO_TRANSPOSE_TASK_GET_PRIVATE (task);
+
+    if (priv->use_gpu) {
+        priv->kernel = ufo_kernel_cache_get_kernel (resources, "transpose.cl", "transpose", NULL, error);
+
+        if (priv->kernel != NULL)
+            UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
+    }
+    else {
+        g_debug ("transpose: using the %s micro kernel", ufo_transpose_get_isa_name ());
+    }
 }
 
 static void
@@ -75,24 +104,46 @@ ufo_transpose_task_get_num_dimensions (UfoTask *task,
 static UfoTaskMode
 ufo_transpose_task_get_mode (UfoTask *task)
 {
+    if (UFO_TRANSPOSE_TASK_GET_PRIVATE (task)->use_gpu)
+        return UFO_TASK_MODE_PROCESSOR | UFO_TASK_MODE_GPU;
+
     return UFO_TASK_MODE_PROCESSOR;
 }
 
-#ifdef __SSE__
-static inline void
-transpose_sse (gfloat *src, gfloat *dst, const int width, const int height)
+static void
+transpose_device (UfoTask *task,
+                  UfoBuffer *input,
+                  UfoBuffer *output,
+                  UfoRequisition *requisition)
 {
-    __m128 row1 = _mm_loadu_ps (src);
-    __m128 row2 = _mm_loadu_ps (src + height);
-    __m128 row3 = _mm_loadu_ps (src + 2 * height);
-    __m128 row4 = _mm_loadu_ps (src + 3 * height);
-    _MM_TRANSPOSE4_PS (row1, row2, row3, row4);
-    _mm_storeu_ps (dst, row1);
-    _mm_storeu_ps (dst + width, row2);
-    _mm_storeu_ps (dst + 2 * width, row3);
-    _mm_storeu_ps (dst + 3 * width, row4);
+    UfoTransposeTaskPrivate *priv;
+    UfoGpuNode *node;
+    UfoProfiler *profiler;
+    cl_command_queue cmd_queue;
+    cl_mem in_mem, out_mem;
+    gint width, height;
+    gsize global_work_size[2];
+    gsize local_work_size[2] = {16, 16};
+
+    priv = UFO_TRANSPOSE_TASK_GET_PRIVATE (task);
+    node = UFO_GPU_NODE (ufo_task_node_get_proc_node (UFO_TASK_NODE (task)));
+    cmd_queue = ufo_gpu_node_get_cmd_queue (node);
+    profiler = ufo_task_node_get_profiler (UFO_TASK_NODE (task));
+    in_mem = ufo_buffer_get_device_array (input, cmd_queue);
+    out_mem = ufo_buffer_get_device_array (output, cmd_queue);
+
+    /* Input dimensions */
+    width = (gint) requisition->dims[1];
+    height = (gint) requisition->dims[0];
+    global_work_size[0] = (width + 15) / 16 * 16;
+    global_work_size[1] = (height + 15) / 16 * 16;
+
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 0, sizeof (cl_mem), &in_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 1, sizeof (cl_mem), &out_mem));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 2, sizeof (gint), &width));
+    UFO_RESOURCES_CHECK_CLERR (clSetKernelArg (priv->kernel, 3, sizeof (gint), &height));
+    ufo_profiler_call (profiler, cmd_queue, priv->kernel, 2, global_work_size, local_work_size);
 }
-#endif
 
 static gboolean
 ufo_transpose_task_process (UfoTask *task,
@@ -100,71 +151,64 @@ ufo_transpose_task_process (UfoTask *task,
                             UfoBuffer *output,
                             UfoRequisition *requisition)
 {
-    gfloat *host_array;
-    gfloat *transposed;
-    gint width = (gint) requisition->dims[0];
-    gint height = (gint) requisition->dims[1];
-    const gint block_size = 128;
-
-#ifdef __SSE__
-    gint fast_width = width - width % 4;
-    gint fast_height = height - height % 4;
-#endif
-
-    host_array = ufo_buffer_get_host_array (inputs[0], NULL);
-    transposed = ufo_buffer_get_host_array (output, NULL);
-
-    #ifdef __SSE__
-    /* Use SSE to do a 4x4 micro transposition, execute such transpositions in a
-     * block-based fashion and last, execute as many blocks as fit the image
-     * dimensions reduced by modulo 4 outliers. */
-    #pragma omp parallel for
-    for (gint j = 0; j < fast_height; j += block_size) {
-        guint block_j = j + block_size < fast_height ? j + block_size : fast_height;
-        for (gint i = 0; i < fast_width; i += block_size) {
-            guint block_i = i + block_size < fast_width ? i + block_size : fast_width;
-            for (guint l = j; l < block_j; l+=4) {
-                for (guint k = i; k < block_i; k+=4) {
-                    transpose_sse (host_array + k * height + l, transposed + l * width + k, width, height);
-                }
-            }
-        }
+    if (UFO_TRANSPOSE_TASK_GET_PRIVATE (task)->use_gpu) {
+        transpose_device (task, inputs[0], output, requisition);
+        return TRUE;
     }
 
-    /* Finish the outliers which exceed block size. This loop cannot be executed
-     * in parallel to the previous one, otherwise the vector access and outlier
-     * access might happen at the same time producing invalid results. */
-    #pragma omp parallel for
-    for (gint j = 0; j < height; j++) {
-        /* If we are in the height which was processed in a vectorized way treat
-         * only the x outlier, otherwise the whole row has to be processed. */
-        guint start_i = j < fast_height ? fast_width : 0;
-        for (gint i = start_i; i < width; i++) {
-            transposed[j * width + i] = host_array[i * height + j];
-        }
-    }
-    #else
-    /* Transpose in blocks */
-    #pragma omp parallel for
-    for (gint j = 0; j < height; j += block_size) {
-        guint block_j = j + block_size < height ? j + block_size : height;
-        for (gint i = 0; i < width; i += block_size) {
-            guint block_i = i + block_size < width ? i + block_size : width;
-            for (guint l = j; l < block_j; l++) {
-                for (guint k = i; k < block_i; k++) {
-                    transposed[l * width + k] = host_array[k * height + l];
-                }
-            }
-        }
-    }
-    #endif
+    ufo_transpose (ufo_buffer_get_host_array (inputs[0], NULL),
+                   ufo_buffer_get_host_array (output, NULL),
+                   requisition->dims[1], requisition->dims[0]);
 
     return TRUE;
 }
 
+static void
+ufo_transpose_task_set_property (GObject *object,
+                                 guint property_id,
+                                 const GValue *value,
+                                 GParamSpec *pspec)
+{
+    UfoTransposeTaskPrivate *priv = UFO_TRANSPOSE_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_USE_GPU:
+            priv->use_gpu = g_value_get_boolean (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
+static void
+ufo_transpose_task_get_property (GObject *object,
+                                 guint property_id,
+                                 GValue *value,
+                                 GParamSpec *pspec)
+{
+    UfoTransposeTaskPrivate *priv = UFO_TRANSPOSE_TASK_GET_PRIVATE (object);
+
+    switch (property_id) {
+        case PROP_USE_GPU:
+            g_value_set_boolean (value, priv->use_gpu);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+            break;
+    }
+}
+
 static void
 ufo_transpose_task_finalize (GObject *object)
 {
+    UfoTransposeTaskPrivate *priv = UFO_TRANSPOSE_TASK_GET_PRIVATE (object);
+
+    if (priv->kernel) {
+        UFO_RESOURCES_CHECK_CLERR (clReleaseKernel (priv->kernel));
+        priv->kernel = NULL;
+    }
+
     G_OBJECT_CLASS (ufo_transpose_task_parent_class)->finalize (object);
 }
 
@@ -185,9 +229,27 @@ ufo_transpose_task_class_init (UfoTransposeTaskClass *klass)
     GObjectClass *oclass = G_OBJECT_CLASS (klass);
 
     oclass->finalize = ufo_transpose_task_finalize;
+    oclass->set_property = ufo_transpose_task_set_property;
+    oclass->get_property = ufo_transpose_task_get_property;
+
+    properties[PROP_USE_GPU] =
+        g_param_spec_boolean ("use-gpu",
+                              "Transpose on the GPU",
+                              "Transpose on the GPU, which avoids a download if the data is on the device",
+                              FALSE,
+                              G_PARAM_READWRITE);
+
+    for (guint i = PROP_0 + 1; i < N_PROPERTIES; i++)
+        g_object_class_install_property (oclass, i, properties[i]);
+
+    g_type_class_add_private (oclass, sizeof (UfoTransposeTaskPrivate));
 }
 
 static void
 ufo_transpose_task_init(UfoTransposeTask *self)
 {
+    UfoTransposeTaskPrivate *priv = UFO_TRANSPOSE_TASK_GET_PRIVATE (self);
+
+    priv->use_gpu = FALSE;
+    priv->kernel = NULL;
 }
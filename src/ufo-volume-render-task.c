@@ -25,6 +25,7 @@
 #include <math.h>
 
 #include "ufo-volume-render-task.h"
+#include "common/ufo-kernel-cache.h"
 
 /**
  * SECTION:ufo-volume-render-task
@@ -95,10 +96,11 @@ ufo_volume_render_task_setup (UfoTask *task,
     priv->context = ufo_resources_get_context (resources);
     UFO_RESOURCES_CHECK_CLERR (clRetainContext (priv->context));
 
-    priv->kernel = ufo_resources_get_kernel (resources,
-                                             "volume.cl",
-                                             "rayCastVolume",
-                                             error);
+    priv->kernel = ufo_kernel_cache_get_kernel (resources,
+                                                "volume.cl",
+                                                "rayCastVolume",
+                                                NULL,
+                                                error);
     UFO_RESOURCES_CHECK_CLERR (clRetainKernel (priv->kernel));
 
 
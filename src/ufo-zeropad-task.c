@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <math.h>
 #include "ufo-zeropad-task.h"
+#include "common/ufo-kernel-cache.h"
 
 /**
  * SECTION:ufo-zeropad-task
@@ -74,7 +75,7 @@ ufo_zeropad_task_setup (UfoTask *task,
 {
     UfoZeropadTaskPrivate *priv = UFO_ZEROPAD_TASK_GET_PRIVATE (task);
     priv->resources = resources;
-    priv->zeropad_kernel = ufo_resources_get_kernel(resources, "zeropad.cl", "zeropadding_kernel", error);
+    priv->zeropad_kernel = ufo_kernel_cache_get_kernel(resources, "zeropad.cl", "zeropadding_kernel", NULL, error);
 }
 
 static void
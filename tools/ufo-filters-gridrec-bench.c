@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare gridrec with filtered backprojection on the analytic sinograms of
+ * an ellipse phantom. The phantom is symmetric to both axes, so that the
+ * comparison does not depend on the orientation conventions of the tasks.
+ * Both reconstructions are scaled to the phantom by least squares before the
+ * error is computed inside the disc of 90% of the field of view, the scale
+ * itself is reported too.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <ufo/ufo.h>
+
+typedef struct {
+    gdouble x, y, a, b, density;
+} Ellipse;
+
+/* Axis-aligned variant of the modified Shepp-Logan phantom */
+static const Ellipse phantom[] = {
+    {  0.00,  0.00, 0.690, 0.920,  1.0 },
+    {  0.00,  0.00, 0.662, 0.874, -0.8 },
+    {  0.22,  0.00, 0.110, 0.310, -0.2 },
+    { -0.22,  0.00, 0.110, 0.310, -0.2 },
+    {  0.25,  0.45, 0.046, 0.046,  0.1 },
+    { -0.25,  0.45, 0.046, 0.046,  0.1 },
+    {  0.25, -0.45, 0.046, 0.046,  0.1 },
+    { -0.25, -0.45, 0.046, 0.046,  0.1 },
+    {  0.00,  0.60, 0.023, 0.023,  0.1 },
+    {  0.00, -0.60, 0.023, 0.023,  0.1 },
+};
+
+static void
+make_image (gfloat *image, guint size)
+{
+    const gdouble radius = size / 2.0;
+
+    for (guint iy = 0; iy < size; iy++) {
+        for (guint ix = 0; ix < size; ix++) {
+            const gdouble x = (ix + 0.5 - radius) / radius;
+            const gdouble y = (iy + 0.5 - radius) / radius;
+            gdouble value = 0.0;
+
+            for (guint e = 0; e < G_N_ELEMENTS (phantom); e++) {
+                const gdouble u = (x - phantom[e].x) / phantom[e].a;
+                const gdouble v = (y - phantom[e].y) / phantom[e].b;
+
+                if (u * u + v * v <= 1.0)
+                    value += phantom[e].density;
+            }
+
+            image[iy * size + ix] = (gfloat) value;
+        }
+    }
+}
+
+/* Line integrals in pixel units, the axis is in the middle of the detector */
+static void
+make_sinogram (gfloat *sinogram, guint size, guint n_angles)
+{
+    const gdouble radius = size / 2.0;
+
+    for (guint i = 0; i < n_angles; i++) {
+        const gdouble angle = i * G_PI / n_angles;
+        const gdouble c = cos (angle);
+        const gdouble s = sin (angle);
+
+        for (guint j = 0; j < size; j++) {
+            const gdouble t = (j + 0.5 - radius) / radius;
+            gdouble value = 0.0;
+
+            for (guint e = 0; e < G_N_ELEMENTS (phantom); e++) {
+                const Ellipse *el = &phantom[e];
+                const gdouble s2 = el->a * el->a * c * c + el->b * el->b * s * s;
+                const gdouble d = t - (el->x * c + el->y * s);
+
+                if (d * d < s2)
+                    value += 2.0 * el->density * el->a * el->b * sqrt (s2 - d * d) / s2;
+            }
+
+            sinogram[i * size + j] = (gfloat) (value * radius);
+        }
+    }
+}
+
+static UfoTaskNode *
+make_task (UfoPluginManager *manager, const gchar *name, GError **error)
+{
+    return UFO_TASK_NODE (ufo_plugin_manager_get_task (manager, name, error));
+}
+
+/* Seconds of the run, the slices are written to @slices */
+static gdouble
+reconstruct (UfoPluginManager *manager, const gchar *method, gfloat *sinograms, gfloat *slices,
+             guint size, guint n_angles, guint n_slices, GError **error)
+{
+    UfoTaskGraph *graph;
+    UfoBaseScheduler *scheduler;
+    UfoTaskNode *reader, *writer, *filter = NULL, *reconstructor;
+    GTimer *timer;
+    gdouble elapsed;
+
+    reader = make_task (manager, "memory-in", error);
+    writer = make_task (manager, "memory-out", error);
+    reconstructor = make_task (manager, method, error);
+
+    if (!g_strcmp0 (method, "backproject"))
+        filter = make_task (manager, "filter", error);
+
+    if (*error != NULL)
+        return 0.0;
+
+    g_object_set (reader,
+                  "pointer", (gulong) sinograms,
+                  "width", size, "height", n_angles, "number", n_slices,
+                  NULL);
+
+    g_object_set (writer,
+                  "pointer", (gulong) slices,
+                  "max-size", (gulong) ((gsize) size * size * n_slices * sizeof (gfloat)),
+                  NULL);
+
+    graph = UFO_TASK_GRAPH (ufo_task_graph_new ());
+
+    if (filter != NULL) {
+        ufo_task_graph_connect_nodes (graph, reader, filter);
+        ufo_task_graph_connect_nodes (graph, filter, reconstructor);
+    }
+    else {
+        ufo_task_graph_connect_nodes (graph, reader, reconstructor);
+    }
+
+    ufo_task_graph_connect_nodes (graph, reconstructor, writer);
+
+    scheduler = ufo_scheduler_new ();
+    timer = g_timer_new ();
+    ufo_base_scheduler_run (scheduler, graph, error);
+    elapsed = g_timer_elapsed (timer, NULL);
+
+    g_timer_destroy (timer);
+    g_object_unref (scheduler);
+    g_object_unref (graph);
+    g_object_unref (reader);
+    g_object_unref (writer);
+    g_object_unref (reconstructor);
+
+    if (filter != NULL)
+        g_object_unref (filter);
+
+    return elapsed;
+}
+
+/* Least-squares scale of @slice to @image and the relative RMS error after scaling */
+static gdouble
+compare (const gfloat *slice, const gfloat *image, guint size, gdouble *scale)
+{
+    const gdouble radius = 0.9 * size / 2.0;
+    gdouble sp = 0.0, ss = 0.0, pp = 0.0, error = 0.0;
+
+    for (guint pass = 0; pass < 2; pass++) {
+        for (guint iy = 0; iy < size; iy++) {
+            for (guint ix = 0; ix < size; ix++) {
+                const gdouble x = ix + 0.5 - size / 2.0;
+                const gdouble y = iy + 0.5 - size / 2.0;
+                const gdouble r = slice[iy * size + ix];
+                const gdouble p = image[iy * size + ix];
+
+                if (x * x + y * y > radius * radius)
+                    continue;
+
+                if (pass == 0) {
+                    sp += r * p;
+                    ss += r * r;
+                    pp += p * p;
+                }
+                else {
+                    error += (*scale * r - p) * (*scale * r - p);
+                }
+            }
+        }
+
+        if (pass == 0)
+            *scale = ss > 0.0 ? sp / ss : 0.0;
+    }
+
+    return pp > 0.0 ? sqrt (error / pp) : 0.0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    static const gchar *methods[] = { "backproject", "gridrec" };
+    GOptionContext *context;
+    UfoPluginManager *manager;
+    GError *error = NULL;
+    gint size = 1024;
+    gint n_angles = 0;
+    gint n_slices = 8;
+    gint n_runs = 3;
+    gfloat *image, *sinograms, *slices;
+    gint status = 0;
+
+    GOptionEntry entries[] = {
+        { "size", 's', 0, G_OPTION_ARG_INT, &size, "Width of the sinograms and slices", "N" },
+        { "angles", 'a', 0, G_OPTION_ARG_INT, &n_angles, "Number of projections over 180 degrees, default is the width", "N" },
+        { "slices", 'n', 0, G_OPTION_ARG_INT, &n_slices, "Number of slices per run", "N" },
+        { "runs", 'r', 0, G_OPTION_ARG_INT, &n_runs, "Number of timed runs, the fastest counts", "N" },
+        { NULL }
+    };
+
+#if !(GLIB_CHECK_VERSION (2, 36, 0))
+    g_type_init ();
+#endif
+
+    context = g_option_context_new ("- compare gridrec with filtered backprojection");
+    g_option_context_add_main_entries (context, entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("Option parsing failed: %s\n", error->message);
+        return 1;
+    }
+
+    if (size < 16 || n_slices < 1 || n_runs < 1 || n_angles < 0) {
+        g_printerr ("Invalid size, number of slices or runs\n");
+        return 1;
+    }
+
+    if (n_angles == 0)
+        n_angles = size;
+
+    image = g_malloc ((gsize) size * size * sizeof (gfloat));
+    sinograms = g_malloc ((gsize) size * n_angles * n_slices * sizeof (gfloat));
+    slices = g_malloc ((gsize) size * size * n_slices * sizeof (gfloat));
+
+    make_image (image, (guint) size);
+    make_sinogram (sinograms, (guint) size, (guint) n_angles);
+
+    for (gint i = 1; i < n_slices; i++)
+        memcpy (sinograms + (gsize) i * size * n_angles, sinograms, (gsize) size * n_angles * sizeof (gfloat));
+
+    manager = ufo_plugin_manager_new ();
+
+    g_print ("%ux%u slices from %u projections, %u slices per run\n\n", size, size, n_angles, n_slices);
+    g_print ("%-12s %14s %10s %14s\n", "method", "ms per slice", "scale", "rel. RMSE %");
+
+    for (guint m = 0; m < G_N_ELEMENTS (methods); m++) {
+        gdouble best = G_MAXDOUBLE;
+        gdouble scale;
+        gdouble rmse;
+
+        /* The first run compiles kernels and creates FFT plans */
+        for (gint run = 0; run <= n_runs && error == NULL; run++) {
+            gdouble elapsed = reconstruct (manager, methods[m], sinograms, slices,
+                                           (guint) size, (guint) n_angles, (guint) n_slices, &error);
+
+            if (run > 0)
+                best = MIN (best, elapsed);
+        }
+
+        if (error != NULL) {
+            g_printerr ("Could not run %s: %s\n", methods[m], error->message);
+            g_clear_error (&error);
+            status = 1;
+            continue;
+        }
+
+        rmse = compare (slices, image, (guint) size, &scale);
+        g_print ("%-12s %14.3f %10.4g %14.3f\n", methods[m], best * 1000.0 / n_slices, scale, rmse * 100.0);
+    }
+
+    g_object_unref (manager);
+    g_free (slices);
+    g_free (sinograms);
+    g_free (image);
+    g_option_context_free (context);
+
+    return status;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measure the throughput of the host transposition for every micro kernel the
+ * CPU supports on a range of frame shapes. The throughput counts both the
+ * bytes read and written.
+ */
+
+#include <glib.h>
+#include "common/ufo-transpose.h"
+
+static const gsize shapes[][2] = {
+    {512, 512},
+    {1024, 1024},
+    {2048, 2048},
+    {4096, 4096},
+    {2560, 2160},
+    {4096, 1024},
+    {1024, 4096},
+    {2001, 1999},
+    {6000, 512},
+};
+
+static gdouble
+measure (gfloat *src, gfloat *dst, gsize width, gsize height, guint n_runs)
+{
+    GTimer *timer;
+    gdouble elapsed;
+
+    /* Warm up caches and threads */
+    if (dst != NULL)
+        ufo_transpose (src, dst, width, height);
+    else
+        ufo_transpose_inplace_square (src, width);
+
+    timer = g_timer_new ();
+
+    for (guint i = 0; i < n_runs; i++) {
+        if (dst != NULL)
+            ufo_transpose (src, dst, width, height);
+        else
+            ufo_transpose_inplace_square (src, width);
+    }
+
+    elapsed = g_timer_elapsed (timer, NULL) / n_runs;
+    g_timer_destroy (timer);
+
+    return 2.0 * width * height * sizeof (gfloat) / elapsed / 1e9;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    gint n_runs = 10;
+
+    GOptionEntry entries[] = {
+        { "runs", 'r', 0, G_OPTION_ARG_INT, &n_runs, "Number of runs per measurement", "N" },
+        { NULL }
+    };
+
+    context = g_option_context_new ("- measure the host transposition throughput");
+    g_option_context_add_main_entries (context, entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("Option parsing failed: %s\n", error->message);
+        return 1;
+    }
+
+    g_print ("%-8s %-12s %14s %14s\n", "isa", "shape", "GB/s", "in-place GB/s");
+
+    for (gint isa = UFO_TRANSPOSE_ISA_AUTO + 1; isa < UFO_TRANSPOSE_ISA_LAST; isa++) {
+        if (!ufo_transpose_set_isa (isa))
+            continue;
+
+        for (guint i = 0; i < G_N_ELEMENTS (shapes); i++) {
+            const gsize width = shapes[i][0];
+            const gsize height = shapes[i][1];
+            gfloat *src = g_malloc (width * height * sizeof (gfloat));
+            gfloat *dst = g_malloc (width * height * sizeof (gfloat));
+            gchar *shape = g_strdup_printf ("%zux%zu", width, height);
+
+            for (gsize j = 0; j < width * height; j++)
+                src[j] = (gfloat) j;
+
+            g_print ("%-8s %-12s %14.2f", ufo_transpose_get_isa_name (), shape,
+                     measure (src, dst, width, height, (guint) n_runs));
+
+            if (width == height)
+                g_print (" %14.2f\n", measure (src, NULL, width, height, (guint) n_runs));
+            else
+                g_print (" %14s\n", "-");
+
+            g_free (shape);
+            g_free (src);
+            g_free (dst);
+        }
+    }
+
+    g_option_context_free (context);
+
+    return 0;
+}
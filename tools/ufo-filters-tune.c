@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2015-2016 Karlsruhe Institute of Technology
+ *
+ * This file is part of Ufo.
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pre-warm the work group size cache by running pipelines once. Every task
+ * that launches its kernels through ufo_tuner_call() tunes them on first use
+ * with the sizes of the pipeline, so later runs start with the tuned values.
+ */
+
+#include <ufo/ufo.h>
+#include "common/ufo-tuner.h"
+
+static gboolean
+run_graph (UfoPluginManager *manager, const gchar *filename, GError **error)
+{
+    UfoTaskGraph *graph;
+    UfoBaseScheduler *scheduler;
+    gboolean success = FALSE;
+
+    graph = UFO_TASK_GRAPH (ufo_task_graph_new ());
+    ufo_task_graph_read_from_file (graph, manager, filename, error);
+
+    if (*error == NULL) {
+        scheduler = ufo_scheduler_new ();
+        ufo_base_scheduler_run (scheduler, graph, error);
+        success = *error == NULL;
+        g_object_unref (scheduler);
+    }
+
+    g_object_unref (graph);
+    return success;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    UfoPluginManager *manager;
+    GError *error = NULL;
+    gboolean force = FALSE;
+    gchar **filenames = NULL;
+    gchar *cache_file;
+    gint status = 0;
+
+    GOptionEntry entries[] = {
+        { "force", 'f', 0, G_OPTION_ARG_NONE, &force, "Tune again even if sizes are cached", NULL },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &filenames, NULL, "GRAPH.json..." },
+        { NULL }
+    };
+
+#if !(GLIB_CHECK_VERSION (2, 36, 0))
+    g_type_init ();
+#endif
+
+    context = g_option_context_new ("- tune work group sizes of the kernels used by pipelines");
+    g_option_context_add_main_entries (context, entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("Option parsing failed: %s\n", error->message);
+        return 1;
+    }
+
+    if (filenames == NULL) {
+        g_printerr ("%s", g_option_context_get_help (context, TRUE, NULL));
+        return 1;
+    }
+
+    cache_file = ufo_tuner_get_cache_file ();
+
+    if (cache_file == NULL) {
+        g_printerr ("Tuning is disabled because UFO_TUNE_CACHE_DIR is empty\n");
+        return 1;
+    }
+
+    /* Picked up by the tasks in the plugins loaded below */
+    if (force)
+        g_setenv ("UFO_TUNE_FORCE", "1", TRUE);
+
+    manager = ufo_plugin_manager_new ();
+
+    for (guint i = 0; filenames[i] != NULL; i++) {
+        if (!run_graph (manager, filenames[i], &error)) {
+            g_printerr ("Could not run `%s': %s\n", filenames[i], error->message);
+            g_clear_error (&error);
+            status = 1;
+        }
+    }
+
+    g_print ("Work group sizes are stored in %s\n", cache_file);
+
+    g_object_unref (manager);
+    g_strfreev (filenames);
+    g_free (cache_file);
+    g_option_context_free (context);
+
+    return status;
+}